@@ -0,0 +1,156 @@
+// alloc_bench.cc - measures allocation throughput of smalloc against libc
+//
+// Each thread repeatedly allocates a window of objects with random sizes in
+// [min_size, max_size] and frees them again. In "remote" mode every thread
+// frees the window allocated by its neighbor instead, which exercises the
+// cross-thread (and cross-node) free path.
+
+extern "C" {
+#include <base/log.h>
+#include <runtime/preempt.h>
+#include <runtime/smalloc.h>
+#include <runtime/sync.h>
+#undef min
+#undef max
+}
+
+#include "runtime.h"
+#include "thread.h"
+#include "sync.h"
+#include "timer.h"
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+
+namespace {
+
+constexpr int kWindow = 64;
+
+int threads;
+size_t min_size, max_size;
+uint64_t iterations;
+bool use_smalloc;
+bool remote;
+
+void *Alloc(size_t size) {
+  if (use_smalloc) return smalloc(size);
+
+  preempt_disable();
+  void *p = malloc(size);
+  preempt_enable();
+  return p;
+}
+
+void Free(void *p) {
+  if (use_smalloc) return sfree(p);
+
+  preempt_disable();
+  free(p);
+  preempt_enable();
+}
+
+void Fill(std::mt19937 &rg, void **window) {
+  std::uniform_int_distribution<size_t> dist(min_size, max_size);
+  for (int i = 0; i < kWindow; i++) {
+    size_t size = dist(rg);
+    window[i] = Alloc(size);
+    if (unlikely(!window[i])) panic("out of memory");
+    // touch the memory so large allocations aren't free
+    static_cast<char *>(window[i])[0] = 1;
+  }
+}
+
+void Drain(void **window) {
+  for (int i = 0; i < kWindow; i++) Free(window[i]);
+}
+
+void MainHandler(void *arg) {
+  std::vector<std::unique_ptr<void *[]>> windows;
+  for (int i = 0; i < threads; i++)
+    windows.emplace_back(std::make_unique<void *[]>(kWindow));
+
+  barrier_t barrier;
+  barrier_init(&barrier, threads);
+  rt::WaitGroup wg(threads);
+  auto start = std::chrono::steady_clock::now();
+
+  for (int i = 0; i < threads; i++) {
+    rt::Spawn([&, i]() {
+      std::mt19937 rg(i);
+      void **mine = windows[i].get();
+      void **theirs = windows[(i + 1) % threads].get();
+
+      for (uint64_t j = 0; j < iterations; j++) {
+        Fill(rg, mine);
+        if (remote) {
+          // wait for everyone to fill, then free the neighbor's window
+          barrier_wait(&barrier);
+          Drain(theirs);
+          barrier_wait(&barrier);
+        } else {
+          Drain(mine);
+        }
+      }
+      wg.Done();
+    });
+  }
+
+  wg.Wait();
+  auto finish = std::chrono::steady_clock::now();
+  double seconds =
+      std::chrono::duration_cast<std::chrono::duration<double>>(finish - start)
+          .count();
+  double ops = static_cast<double>(threads) * iterations * kWindow;
+  log_info("%s: %d threads, %f allocs/s, %f ns/alloc+free",
+           use_smalloc ? "smalloc" : "libc", threads, ops / seconds,
+           seconds * 1e9 * threads / ops);
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  int ret;
+
+  if (argc != 8) {
+    std::cerr << "usage: [config_file] [#threads] [min_size] [max_size] "
+              << "[#iterations] [smalloc|libc] [local|remote]" << std::endl;
+    return -EINVAL;
+  }
+
+  threads = std::stoi(argv[2], nullptr, 0);
+  min_size = std::stoul(argv[3], nullptr, 0);
+  max_size = std::stoul(argv[4], nullptr, 0);
+  iterations = std::stoul(argv[5], nullptr, 0);
+
+  std::string allocator = argv[6];
+  if (allocator == "smalloc") {
+    use_smalloc = true;
+  } else if (allocator != "libc") {
+    std::cerr << "invalid allocator '" << allocator << "'" << std::endl;
+    return -EINVAL;
+  }
+
+  std::string mode = argv[7];
+  if (mode == "remote") {
+    remote = true;
+  } else if (mode != "local") {
+    std::cerr << "invalid mode '" << mode << "'" << std::endl;
+    return -EINVAL;
+  }
+
+  if (threads <= 0 || min_size > max_size) {
+    std::cerr << "invalid arguments" << std::endl;
+    return -EINVAL;
+  }
+
+  ret = runtime_init(argv[1], MainHandler, NULL);
+  if (ret) {
+    printf("failed to start runtime\n");
+    return ret;
+  }
+
+  return 0;
+}
@@ -0,0 +1,115 @@
+// coop_bench.cc - a best effort workload that measures how quickly the
+// iokernel gets its cores back
+//
+// Run it next to a latency critical app that makes the iokernel reallocate
+// cores. In "signal" mode the workers never check for preemption, so each
+// core is taken back with a signal. In "coop" mode they call preempt_point()
+// between work units; set runtime_coop_preempt_us in the config so the
+// iokernel waits for the cooperative cede before falling back to a signal.
+
+extern "C" {
+#include <base/log.h>
+#include <runtime/preempt.h>
+#undef min
+#undef max
+}
+
+#include "runtime.h"
+#include "thread.h"
+#include "sync.h"
+#include "timer.h"
+#include "fake_worker.h"
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+
+namespace {
+
+int threads;
+uint64_t n;
+std::string worker_spec;
+bool coop;
+
+void MainHandler(void *arg) {
+  rt::WaitGroup wg(1);
+  auto cnt = std::make_unique<uint64_t[]>(threads);
+
+  for (int i = 0; i < threads; ++i) {
+    rt::Spawn([&, i]() {
+      auto *w = FakeWorkerFactory(worker_spec);
+      if (w == nullptr) {
+        std::cerr << "Failed to create worker." << std::endl;
+        exit(1);
+      }
+
+      while (true) {
+        w->Work(n);
+        cnt[i]++;
+        if (coop) preempt_point();
+      }
+    });
+  }
+
+  rt::Spawn([&]() {
+    uint64_t last_total = 0, last_nr = 0, last_cycles = 0;
+    auto last = std::chrono::steady_clock::now();
+    while (1) {
+      rt::Sleep(rt::kSeconds);
+      auto now = std::chrono::steady_clock::now();
+      uint64_t total = 0, nr, cycles;
+      double duration =
+          std::chrono::duration_cast<std::chrono::duration<double>>(now - last)
+              .count();
+      for (int i = 0; i < threads; i++) total += cnt[i];
+      preempt_get_cede_stats(&nr, &cycles);
+
+      double cede_us = 0;
+      if (nr != last_nr)
+        cede_us = static_cast<double>(cycles - last_cycles) /
+                  (nr - last_nr) / cycles_per_us;
+      log_info("%f work/s, %ld cedes, %.2f us avg cede latency",
+               static_cast<double>(total - last_total) / duration,
+               nr - last_nr, cede_us);
+      last_total = total;
+      last_nr = nr;
+      last_cycles = cycles;
+      last = now;
+    }
+  });
+
+  // never returns
+  wg.Wait();
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  int ret;
+
+  if (argc != 6) {
+    std::cerr << "usage: [config_file] [#threads] [#n] [worker_spec] "
+              << "[signal|coop]" << std::endl;
+    return -EINVAL;
+  }
+
+  threads = std::stoi(argv[2], nullptr, 0);
+  n = std::stoul(argv[3], nullptr, 0);
+  worker_spec = std::string(argv[4]);
+
+  std::string mode = argv[5];
+  if (mode == "coop") {
+    coop = true;
+  } else if (mode != "signal") {
+    std::cerr << "invalid mode '" << mode << "'" << std::endl;
+    return -EINVAL;
+  }
+
+  ret = runtime_init(argv[1], MainHandler, NULL);
+  if (ret) {
+    printf("failed to start runtime\n");
+    return ret;
+  }
+
+  return 0;
+}
@@ -1,10 +1,12 @@
 extern "C" {
 #include <base/log.h>
 #include <net/ip.h>
+#include <runtime/preempt.h>
 }
 #undef min
 #undef max
 
+#include "arena.h"
 #include "runtime.h"
 #include "thread.h"
 #include "sync.h"
@@ -20,6 +22,7 @@ extern "C" {
 #include <chrono>
 #include <vector>
 #include <algorithm>
+#include <atomic>
 #include <numeric>
 #include <random>
 
@@ -41,6 +44,46 @@ uint64_t n;
 // the mean service time in us.
 double st;
 
+// How the server allocates per-request state.
+enum class AllocMode { kNone, kMalloc, kArena };
+AllocMode alloc_mode = AllocMode::kNone;
+// The number of objects the server allocates per request.
+constexpr int kAllocsPerRequest = 16;
+// Cycles the server spent allocating and freeing per-request state.
+std::atomic<uint64_t> alloc_cycles, alloc_requests;
+
+// Allocates and frees request state the way a typical RPC handler would (a
+// context, buffers, and an iovec array), returning the cycles it took.
+uint64_t SimulateRequestState(const payload &p) {
+  static constexpr size_t kSizes[] = {48, 64, 128, 256, 512, 1024};
+  void *objs[kAllocsPerRequest];
+  uint64_t start = rdtsc();
+
+  if (alloc_mode == AllocMode::kMalloc) {
+    for (int i = 0; i < kAllocsPerRequest; i++) {
+      preempt_disable();
+      objs[i] = malloc(kSizes[i % 6]);
+      preempt_enable();
+      if (unlikely(!objs[i])) panic("out of memory");
+      *static_cast<volatile char *>(objs[i]) = p.tag;
+    }
+    for (int i = 0; i < kAllocsPerRequest; i++) {
+      preempt_disable();
+      free(objs[i]);
+      preempt_enable();
+    }
+  } else {
+    rt::Arena arena;
+    for (int i = 0; i < kAllocsPerRequest; i++) {
+      objs[i] = arena.Alloc(kSizes[i % 6]);
+      if (unlikely(!objs[i])) panic("out of memory");
+      *static_cast<volatile char *>(objs[i]) = p.tag;
+    }
+  }
+
+  return rdtsc() - start;
+}
+
 void ServerWorker(std::unique_ptr<rt::TcpConn> c) {
   payload p;
   std::unique_ptr<FakeWorker> w(FakeWorkerFactory("stridedmem:3200:64"));
@@ -54,6 +97,12 @@ void ServerWorker(std::unique_ptr<rt::TcpConn> c) {
       panic("read failed, ret = %ld", ret);
     }
 
+    // Build and tear down per-request state if requested.
+    if (alloc_mode != AllocMode::kNone) {
+      alloc_cycles += SimulateRequestState(p);
+      alloc_requests++;
+    }
+
     // Perform fake work if requested.
     if (p.workn != 0) w->Work(p.workn * 82.0);
 
@@ -71,6 +120,23 @@ void ServerHandler(void *arg) {
 				  4096));
   if (q == nullptr) panic("couldn't listen for connections");
 
+  if (alloc_mode != AllocMode::kNone) {
+    rt::Thread([] {
+      uint64_t last_cycles = 0, last_requests = 0;
+      while (true) {
+        rt::Sleep(rt::kSeconds);
+        uint64_t cycles = alloc_cycles, requests = alloc_requests;
+        if (requests == last_requests) continue;
+        log_info("%s: %.1f cycles of allocation per request",
+                 alloc_mode == AllocMode::kArena ? "arena" : "malloc",
+                 static_cast<double>(cycles - last_cycles) /
+                     (requests - last_requests));
+        last_cycles = cycles;
+        last_requests = requests;
+      }
+    }).Detach();
+  }
+
   while (true) {
     rt::TcpConn *c = q->Accept();
     if (c == nullptr) panic("couldn't accept a connection");
@@ -302,6 +368,18 @@ int main(int argc, char *argv[]) {
 
   std::string cmd = argv[2];
   if (cmd.compare("server") == 0) {
+    if (argc > 3) {
+      std::string mode = argv[3];
+      if (mode == "malloc") {
+        alloc_mode = AllocMode::kMalloc;
+      } else if (mode == "arena") {
+        alloc_mode = AllocMode::kArena;
+      } else if (mode != "none") {
+        std::cerr << "usage: [cfg_file] server [none|malloc|arena]"
+                  << std::endl;
+        return -EINVAL;
+      }
+    }
     ret = runtime_init(argv[1], ServerHandler, NULL);
     if (ret) {
       printf("failed to start runtime\n");
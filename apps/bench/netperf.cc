@@ -23,9 +23,15 @@ constexpr uint16_t kNetperfPort = 8080;
 constexpr uint64_t kNetperfMagic = 0xF00BAD11DEADBEEF;
 constexpr size_t kMaxBuffer = 0x10000000;
 
+constexpr int kZeroCopyIOVs = 64;
+
+// keeps the zero-copy receiver's reads from being optimized away
+volatile uint64_t zc_sink;
+
 enum {
   kTCPStream = 0,
   kTCPRR,
+  kTCPStreamZC,
 };
 
 struct server_init_msg {
@@ -34,6 +40,28 @@ struct server_init_msg {
   size_t buflen;
 };
 
+// Consumes the stream with zero-copy reads, touching each byte once.
+void ServerWorkerZeroCopy(rt::TcpConn *c) {
+  iovec iov[kZeroCopyIOVs];
+  uint64_t sum = 0;
+  while (true) {
+    int iovcnt = kZeroCopyIOVs;
+    mbuf *chain;
+    ssize_t ret = c->ReadZeroCopy(iov, &iovcnt, &chain);
+    if (ret <= 0) {
+      if (ret == 0 || ret == -ECONNRESET) break;
+      log_err("read failed, ret = %ld", ret);
+      break;
+    }
+    for (int i = 0; i < iovcnt; ++i) {
+      const char *p = static_cast<const char *>(iov[i].iov_base);
+      for (size_t j = 0; j < iov[i].iov_len; ++j) sum += p[j];
+    }
+    c->ReleaseZeroCopy(chain);
+  }
+  zc_sink = sum;
+}
+
 void ServerWorker(std::unique_ptr<rt::TcpConn> c) {
   server_init_msg msg;
   ssize_t ret = c->ReadFull(&msg, sizeof(msg));
@@ -56,6 +84,9 @@ void ServerWorker(std::unique_ptr<rt::TcpConn> c) {
     case kTCPRR:
       write_back = true;
       break;
+    case kTCPStreamZC:
+      ServerWorkerZeroCopy(c.get());
+      return;
     default:
       log_err("invalid mode %ld", msg.mode);
       return;
@@ -109,9 +140,11 @@ void ClientWorker(std::unique_ptr<rt::TcpConn> c, int samples, size_t buflen,
 }
 
 void RunClient(netaddr raddr, int threads, int samples, size_t buflen,
-               bool rr) {
+               uint64_t mode) {
+  bool rr = mode == kTCPRR;
+
   // setup experiment
-  server_init_msg msg = {kNetperfMagic, rr ? kTCPRR : kTCPStream, buflen};
+  server_init_msg msg = {kNetperfMagic, mode, buflen};
   std::vector<std::unique_ptr<rt::TcpConn>> conns;
   for (int i = 0; i < threads; ++i) {
     std::unique_ptr<rt::TcpConn> outc(rt::TcpConn::Dial({0, 0}, raddr));
@@ -165,6 +198,8 @@ int main(int argc, char *argv[]) {
     std::cerr << "\tserver - runs a netperf TCP server" << std::endl;
     std::cerr << "\ttcpstream - runs a streaming TCP client" << std::endl;
     std::cerr << "\ttcprr - runs a request-reply TCP client" << std::endl;
+    std::cerr << "\ttcpstreamzc - runs a streaming TCP client against a "
+              << "zero-copy receiver" << std::endl;
     return -EINVAL;
   }
 
@@ -172,7 +207,8 @@ int main(int argc, char *argv[]) {
   netaddr raddr = {};
   int threads = 0, samples = 0;
   size_t buflen = 0;
-  if (cmd.compare("tcpstream") == 0 || cmd.compare("tcprr") == 0) {
+  if (cmd.compare("tcpstream") == 0 || cmd.compare("tcprr") == 0 ||
+      cmd.compare("tcpstreamzc") == 0) {
     if (argc != 7) {
       std::cerr << "usage: [cfg_file] " << cmd << " [ip_addr] [threads] "
                 << "[samples] [buflen]" << std::endl;
@@ -194,9 +230,11 @@ int main(int argc, char *argv[]) {
     if (cmd.compare("server") == 0) {
       RunServer();
     } else if (cmd.compare("tcpstream") == 0) {
-      RunClient(raddr, threads, samples, buflen, false);
+      RunClient(raddr, threads, samples, buflen, kTCPStream);
     } else if (cmd.compare("tcprr") == 0) {
-      RunClient(raddr, threads, samples, buflen, true);
+      RunClient(raddr, threads, samples, buflen, kTCPRR);
+    } else if (cmd.compare("tcpstreamzc") == 0) {
+      RunClient(raddr, threads, samples, buflen, kTCPStreamZC);
     }
   });
 }
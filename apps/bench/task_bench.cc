@@ -0,0 +1,135 @@
+// task_bench.cc - compares rt::Task coroutines against rt::Spawn uthreads
+
+extern "C" {
+#include <base/log.h>
+}
+
+#include "runtime.h"
+#include "sync.h"
+#include "task.h"
+#include "thread.h"
+#include "timer.h"
+
+#include <chrono>
+#include <iostream>
+
+namespace {
+
+using us = std::chrono::duration<double, std::micro>;
+constexpr int kMeasureRounds = 1000000;
+constexpr int kFanout = 16;
+constexpr int kSleepers = 100000;
+constexpr uint64_t kSleepUs = 10 * rt::kMilliseconds;
+
+rt::Task<int> Leaf(int i) { co_return i; }
+
+rt::Task<int> Chain(int depth) {
+  if (depth == 0) co_return 0;
+  co_return 1 + co_await Chain(depth - 1);
+}
+
+void BenchSpawnFanout() {
+  for (int i = 0; i < kMeasureRounds / kFanout; ++i) {
+    rt::WaitGroup wg(kFanout);
+    for (int j = 0; j < kFanout; ++j) rt::Spawn([&wg] { wg.Done(); });
+    wg.Wait();
+  }
+}
+
+void BenchTaskFanout() {
+  rt::BlockOn([]() -> rt::Task<void> {
+    for (int i = 0; i < kMeasureRounds / kFanout; ++i) {
+      rt::AsyncWaitGroup wg(kFanout);
+      for (int j = 0; j < kFanout; ++j) {
+        rt::Spawn([](rt::AsyncWaitGroup &wg) -> rt::Task<void> {
+          wg.Done();
+          co_return;
+        }(wg));
+      }
+      co_await wg.Wait();
+    }
+  }());
+}
+
+void BenchTaskAwait() {
+  rt::BlockOn([]() -> rt::Task<void> {
+    int sum = 0;
+    for (int i = 0; i < kMeasureRounds; ++i) sum += co_await Leaf(i);
+    if (sum == 0) BUG();
+  }());
+}
+
+void BenchTaskChain() {
+  rt::BlockOn([]() -> rt::Task<void> {
+    for (int i = 0; i < kMeasureRounds / kFanout; ++i)
+      if (co_await Chain(kFanout) != kFanout) BUG();
+  }());
+}
+
+void BenchSpawnSleepers() {
+  rt::WaitGroup wg(kSleepers);
+  for (int i = 0; i < kSleepers; ++i) {
+    rt::Spawn([&wg] {
+      rt::Sleep(kSleepUs);
+      wg.Done();
+    });
+  }
+  wg.Wait();
+}
+
+void BenchTaskSleepers() {
+  rt::BlockOn([]() -> rt::Task<void> {
+    rt::AsyncWaitGroup wg(kSleepers);
+    for (int i = 0; i < kSleepers; ++i) {
+      rt::Spawn([](rt::AsyncWaitGroup &wg) -> rt::Task<void> {
+        co_await rt::SleepFor(kSleepUs);
+        wg.Done();
+      }(wg));
+    }
+    co_await wg.Wait();
+  }());
+}
+
+void PrintResult(std::string name, us time, int rounds) {
+  time /= rounds;
+  std::cout << "test '" << name << "' took " << time.count() << " us."
+            << std::endl;
+}
+
+template <typename F>
+void Run(std::string name, F f, int rounds) {
+  auto start = std::chrono::steady_clock::now();
+  f();
+  auto finish = std::chrono::steady_clock::now();
+  PrintResult(name, std::chrono::duration_cast<us>(finish - start), rounds);
+}
+
+void MainHandler(void *arg) {
+  Run("SpawnFanout", BenchSpawnFanout, kMeasureRounds);
+  Run("TaskFanout", BenchTaskFanout, kMeasureRounds);
+  Run("TaskAwait", BenchTaskAwait, kMeasureRounds);
+  Run("TaskChain", BenchTaskChain, kMeasureRounds);
+
+  // the time is dominated by the sleep, the interesting part is the memory
+  // used by the sleepers (see the stacks_* stats)
+  Run("SpawnSleepers", BenchSpawnSleepers, kSleepers);
+  Run("TaskSleepers", BenchTaskSleepers, kSleepers);
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  int ret;
+
+  if (argc < 2) {
+    printf("arg must be config file\n");
+    return -EINVAL;
+  }
+
+  ret = runtime_init(argv[1], MainHandler, NULL);
+  if (ret) {
+    printf("failed to start runtime\n");
+    return ret;
+  }
+  return 0;
+}
@@ -108,28 +108,14 @@ class SharedTcpStream {
 };
 
 static char *allocate_buf(size_t sz) {
-  char *buf;
-
-  if (sz <= (1 << 18)) {
-    buf = (char *)smalloc(sz);
-  } else {
-    preempt_disable();
-    buf = (char *)malloc(sz);
-    preempt_enable();
-  }
+  char *buf = (char *)smalloc(sz);
   if (!buf) throw std::bad_alloc();
   return buf;
 }
 
 static void free_buf(char *buf, size_t sz) {
   if (!buf) return;
-  if (sz <= (1 << 18)) {
-    sfree(buf);
-  } else {
-    preempt_disable();
-    free(buf);
-    preempt_enable();
-  }
+  sfree(buf);
 }
 
 class RequestContext {
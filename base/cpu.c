@@ -5,6 +5,7 @@
 #include <unistd.h>
 #include <limits.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/syscall.h>
 
 #include <base/stddef.h>
@@ -23,13 +24,48 @@ int numa_count;
 /* a table of information on each CPU */
 struct cpu_info cpu_info_tbl[NCPU];
 
+/*
+ * Finds the CPUs that share the last-level cache (the highest cache level
+ * reported by sysfs). Falls back to the package if caches aren't reported.
+ */
+static int cpu_scan_llc(int cpu)
+{
+	char path[PATH_MAX];
+	uint64_t level, max_level = 0;
+	int i;
+
+	for (i = 0; ; i++) {
+		snprintf(path, sizeof(path), SYSFS_CPU_CACHE_PATH "/level",
+			 cpu, i);
+		if (sysfs_parse_val(path, &level))
+			break;
+		if (level <= max_level)
+			continue;
+
+		snprintf(path, sizeof(path), SYSFS_CPU_CACHE_PATH
+			 "/shared_cpu_list", cpu, i);
+		if (sysfs_parse_bitlist(path,
+			cpu_info_tbl[cpu].llc_siblings_mask, cpu_count))
+			return -EIO;
+		max_level = level;
+	}
+
+	if (max_level == 0) {
+		memcpy(cpu_info_tbl[cpu].llc_siblings_mask,
+		       cpu_info_tbl[cpu].core_siblings_mask,
+		       sizeof(cpu_info_tbl[cpu].llc_siblings_mask));
+	}
+
+	return 0;
+}
+
 static int cpu_scan_topology(void)
 {
 	char path[PATH_MAX];
 	DEFINE_BITMAP(numa_mask, NNUMA);
 	DEFINE_BITMAP(cpu_mask, NCPU);
 	uint64_t tmp;
-	int i;
+	int i, j;
 
 	/* How many NUMA nodes? */
 	if (sysfs_parse_bitlist("/sys/devices/system/node/online",
@@ -88,6 +124,18 @@ static int cpu_scan_topology(void)
 		if (sysfs_parse_bitlist(path,
 			cpu_info_tbl[i].thread_siblings_mask, cpu_count))
 			return -EIO;
+
+		if (cpu_scan_llc(i))
+			return -EIO;
+	}
+
+	/* Which NUMA node is each CPU on? (not always its package) */
+	for (i = 0; i < numa_count; i++) {
+		snprintf(path, sizeof(path), SYSFS_NODE_PATH "/cpulist", i);
+		if (sysfs_parse_bitlist(path, cpu_mask, NCPU))
+			return -EIO;
+		bitmap_for_each_set(cpu_mask, cpu_count, j)
+			cpu_info_tbl[j].numa_node = i;
 	}
 
 	return 0;
@@ -28,8 +28,13 @@ struct lgpage_node {
 	unsigned int		idx;
 	struct page		*tbl; /* aliases page_tbl above */
 	struct list_head	pages;
-	uint64_t		pad[4];
+	struct list_head	runs; /* free runs of contiguous pages */
+	struct list_head	cached_runs; /* freed runs that are still mapped */
+	unsigned int		nr_cached; /* pages in cached_runs */
 } __aligned(CACHE_LINE_SIZE);
+
+/* the number of freed run pages each node keeps mapped for reuse */
+#define LGPAGE_RUN_CACHE_MAX	16
 static struct lgpage_node lgpage_nodes[NNUMA];
 
 /* small page (4KB) definitions */
@@ -86,7 +91,7 @@ static void page_free_check(struct page *pg, size_t pgsize) {;}
 
 #endif /* DEBUG */
 
-static int lgpage_create(struct page *pg, int numa_node)
+static int lgpage_create(struct page *pg, int numa_node, bool need_paddr)
 {
 	void *pgaddr = lgpage_to_addr(pg);
 	int ret;
@@ -97,10 +102,13 @@ static int lgpage_create(struct page *pg, int numa_node)
 		return -ENOMEM;
 	}
 
-	ret = mem_lookup_page_phys_addr(pgaddr, PGSIZE_2MB, &pg->paddr);
-	if (ret) {
-		munmap(pgaddr, PGSIZE_2MB);
-		return ret;
+	pg->paddr = 0;
+	if (need_paddr) {
+		ret = mem_lookup_page_phys_addr(pgaddr, PGSIZE_2MB, &pg->paddr);
+		if (ret) {
+			munmap(pgaddr, PGSIZE_2MB);
+			return ret;
+		}
 	}
 
 	kref_init(&pg->ref);
@@ -138,7 +146,7 @@ static struct page *lgpage_alloc_on_node(int numa_node)
 	spin_unlock(&node->lock);
 
 	assert(!(pg->flags & PAGE_FLAG_IN_USE));
-	ret = lgpage_create(pg, numa_node);
+	ret = lgpage_create(pg, numa_node, true);
 	if (ret) {
 		log_err_once("page: unable to create 2MB page,"
 			     "node = %d, ret = %d", numa_node, ret);
@@ -160,6 +168,205 @@ static void lgpage_free(struct page *pg)
 	spin_unlock(&node->lock);
 }
 
+/* finds a free run of at least @nr pages, splitting off what isn't needed */
+static struct page *lgpage_run_get(struct lgpage_node *node, size_t nr)
+{
+	struct page *pg, *rest;
+
+	assert_spin_lock_held(&node->lock);
+
+	list_for_each(&node->runs, pg, link) {
+		if (pg->item_count < nr)
+			continue;
+
+		list_del_from(&node->runs, &pg->link);
+		if (pg->item_count > nr) {
+			rest = pg + nr;
+			rest->item_count = pg->item_count - nr;
+			list_add(&node->runs, &rest->link);
+		}
+		return pg;
+	}
+
+	/* otherwise carve a new run out of unused address space */
+	if (unlikely(node->idx + nr > LGPAGE_META_ENTS))
+		return NULL;
+	pg = &node->tbl[node->idx];
+	node->idx += nr;
+	return pg;
+}
+
+/* returns a run to the free list, merging it with its free neighbors */
+static void lgpage_run_put(struct lgpage_node *node, struct page *pg,
+			   size_t nr)
+{
+	struct page *r, *next;
+
+	assert_spin_lock_held(&node->lock);
+
+	list_for_each_safe(&node->runs, r, next, link) {
+		if (r + r->item_count == pg) {
+			list_del_from(&node->runs, &r->link);
+			nr += r->item_count;
+			pg = r;
+		} else if (pg + nr == r) {
+			list_del_from(&node->runs, &r->link);
+			nr += r->item_count;
+		}
+	}
+
+	pg->item_count = nr;
+	list_add(&node->runs, &pg->link);
+}
+
+/* takes a mapped run of at least @nr pages from the cache, or NULL if none */
+static struct page *lgpage_run_cache_get(struct lgpage_node *node, size_t nr)
+{
+	struct page *pg, *rest;
+
+	assert_spin_lock_held(&node->lock);
+
+	list_for_each(&node->cached_runs, pg, link) {
+		if (pg->item_count < nr)
+			continue;
+
+		list_del_from(&node->cached_runs, &pg->link);
+		if (pg->item_count > nr) {
+			rest = pg + nr;
+			rest->item_count = pg->item_count - nr;
+			list_add(&node->cached_runs, &rest->link);
+		}
+		node->nr_cached -= nr;
+		return pg;
+	}
+
+	return NULL;
+}
+
+/* unmaps all cached runs so their memory can back other pages */
+static bool lgpage_run_cache_drain(struct lgpage_node *node)
+{
+	struct list_head drained;
+	struct page *pg;
+	size_t i, nr;
+
+	list_head_init(&drained);
+	spin_lock(&node->lock);
+	list_append_list(&drained, &node->cached_runs);
+	node->nr_cached = 0;
+	spin_unlock(&node->lock);
+
+	if (list_empty(&drained))
+		return false;
+
+	while ((pg = list_pop(&drained, struct page, link))) {
+		nr = pg->item_count;
+		for (i = 0; i < nr; i++)
+			lgpage_destroy(&pg[i]);
+
+		spin_lock(&node->lock);
+		lgpage_run_put(node, pg, nr);
+		spin_unlock(&node->lock);
+	}
+
+	return true;
+}
+
+/**
+ * page_alloc_run_on_node - allocates contiguous 2MB pages for a NUMA node
+ * @nr: the number of pages
+ * @numa_node: the NUMA node the pages are allocated from
+ *
+ * The run is not reference counted, it must be freed with page_free_run().
+ * Runs are meant for heap memory, so their pages have no physical address.
+ *
+ * Returns a pointer to the first page's data, or NULL if out of memory or @nr
+ * is zero or larger than a node's address space.
+ */
+void *page_alloc_run_on_node(size_t nr, int numa_node)
+{
+	struct lgpage_node *node;
+	struct page *pg;
+	size_t i;
+
+	assert(numa_node < NNUMA);
+	node = &lgpage_nodes[numa_node];
+
+	if (unlikely(nr == 0 || nr > LGPAGE_META_ENTS))
+		return NULL;
+
+	/* recently freed runs are still mapped, so reusing them is cheap */
+	spin_lock(&node->lock);
+	pg = lgpage_run_cache_get(node, nr);
+	spin_unlock(&node->lock);
+	if (pg)
+		goto done;
+
+again:
+	spin_lock(&node->lock);
+	pg = lgpage_run_get(node, nr);
+	spin_unlock(&node->lock);
+	if (!pg) {
+		log_err_ratelimited("page: out of page region addresses");
+		return NULL;
+	}
+
+	for (i = 0; i < nr; i++) {
+		assert(!(pg[i].flags & PAGE_FLAG_IN_USE));
+		if (unlikely(lgpage_create(&pg[i], numa_node, false)))
+			goto fail;
+		pg[i].flags |= PAGE_FLAG_RUN;
+	}
+
+done:
+	pg->item_count = nr;
+	return lgpage_to_addr(pg);
+
+fail:
+	while (i--)
+		lgpage_destroy(&pg[i]);
+	spin_lock(&node->lock);
+	lgpage_run_put(node, pg, nr);
+	spin_unlock(&node->lock);
+
+	/* the cache may be holding the large pages we ran out of */
+	if (lgpage_run_cache_drain(node))
+		goto again;
+	return NULL;
+}
+
+/**
+ * page_free_run - frees pages allocated with page_alloc_run_on_node()
+ * @addr: the address returned by page_alloc_run_on_node()
+ *
+ * Small runs stay mapped in a per-node cache so the next allocation can skip
+ * mapping them again.
+ */
+void page_free_run(void *addr)
+{
+	struct page *pg = addr_to_lgpage(addr);
+	struct lgpage_node *node = &lgpage_nodes[addr_to_numa_node(addr)];
+	size_t i, nr = pg->item_count;
+
+	assert(pg->flags & PAGE_FLAG_RUN);
+
+	spin_lock(&node->lock);
+	if (node->nr_cached + nr <= LGPAGE_RUN_CACHE_MAX) {
+		node->nr_cached += nr;
+		list_add(&node->cached_runs, &pg->link);
+		spin_unlock(&node->lock);
+		return;
+	}
+	spin_unlock(&node->lock);
+
+	for (i = 0; i < nr; i++)
+		lgpage_destroy(&pg[i]);
+
+	spin_lock(&node->lock);
+	lgpage_run_put(node, pg, nr);
+	spin_unlock(&node->lock);
+}
+
 static struct page *smpage_alloc_on_node(int numa_node)
 {
 	struct page *pg;
@@ -373,6 +580,9 @@ int page_init(void)
 
 		spin_lock_init(&node->lock);
 		list_head_init(&node->pages);
+		list_head_init(&node->runs);
+		list_head_init(&node->cached_runs);
+		node->nr_cached = 0;
 		node->idx = 0;
 	}
 
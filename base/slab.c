@@ -13,6 +13,8 @@
  * of the SLAB allocator.
  */
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <base/slab.h>
@@ -65,6 +67,8 @@ __slab_create_node(struct slab_node *n, int numa_node,
 	n->cur_pg = NULL;
 	n->pg_off = 0;
 	n->nr_pages = 0;
+	n->remote_frees = NULL;
+	atomic64_write(&n->nr_remote_frees, 0);
 
 	spin_lock_init(&n->page_lock);
 	list_head_init(&n->full_list);
@@ -231,8 +235,7 @@ static void slab_item_check(struct slab_node *n, void *item)
 		return;
 
 	/* NUMA node checks */
-	assert(n->numa_node == thread_numa_node);
-	assert(addr_to_numa_node(item) == thread_numa_node);
+	assert(addr_to_numa_node(item) == n->numa_node);
 
 	/* page checks */
 	assert(is_page_addr(item));
@@ -388,14 +391,63 @@ void slab_free(struct slab *s, void *item)
 	slab_node_free(n, item);
 }
 
-static int slab_tcache_alloc(struct tcache *tc, int nr, void **items)
+/**
+ * slab_free_remote - frees a batch of items allocated on another NUMA node
+ * @s: the slab
+ * @head: the first item
+ * @tail: the last item
+ * @nr: the number of items
+ *
+ * The items must all belong to the same NUMA node and be chained through their
+ * first word, ending at @tail. They are handed back to the owning node in one
+ * atomic push and recycled the next time a thread on that node refills its
+ * cache, so remote memory never ends up in a local thread cache.
+ */
+void slab_free_remote(struct slab *s, void *head, void *tail, int nr)
+{
+	struct slab_node *n = s->nodes[addr_to_numa_node(head)];
+	struct slab_hdr *first = (struct slab_hdr *)head;
+	struct slab_hdr *last = (struct slab_hdr *)tail;
+
+	do {
+		last->next_hdr = ACCESS_ONCE(n->remote_frees);
+	} while (!__sync_bool_compare_and_swap(&n->remote_frees,
+					       last->next_hdr, first));
+	atomic64_fetch_and_add(&n->nr_remote_frees, nr);
+}
+
+/* hands out items that were freed remotely, returns the number taken */
+static int slab_node_take_remote(struct slab_node *n, int nr, void **items)
+{
+	struct slab_hdr *hdr, *next;
+	int i = 0;
+
+	if (likely(!ACCESS_ONCE(n->remote_frees)))
+		return 0;
+
+	hdr = __atomic_exchange_n(&n->remote_frees, NULL, __ATOMIC_ACQUIRE);
+	for (; hdr && i < nr; hdr = hdr->next_hdr)
+		items[i++] = hdr;
+
+	/* release the rest back to their pages */
+	for (; hdr; hdr = next) {
+		next = hdr->next_hdr;
+		slab_node_free(n, hdr);
+	}
+
+	return i;
+}
+
+static int slab_node_tcache_alloc(struct slab_node *n, int nr, void **items)
 {
-	struct slab *s = (struct slab *)tc->data;
-	struct slab_node *n = s->nodes[thread_numa_node];
 	int i;
 
+	i = slab_node_take_remote(n, nr, items);
+	if (i == nr)
+		return 0;
+
 	spin_lock(&n->page_lock);
-	for (i = 0; i < nr; i++) {
+	for (; i < nr; i++) {
 		items[i] = __slab_node_alloc(n);
 		if (unlikely(!items[i])) {
 			spin_unlock(&n->page_lock);
@@ -412,27 +464,54 @@ fail:
 	return -ENOMEM;
 }
 
+static int slab_tcache_alloc(struct tcache *tc, int nr, void **items)
+{
+	struct slab *s = (struct slab *)tc->data;
+
+	return slab_node_tcache_alloc(s->nodes[thread_numa_node], nr, items);
+}
+
 static void slab_tcache_free(struct tcache *tc, int nr, void **items)
 {
 	struct slab *s = (struct slab *)tc->data;
-	struct slab_node *n = s->nodes[thread_numa_node];
 	int i;
 
+	/* the thread may have moved nodes since it allocated these items */
 	for (i = 0; i < nr; i++)
-		slab_node_free(n, items[i]);
-
+		slab_node_free(s->nodes[addr_to_numa_node(items[i])], items[i]);
 }
 
 static const struct tcache_ops slab_tcache_ops = {
 	.alloc	= slab_tcache_alloc,
 	.free	= slab_tcache_free,
-}; 
+};
+
+static int slab_node_tcache_alloc_op(struct tcache *tc, int nr, void **items)
+{
+	return slab_node_tcache_alloc((struct slab_node *)tc->data, nr, items);
+}
+
+static void slab_node_tcache_free_op(struct tcache *tc, int nr, void **items)
+{
+	struct slab_node *n = (struct slab_node *)tc->data;
+	int i;
+
+	for (i = 0; i < nr; i++)
+		slab_node_free(n, items[i]);
+}
+
+static const struct tcache_ops slab_node_tcache_ops = {
+	.alloc	= slab_node_tcache_alloc_op,
+	.free	= slab_node_tcache_free_op,
+};
 
 /**
  * slab_create_tcache - creates a thread-local cache of slab items
  * @s: the backing slab
  * @mag_size: the number of items in a magazine
  *
+ * Items come from the NUMA node of the thread that refills its cache.
+ *
  * Returns a thread-local cache, or NULL if out of memory.
  */
 struct tcache *
@@ -441,12 +520,57 @@ slab_create_tcache(struct slab *s, unsigned int mag_size)
 	struct tcache *tc;
 
 	tc = tcache_create(s->name, &slab_tcache_ops, mag_size, s->size);
+	if (!tc)
+		return NULL;
 	tc->data = (unsigned long)s;
 	return tc;
 }
 
+/**
+ * slab_create_tcache_on_node - creates a thread-local cache of slab items
+ *                              that all belong to one NUMA node
+ * @s: the backing slab
+ * @numa_node: the NUMA node
+ * @mag_size: the number of items in a magazine
+ *
+ * Only items from @numa_node may be freed to the cache, so magazines never
+ * mix memory from different nodes. On multi-node machines the cache's name
+ * gets the node appended so its statistics can be told apart.
+ *
+ * Returns a thread-local cache, or NULL if out of memory.
+ */
+struct tcache *
+slab_create_tcache_on_node(struct slab *s, int numa_node,
+			   unsigned int mag_size)
+{
+	struct tcache *tc;
+	char *name = (char *)s->name;
+	int len;
+
+	/* e.g. "smalloc (16 B) node 1" */
+	if (numa_count > 1) {
+		len = snprintf(NULL, 0, "%s node %d", s->name, numa_node) + 1;
+		name = malloc(len);
+		if (!name)
+			return NULL;
+		snprintf(name, len, "%s node %d", s->name, numa_node);
+	}
+
+	tc = tcache_create(name, &slab_node_tcache_ops, mag_size, s->size);
+	if (!tc) {
+		if (name != s->name)
+			free(name);
+		return NULL;
+	}
+	tc->data = (unsigned long)s->nodes[numa_node];
+	return tc;
+}
+
 /**
  * slab_print_usage - prints the amount of memory used in each slab
+ *
+ * On multi-node machines, also breaks the usage down per NUMA node along with
+ * how many items were freed from other nodes.
  */
 void slab_print_usage(void)
 {
@@ -472,6 +596,18 @@ void slab_print_usage(void)
 		}
 
 		log_info("%8ld KB\t%s", usage / 1024, s->name);
+		if (numa_count == 1)
+			continue;
+
+		for (i = 0; i < numa_count; i++) {
+			struct slab_node *n = s->nodes[i];
+			size_t pgsize = (n->flags & SLAB_FLAG_LGPAGE) ?
+					PGSIZE_2MB : PGSIZE_4KB;
+
+			log_info("%8ld KB\t  node %d (%ld remote frees)",
+				 n->nr_pages * pgsize / 1024, i,
+				 atomic64_read(&n->nr_remote_frees));
+		}
 	}
 	spin_unlock(&slab_lock);
 
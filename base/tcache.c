@@ -18,6 +18,7 @@
 #include <base/lock.h>
 #include <base/tcache.h>
 #include <base/thread.h>
+#include <base/time.h>
 
 static DEFINE_SPINLOCK(tcache_lock);
 static LIST_HEAD(tcache_list);
@@ -27,7 +28,17 @@ DEFINE_PERTHREAD(uint64_t, mag_free);
 DEFINE_PERTHREAD(uint64_t, pool_alloc);
 DEFINE_PERTHREAD(uint64_t, pool_free);
 
-static struct tcache_hdr *tcache_alloc_mag(struct tcache *tc)
+/*
+ * Magazine sizes are re-evaluated once per window. Like in the paper, a cache
+ * whose threads keep going to the depot gets bigger magazines, and one that
+ * rarely does shrinks back so idle threads don't hoard items.
+ */
+#define TCACHE_WINDOW_US	10000
+#define TCACHE_GROW_TRIPS	256
+#define TCACHE_SHRINK_TRIPS	16
+
+static struct tcache_hdr *tcache_alloc_mag(struct tcache *tc,
+					   unsigned int mag_size)
 {
 	void *items[TCACHE_MAX_MAG_SIZE];
 	struct tcache_hdr *head, **pos;
@@ -35,19 +46,19 @@ static struct tcache_hdr *tcache_alloc_mag(struct tcache *tc)
 
 	perthread_get(mag_alloc)++;
 
-	err = tc->ops->alloc(tc, tc->mag_size, items);
+	err = tc->ops->alloc(tc, mag_size, items);
 	if (err)
 		return NULL;
 
 	head = (struct tcache_hdr *)items[0];
 	pos = &head->next_item;
-	for (i = 1; i < tc->mag_size; i++) {
+	for (i = 1; i < mag_size; i++) {
 		*pos = (struct tcache_hdr *)items[i];
 		pos = &(*pos)->next_item;
 	}
 
 	*pos = NULL;
-	atomic64_inc(&tc->mags_allocated);
+	atomic64_fetch_and_add(&tc->items_allocated, mag_size);
 	return head;
 }
 
@@ -63,15 +74,71 @@ static void tcache_free_mag(struct tcache *tc, struct tcache_hdr *hdr)
 		hdr = hdr->next_item;
 	} while (hdr);
 
-	assert(nr == tc->mag_size);
+	assert(nr <= TCACHE_MAX_MAG_SIZE);
 	tc->ops->free(tc, nr, items);
-	atomic64_dec(&tc->mags_allocated);
+	atomic64_fetch_and_add(&tc->items_allocated, -nr);
+}
+
+/* frees a list of magazines linked through next_mag */
+static void tcache_free_mags(struct tcache *tc, struct tcache_hdr *hdr)
+{
+	struct tcache_hdr *next;
+
+	for (; hdr; hdr = next) {
+		next = hdr->next_mag;
+		tcache_free_mag(tc, hdr);
+	}
+}
+
+static void tcache_depot_lock(struct tcache *tc)
+{
+	if (unlikely(!spin_try_lock(&tc->lock))) {
+		spin_lock(&tc->lock);
+		tc->depot_contended++;
+	}
+	tc->depot_trips++;
+}
+
+/*
+ * Counts a trip to the depot and resizes magazines at the end of each window.
+ * Returns the depot's magazines if they no longer have the right size, so the
+ * caller can free them after dropping the lock.
+ */
+static struct tcache_hdr *tcache_depot_adapt(struct tcache *tc)
+{
+	unsigned int mag_size = tc->mag_size;
+	struct tcache_hdr *stale;
+	uint64_t now = rdtsc();
+
+	assert_spin_lock_held(&tc->lock);
+
+	tc->window_trips++;
+	if (now - tc->window_start_tsc < TCACHE_WINDOW_US * cycles_per_us)
+		return NULL;
+
+	if (tc->window_trips >= TCACHE_GROW_TRIPS)
+		mag_size = MIN(mag_size * 2, tc->max_mag_size);
+	else if (tc->window_trips <= TCACHE_SHRINK_TRIPS)
+		mag_size = MAX(mag_size / 2, tc->min_mag_size);
+	tc->window_start_tsc = now;
+	tc->window_trips = 0;
+
+	if (mag_size == tc->mag_size)
+		return NULL;
+
+	ACCESS_ONCE(tc->mag_size) = mag_size;
+	tc->resizes++;
+	stale = tc->shared_mags;
+	tc->shared_mags = NULL;
+	return stale;
 }
 
 /* The thread-local cache allocation slow path. */
 void *__tcache_alloc(struct tcache_perthread *ltc)
 {
 	struct tcache *tc = ltc->tc;
+	struct tcache_hdr *stale;
+	unsigned int mag_size;
 	void *item;
 
 	/* must be out of rounds */
@@ -88,16 +155,24 @@ void *__tcache_alloc(struct tcache_perthread *ltc)
 	perthread_get(pool_alloc)++;
 
 	/* CASE 2: grab a magazine from the shared pool */
-	spin_lock(&tc->lock);
+	tcache_depot_lock(tc);
+	mag_size = tc->mag_size;
 	ltc->loaded = tc->shared_mags;
 	if (tc->shared_mags)
 		tc->shared_mags = tc->shared_mags->next_mag;
+	else
+		tc->depot_misses++;
+	stale = tcache_depot_adapt(tc);
 	spin_unlock(&tc->lock);
+	tcache_free_mags(tc, stale);
+
+	/* pick up the current magazine size */
+	ltc->capacity = mag_size;
 	if (ltc->loaded)
 		goto alloc;
 
 	/* CASE 3: allocate a new magazine */
-	ltc->loaded = tcache_alloc_mag(tc);
+	ltc->loaded = tcache_alloc_mag(tc, mag_size);
 	if (unlikely(!ltc->loaded))
 		return NULL;
 
@@ -114,11 +189,22 @@ void __tcache_free(struct tcache_perthread *ltc, void *item)
 {
 	struct tcache *tc = ltc->tc;
 	struct tcache_hdr *hdr = (struct tcache_hdr *)item;
+	struct tcache_hdr *stale = NULL, *adapted;
 
 	/* magazine must be full */
 	assert(ltc->rounds == ltc->capacity);
 	assert(ltc->loaded != NULL);
 
+	/* the magazine size changed, so drop the magazines of the old size */
+	if (unlikely(ltc->capacity != ACCESS_ONCE(tc->mag_size))) {
+		tcache_free_mag(tc, ltc->loaded);
+		if (ltc->previous)
+			tcache_free_mag(tc, ltc->previous);
+		ltc->previous = NULL;
+		ltc->capacity = ACCESS_ONCE(tc->mag_size);
+		goto free;
+	}
+
 	/* CASE 1: exchange empty previous mag with full loaded mag */
 	if (!ltc->previous) {
 		ltc->previous = ltc->loaded;
@@ -128,12 +214,30 @@ void __tcache_free(struct tcache_perthread *ltc, void *item)
 	perthread_get(pool_free)++;
 
 	/* CASE 2: return a magazine to the shared pool */
-	spin_lock(&tc->lock);
-	ltc->previous->next_mag = tc->shared_mags;
-	tc->shared_mags = ltc->previous;
+	tcache_depot_lock(tc);
+	if (likely(ltc->capacity == tc->mag_size)) {
+		ltc->previous->next_mag = tc->shared_mags;
+		tc->shared_mags = ltc->previous;
+	} else {
+		ltc->previous->next_mag = NULL;
+		stale = ltc->previous;
+	}
+	adapted = tcache_depot_adapt(tc);
+	if (stale)
+		stale->next_mag = adapted;
+	else
+		stale = adapted;
 	spin_unlock(&tc->lock);
 	ltc->previous = ltc->loaded;
 
+	/* a resize raced with us, the magazines are freed instead */
+	if (unlikely(stale)) {
+		tcache_free_mags(tc, stale);
+		ltc->previous = NULL;
+		tcache_free_mag(tc, ltc->loaded);
+		ltc->capacity = ACCESS_ONCE(tc->mag_size);
+	}
+
 free:
 	/* start a new magazine and free the item */
 	ltc->rounds = 1;
@@ -145,9 +249,12 @@ free:
  * tcache_create - creates a new thread-local cache
  * @name: a human-readable name to identify the cache
  * @ops: operations for allocating and freeing items that back the cache
- * @mag_size: the number of items in a magazine
+ * @mag_size: the initial number of items in a magazine
  * @item_size: the size of each item
  *
+ * Magazines grow up to TCACHE_MAG_GROWTH times @mag_size (capped at
+ * TCACHE_MAX_MAG_SIZE) when threads keep missing in their local cache.
+ *
  * Returns a thread cache or NULL of out of memory.
  *
  * After creating a thread-local cache, you'll want to attach one or more
@@ -169,10 +276,19 @@ struct tcache *tcache_create(const char *name, const struct tcache_ops *ops,
 	tc->name = name;
 	tc->ops = ops;
 	tc->item_size = item_size;
-	atomic64_write(&tc->mags_allocated, 0);
+	atomic64_write(&tc->items_allocated, 0);
 	tc->mag_size = mag_size;
+	tc->min_mag_size = mag_size;
+	tc->max_mag_size = MIN(mag_size * TCACHE_MAG_GROWTH,
+			       TCACHE_MAX_MAG_SIZE);
 	spin_lock_init(&tc->lock);
 	tc->shared_mags = NULL;
+	tc->depot_trips = 0;
+	tc->depot_misses = 0;
+	tc->depot_contended = 0;
+	tc->resizes = 0;
+	tc->window_start_tsc = 0;
+	tc->window_trips = 0;
 
 	spin_lock(&tcache_lock);
 	list_add_tail(&tcache_list, &tc->link);
@@ -192,7 +308,7 @@ void tcache_init_perthread(struct tcache *tc, struct tcache_perthread *ltc)
 	ltc->tc = tc;
 	ltc->loaded = ltc->previous = NULL;
 	ltc->rounds = 0;
-	ltc->capacity = tc->mag_size; 
+	ltc->capacity = ACCESS_ONCE(tc->mag_size);
 }
 
 /**
@@ -201,38 +317,76 @@ void tcache_init_perthread(struct tcache *tc, struct tcache_perthread *ltc)
  */
 void tcache_reclaim(struct tcache *tc)
 {
-	struct tcache_hdr *hdr, *next;
+	struct tcache_hdr *hdr;
 
 	spin_lock(&tc->lock);
 	hdr = tc->shared_mags;
 	tc->shared_mags = NULL;
 	spin_unlock(&tc->lock);
 
-	while (hdr) {
-		next = hdr->next_mag;
-		tcache_free_mag(tc, hdr);
-		hdr = next;
-	}
+	tcache_free_mags(tc, hdr);
+}
+
+static void tcache_get_stats(struct tcache *tc, struct tcache_stats *stats)
+{
+	spin_lock(&tc->lock);
+	stats->mag_size = tc->mag_size;
+	stats->depot_trips = tc->depot_trips;
+	stats->depot_misses = tc->depot_misses;
+	stats->depot_contended = tc->depot_contended;
+	stats->resizes = tc->resizes;
+	spin_unlock(&tc->lock);
+	stats->usage = atomic64_read(&tc->items_allocated) * tc->item_size;
 }
 
 /**
- * tcache_print_stats - dumps usage statistics about all thread-local caches
+ * tcache_for_each - calls a function with the statistics of each tcache
+ * @fn: the function, iteration stops if it returns non-zero
+ * @arg: an argument passed to @fn
+ *
+ * Returns the last value returned by @fn.
  */
-void tcache_print_usage(void)
+int tcache_for_each(int (*fn)(const char *name, struct tcache_stats *stats,
+			      void *arg),
+		    void *arg)
 {
+	struct tcache_stats stats;
 	struct tcache *tc;
-	size_t total = 0;
-
-	log_info("tcache: dumping usage statistics...");
+	int ret = 0;
 
 	spin_lock(&tcache_lock);
 	list_for_each(&tcache_list, tc, link) {
-		long mags = atomic64_read(&tc->mags_allocated);
-		size_t usage = tc->mag_size * tc->item_size * mags;
-		log_info("%8ld KB\t%s", usage / 1024, tc->name);
-		total += usage;
+		tcache_get_stats(tc, &stats);
+		ret = fn(tc->name, &stats, arg);
+		if (ret)
+			break;
 	}
 	spin_unlock(&tcache_lock);
 
+	return ret;
+}
+
+static int tcache_print_one(const char *name, struct tcache_stats *stats,
+			    void *arg)
+{
+	size_t *total = (size_t *)arg;
+
+	log_info("%8ld KB\t%s (mag %u, %ld depot trips, %ld misses, "
+		 "%ld contended, %ld resizes)", stats->usage / 1024, name,
+		 stats->mag_size, stats->depot_trips, stats->depot_misses,
+		 stats->depot_contended, stats->resizes);
+	*total += stats->usage;
+	return 0;
+}
+
+/**
+ * tcache_print_stats - dumps usage statistics about all thread-local caches
+ */
+void tcache_print_usage(void)
+{
+	size_t total = 0;
+
+	log_info("tcache: dumping usage statistics...");
+	tcache_for_each(tcache_print_one, &total);
 	log_info("total: %8ld KB", total / 1024);
 }
@@ -0,0 +1,77 @@
+// arena.h - support for bump-pointer arenas
+
+#pragma once
+
+extern "C" {
+#include <base/stddef.h>
+#include <runtime/arena.h>
+}
+
+#include <memory_resource>
+#include <new>
+
+namespace rt {
+
+// A bump-pointer arena that frees everything it allocated when destroyed.
+class Arena {
+ public:
+  Arena() { arena_init(&a_); }
+  ~Arena() { arena_destroy(&a_); }
+
+  // Allocates memory that lives as long as the arena. Returns nullptr if out
+  // of memory.
+  void *Alloc(size_t size, size_t align = ARENA_MIN_ALIGN) {
+    return arena_alloc_aligned(&a_, size, align);
+  }
+
+  // Constructs an object in the arena. Its destructor is never called, so T
+  // should be trivially destructible or own only arena memory.
+  template <typename T, typename... Args>
+  T *New(Args &&... args) {
+    void *p = Alloc(sizeof(T), alignof(T));
+    if (unlikely(!p)) throw std::bad_alloc();
+    return new (p) T(std::forward<Args>(args)...);
+  }
+
+  // Frees everything allocated so far; the arena can be used again.
+  void Reset() { arena_reset(&a_); }
+
+  // Gets the underlying C arena.
+  arena_t *get() { return &a_; }
+
+ private:
+  arena_t a_;
+
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+};
+
+// A std::pmr::memory_resource backed by an arena, so standard containers can
+// allocate from it (e.g. std::pmr::vector<int> v(&resource)). Deallocation is
+// a no-op; memory is returned when the resource is destroyed.
+class ArenaResource : public std::pmr::memory_resource {
+ public:
+  ArenaResource() {}
+  ~ArenaResource() override {}
+
+  // Frees everything allocated so far.
+  void Reset() { arena_.Reset(); }
+
+ private:
+  Arena arena_;
+
+  void *do_allocate(size_t bytes, size_t alignment) override {
+    void *p = arena_.Alloc(bytes, alignment);
+    if (unlikely(!p)) throw std::bad_alloc();
+    return p;
+  }
+
+  void do_deallocate(void *p, size_t bytes, size_t alignment) override {}
+
+  bool do_is_equal(const std::pmr::memory_resource &other) const
+      noexcept override {
+    return this == &other;
+  }
+};
+
+}  // namespace rt
@@ -0,0 +1,87 @@
+// chan.h - support for bounded channels between threads
+
+#pragma once
+
+extern "C" {
+#include <base/stddef.h>
+#include <runtime/chan.h>
+}
+
+#include <initializer_list>
+#include <optional>
+#include <type_traits>
+
+namespace rt {
+
+// A bounded multi-producer, multi-consumer channel. Values are copied in and
+// out, so T must be trivially copyable (send pointers for anything else).
+template <typename T>
+class Channel {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "Trivially copyable type required.");
+
+ public:
+  // Creates a channel that holds at least @capacity values.
+  explicit Channel(unsigned int capacity) {
+    if (chan_init(&ch_, sizeof(T), capacity)) BUG();
+  }
+  ~Channel() { chan_destroy(&ch_); }
+
+  // Sends a value, blocking while the channel is full. Returns false if the
+  // channel is closed.
+  bool Send(const T &val) { return chan_send(&ch_, &val) == 0; }
+
+  // Sends a value only if there is room. Returns true if successful.
+  bool TrySend(const T &val) { return chan_try_send(&ch_, &val) == 0; }
+
+  // Receives a value, blocking while the channel is empty. Returns nothing
+  // once the channel is closed and drained.
+  std::optional<T> Recv() {
+    T val;
+    if (chan_recv(&ch_, &val)) return std::nullopt;
+    return val;
+  }
+
+  // Receives a value only if one is available.
+  std::optional<T> TryRecv() {
+    T val;
+    if (chan_try_recv(&ch_, &val)) return std::nullopt;
+    return val;
+  }
+
+  // Sends up to @n values, blocking until at least one is sent. Returns the
+  // number sent, or -EPIPE if the channel is closed.
+  ssize_t SendBatch(const T *vals, size_t n) {
+    return chan_send_batch(&ch_, vals, n);
+  }
+
+  // Receives up to @n values, blocking until at least one is received.
+  // Returns the number received, or -EPIPE if closed and drained.
+  ssize_t RecvBatch(T *vals, size_t n) {
+    return chan_recv_batch(&ch_, vals, n);
+  }
+
+  // Closes the channel, waking all waiters. Receivers can still drain it.
+  void Close() { chan_close(&ch_); }
+
+  // Gets the underlying C channel.
+  chan_t *get() { return &ch_; }
+
+ private:
+  chan_t ch_;
+
+  Channel(const Channel &) = delete;
+  Channel &operator=(const Channel &) = delete;
+};
+
+// Receives a value from whichever channel has one first. Returns the index of
+// that channel, or -EPIPE once all of them are closed and drained.
+template <typename T>
+int Select(std::initializer_list<Channel<T> *> chans, T *val) {
+  chan_t *cs[chans.size()];
+  int i = 0;
+  for (Channel<T> *c : chans) cs[i++] = c->get();
+  return chan_select(cs, chans.size(), val);
+}
+
+}  // namespace rt
@@ -31,10 +31,24 @@ size_t SumIOV(const iovec *iov, int iovcnt) {
   return len;
 }
 
+void ZeroCopyTrampoline(void *arg) {
+  std::unique_ptr<std::function<void()>> done(
+      static_cast<std::function<void()> *>(arg));
+  (*done)();
+}
+
 }  // namespace
 
 namespace rt {
 
+ssize_t TcpConn::WriteZeroCopy(const void *buf, size_t len,
+                               std::function<void()> done) {
+  auto *arg = new std::function<void()>(std::move(done));
+  ssize_t ret = tcp_write_zc(c_, buf, len, ZeroCopyTrampoline, arg);
+  if (ret <= 0) delete arg;
+  return ret;
+}
+
 ssize_t TcpConn::WritevFullRaw(const iovec *iov, int iovcnt) {
   // first try to send without copying the vector
   ssize_t n = tcp_writev(c_, iov, iovcnt);
@@ -8,6 +8,8 @@ extern "C" {
 #include <runtime/udp.h>
 }
 
+#include <functional>
+
 namespace rt {
 
 class NetConn {
@@ -133,6 +135,34 @@ class TcpConn : public NetConn {
   ssize_t Writev(const iovec *iov, int iovcnt) {
     return tcp_writev(c_, iov, iovcnt);
   }
+  // Reads from the TCP stream without blocking. Returns -EAGAIN and arms @w
+  // if there is nothing to read yet; retry once @w runs.
+  ssize_t ReadAsync(void *buf, size_t len, waker_t *w) {
+    return tcp_read_async(c_, buf, len, w);
+  }
+  // Writes to the TCP stream without blocking. Returns -EAGAIN and arms @w
+  // if nothing can be sent yet; retry once @w runs.
+  ssize_t WriteAsync(const void *buf, size_t len, waker_t *w) {
+    return tcp_write_async(c_, buf, len, w);
+  }
+
+  // Allocates memory that can be sent with WriteZeroCopy(). It is never
+  // freed. Returns nullptr if the zero-copy region is exhausted.
+  static void *AllocZeroCopy(size_t len) { return tcp_zc_alloc(len); }
+  // Writes to the TCP stream without copying @buf, which must come from
+  // AllocZeroCopy(). The written bytes must not change until @done runs once
+  // they are acknowledged; @done never runs if nothing was written. @done
+  // may run with preemption disabled, so it must not block.
+  ssize_t WriteZeroCopy(const void *buf, size_t len,
+                        std::function<void()> done);
+  // Reads from the TCP stream without copying. Points up to @iovcnt vectors
+  // at received data and sets @iovcnt to the number filled. The data stays
+  // valid until ReleaseZeroCopy(@chain) is called.
+  ssize_t ReadZeroCopy(iovec *iov, int *iovcnt, mbuf **chain) {
+    return tcp_read_zc(c_, iov, iovcnt, chain);
+  }
+  // Releases data returned by ReadZeroCopy() and reopens the receive window.
+  void ReleaseZeroCopy(mbuf *chain) { tcp_read_zc_release(c_, chain); }
 
   // Reads exactly @len bytes from the TCP stream.
   ssize_t ReadFull(void *buf, size_t len) {
@@ -19,6 +19,18 @@ class Storage {
     return storage_read(dst, lba, lba_count);
   }
 
+  // Starts writing contiguous storage blocks; @w runs once @op completes.
+  static int WriteAsync(storage_op *op, const void *src, uint64_t lba,
+                        uint32_t lba_count, waker_t *w) {
+    return storage_write_async(op, src, lba, lba_count, w);
+  }
+
+  // Starts reading contiguous storage blocks; @w runs once @op completes.
+  static int ReadAsync(storage_op *op, void *dst, uint64_t lba,
+                       uint32_t lba_count, waker_t *w) {
+    return storage_read_async(op, dst, lba, lba_count, w);
+  }
+
   // Returns the size of each block.
   static uint32_t get_block_size() { return storage_block_size(); }
 
@@ -171,6 +171,10 @@ class Mutex {
   // Returns true if the mutex is currently held.
   bool IsHeld() { return mutex_held(&mu_); }
 
+  // Counts acquisitions and contention, reported as lock_<name>_* stats.
+  // Meant for long-lived mutexes. Returns 0 if successful.
+  int EnableStats(const char *name) { return mutex_enable_stats(&mu_, name); }
+
  private:
   mutex_t mu_;
 
@@ -178,7 +182,49 @@ class Mutex {
   Mutex& operator=(const Mutex&) = delete;
 };
 
-// RAII lock support (works with Spin, Preempt, and Mutex).
+// Reader-writer mutex for read-mostly data. Readers on different cores don't
+// contend with each other, but writers are expensive.
+class BRMutex {
+ public:
+  BRMutex() {
+    if (brmutex_init(&mu_)) BUG();
+  }
+  ~BRMutex() { brmutex_destroy(&mu_); }
+
+  // Locks the mutex for reading. Pass the result to RUnlock().
+  unsigned int RLock() { return brmutex_rdlock(&mu_); }
+
+  // Unlocks the mutex for reading.
+  void RUnlock(unsigned int token) { brmutex_rdunlock(&mu_, token); }
+
+  // Locks the mutex for writing.
+  void Lock() { brmutex_wrlock(&mu_); }
+
+  // Unlocks the mutex for writing.
+  void Unlock() { brmutex_wrunlock(&mu_); }
+
+ private:
+  brmutex_t mu_;
+
+  BRMutex(const BRMutex&) = delete;
+  BRMutex& operator=(const BRMutex&) = delete;
+};
+
+// RAII read lock support for BRMutex.
+class BRMutexReadGuard {
+ public:
+  explicit BRMutexReadGuard(BRMutex *mu) : mu_(mu), token_(mu->RLock()) {}
+  ~BRMutexReadGuard() { mu_->RUnlock(token_); }
+
+ private:
+  BRMutex *const mu_;
+  const unsigned int token_;
+
+  BRMutexReadGuard(const BRMutexReadGuard&) = delete;
+  BRMutexReadGuard& operator=(const BRMutexReadGuard&) = delete;
+};
+
+// RAII lock support (works with Spin, Preempt, Mutex, and BRMutex).
 template <typename L>
 class ScopedLock {
  public:
@@ -194,6 +240,7 @@ class ScopedLock {
 
 using SpinGuard = ScopedLock<Spin>;
 using MutexGuard = ScopedLock<Mutex>;
+using BRMutexGuard = ScopedLock<BRMutex>;
 using PreemptGuard = ScopedLock<Preempt>;
 
 // RAII lock and park support (works with both Spin and Preempt).
@@ -259,6 +306,10 @@ class WaitGroup {
   // Block until the number of jobs reaches zero.
   void Wait() { waitgroup_wait(&wg_); }
 
+  // Arms @w to run once the number of jobs reaches zero. Returns false (and
+  // leaves @w unarmed) if it already is zero.
+  bool WaitAsync(waker_t *w) { return waitgroup_wait_async(&wg_, w); }
+
  private:
   waitgroup_t wg_;
 
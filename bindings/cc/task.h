@@ -0,0 +1,478 @@
+// task.h - Support for stackless coroutines that run on uthreads
+//
+// A Task<T> is a lazily started C++20 coroutine. Awaiting a Task from another
+// Task runs it to completion without creating a uthread, and a suspended Task
+// holds only its coroutine frame (no stack). Woken Tasks are queued on the
+// local kthread, and a single uthread resumes the whole queue, so a burst of
+// wakeups costs one uthread rather than one per Task. A Task must therefore
+// never block its uthread; it should await instead.
+//
+// Timers, AsyncWaitGroup, WaitGroup, TCP and storage wake Tasks through
+// wakers, without any stack. Other blocking calls (e.g. Mutex) can be awaited
+// with Blocking(), which runs them on a uthread of their own.
+
+#pragma once
+
+extern "C" {
+#include <base/assert.h>
+#include <base/limits.h>
+#include <base/lock.h>
+#include <base/time.h>
+#include <runtime/sync.h>
+#include <runtime/thread.h>
+#include <runtime/timer.h>
+}
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "net.h"
+#include "storage.h"
+#include "sync.h"
+
+namespace rt {
+
+template <typename T>
+class Task;
+
+namespace task_internal {
+
+// Coroutines that are ready to resume on a kthread.
+struct ReadyQueue {
+  spinlock_t lock;
+  bool draining;
+  std::vector<std::coroutine_handle<>> handles;
+};
+
+inline ReadyQueue ready_queues[NCPU];
+
+// The uthread entry point that resumes coroutines until its queue is empty.
+inline void Drain(void *arg) {
+  ReadyQueue *q = static_cast<ReadyQueue *>(arg);
+  std::vector<std::coroutine_handle<>> batch;
+
+  while (true) {
+    spin_lock_np(&q->lock);
+    if (q->handles.empty()) {
+      q->draining = false;
+      spin_unlock_np(&q->lock);
+      return;
+    }
+    batch.swap(q->handles);
+    spin_unlock_np(&q->lock);
+
+    for (auto h : batch) h.resume();
+    batch.clear();
+  }
+}
+
+// Makes a suspended coroutine runnable on the local kthread. Only the first
+// coroutine queued while no uthread is draining the queue creates one.
+inline void Schedule(std::coroutine_handle<> h) {
+  ReadyQueue *q = &ready_queues[get_current_affinity()];
+  bool start;
+
+  spin_lock_np(&q->lock);
+  q->handles.push_back(h);
+  start = !std::exchange(q->draining, true);
+  spin_unlock_np(&q->lock);
+  if (!start) return;
+
+  thread_t *th = thread_create(Drain, q);
+  if (unlikely(!th)) BUG();
+  thread_ready(th);
+}
+
+// A waker that makes a suspended coroutine runnable.
+struct CoroutineWaker : waker_t {
+  CoroutineWaker() { waker_init(this, Wake); }
+  static void Wake(waker_t *w) {
+    Schedule(static_cast<CoroutineWaker *>(w)->h);
+  }
+
+  std::coroutine_handle<> h;
+};
+
+// Awaitable that makes a non-blocking call with a waker. The call returns
+// -EAGAIN once it has armed the waker, and then the awaiter can be resumed
+// (and destroyed) on another kthread at any time, so nothing in it is touched
+// after that. Resuming yields -EAGAIN, and the caller retries the call.
+template <typename F>
+class ArmWaker {
+ public:
+  explicit ArmWaker(F &&f) : f_(std::forward<F>(f)) {}
+
+  bool await_ready() const noexcept { return false; }
+  bool await_suspend(std::coroutine_handle<> h) {
+    w_.h = h;
+    ssize_t ret = f_(&w_);
+    if (ret == -EAGAIN) return true;
+    ret_ = ret;
+    return false;
+  }
+  ssize_t await_resume() const noexcept { return ret_; }
+
+ private:
+  F f_;
+  CoroutineWaker w_;
+  ssize_t ret_ = -EAGAIN;
+};
+
+template <typename F>
+ArmWaker(F &&) -> ArmWaker<F>;
+
+// Awaitable that submits a storage request and waits for it to complete.
+template <bool kWrite>
+class StorageOp {
+ public:
+  StorageOp(void *buf, uint64_t lba, uint32_t lba_count)
+      : buf_(buf), lba_(lba), lba_count_(lba_count) {}
+
+  bool await_ready() const noexcept { return false; }
+  bool await_suspend(std::coroutine_handle<> h) {
+    int ret;
+
+    w_.h = h;
+    if constexpr (kWrite)
+      ret = Storage::WriteAsync(&op_, buf_, lba_, lba_count_, &w_);
+    else
+      ret = Storage::ReadAsync(&op_, buf_, lba_, lba_count_, &w_);
+    if (ret == 0) return true;
+    ret_ = ret;
+    return false;
+  }
+  int await_resume() const noexcept { return ret_ ? ret_ : op_.ret; }
+
+ private:
+  void *buf_;
+  uint64_t lba_;
+  uint32_t lba_count_;
+  storage_op op_;
+  CoroutineWaker w_;
+  int ret_ = 0;
+};
+
+// Transfers control to the awaiting coroutine (if any) on completion.
+struct FinalAwaiter {
+  bool await_ready() noexcept { return false; }
+  template <typename Promise>
+  std::coroutine_handle<> await_suspend(
+      std::coroutine_handle<Promise> h) noexcept {
+    auto &p = h.promise();
+    if (p.continuation_) return p.continuation_;
+    if (p.detached_) h.destroy();
+    return std::noop_coroutine();
+  }
+  void await_resume() noexcept {}
+};
+
+struct PromiseBase {
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  FinalAwaiter final_suspend() noexcept { return {}; }
+  void unhandled_exception() { exception_ = std::current_exception(); }
+  void RethrowIfFailed() {
+    if (unlikely(exception_)) std::rethrow_exception(exception_);
+  }
+
+  std::coroutine_handle<> continuation_;
+  std::exception_ptr exception_;
+  bool detached_ = false;
+};
+
+template <typename T>
+struct Promise : PromiseBase {
+  Task<T> get_return_object();
+  template <typename U>
+  void return_value(U &&value) {
+    value_.emplace(std::forward<U>(value));
+  }
+  T Result() {
+    RethrowIfFailed();
+    return std::move(*value_);
+  }
+
+  std::optional<T> value_;
+};
+
+template <>
+struct Promise<void> : PromiseBase {
+  Task<void> get_return_object();
+  void return_void() {}
+  void Result() { RethrowIfFailed(); }
+};
+
+}  // namespace task_internal
+
+// A lazily started coroutine that produces a T.
+template <typename T = void>
+class [[nodiscard]] Task {
+ public:
+  using promise_type = task_internal::Promise<T>;
+  using handle_type = std::coroutine_handle<promise_type>;
+
+  explicit Task(handle_type h) : h_(h) {}
+  ~Task() {
+    if (h_) h_.destroy();
+  }
+
+  // disable copy.
+  Task(const Task &) = delete;
+  Task &operator=(const Task &) = delete;
+
+  // Move support.
+  Task(Task &&t) : h_(std::exchange(t.h_, nullptr)) {}
+  Task &operator=(Task &&t) {
+    if (h_) h_.destroy();
+    h_ = std::exchange(t.h_, nullptr);
+    return *this;
+  }
+
+  // Awaiting a task starts it and resumes the awaiter when it completes.
+  bool await_ready() const noexcept { return false; }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) {
+    h_.promise().continuation_ = awaiter;
+    return h_;
+  }
+  T await_resume() { return h_.promise().Result(); }
+
+  // Gives up ownership of the coroutine; it frees itself when it completes.
+  handle_type Release() {
+    h_.promise().detached_ = true;
+    return std::exchange(h_, nullptr);
+  }
+
+ private:
+  handle_type h_;
+};
+
+namespace task_internal {
+
+template <typename T>
+inline Task<T> Promise<T>::get_return_object() {
+  return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object() {
+  return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+}  // namespace task_internal
+
+// Starts a task on the local runqueue without waiting for it. An exception
+// that escapes the task is discarded.
+inline void Spawn(Task<void> &&t) { task_internal::Schedule(t.Release()); }
+
+// Runs a task to completion, blocking the calling uthread until it finishes.
+template <typename T>
+T BlockOn(Task<T> t) {
+  std::optional<std::conditional_t<std::is_void_v<T>, bool, T>> result;
+  std::exception_ptr exception;
+  WaitGroup wg(1);
+
+  Spawn([](Task<T> t, auto &result, std::exception_ptr &exception,
+           WaitGroup &wg) -> Task<void> {
+    try {
+      if constexpr (std::is_void_v<T>) {
+        co_await std::move(t);
+        result.emplace(true);
+      } else {
+        result.emplace(co_await std::move(t));
+      }
+    } catch (...) {
+      exception = std::current_exception();
+    }
+    wg.Done();
+  }(std::move(t), result, exception, wg));
+
+  wg.Wait();
+  if (unlikely(exception)) std::rethrow_exception(exception);
+  if constexpr (!std::is_void_v<T>) return std::move(*result);
+}
+
+// Awaitable that moves the task to the back of the local runqueue.
+struct Reschedule {
+  bool await_ready() const noexcept { return false; }
+  void await_suspend(std::coroutine_handle<> h) { task_internal::Schedule(h); }
+  void await_resume() const noexcept {}
+};
+
+// Awaitable that suspends the task until a microsecond deadline.
+class SleepUntil {
+ public:
+  explicit SleepUntil(uint64_t deadline_us) : deadline_us_(deadline_us) {}
+
+  bool await_ready() const noexcept { return deadline_us_ <= microtime(); }
+  void await_suspend(std::coroutine_handle<> h) {
+    timer_init(&e_, TimerFired, reinterpret_cast<unsigned long>(h.address()));
+    timer_start(&e_, deadline_us_);
+  }
+  void await_resume() const noexcept {}
+
+ private:
+  static void TimerFired(unsigned long arg) {
+    task_internal::Schedule(
+        std::coroutine_handle<>::from_address(reinterpret_cast<void *>(arg)));
+  }
+
+  uint64_t deadline_us_;
+  timer_entry e_;
+};
+
+// Awaitable that suspends the task for a microsecond duration.
+class SleepFor : public SleepUntil {
+ public:
+  explicit SleepFor(uint64_t duration_us)
+      : SleepUntil(microtime() + duration_us) {}
+};
+
+// Reads from a TCP stream without blocking a uthread.
+inline Task<ssize_t> TcpRead(TcpConn &c, void *buf, size_t len) {
+  while (true) {
+    ssize_t ret = co_await task_internal::ArmWaker(
+        [&](waker_t *w) { return c.ReadAsync(buf, len, w); });
+    if (ret != -EAGAIN) co_return ret;
+  }
+}
+
+// Writes to a TCP stream without blocking a uthread.
+inline Task<ssize_t> TcpWrite(TcpConn &c, const void *buf, size_t len) {
+  while (true) {
+    ssize_t ret = co_await task_internal::ArmWaker(
+        [&](waker_t *w) { return c.WriteAsync(buf, len, w); });
+    if (ret != -EAGAIN) co_return ret;
+  }
+}
+
+// Awaitable that reads contiguous storage blocks without blocking a uthread.
+inline auto StorageRead(void *dst, uint64_t lba, uint32_t lba_count) {
+  return task_internal::StorageOp<false>(dst, lba, lba_count);
+}
+
+// Awaitable that writes contiguous storage blocks without blocking a uthread.
+inline auto StorageWrite(const void *src, uint64_t lba, uint32_t lba_count) {
+  return task_internal::StorageOp<true>(const_cast<void *>(src), lba,
+                                        lba_count);
+}
+
+// Awaitable that suspends the task until a WaitGroup's jobs reach zero.
+inline auto Wait(WaitGroup &wg) {
+  struct Awaiter {
+    WaitGroup *wg;
+    task_internal::CoroutineWaker w;
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> h) {
+      w.h = h;
+      return wg->WaitAsync(&w);
+    }
+    void await_resume() const noexcept {}
+  };
+  return Awaiter{&wg};
+}
+
+// Awaitable that runs a blocking call (e.g. Mutex::Lock()) on a new uthread
+// and suspends the task until it returns. The task then continues on that
+// uthread.
+template <typename F>
+class Blocking {
+  using R = std::invoke_result_t<F>;
+
+ public:
+  explicit Blocking(F &&f) : f_(std::forward<F>(f)) {}
+
+  bool await_ready() const noexcept { return false; }
+  void await_suspend(std::coroutine_handle<> h) {
+    h_ = h;
+    thread_t *th = thread_create(Run, this);
+    if (unlikely(!th)) BUG();
+    thread_ready(th);
+  }
+  R await_resume() {
+    if (unlikely(exception_)) std::rethrow_exception(exception_);
+    if constexpr (!std::is_void_v<R>) return std::move(*result_);
+  }
+
+ private:
+  static void Run(void *arg) {
+    Blocking *b = static_cast<Blocking *>(arg);
+    try {
+      if constexpr (std::is_void_v<R>)
+        b->f_();
+      else
+        b->result_.emplace(b->f_());
+    } catch (...) {
+      b->exception_ = std::current_exception();
+    }
+    b->h_.resume();
+  }
+
+  F f_;
+  std::coroutine_handle<> h_;
+  std::optional<std::conditional_t<std::is_void_v<R>, bool, R>> result_;
+  std::exception_ptr exception_;
+};
+
+template <typename F>
+Blocking(F &&) -> Blocking<F>;
+
+// A WaitGroup that tasks can wait on without blocking a uthread.
+class AsyncWaitGroup {
+ public:
+  // Initializes a waitgroup with @count jobs.
+  explicit AsyncWaitGroup(int count = 0) : cnt_(count) {
+    spin_lock_init(&lock_);
+  }
+  ~AsyncWaitGroup() { assert(cnt_ == 0); }
+
+  // disable copy.
+  AsyncWaitGroup(const AsyncWaitGroup &) = delete;
+  AsyncWaitGroup &operator=(const AsyncWaitGroup &) = delete;
+
+  // Changes the number of jobs (can be negative).
+  void Add(int count) {
+    std::vector<std::coroutine_handle<>> waiters;
+
+    spin_lock_np(&lock_);
+    cnt_ += count;
+    BUG_ON(cnt_ < 0);
+    if (cnt_ == 0) waiters.swap(waiters_);
+    spin_unlock_np(&lock_);
+
+    for (auto h : waiters) task_internal::Schedule(h);
+  }
+
+  // Decrements the number of jobs by one.
+  void Done() { Add(-1); }
+
+  // Awaitable that suspends the task until the number of jobs reaches zero.
+  auto Wait() {
+    struct Awaiter {
+      AsyncWaitGroup *wg;
+
+      bool await_ready() const noexcept { return false; }
+      bool await_suspend(std::coroutine_handle<> h) {
+        spin_lock_np(&wg->lock_);
+        if (wg->cnt_ == 0) {
+          spin_unlock_np(&wg->lock_);
+          return false;
+        }
+        wg->waiters_.push_back(h);
+        spin_unlock_np(&wg->lock_);
+        return true;
+      }
+      void await_resume() const noexcept {}
+    };
+    return Awaiter{this};
+  }
+
+ private:
+  spinlock_t lock_;
+  int cnt_;
+  std::vector<std::coroutine_handle<>> waiters_;
+};
+
+}  // namespace rt
@@ -4,8 +4,13 @@ extern "C" {
 }
 
 #include <string>
+#include <vector>
 
+#include "arena.h"
+#include "chan.h"
 #include "runtime.h"
+#include "sync.h"
+#include "task.h"
 #include "thread.h"
 #include "timer.h"
 
@@ -17,6 +22,29 @@ void foo(int arg) {
   if (arg != kTestValue) BUG();
 }
 
+rt::Task<int> Double(int arg) {
+  co_await rt::SleepFor(1);
+  co_return arg * 2;
+}
+
+// Waits for uthreads through a WaitGroup, then for a blocking call.
+rt::Task<int> WaitForThreads(int arg) {
+  rt::WaitGroup wg(arg);
+  int sum = 0;
+  for (int i = 0; i < arg; i++) {
+    rt::Spawn([&] {
+      rt::Sleep(1);
+      sum++;
+      wg.Done();
+    });
+  }
+  co_await rt::Wait(wg);
+  co_return co_await rt::Blocking([&] {
+    rt::Sleep(1);
+    return sum * 2;
+  });
+}
+
 void MainHandler() {
   std::string str = "captured!";
   int i = kTestValue;
@@ -38,11 +66,37 @@ void MainHandler() {
 
   rt::Sleep(1 * rt::kMilliseconds);
 
+  rt::WaitGroup wg(kTestValue);
+  std::vector<std::function<void()>> funcs(kTestValue, [&] {
+    foo(i);
+    wg.Done();
+  });
+  rt::Spawn(funcs.begin(), funcs.end());
+  wg.Wait();
+
+  if (rt::BlockOn(Double(kTestValue)) != kTestValue * 2) BUG();
+  if (rt::BlockOn(WaitForThreads(kTestValue)) != kTestValue * 2) BUG();
+
   auto th = rt::Thread([&] {
     log_info("hello from rt::Thread! '%s'", str.c_str());
     foo(i);
   });
   th.Join();
+
+  rt::Channel<int> a(1), b(1);
+  rt::Spawn([&] {
+    b.Send(kTestValue);
+    b.Close();
+    a.Close();
+  });
+  int val;
+  if (rt::Select({&a, &b}, &val) != 1 || val != kTestValue) BUG();
+  if (b.Recv() || a.Recv()) BUG();
+
+  rt::ArenaResource arena;
+  std::pmr::vector<int> v(&arena);
+  for (int j = 0; j < 100000; j++) v.push_back(j);
+  if (v[kTestValue] != kTestValue) BUG();
 }
 
 }  // anonymous namespace
@@ -53,6 +53,51 @@ inline void Spawn(std::function<void()>&& func) {
   thread_ready(th);
 }
 
+// Spawns a new thread with a priority class (THREAD_PRIO_*) by copying.
+inline void Spawn(int prio, const std::function<void()>& func) {
+  void* buf;
+  thread_t* th = thread_create_with_buf(thread_internal::ThreadTrampoline, &buf,
+                                        sizeof(std::function<void()>));
+  if (unlikely(!th)) BUG();
+  new (buf) std::function<void()>(func);
+  thread_set_prio(th, prio);
+  thread_ready(th);
+}
+
+// Spawns a new thread with a priority class (THREAD_PRIO_*) by moving.
+inline void Spawn(int prio, std::function<void()>&& func) {
+  void* buf;
+  thread_t* th = thread_create_with_buf(thread_internal::ThreadTrampoline, &buf,
+                                        sizeof(std::function<void()>));
+  if (unlikely(!th)) BUG();
+  new (buf) std::function<void()>(std::move(func));
+  thread_set_prio(th, prio);
+  thread_ready(th);
+}
+
+// Spawns a new thread for each callable in the range [first, last), making
+// them runnable in batches.
+template <typename InputIt>
+void Spawn(InputIt first, InputIt last) {
+  constexpr int kBatchSize = 64;
+  thread_t* ths[kBatchSize];
+  int n = 0;
+
+  for (; first != last; ++first) {
+    void* buf;
+    thread_t* th = thread_create_with_buf(thread_internal::ThreadTrampoline,
+                                          &buf, sizeof(std::function<void()>));
+    if (unlikely(!th)) BUG();
+    new (buf) std::function<void()>(*first);
+    ths[n++] = th;
+    if (n == kBatchSize) {
+      thread_ready_many(ths, n);
+      n = 0;
+    }
+  }
+  if (n) thread_ready_many(ths, n);
+}
+
 // Called from a running thread to exit.
 inline void Exit(void) { thread_exit(); }
 
@@ -55,6 +55,9 @@ RUNTIME_LIBS += -lspdk_nvme -lspdk_util -lspdk_env_dpdk -lspdk_log -lspdk_sock \
 		-ldpdk -lpthread -lrt -luuid -lcrypto -lnuma -ldl
 INC += -I$(ROOT_PATH)/spdk/include
 endif
+ifeq ($(CONFIG_LOCKFREE_RQ),y)
+FLAGS += -DLOCKFREE_RQ
+endif
 ifeq ($(CONFIG_DIRECTPATH),y)
 RUNTIME_LIBS += $(MLX5_LIBS)
 INC += $(MLX5_INC)
@@ -64,5 +67,11 @@ endif
 CFLAGS = -std=gnu11 $(FLAGS)
 CXXFLAGS = -std=gnu++17 $(FLAGS)
 
+# extra flags for sources that use C++20 coroutines (bindings/cc/task.h)
+CORO_CXXFLAGS = -std=gnu++20
+ifeq ($(findstring clang,$(shell $(CXX) --version)),)
+CORO_CXXFLAGS += -fcoroutines
+endif
+
 # handy for debugging
 print-%  : ; @echo $* = $($*) 
@@ -28,6 +28,7 @@ struct page {
 #define PAGE_FLAG_SLAB		0x04 /* page is used by SLAB */
 #define PAGE_FLAG_SHATTERED	0x08 /* page is 2MB shattered into 4KB */
 #define PAGE_FLAG_PGDIR		0x10 /* page is being used as a PDE */
+#define PAGE_FLAG_RUN		0x20 /* page is part of a contiguous run */
 
 /* meta-data length for small pages */
 #define SMPAGE_META_LEN		(PGSIZE_2MB / PGSIZE_4KB * sizeof(struct page))
@@ -177,6 +178,19 @@ static inline struct page *smpage_to_lgpage(struct page *pg)
 	return addr_to_lgpage((void *)pg);
 }
 
+/**
+ * page_run_len - gets the number of 2MB pages in a run
+ * @addr: the address returned by page_alloc_run_on_node()
+ *
+ * Returns the number of pages.
+ */
+static inline size_t page_run_len(void *addr)
+{
+	struct page *pg = addr_to_lgpage(addr);
+	assert(pg->flags & PAGE_FLAG_RUN);
+	return pg->item_count;
+}
+
 /**
  * page_to_size - gets the size of the page (in bytes)
  * @pg: the page
@@ -204,6 +218,8 @@ extern void *page_alloc_addr(size_t pgsize) __page_malloc;
 extern void *page_zalloc_addr_on_node(size_t pgsize, int numa_node) __page_malloc;
 extern void *page_zalloc_addr(size_t pgsize) __page_malloc;
 extern void page_put_addr(void *addr);
+extern void *page_alloc_run_on_node(size_t nr, int numa_node) __page_malloc;
+extern void page_free_run(void *addr);
 extern void page_release(struct kref *ref);
 
 /**
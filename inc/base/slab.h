@@ -8,6 +8,7 @@
 #include <base/list.h>
 #include <base/thread.h>
 #include <base/limits.h>
+#include <base/atomic.h>
 
 /* forward declarations */
 struct slab_hdr;
@@ -40,6 +41,10 @@ struct slab_node {
 	struct list_head	full_list;
 	struct list_head	partial_list;
 	int			nr_pages;
+
+	/* items freed by threads on other NUMA nodes */
+	struct slab_hdr		*remote_frees;
+	atomic64_t		nr_remote_frees;
 };
 
 struct slab {
@@ -61,6 +66,7 @@ extern void slab_destroy(struct slab *s);
 extern int slab_reclaim(struct slab *s);
 extern void *slab_alloc_on_node(struct slab *s, int numa_node) __slab_malloc;
 extern void slab_free(struct slab *s, void *item);
+extern void slab_free_remote(struct slab *s, void *head, void *tail, int nr);
 extern void slab_print_usage(void);
 
 /**
@@ -75,3 +81,5 @@ static __always_inline void *slab_alloc(struct slab *s)
 }
 
 struct tcache *slab_create_tcache(struct slab *s, unsigned int mag_size);
+struct tcache *slab_create_tcache_on_node(struct slab *s, int numa_node,
+					  unsigned int mag_size);
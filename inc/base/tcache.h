@@ -12,6 +12,8 @@
 
 #define TCACHE_MAX_MAG_SIZE	64
 #define TCACHE_DEFAULT_MAG_SIZE	8
+/* magazines can grow up to this many times their initial size */
+#define TCACHE_MAG_GROWTH	4
 
 struct tcache;
 
@@ -39,13 +41,34 @@ struct tcache {
 	const char		*name;
 	const struct tcache_ops	*ops;
 	size_t			item_size;
-	atomic64_t		mags_allocated;
+	atomic64_t		items_allocated;
 	struct list_node	link;
 
+	/* the magazine size adapts to how often threads go to the depot */
 	unsigned int		mag_size;
+	unsigned int		min_mag_size;
+	unsigned int		max_mag_size;
+
 	spinlock_t		lock;
 	struct tcache_hdr	*shared_mags;
 	unsigned long		data;
+
+	/* depot statistics, protected by @lock */
+	uint64_t		depot_trips;
+	uint64_t		depot_misses;
+	uint64_t		depot_contended;
+	uint64_t		resizes;
+	uint64_t		window_start_tsc;
+	unsigned int		window_trips;
+};
+
+struct tcache_stats {
+	unsigned int		mag_size;
+	uint64_t		depot_trips;
+	uint64_t		depot_misses;
+	uint64_t		depot_contended;
+	uint64_t		resizes;
+	size_t			usage;
 };
 
 extern void *__tcache_alloc(struct tcache_perthread *ltc);
@@ -101,3 +124,6 @@ extern void tcache_init_perthread(struct tcache *tc,
 				  struct tcache_perthread *ltc);
 extern void tcache_reclaim(struct tcache *tc);
 extern void tcache_print_usage(void);
+extern int tcache_for_each(int (*fn)(const char *name,
+				     struct tcache_stats *stats, void *arg),
+			   void *arg);
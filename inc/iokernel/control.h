@@ -16,7 +16,7 @@
  * struct control_hdr, please increment the version number!
  */
 
-#define CONTROL_HDR_VERSION 5
+#define CONTROL_HDR_VERSION 6
 
 /* The abstract namespace path for the control socket. */
 #define CONTROL_SOCK_PATH	"\0/control/iokernel.sock"
@@ -33,6 +33,7 @@ struct q_ptrs {
 	uint64_t		oldest_tsc;
 	uint64_t		rcu_gen;
 	uint64_t		run_start_tsc;
+	uint64_t		cede_req_tsc; /* written by the iokernel */
 };
 
 BUILD_ASSERT(sizeof(struct q_ptrs) <= CACHE_LINE_SIZE);
@@ -92,6 +93,7 @@ struct sched_spec {
 	unsigned int		preferred_socket;
 	uint64_t		qdelay_us;
 	uint64_t		ht_punish_us;
+	uint64_t		coop_preempt_us;
 };
 
 #define CONTROL_HDR_MAGIC	0x696f6b3a /* "iok:" */
@@ -21,7 +21,10 @@ struct tx_net_hdr {
 	unsigned long completion_data; /* a tag to help complete the request */
 	unsigned int len;	/* the length of the payload */
 	unsigned int olflags;	/* offload flags */
-	unsigned short pad;	/* because of 14 byte ethernet header */
+	unsigned long zc_payload; /* shmptr to the rest of the packet (OLFLAG_ZC) */
+	unsigned int zc_len;	/* the length of @zc_payload */
+	unsigned short tso_mss;	/* segment size if OLFLAG_TCP_TSO, else zero */
+	unsigned short pad[2];	/* because of 14 byte ethernet header */
 	char	     payload[];	/* packet data */
 } __attribute__((__packed__));
 
@@ -51,6 +54,8 @@ enum {
 #define OLFLAG_TCP_CHKSUM	BIT(1)	/* enable TCP checksum generation */
 #define OLFLAG_IPV4		BIT(2)  /* indicates the packet is IPv4 */
 #define OLFLAG_IPV6		BIT(3)  /* indicates the packet is IPv6 */
+#define OLFLAG_TCP_TSO		BIT(4)	/* segment into @tso_mss sized packets */
+#define OLFLAG_ZC		BIT(5)	/* payload continues at @zc_payload */
 
 /*
  * RX queues: IOKERNEL -> RUNTIMES
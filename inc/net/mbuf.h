@@ -35,6 +35,9 @@ struct mbuf {
 
 	unsigned short	network_off;	/* the offset of the network header */
 	unsigned short	transport_off;	/* the offset of the transport header */
+	unsigned short	tso_mss;	/* TSO segment size (TX only, 0 if off) */
+	unsigned int	zc_len;		/* length of @zc_payload (TX only) */
+	const void	*zc_payload;	/* payload sent by reference (TX only) */
 	unsigned long   release_data;	/* data for the release method */
 	void		(*release)(struct mbuf *m); /* frees the mbuf */
 
@@ -44,6 +47,7 @@ struct mbuf {
 	uint32_t	seg_seq;    /* the first seg number */
 	uint32_t	seg_end;    /* the last seg number (noninclusive) */
 	uint8_t		flags;	    /* which flags were set? */
+	uint8_t		resent;	    /* was the segment retransmitted? */
 	atomic_t	ref;	    /* a reference count for the mbuf */
 };
 
@@ -0,0 +1,103 @@
+/*
+ * arena.h - bump-pointer arenas for short-lived allocations
+ *
+ * An arena hands out memory from 64 KB chunks by bumping a pointer and frees
+ * everything at once when it is destroyed. It suits objects that die together,
+ * such as everything a handler allocates while serving one request. Arenas
+ * are not thread-safe; use one per request or per thread.
+ */
+
+#pragma once
+
+#include <string.h>
+
+#include <base/stddef.h>
+
+#define ARENA_CHUNK_SIZE	(64 * 1024)
+#define ARENA_MIN_ALIGN		16
+
+struct arena_chunk;
+
+struct arena {
+	char			*pos;
+	char			*end;
+	struct arena_chunk	*chunks;
+	struct arena_chunk	*large;
+};
+
+typedef struct arena arena_t;
+
+extern void *__arena_alloc(arena_t *a, size_t size, size_t align);
+extern void arena_reset(arena_t *a);
+
+/**
+ * arena_init - initializes an empty arena
+ * @a: the arena
+ *
+ * Chunks are only allocated once the arena is first used.
+ */
+static inline void arena_init(arena_t *a)
+{
+	a->pos = a->end = NULL;
+	a->chunks = a->large = NULL;
+}
+
+/**
+ * arena_destroy - frees all memory allocated from an arena
+ * @a: the arena
+ */
+static inline void arena_destroy(arena_t *a)
+{
+	arena_reset(a);
+}
+
+/**
+ * arena_alloc_aligned - allocates memory from an arena
+ * @a: the arena
+ * @size: the size of the allocation
+ * @align: the alignment, a power of two
+ *
+ * The memory stays valid until the arena is reset or destroyed.
+ *
+ * Returns a pointer to the memory, or NULL if out of memory.
+ */
+static inline void *arena_alloc_aligned(arena_t *a, size_t size, size_t align)
+{
+	uintptr_t pos = align_up((uintptr_t)a->pos, align);
+
+	if (unlikely(size > ARENA_CHUNK_SIZE || !a->pos ||
+		     pos + size > (uintptr_t)a->end))
+		return __arena_alloc(a, size, align);
+
+	a->pos = (char *)(pos + size);
+	return (void *)pos;
+}
+
+/**
+ * arena_alloc - allocates memory from an arena
+ * @a: the arena
+ * @size: the size of the allocation
+ *
+ * Returns a pointer to memory aligned to ARENA_MIN_ALIGN, or NULL if out of
+ * memory.
+ */
+static inline void *arena_alloc(arena_t *a, size_t size)
+{
+	return arena_alloc_aligned(a, size, ARENA_MIN_ALIGN);
+}
+
+/**
+ * arena_zalloc - allocates zeroed memory from an arena
+ * @a: the arena
+ * @size: the size of the allocation
+ *
+ * Returns a pointer to zeroed memory, or NULL if out of memory.
+ */
+static inline void *arena_zalloc(arena_t *a, size_t size)
+{
+	void *p = arena_alloc(a, size);
+
+	if (likely(p))
+		memset(p, 0, size);
+	return p;
+}
@@ -0,0 +1,96 @@
+/*
+ * chan.h - bounded lock-free channels for passing values between uthreads
+ */
+
+#pragma once
+
+#include <base/stddef.h>
+#include <base/list.h>
+#include <base/lock.h>
+#include <runtime/thread.h>
+
+struct chan {
+	/* the next send position, written by senders */
+	uint64_t		send_pos __aligned(CACHE_LINE_SIZE);
+
+	/* the next receive position, written by receivers */
+	uint64_t		recv_pos __aligned(CACHE_LINE_SIZE);
+
+	/* read-mostly state */
+	uint64_t		mask __aligned(CACHE_LINE_SIZE);
+	size_t			elem_size;
+	size_t			stride;
+	char			*cells;
+	bool			closed;
+
+	/* only touched when a sender or receiver has to wait */
+	spinlock_t		lock __aligned(CACHE_LINE_SIZE);
+	unsigned int		nr_send_waiters;
+	unsigned int		nr_recv_waiters;
+	struct list_head	send_waiters;
+	struct list_head	recv_waiters;
+};
+
+typedef struct chan chan_t;
+
+extern int chan_init(chan_t *c, size_t elem_size, unsigned int capacity);
+extern void chan_destroy(chan_t *c);
+extern void chan_close(chan_t *c);
+
+extern ssize_t chan_try_send_batch(chan_t *c, const void *elems, size_t n);
+extern ssize_t chan_try_recv_batch(chan_t *c, void *elems, size_t n);
+extern ssize_t chan_send_batch(chan_t *c, const void *elems, size_t n);
+extern ssize_t chan_recv_batch(chan_t *c, void *elems, size_t n);
+extern int chan_select(chan_t **chans, int n, void *elem);
+
+/**
+ * chan_try_send - sends a value if the channel isn't full
+ * @c: the channel
+ * @elem: the value to copy into the channel
+ *
+ * Returns 0 if successful, -EAGAIN if full, or -EPIPE if closed.
+ */
+static inline int chan_try_send(chan_t *c, const void *elem)
+{
+	ssize_t ret = chan_try_send_batch(c, elem, 1);
+	return ret < 0 ? ret : 0;
+}
+
+/**
+ * chan_try_recv - receives a value if the channel isn't empty
+ * @c: the channel
+ * @elem: the buffer to copy the value into
+ *
+ * Returns 0 if successful, -EAGAIN if empty, or -EPIPE if empty and closed.
+ */
+static inline int chan_try_recv(chan_t *c, void *elem)
+{
+	ssize_t ret = chan_try_recv_batch(c, elem, 1);
+	return ret < 0 ? ret : 0;
+}
+
+/**
+ * chan_send - sends a value, blocking while the channel is full
+ * @c: the channel
+ * @elem: the value to copy into the channel
+ *
+ * Returns 0 if successful, or -EPIPE if closed.
+ */
+static inline int chan_send(chan_t *c, const void *elem)
+{
+	ssize_t ret = chan_send_batch(c, elem, 1);
+	return ret < 0 ? ret : 0;
+}
+
+/**
+ * chan_recv - receives a value, blocking while the channel is empty
+ * @c: the channel
+ * @elem: the buffer to copy the value into
+ *
+ * Returns 0 if successful, or -EPIPE if empty and closed.
+ */
+static inline int chan_recv(chan_t *c, void *elem)
+{
+	ssize_t ret = chan_recv_batch(c, elem, 1);
+	return ret < 0 ? ret : 0;
+}
@@ -5,10 +5,15 @@
 #pragma once
 
 #include <base/stddef.h>
+#include <asm/ops.h>
 
 extern __thread volatile unsigned int preempt_cnt;
 extern __thread volatile bool preempt_cede;
+extern __thread volatile uint64_t *preempt_cede_req;
+extern __thread uint64_t preempt_slice_end_tsc;
 extern void preempt(void);
+extern void preempt_point_slow(void);
+extern void preempt_get_cede_stats(uint64_t *nr, uint64_t *cycles);
 
 #define PREEMPT_NOT_PENDING	(1 << 31)
 
@@ -64,10 +69,37 @@ static inline bool preempt_needed(void)
 
 /**
  * preempt_needed - returns true if a cede preemption event is stuck waiting
+ *
+ * The iokernel may also ask for the core back without a signal.
  */
 static inline bool preempt_cede_needed(void)
 {
-	return preempt_cede;
+	return preempt_cede || *preempt_cede_req != 0;
+}
+
+/**
+ * preempt_point_needed - returns true if the running thread should yield
+ *
+ * This is the case if a preemption event is pending, if the iokernel asked for
+ * the core back, or if the thread used up its time slice (runtime_quantum_us).
+ */
+static inline bool preempt_point_needed(void)
+{
+	return preempt_needed() || *preempt_cede_req != 0 ||
+	       rdtsc() >= preempt_slice_end_tsc;
+}
+
+/**
+ * preempt_point - a cooperative preemption point
+ *
+ * Long-running loops should call this regularly. It lets a best effort
+ * runtime give its core back without waiting for a preemption signal (see
+ * runtime_coop_preempt_us). Does nothing if preemption is disabled.
+ */
+static inline void preempt_point(void)
+{
+	if (unlikely(preempt_point_needed()))
+		preempt_point_slow();
 }
 
 
@@ -94,7 +126,8 @@ static inline void assert_preempt_disabled(void)
  */
 static inline void clear_preempt_needed(void)
 {
-	preempt_cnt |= PREEMPT_NOT_PENDING;
+	asm volatile("orl %0, %%fs:preempt_cnt@tpoff"
+		     : : "i"(PREEMPT_NOT_PENDING) : "memory", "cc");
 }
 
 /**
@@ -105,5 +138,6 @@ static inline void clear_preempt_cede_needed(void)
 {
 	clear_preempt_needed();
 	preempt_cede = false;
+	*preempt_cede_req = 0;
 }
 
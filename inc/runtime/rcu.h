@@ -115,3 +115,6 @@ struct rcu_head {
 
 extern void rcu_free(struct rcu_head *head, rcu_callback_t func);
 extern void synchronize_rcu(void);
+extern void rcu_barrier(void);
+extern void rcu_get_stats(uint64_t *outstanding, uint64_t *gps,
+			  uint64_t *gp_cycles);
@@ -13,6 +13,11 @@
 extern void *smalloc(size_t size) __smalloc_attr;
 extern void *__szalloc(size_t size) __smalloc_attr;
 extern void sfree(void *item);
+extern void *srealloc(void *item, size_t size);
+extern void *saligned_alloc(size_t alignment, size_t size) __malloc;
+extern size_t smalloc_usable_size(void *item);
+
+extern __thread bool smalloc_thread_ready;
 
 /**
  * szalloc - allocates zeroed memory
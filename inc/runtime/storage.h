@@ -5,10 +5,27 @@
 #pragma once
 
 #include <base/stddef.h>
+#include <runtime/sync.h>
 
 extern int storage_write(const void *payload, uint64_t lba, uint32_t lba_count);
 extern int storage_read(void *dest, uint64_t lba, uint32_t lba_count);
 
+/* an asynchronous storage request */
+struct storage_op {
+	waker_t		*waker;	/* runs once the request completes */
+	int		ret;	/* 0 or -EIO, valid once @waker runs */
+
+	/* private fields */
+	void		*payload;
+	void		*dest;
+	size_t		len;
+};
+
+extern int storage_write_async(struct storage_op *op, const void *payload,
+			       uint64_t lba, uint32_t lba_count, waker_t *w);
+extern int storage_read_async(struct storage_op *op, void *dest, uint64_t lba,
+			      uint32_t lba_count, waker_t *w);
+
 
 
 /*
@@ -11,6 +11,46 @@
 #include <runtime/preempt.h>
 
 
+/*
+ * Waker support
+ *
+ * A waker is a callback that an event source runs in place of waking a parked
+ * thread, so that stackless code (e.g. C++ coroutines) can wait without
+ * holding a uthread. It runs once per arming, in the waking context and
+ * possibly with locks held, so it must not block. Typically it makes the
+ * waiter runnable, and the waiter checks its condition again.
+ */
+
+typedef struct waker {
+	struct list_node	link;
+	void			(*fn)(struct waker *w);
+} waker_t;
+
+/**
+ * waker_init - initializes a waker
+ * @w: the waker to initialize
+ * @fn: the callback to run when the waker is woken
+ */
+static inline void waker_init(waker_t *w, void (*fn)(waker_t *w))
+{
+	w->fn = fn;
+}
+
+
+/*
+ * Lock contention statistics
+ */
+
+/* optional per-lock counters, updated while the lock is held */
+struct lock_stats {
+	const char		*name;
+	uint64_t		acquires;
+	uint64_t		contended;	/* acquires that had to wait */
+	uint64_t		wait_cycles;	/* time spent waiting */
+	struct list_node	link;
+};
+
+
 /*
  * Mutex support
  */
@@ -19,6 +59,8 @@ struct mutex {
 	atomic_t		held;
 	spinlock_t		waiter_lock;
 	struct list_head	waiters;
+	thread_t		*owner;
+	struct lock_stats	*stats;
 };
 
 typedef struct mutex mutex_t;
@@ -26,6 +68,14 @@ typedef struct mutex mutex_t;
 extern void __mutex_lock(mutex_t *m);
 extern void __mutex_unlock(mutex_t *m);
 extern void mutex_init(mutex_t *m);
+extern int mutex_enable_stats(mutex_t *m, const char *name);
+
+static inline void __mutex_acquired(mutex_t *m)
+{
+	m->owner = thread_self();
+	if (unlikely(m->stats))
+		m->stats->acquires++;
+}
 
 /**
  * mutex_try_lock - attempts to acquire a mutex
@@ -35,7 +85,11 @@ extern void mutex_init(mutex_t *m);
  */
 static inline bool mutex_try_lock(mutex_t *m)
 {
-	return atomic_cmpxchg(&m->held, 0, 1);
+	if (!atomic_cmpxchg(&m->held, 0, 1))
+		return false;
+
+	__mutex_acquired(m);
+	return true;
 }
 
 /**
@@ -44,8 +98,10 @@ static inline bool mutex_try_lock(mutex_t *m)
  */
 static inline void mutex_lock(mutex_t *m)
 {
-	if (likely(atomic_cmpxchg(&m->held, 0, 1)))
+	if (likely(atomic_cmpxchg(&m->held, 0, 1))) {
+		__mutex_acquired(m);
 		return;
+	}
 
 	__mutex_lock(m);
 }
@@ -56,6 +112,7 @@ static inline void mutex_lock(mutex_t *m)
  */
 static inline void mutex_unlock(mutex_t *m)
 {
+	m->owner = NULL;
 	if (likely(atomic_cmpxchg(&m->held, 1, 0)))
 		return;
 
@@ -105,12 +162,14 @@ struct waitgroup {
 	spinlock_t		lock;
 	int			cnt;
 	struct list_head	waiters;
+	struct list_head	wakers;
 };
 
 typedef struct waitgroup waitgroup_t;
 
 extern void waitgroup_add(waitgroup_t *wg, int cnt);
 extern void waitgroup_wait(waitgroup_t *wg);
+extern bool waitgroup_wait_async(waitgroup_t *wg, waker_t *w);
 extern void waitgroup_init(waitgroup_t *wg);
 
 /**
@@ -190,7 +249,8 @@ struct rwmutex {
 	int			count;
 	struct list_head	read_waiters;
 	struct list_head	write_waiters;
-	int			read_waiter_count;
+	thread_t		*writer;
+	struct lock_stats	*stats;
 };
 
 typedef struct rwmutex rwmutex_t;
@@ -201,3 +261,72 @@ extern void rwmutex_wrlock(rwmutex_t *m);
 extern bool rwmutex_try_rdlock(rwmutex_t *m);
 extern bool rwmutex_try_wrlock(rwmutex_t *m);
 extern void rwmutex_unlock(rwmutex_t *m);
+extern int rwmutex_enable_stats(rwmutex_t *m, const char *name);
+
+
+/*
+ * Big-reader mutex support
+ *
+ * A read-mostly rwmutex. While it is reader-biased, readers only touch a
+ * counter that belongs to their kthread, so they don't contend with each
+ * other. A writer revokes the bias and waits for those readers to drain, and
+ * readers fall back to the underlying rwmutex until the bias is restored.
+ */
+
+struct brmutex_reader {
+	atomic_t		cnt;
+} __aligned(CACHE_LINE_SIZE);
+
+struct brmutex {
+	bool			rbias;
+	uint64_t		inhibit_until_tsc;
+	struct brmutex_reader	*readers;
+	rwmutex_t		rw;
+};
+
+typedef struct brmutex brmutex_t;
+
+/* the read lock token for readers that took the underlying rwmutex */
+#define BRMUTEX_SLOW_READER	(~0U)
+
+extern int brmutex_init(brmutex_t *m);
+extern void brmutex_destroy(brmutex_t *m);
+extern unsigned int __brmutex_rdlock(brmutex_t *m);
+extern void brmutex_wrlock(brmutex_t *m);
+extern void brmutex_wrunlock(brmutex_t *m);
+
+/**
+ * brmutex_rdlock - acquires a read lock on a brmutex
+ * @m: the brmutex to acquire
+ *
+ * Returns a token that must be passed to brmutex_rdunlock().
+ */
+static inline unsigned int brmutex_rdlock(brmutex_t *m)
+{
+	unsigned int idx = get_current_affinity();
+
+	if (likely(ACCESS_ONCE(m->rbias))) {
+		/* the atomic orders the increment before the recheck */
+		atomic_inc(&m->readers[idx].cnt);
+		if (likely(ACCESS_ONCE(m->rbias)))
+			return idx;
+		atomic_dec(&m->readers[idx].cnt);
+	}
+
+	return __brmutex_rdlock(m);
+}
+
+/**
+ * brmutex_rdunlock - releases a read lock on a brmutex
+ * @m: the brmutex to release
+ * @token: the value returned by brmutex_rdlock()
+ */
+static inline void brmutex_rdunlock(brmutex_t *m, unsigned int token)
+{
+	if (unlikely(token == BRMUTEX_SLOW_READER)) {
+		rwmutex_unlock(&m->rw);
+		return;
+	}
+
+	atomic_dec(&m->readers[token].cnt);
+}
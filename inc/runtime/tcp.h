@@ -5,6 +5,7 @@
 #pragma once
 
 #include <runtime/net.h>
+#include <runtime/sync.h>
 #include <sys/uio.h>
 #include <sys/socket.h>
 
@@ -30,5 +31,24 @@ extern ssize_t tcp_write(tcpconn_t *c, const void *buf, size_t len);
 extern ssize_t tcp_readv(tcpconn_t *c, const struct iovec *iov, int iovcnt);
 extern ssize_t tcp_writev(tcpconn_t *c, const struct iovec *iov, int iovcnt);
 extern int tcp_shutdown(tcpconn_t *c, int how);
+
+/* non-blocking I/O, a waker is armed when the call would block */
+extern ssize_t tcp_read_async(tcpconn_t *c, void *buf, size_t len,
+			      waker_t *w);
+extern ssize_t tcp_write_async(tcpconn_t *c, const void *buf, size_t len,
+			       waker_t *w);
+
+/* zero-copy transmit */
+typedef void (*tcp_zc_done_fn)(void *arg);
+extern void *tcp_zc_alloc(size_t len);
+extern ssize_t tcp_write_zc(tcpconn_t *c, const void *buf, size_t len,
+			    tcp_zc_done_fn done, void *arg);
+
+/* zero-copy receive */
+struct mbuf;
+extern ssize_t tcp_read_zc(tcpconn_t *c, struct iovec *iov, int *iovcnt,
+			   struct mbuf **chain);
+extern void tcp_read_zc_release(tcpconn_t *c, struct mbuf *chain);
+
 extern void tcp_abort(tcpconn_t *c);
 extern void tcp_close(tcpconn_t *c);
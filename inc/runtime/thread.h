@@ -13,6 +13,13 @@ struct thread;
 typedef void (*thread_fn_t)(void *arg);
 typedef struct thread thread_t;
 
+/* scheduling priority classes for uthreads */
+enum {
+	THREAD_PRIO_NORMAL = 0,	/* the default, for latency-critical work */
+	THREAD_PRIO_LOW,	/* background work, runs when nothing else can */
+	THREAD_PRIO_NR,
+};
+
 
 /*
  * Low-level routines, these are helpful for bindings and synchronization
@@ -23,8 +30,13 @@ extern void thread_park_and_unlock_np(spinlock_t *l);
 extern void thread_park_and_preempt_enable(void);
 extern void thread_ready(thread_t *thread);
 extern void thread_ready_head(thread_t *thread);
+extern void thread_ready_many(thread_t **threads, int n);
 extern thread_t *thread_create(thread_fn_t fn, void *arg);
 extern thread_t *thread_create_with_buf(thread_fn_t fn, void **buf, size_t len);
+extern thread_t *thread_create_with_stack_size(thread_fn_t fn, void *arg,
+					       size_t stack_size);
+extern thread_t *thread_create_with_prio(thread_fn_t fn, void *arg, int prio);
+extern void thread_set_prio(thread_t *th, int prio);
 
 extern __thread thread_t *__self;
 extern __thread unsigned int kthread_idx;
@@ -45,6 +57,7 @@ inline thread_t *thread_self(void)
 
 extern uint64_t get_uthread_specific(void);
 extern void set_uthread_specific(uint64_t val);
+extern uint64_t thread_get_run_cycles(thread_t *th);
 
 
 /*
@@ -53,4 +66,5 @@ extern void set_uthread_specific(uint64_t val);
 
 extern void thread_yield(void);
 extern int thread_spawn(thread_fn_t fn, void *arg);
+extern int thread_spawn_many(thread_fn_t fn, void **args, int n);
 extern void thread_exit(void) __noreturn;
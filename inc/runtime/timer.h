@@ -5,6 +5,7 @@
 #pragma once
 
 #include <base/stddef.h>
+#include <base/list.h>
 
 typedef void (*timer_fn_t)(unsigned long arg);
 
@@ -12,10 +13,13 @@ struct kthread;
 
 struct timer_entry {
 	bool		armed;
+	bool		in_wheel;
 	unsigned int	idx;
 	timer_fn_t	fn;
 	unsigned long	arg;
 	struct kthread *localk;
+	uint64_t	deadline_us;
+	struct list_node link;
 };
 
 
@@ -33,11 +37,13 @@ static inline void
 timer_init(struct timer_entry *e, timer_fn_t fn, unsigned long arg)
 {
 	e->armed = false;
+	e->localk = NULL;
 	e->fn = fn;
 	e->arg = arg;
 }
 
 extern void timer_start(struct timer_entry *e, uint64_t deadline_us);
+extern void timer_start_coarse(struct timer_entry *e, uint64_t deadline_us);
 extern bool timer_cancel(struct timer_entry *e);
 
 
@@ -289,6 +289,7 @@ enum {
 
 	TX_COMPLETION_OVERFLOW,
 	TX_COMPLETION_FAIL,
+	TX_ZC_INVALID,
 
 	RX_PULLED,
 	COMMANDS_PULLED,
@@ -105,6 +105,16 @@ static inline int dpdk_port_init(uint8_t port, struct rte_mempool *mbuf_pool)
 		nb_txd = MLX5_TX_RING_SIZE;
 	}
 
+	/* zero-copy packets carry their payload in a second segment */
+	if (dev_info.tx_offload_capa & DEV_TX_OFFLOAD_MULTI_SEGS)
+		port_conf.txmode.offloads |= DEV_TX_OFFLOAD_MULTI_SEGS;
+
+	/* runtimes may hand us TCP super-segments (see enable_tso) */
+	if (dev_info.tx_offload_capa & DEV_TX_OFFLOAD_TCP_TSO)
+		port_conf.txmode.offloads |= DEV_TX_OFFLOAD_TCP_TSO;
+	else
+		log_warn("dpdk: NIC does not support TSO, don't use enable_tso");
+
 	/* Configure the Ethernet device. */
 	retval = rte_eth_dev_configure(port, rx_rings, tx_rings, &port_conf);
 	if (retval != 0)
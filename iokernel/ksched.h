@@ -65,17 +65,8 @@ enum {
 	KSCHED_INTR_YIELD,
 };
 
-/**
- * ksched_enqueue_intr - enqueues an interrupt request on a core
- * @core: the core to interrupt
- * @type: the type of interrupt to enqueue
- *
- * The interrupt will not be sent until ksched_send_intrs(). This is done to
- * create an opportunity for batching interrupts. If ksched_run() is called on
- * the same core after ksched_enqueue_intr(), it may prevent interrupts
- * still pending for the last kthread from being delivered.
- */
-static inline void ksched_enqueue_intr(unsigned int core, int type)
+static inline void __ksched_enqueue_intr(unsigned int core, int type,
+					 unsigned int gen)
 {
 	unsigned int signum;
 
@@ -94,11 +85,39 @@ static inline void ksched_enqueue_intr(unsigned int core, int type)
 	}
 
 	ksched_shm[core].signum = signum;
-	store_release(&ksched_shm[core].sig, ksched_gens[core]);
+	store_release(&ksched_shm[core].sig, gen);
 	CPU_SET(core, &ksched_set);
 	ksched_count++;
 }
 
+/**
+ * ksched_enqueue_intr - enqueues an interrupt request on a core
+ * @core: the core to interrupt
+ * @type: the type of interrupt to enqueue
+ *
+ * The interrupt will not be sent until ksched_send_intrs(). This is done to
+ * create an opportunity for batching interrupts. If ksched_run() is called on
+ * the same core after ksched_enqueue_intr(), it may prevent interrupts
+ * still pending for the last kthread from being delivered.
+ */
+static inline void ksched_enqueue_intr(unsigned int core, int type)
+{
+	__ksched_enqueue_intr(core, type, ksched_gens[core]);
+}
+
+/**
+ * ksched_enqueue_intr_prev - enqueues an interrupt request for the kthread
+ * that a pending ksched_run() call is replacing
+ * @core: the core to interrupt
+ * @type: the type of interrupt to enqueue
+ *
+ * The interrupt is dropped if the run finishes before it is delivered.
+ */
+static inline void ksched_enqueue_intr_prev(unsigned int core, int type)
+{
+	__ksched_enqueue_intr(core, type, ksched_gens[core] - 1);
+}
+
 /**
  * ksched_enqueue_pmc - enqueues a performance counter request on a core
  * @core: the core to measure
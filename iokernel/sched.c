@@ -41,6 +41,7 @@ struct core_state {
 	unsigned int	idle:1;	      /* is the core idle? */
 	unsigned int	pending:1;    /* the next run is waiting */
 	unsigned int	wait:1;       /* waiting for run to finish */
+	uint64_t	cede_deadline_tsc; /* when to signal a cooperative kthread */
 };
 
 /* a per-CPU state table to manage scheduling operations */
@@ -140,6 +141,27 @@ static struct thread *sched_pick_kthread(struct proc *p, unsigned int core)
 	return list_tail(&p->idle_threads, struct thread, idle_link);
 }
 
+/*
+ * Asks the kthread running on a core to give the core back. Runtimes that
+ * opted into cooperative preemption get a grace period to notice the request
+ * before they are signalled.
+ */
+static void sched_request_cede(struct core_state *s, unsigned int core)
+{
+	struct thread *th = s->cur_th;
+
+	if (th)
+		store_release(&th->q_ptrs->cede_req_tsc, cur_tsc);
+
+	if (!th || th->p->sched_cfg.coop_preempt_us == 0) {
+		ksched_enqueue_intr(core, KSCHED_INTR_CEDE);
+		return;
+	}
+
+	s->cede_deadline_tsc = cur_tsc +
+			       th->p->sched_cfg.coop_preempt_us * cycles_per_us;
+}
+
 static int
 __sched_run(struct core_state *s, struct thread *th, unsigned int core)
 {
@@ -156,7 +178,7 @@ __sched_run(struct core_state *s, struct thread *th, unsigned int core)
 
 	/* check if we need to interrupt the current core */
 	if (!s->idle && s->cur_th != NULL)
-		ksched_enqueue_intr(core, KSCHED_INTR_CEDE);
+		sched_request_cede(s, core);
 
 	/* finally request that the new kthread run on this core */
 	ksched_run(core, th ? th->tid : 0);
@@ -198,6 +220,12 @@ int sched_run_on_core(struct proc *p, unsigned int core)
 	proc_get(th->p);
 	sched_enable_kthread(th, core);
 
+	/*
+	 * A cede request can race with the kthread parking on its own and be
+	 * left behind. Clear it so only requests for this grant are honored.
+	 */
+	store_release(&th->q_ptrs->cede_req_tsc, 0);
+
 	/* issue the command to run the thread */
 	return __sched_run(s, th, core);
 }
@@ -483,6 +511,8 @@ static int sched_try_fast_rewake(struct thread *th)
 	return -EINVAL;
 
 rewake:
+	/* as in sched_run_on_core(), drop any cede request from before */
+	store_release(&th->q_ptrs->cede_req_tsc, 0);
 	ksched_run(th->core, th->tid);
 	state[th->core].wait = true;
 	return 0;
@@ -534,12 +564,13 @@ void sched_poll(void)
 
 		/* check if a pending context switch finished */
 		if (s->wait && ksched_poll_run_done(core)) {
+			s->cede_deadline_tsc = 0;
 			if (s->pending) {
 				struct thread *th = s->pending_th;
 
 				s->pending_th = NULL;
 				s->pending = false;
-				ksched_enqueue_intr(core, KSCHED_INTR_CEDE);
+				sched_request_cede(s, core);
 				ksched_run(core, th ? th->tid : 0);
 				if (s->cur_th) {
 					sched_disable_kthread(s->cur_th);
@@ -551,6 +582,13 @@ void sched_poll(void)
 			}
 		}
 
+		/* signal a cooperative kthread that missed its grace period */
+		if (s->wait && s->cede_deadline_tsc &&
+		    cur_tsc >= s->cede_deadline_tsc) {
+			ksched_enqueue_intr_prev(core, KSCHED_INTR_CEDE);
+			s->cede_deadline_tsc = 0;
+		}
+
 		/* check if a core went idle */
 		if (!s->wait && !s->idle && ksched_poll_idle(core)) {
 			if (s->cur_th) {
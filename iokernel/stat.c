@@ -17,6 +17,7 @@ static const char *stat_names[] = {
 	"RX_JOIN_FAIL",
 	"TX_COMPLETION_OVERFLOW",
 	"TX_COMPLETION_FAIL",
+	"TX_ZC_INVALID",
 	"RX_PULLED",
 	"COMMANDS_PULLED",
 	"COMPLETION_DRAINED",
@@ -39,12 +39,77 @@ static inline struct tx_pktmbuf_priv *tx_pktmbuf_get_priv(struct rte_mbuf *buf)
 			+ sizeof(struct rte_mbuf));
 }
 
+/*
+ * Attach the payload of a zero-copy packet to @buf as a second segment.
+ *
+ * The payload range comes from the runtime, so it is checked first. Returns 0
+ * if successful, or -EINVAL if the range is outside the runtime's shared
+ * memory or crosses a 2MB page.
+ */
+static int tx_prepare_zc_seg(struct rte_mbuf *buf, struct rte_mbuf *seg,
+			     const struct tx_net_hdr *net_hdr, struct proc *p)
+{
+	struct tx_pktmbuf_priv *priv_data;
+	uintptr_t payload, off;
+
+	if (unlikely(net_hdr->zc_len == 0))
+		return -EINVAL;
+	payload = (uintptr_t)shmptr_to_ptr(&p->region, net_hdr->zc_payload,
+					   net_hdr->zc_len);
+	if (unlikely(!payload))
+		return -EINVAL;
+	off = payload - (uintptr_t)p->region.base;
+	if (unlikely(PGN_2MB(off) != PGN_2MB(off + net_hdr->zc_len - 1)))
+		return -EINVAL;
+
+	seg->buf_addr = (void *)payload;
+	seg->buf_physaddr = p->page_paddrs[PGN_2MB(off)] + PGOFF_2MB(payload);
+	seg->data_off = 0;
+	rte_mbuf_refcnt_set(seg, 1);
+	seg->buf_len = net_hdr->zc_len;
+	seg->pkt_len = net_hdr->zc_len;
+	seg->data_len = net_hdr->zc_len;
+	seg->ol_flags = 0;
+	seg->next = NULL;
+	seg->nb_segs = 1;
+
+	buf->next = seg;
+	buf->nb_segs = 2;
+	buf->pkt_len += net_hdr->zc_len;
+
+	/* only the first segment sends a completion */
+	priv_data = tx_pktmbuf_get_priv(seg);
+	priv_data->p = NULL;
+#ifdef MLX
+	priv_data->lkey = p->lkey;
+#endif /* MLX */
+
+	return 0;
+}
+
+/*
+ * Return mbufs that were allocated but never prepared to the mempool.
+ */
+static void tx_put_unused(struct rte_mbuf **bufs, int n)
+{
+	int i;
+
+	/* make sure returning them doesn't send stale completions */
+	for (i = 0; i < n; i++)
+		tx_pktmbuf_get_priv(bufs[i])->p = NULL;
+	rte_mempool_put_bulk(tx_mbuf_pool, (void **)bufs, n);
+}
+
 /*
  * Prepare rte_mbuf struct for transmission.
+ *
+ * Returns 0 if successful, or -EINVAL if the packet must be dropped. A dropped
+ * mbuf is still set up to send its completion when it is returned to the
+ * mempool.
  */
-static void tx_prepare_tx_mbuf(struct rte_mbuf *buf,
-			       const struct tx_net_hdr *net_hdr,
-			       struct thread *th)
+static int tx_prepare_tx_mbuf(struct rte_mbuf *buf,
+			      const struct tx_net_hdr *net_hdr,
+			      struct thread *th, struct rte_mbuf *seg)
 {
 	struct proc *p = th->p;
 	uint32_t page_number;
@@ -60,6 +125,26 @@ static void tx_prepare_tx_mbuf(struct rte_mbuf *buf,
 	buf->buf_len = net_hdr->len;
 	buf->pkt_len = net_hdr->len;
 	buf->data_len = net_hdr->len;
+	buf->next = NULL;
+	buf->nb_segs = 1;
+
+	/* initialize the private data, used to send completion events */
+	priv_data = tx_pktmbuf_get_priv(buf);
+	priv_data->p = p;
+	priv_data->th = th;
+	priv_data->completion_data = net_hdr->completion_data;
+
+#ifdef MLX
+	/* initialize private data used by Mellanox driver to register memory */
+	priv_data->lkey = p->lkey;
+#endif /* MLX */
+
+	/* reference count @p so it doesn't get freed before the completion */
+	proc_get(p);
+
+	if ((net_hdr->olflags & OLFLAG_ZC) &&
+	    unlikely(tx_prepare_zc_seg(buf, seg, net_hdr, p)))
+		return -EINVAL;
 
 	buf->ol_flags = 0;
 	if (net_hdr->olflags != 0) {
@@ -71,25 +156,17 @@ static void tx_prepare_tx_mbuf(struct rte_mbuf *buf,
 			buf->ol_flags |= PKT_TX_IPV4;
 		if (net_hdr->olflags & OLFLAG_IPV6)
 			buf->ol_flags |= PKT_TX_IPV6;
+		if (net_hdr->olflags & OLFLAG_TCP_TSO) {
+			buf->ol_flags |= PKT_TX_TCP_SEG;
+			buf->tso_segsz = net_hdr->tso_mss;
+		}
 
 		buf->l4_len = sizeof(struct rte_tcp_hdr);
 		buf->l3_len = sizeof(struct rte_ipv4_hdr);
 		buf->l2_len = RTE_ETHER_HDR_LEN;
 	}
 
-	/* initialize the private data, used to send completion events */
-	priv_data = tx_pktmbuf_get_priv(buf);
-	priv_data->p = p;
-	priv_data->th = th;
-	priv_data->completion_data = net_hdr->completion_data;
-
-#ifdef MLX
-	/* initialize private data used by Mellanox driver to register memory */
-	priv_data->lkey = p->lkey;
-#endif /* MLX */
-
-	/* reference count @p so it doesn't get freed before the completion */
-	proc_get(p);
+	return 0;
 }
 
 /*
@@ -215,8 +292,10 @@ bool tx_burst(void)
 {
 	const struct tx_net_hdr *hdrs[IOKERNEL_TX_BURST_SIZE];
 	static struct rte_mbuf *bufs[IOKERNEL_TX_BURST_SIZE];
+	struct rte_mbuf *segs[IOKERNEL_TX_BURST_SIZE];
 	struct thread *threads[IOKERNEL_TX_BURST_SIZE];
-	int i, j, ret, pulltotal = 0;
+	struct rte_mbuf *seg;
+	int i, j, k, ret, pulltotal = 0, nr_segs = 0;
 	static unsigned int pos = 0, n_pkts = 0, n_bufs = 0;
 	struct thread *t;
 
@@ -255,14 +334,43 @@ full:
 			log_warn_ratelimited("tx: error getting %d mbufs from mempool", n_pkts - n_bufs);
 			return true;
 		}
+
+		/* zero-copy packets need a second mbuf for their payload */
+		for (i = n_bufs; i < n_pkts; i++) {
+			if (hdrs[i]->olflags & OLFLAG_ZC)
+				nr_segs++;
+		}
+		if (nr_segs > 0) {
+			ret = rte_mempool_get_bulk(tx_mbuf_pool, (void **)segs,
+						   nr_segs);
+			if (unlikely(ret)) {
+				tx_put_unused(&bufs[n_bufs], n_pkts - n_bufs);
+				stats[TX_COMPLETION_FAIL] += n_pkts - n_bufs;
+				log_warn_ratelimited("tx: error getting %d mbufs from mempool", nr_segs);
+				return true;
+			}
+		}
 	}
 
 	/* fill in packet metadata */
-	for (i = n_bufs; i < n_pkts; i++) {
+	for (i = n_bufs, j = 0, k = n_bufs; i < n_pkts; i++) {
 		if (i + TX_PREFETCH_STRIDE < n_pkts)
 			prefetch(hdrs[i + TX_PREFETCH_STRIDE]);
-		tx_prepare_tx_mbuf(bufs[i], hdrs[i], threads[i]);
+		seg = (hdrs[i]->olflags & OLFLAG_ZC) ? segs[j++] : NULL;
+		if (unlikely(tx_prepare_tx_mbuf(bufs[i], hdrs[i], threads[i],
+						seg))) {
+			/* drop it, returning it to the mempool completes it */
+			if (seg)
+				tx_put_unused(&seg, 1);
+			rte_mempool_put(tx_mbuf_pool, bufs[i]);
+			stats[TX_ZC_INVALID]++;
+			log_warn_ratelimited("tx: dropped a zero-copy packet "
+					     "with an invalid payload");
+			continue;
+		}
+		bufs[k++] = bufs[i];
 	}
+	n_pkts = k;
 
 	n_bufs = n_pkts;
 
@@ -0,0 +1,136 @@
+/*
+ * arena.c - bump-pointer arenas backed by recycled chunks
+ *
+ * Chunks come from a slab through a thread-local cache, so creating and
+ * dropping an arena per request usually costs one tcache allocation and one
+ * tcache free. Allocations too big to pack well into a chunk are made with
+ * smalloc and chained off the arena so they are freed along with it.
+ */
+
+#include <base/slab.h>
+#include <base/tcache.h>
+#include <base/thread.h>
+#include <runtime/arena.h>
+#include <runtime/smalloc.h>
+
+#include "defs.h"
+
+/* allocations larger than this bypass the chunks */
+#define ARENA_LARGE_SIZE	(ARENA_CHUNK_SIZE / 4)
+
+struct arena_chunk {
+	struct arena_chunk	*next;
+} __aligned(ARENA_MIN_ALIGN);
+
+static struct slab arena_chunk_slab;
+static struct tcache *arena_chunk_tcache;
+static DEFINE_PERTHREAD(struct tcache_perthread, arena_chunk_pt);
+
+static void *arena_alloc_large(arena_t *a, size_t size, size_t align)
+{
+	struct arena_chunk *c;
+
+	/* keep the link in front of the allocation without breaking alignment */
+	align = MAX(align, sizeof(*c));
+	if (unlikely(size > SIZE_MAX - align))
+		return NULL;
+
+	c = saligned_alloc(align, size + align);
+	if (unlikely(!c))
+		return NULL;
+
+	c->next = a->large;
+	a->large = c;
+	return (char *)c + align;
+}
+
+/**
+ * __arena_alloc - allocates memory from an arena (slow path)
+ * @a: the arena
+ * @size: the size of the allocation
+ * @align: the alignment, a power of two
+ *
+ * Returns a pointer to the memory, or NULL if out of memory.
+ */
+void *__arena_alloc(arena_t *a, size_t size, size_t align)
+{
+	struct arena_chunk *c;
+	uintptr_t pos;
+
+	if (align >= ARENA_LARGE_SIZE || size > ARENA_LARGE_SIZE - align)
+		return arena_alloc_large(a, size, align);
+
+	preempt_disable();
+	c = tcache_alloc(&perthread_get(arena_chunk_pt));
+	preempt_enable();
+	if (unlikely(!c))
+		return NULL;
+
+	c->next = a->chunks;
+	a->chunks = c;
+	a->end = (char *)c + ARENA_CHUNK_SIZE;
+
+	pos = align_up((uintptr_t)(c + 1), align);
+	a->pos = (char *)(pos + size);
+	return (void *)pos;
+}
+
+/**
+ * arena_reset - frees all memory allocated from an arena
+ * @a: the arena
+ *
+ * The arena is left empty and can be used again.
+ */
+void arena_reset(arena_t *a)
+{
+	struct arena_chunk *c, *next;
+	struct tcache_perthread *pt;
+
+	for (c = a->large; c; c = next) {
+		next = c->next;
+		sfree(c);
+	}
+
+	if (a->chunks) {
+		preempt_disable();
+		pt = &perthread_get(arena_chunk_pt);
+		for (c = a->chunks; c; c = next) {
+			next = c->next;
+			tcache_free(pt, c);
+		}
+		preempt_enable();
+	}
+
+	arena_init(a);
+}
+
+/**
+ * arenas_init_thread - initializes arena support (per-thread)
+ */
+int arenas_init_thread(void)
+{
+	tcache_init_perthread(arena_chunk_tcache,
+			      &perthread_get(arena_chunk_pt));
+	return 0;
+}
+
+/**
+ * arenas_init - initializes arena support
+ */
+int arenas_init(void)
+{
+	int ret;
+
+	ret = slab_create(&arena_chunk_slab, "arena chunks", ARENA_CHUNK_SIZE, 0);
+	if (ret)
+		return ret;
+
+	arena_chunk_tcache = slab_create_tcache(&arena_chunk_slab,
+						TCACHE_DEFAULT_MAG_SIZE);
+	if (!arena_chunk_tcache) {
+		slab_destroy(&arena_chunk_slab);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
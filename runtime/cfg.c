@@ -205,6 +205,99 @@ static int parse_runtime_qdelay_us(const char *name, const char *val)
 	return 0;
 }
 
+static int parse_runtime_rq_size(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 2 || tmp > RUNTIME_RQ_MAX_SIZE || !is_power_of_two(tmp)) {
+		log_err("runtime_rq_size must be a power of two between 2 and %d",
+			RUNTIME_RQ_MAX_SIZE);
+		return -EINVAL;
+	}
+
+	cfg_rq_size = tmp;
+	return 0;
+}
+
+static int parse_runtime_stack_size(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	ret = tmp > 0 ? stack_size_to_class(tmp) : -EINVAL;
+	if (ret < 0) {
+		log_err("runtime_stack_size must be between 1 and %d bytes",
+			RUNTIME_STACK_SIZE);
+		return -EINVAL;
+	}
+
+	cfg_stack_class = ret;
+	return 0;
+}
+
+static int parse_runtime_remote_steal_us(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 0) {
+		log_err("runtime_remote_steal_us must be positive");
+		return -EINVAL;
+	}
+
+	cfg_remote_steal_us = tmp;
+	return 0;
+}
+
+static int parse_runtime_coop_preempt_us(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 0) {
+		log_err("runtime_coop_preempt_us must be positive");
+		return -EINVAL;
+	}
+
+	cfg_coop_preempt_us = tmp;
+	return 0;
+}
+
+static int parse_runtime_quantum_us(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 0) {
+		log_err("runtime_quantum_us must be positive");
+		return -EINVAL;
+	}
+
+	cfg_quantum_us = tmp;
+	return 0;
+}
+
 static int parse_mac_address(const char *name, const char *val)
 {
 	int ret = str_to_mac(val, &netcfg.mac);
@@ -322,6 +415,51 @@ static int parse_enable_directpath(const char *name, const char *val)
 #endif
 }
 
+static int parse_tcp_cc(const char *name, const char *val)
+{
+	if (!strcmp(val, "reno")) {
+		cfg_tcp_cc = TCP_CC_RENO;
+	} else if (!strcmp(val, "dctcp")) {
+		cfg_tcp_cc = TCP_CC_DCTCP;
+	} else {
+		log_err("cfg: unknown TCP congestion control '%s'", val);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int parse_disable_gro(const char *name, const char *val)
+{
+	cfg_gro_enabled = false;
+	return 0;
+}
+
+static int parse_enable_tso(const char *name, const char *val)
+{
+	cfg_tso_enabled = true;
+	return 0;
+}
+
+static int parse_tcp_zc_region_mb(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 0) {
+		log_err("tcp zero-copy region size must be positive, got %ld",
+			tmp);
+		return -EINVAL;
+	}
+
+	cfg_tcp_zc_len = tmp * 1024 * 1024;
+	return 0;
+}
+
 static int parse_enable_gc(const char *name, const char *val)
 {
 #ifdef GC
@@ -362,12 +500,21 @@ static const struct cfg_handler cfg_handlers[] = {
 	{ "runtime_priority", parse_runtime_priority, false },
 	{ "runtime_ht_punish_us", parse_runtime_ht_punish_us, false },
 	{ "runtime_qdelay_us", parse_runtime_qdelay_us, false },
+	{ "runtime_rq_size", parse_runtime_rq_size, false },
+	{ "runtime_remote_steal_us", parse_runtime_remote_steal_us, false },
+	{ "runtime_stack_size", parse_runtime_stack_size, false },
+	{ "runtime_coop_preempt_us", parse_runtime_coop_preempt_us, false },
+	{ "runtime_quantum_us", parse_runtime_quantum_us, false },
 	{ "static_arp", parse_static_arp_entry, false },
 	{ "log_level", parse_log_level, false },
 	{ "disable_watchdog", parse_watchdog_flag, false },
 	{ "preferred_socket", parse_preferred_socket, false },
 	{ "enable_storage", parse_enable_storage, false },
 	{ "enable_directpath", parse_enable_directpath, false },
+	{ "enable_tso", parse_enable_tso, false },
+	{ "disable_gro", parse_disable_gro, false },
+	{ "tcp_cc", parse_tcp_cc, false },
+	{ "tcp_zc_region_mb", parse_tcp_zc_region_mb, false },
 	{ "enable_gc", parse_enable_gc, false },
 
 };
@@ -478,6 +625,10 @@ int cfg_load(const char *path)
 #else
 		"disabled");
 #endif
+	log_info("cfg: TCP segmentation offload %s",
+		 cfg_tso_enabled ? "enabled" : "disabled");
+	log_info("cfg: generic receive offload %s",
+		 cfg_gro_enabled ? "enabled" : "disabled");
 
 out:
 	fclose(f);
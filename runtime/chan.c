@@ -0,0 +1,404 @@
+/*
+ * chan.c - bounded lock-free channels for passing values between uthreads
+ *
+ * The ring is a bounded MPMC queue where each cell carries a sequence number
+ * that tells senders and receivers whether it is free or full for their
+ * position, so both sides only contend on a compare-and-swap of their own
+ * position. The lock is only taken to park when the channel is full or empty.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <runtime/chan.h>
+#include <runtime/poll.h>
+
+#include "defs.h"
+
+struct chan_waiter {
+	struct list_node	link;
+	thread_t		*th;	  /* a parked sender or receiver */
+	poll_trigger_t		*trigger; /* or a chan_select() waiting */
+	bool			queued;
+};
+
+static inline uint64_t *chan_cell(chan_t *c, uint64_t pos)
+{
+	return (uint64_t *)(c->cells + (pos & c->mask) * c->stride);
+}
+
+static inline void *chan_cell_data(uint64_t *cell)
+{
+	return cell + 1;
+}
+
+/* is the cell at the send position still waiting for a receiver? */
+static bool chan_full(chan_t *c)
+{
+	uint64_t pos = ACCESS_ONCE(c->send_pos);
+	uint64_t seq = load_acquire(chan_cell(c, pos));
+
+	return (int64_t)(seq - pos) < 0;
+}
+
+/* is the cell at the receive position still waiting for a sender? */
+static bool chan_empty(chan_t *c)
+{
+	uint64_t pos = ACCESS_ONCE(c->recv_pos);
+	uint64_t seq = load_acquire(chan_cell(c, pos));
+
+	return (int64_t)(seq - (pos + 1)) < 0;
+}
+
+/*
+ * Wakes up to @n parked threads and every chan_select() waiting on the list.
+ * Selects are woken in addition to threads because they might end up taking
+ * a value from a different channel.
+ */
+static void chan_wake(chan_t *c, struct list_head *waiters,
+		      unsigned int *nr_waiters, size_t n)
+{
+	struct chan_waiter *w, *next;
+
+	spin_lock_np(&c->lock);
+	list_for_each_safe(waiters, w, next, link) {
+		if (w->th && n == 0)
+			continue;
+		list_del_from(waiters, &w->link);
+		w->queued = false;
+		(*nr_waiters)--;
+		if (w->th) {
+			n--;
+			thread_ready(w->th);
+		} else {
+			poll_trigger(w->trigger->waiter, w->trigger);
+		}
+	}
+	spin_unlock_np(&c->lock);
+}
+
+static void chan_wake_receivers(chan_t *c, size_t n)
+{
+	/* pairs with the barrier in chan_wait() */
+	mb();
+	if (unlikely(ACCESS_ONCE(c->nr_recv_waiters) > 0))
+		chan_wake(c, &c->recv_waiters, &c->nr_recv_waiters, n);
+}
+
+static void chan_wake_senders(chan_t *c, size_t n)
+{
+	/* pairs with the barrier in chan_wait() */
+	mb();
+	if (unlikely(ACCESS_ONCE(c->nr_send_waiters) > 0))
+		chan_wake(c, &c->send_waiters, &c->nr_send_waiters, n);
+}
+
+/* parks the calling thread unless @blocked() became false or @c was closed */
+static void chan_wait(chan_t *c, struct list_head *waiters,
+		      unsigned int *nr_waiters, bool (*blocked)(chan_t *c))
+{
+	struct chan_waiter w;
+
+	w.th = thread_self();
+	w.trigger = NULL;
+	w.queued = true;
+
+	spin_lock_np(&c->lock);
+	list_add_tail(waiters, &w.link);
+	(*nr_waiters)++;
+	mb();
+	if (!blocked(c) || ACCESS_ONCE(c->closed)) {
+		list_del_from(waiters, &w.link);
+		(*nr_waiters)--;
+		spin_unlock_np(&c->lock);
+		return;
+	}
+
+	thread_park_and_unlock_np(&c->lock);
+}
+
+/**
+ * chan_init - initializes a channel
+ * @c: the channel to initialize
+ * @elem_size: the size of each value in bytes
+ * @capacity: the number of values that fit (rounded up to a power of two)
+ *
+ * Returns 0 if successful, otherwise -ENOMEM.
+ */
+int chan_init(chan_t *c, size_t elem_size, unsigned int capacity)
+{
+	uint64_t i, size = 1;
+
+	while (size < MAX(capacity, 1))
+		size <<= 1;
+
+	c->elem_size = elem_size;
+	c->stride = align_up(sizeof(uint64_t) + elem_size, sizeof(uint64_t));
+	c->cells = aligned_alloc(CACHE_LINE_SIZE,
+				 align_up(c->stride * size, CACHE_LINE_SIZE));
+	if (!c->cells)
+		return -ENOMEM;
+
+	c->mask = size - 1;
+	for (i = 0; i < size; i++)
+		*chan_cell(c, i) = i;
+	c->send_pos = 0;
+	c->recv_pos = 0;
+	c->closed = false;
+	spin_lock_init(&c->lock);
+	c->nr_send_waiters = 0;
+	c->nr_recv_waiters = 0;
+	list_head_init(&c->send_waiters);
+	list_head_init(&c->recv_waiters);
+	return 0;
+}
+
+/**
+ * chan_destroy - frees the resources used by a channel
+ * @c: the channel, nobody may be waiting on it
+ */
+void chan_destroy(chan_t *c)
+{
+	assert(list_empty(&c->send_waiters));
+	assert(list_empty(&c->recv_waiters));
+	free(c->cells);
+	c->cells = NULL;
+}
+
+/**
+ * chan_close - closes a channel
+ * @c: the channel
+ *
+ * Sends fail after this (sends that race with the close may still go
+ * through). Receivers can still drain the values that were already sent,
+ * after which receives fail too.
+ */
+void chan_close(chan_t *c)
+{
+	ACCESS_ONCE(c->closed) = true;
+	mb();
+	chan_wake(c, &c->send_waiters, &c->nr_send_waiters, SIZE_MAX);
+	chan_wake(c, &c->recv_waiters, &c->nr_recv_waiters, SIZE_MAX);
+}
+
+/**
+ * chan_try_send_batch - sends values without blocking
+ * @c: the channel
+ * @elems: an array of values to copy into the channel
+ * @n: the number of values in @elems
+ *
+ * Sends as many values as there is room for, in order.
+ *
+ * Returns the number of values sent, -EAGAIN if the channel is full, or
+ * -EPIPE if it is closed.
+ */
+ssize_t chan_try_send_batch(chan_t *c, const void *elems, size_t n)
+{
+	uint64_t pos, seq, *cell;
+	size_t i, k;
+
+	if (unlikely(ACCESS_ONCE(c->closed)))
+		return -EPIPE;
+	if (unlikely(n == 0))
+		return 0;
+
+	pos = ACCESS_ONCE(c->send_pos);
+	while (true) {
+		/* count the free cells starting at this position */
+		for (k = 0; k < n; k++) {
+			seq = load_acquire(chan_cell(c, pos + k));
+			if (seq != pos + k)
+				break;
+		}
+
+		if (k == 0) {
+			if ((int64_t)(seq - pos) < 0)
+				return -EAGAIN;
+			pos = ACCESS_ONCE(c->send_pos);
+			continue;
+		}
+
+		if (__sync_bool_compare_and_swap(&c->send_pos, pos, pos + k))
+			break;
+		pos = ACCESS_ONCE(c->send_pos);
+	}
+
+	for (i = 0; i < k; i++) {
+		cell = chan_cell(c, pos + i);
+		memcpy(chan_cell_data(cell),
+		       (const char *)elems + i * c->elem_size, c->elem_size);
+		store_release(cell, pos + i + 1);
+	}
+
+	chan_wake_receivers(c, k);
+	return k;
+}
+
+/**
+ * chan_try_recv_batch - receives values without blocking
+ * @c: the channel
+ * @elems: an array to copy the values into
+ * @n: the number of values that fit in @elems
+ *
+ * Returns the number of values received, -EAGAIN if the channel is empty, or
+ * -EPIPE if it is empty and closed.
+ */
+ssize_t chan_try_recv_batch(chan_t *c, void *elems, size_t n)
+{
+	uint64_t pos, seq, *cell;
+	size_t i, k;
+
+	if (unlikely(n == 0))
+		return 0;
+
+	pos = ACCESS_ONCE(c->recv_pos);
+	while (true) {
+		/* count the full cells starting at this position */
+		for (k = 0; k < n; k++) {
+			seq = load_acquire(chan_cell(c, pos + k));
+			if (seq != pos + k + 1)
+				break;
+		}
+
+		if (k == 0) {
+			if ((int64_t)(seq - (pos + 1)) < 0) {
+				/* closed, and no send is still in progress */
+				if (load_acquire(&c->closed) &&
+				    ACCESS_ONCE(c->send_pos) == pos)
+					return -EPIPE;
+				return -EAGAIN;
+			}
+			pos = ACCESS_ONCE(c->recv_pos);
+			continue;
+		}
+
+		if (__sync_bool_compare_and_swap(&c->recv_pos, pos, pos + k))
+			break;
+		pos = ACCESS_ONCE(c->recv_pos);
+	}
+
+	for (i = 0; i < k; i++) {
+		cell = chan_cell(c, pos + i);
+		memcpy((char *)elems + i * c->elem_size, chan_cell_data(cell),
+		       c->elem_size);
+		store_release(cell, pos + i + c->mask + 1);
+	}
+
+	chan_wake_senders(c, k);
+	return k;
+}
+
+/**
+ * chan_send_batch - sends values, blocking while the channel is full
+ * @c: the channel
+ * @elems: an array of values to copy into the channel
+ * @n: the number of values in @elems
+ *
+ * Blocks only until at least one value is sent, like write().
+ *
+ * Returns the number of values sent, or -EPIPE if the channel is closed.
+ */
+ssize_t chan_send_batch(chan_t *c, const void *elems, size_t n)
+{
+	ssize_t ret;
+
+	while (true) {
+		ret = chan_try_send_batch(c, elems, n);
+		if (ret != -EAGAIN)
+			return ret;
+
+		chan_wait(c, &c->send_waiters, &c->nr_send_waiters, chan_full);
+	}
+}
+
+/**
+ * chan_recv_batch - receives values, blocking while the channel is empty
+ * @c: the channel
+ * @elems: an array to copy the values into
+ * @n: the number of values that fit in @elems
+ *
+ * Blocks only until at least one value is received, like read().
+ *
+ * Returns the number of values received, or -EPIPE if the channel is empty
+ * and closed.
+ */
+ssize_t chan_recv_batch(chan_t *c, void *elems, size_t n)
+{
+	ssize_t ret;
+
+	while (true) {
+		ret = chan_try_recv_batch(c, elems, n);
+		if (ret != -EAGAIN)
+			return ret;
+
+		chan_wait(c, &c->recv_waiters, &c->nr_recv_waiters, chan_empty);
+	}
+}
+
+/**
+ * chan_select - receives a value from whichever channel has one first
+ * @chans: the channels to wait on, all with the same value size
+ * @n: the number of channels
+ * @elem: the buffer to copy the value into
+ *
+ * Returns the index of the channel the value came from, or -EPIPE once every
+ * channel is empty and closed.
+ */
+int chan_select(chan_t **chans, int n, void *elem)
+{
+	struct chan_waiter ws[n];
+	poll_trigger_t ts[n];
+	poll_waiter_t pw;
+	int i, ret, closed;
+	bool ready;
+
+	while (true) {
+		closed = 0;
+		for (i = 0; i < n; i++) {
+			ret = chan_try_recv(chans[i], elem);
+			if (ret == 0)
+				return i;
+			if (ret == -EPIPE)
+				closed++;
+		}
+		if (closed == n)
+			return -EPIPE;
+
+		/* have each channel fire a trigger once it has a value */
+		poll_init(&pw);
+		for (i = 0; i < n; i++) {
+			poll_trigger_init(&ts[i]);
+			poll_arm(&pw, &ts[i], i);
+			ws[i].th = NULL;
+			ws[i].trigger = &ts[i];
+			ws[i].queued = true;
+			spin_lock_np(&chans[i]->lock);
+			list_add_tail(&chans[i]->recv_waiters, &ws[i].link);
+			chans[i]->nr_recv_waiters++;
+			spin_unlock_np(&chans[i]->lock);
+		}
+
+		/* pairs with the barrier in chan_wake_receivers() */
+		mb();
+		ready = false;
+		for (i = 0; i < n; i++) {
+			if (!chan_empty(chans[i]) || ACCESS_ONCE(chans[i]->closed))
+				ready = true;
+		}
+		if (!ready)
+			poll_wait(&pw);
+
+		for (i = 0; i < n; i++) {
+			spin_lock_np(&chans[i]->lock);
+			if (ws[i].queued) {
+				list_del_from(&chans[i]->recv_waiters,
+					      &ws[i].link);
+				chans[i]->nr_recv_waiters--;
+			}
+			spin_unlock_np(&chans[i]->lock);
+			poll_disarm(&ts[i]);
+		}
+	}
+}
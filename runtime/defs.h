@@ -31,13 +31,17 @@
 
 #define RUNTIME_MAX_THREADS		100000
 #define RUNTIME_STACK_SIZE		256 * KB
-#define RUNTIME_GUARD_SIZE		256 * KB
 #define RUNTIME_RQ_SIZE			32
+#define RUNTIME_RQ_MAX_SIZE		65536
 #define RUNTIME_MAX_TIMERS		4096
 #define RUNTIME_SCHED_POLL_ITERS	0
 #define RUNTIME_SCHED_MIN_POLL_US	2
 #define RUNTIME_WATCHDOG_US		50
+#define RUNTIME_REMOTE_STEAL_US		5
+#define RUNTIME_LOW_PRIO_DEADLINE_US	1000
+#define RUNTIME_SPAWN_BATCH		64
 #define RUNTIME_RX_BATCH_SIZE		32
+#define RUNTIME_SYNC_SPIN_US		5
 
 
 /*
@@ -93,11 +97,14 @@ struct thread {
 	struct list_node	link;
 	struct stack		*stack;
 	unsigned int		main_thread:1;
+	unsigned int		prio:1;
+	unsigned int		stack_class:2;
 	unsigned int		thread_ready;
 	unsigned int		thread_running;
 	unsigned int		last_cpu;
 	uint64_t		run_start_tsc;
 	uint64_t		ready_tsc;
+	uint64_t		run_cycles;
 	uint64_t		tlsvar;
 #ifdef GC
 	struct list_node	gc_link;
@@ -107,6 +114,16 @@ struct thread {
 
 typedef void (*runtime_fn_t)(void);
 
+/* a per-kthread ring of runnable threads, its size is a power of two */
+struct rq_ring {
+	uint32_t		mask;
+	struct rcu_head		rcu;
+	thread_t		*slots[];
+};
+
+extern unsigned int cfg_rq_size;
+extern uint64_t cfg_remote_steal_us;
+
 /* assembly helper routines from switch.S */
 extern void __jmp_thread(struct thread_tf *tf) __noreturn;
 extern void __jmp_thread_direct(struct thread_tf *oldtf,
@@ -121,35 +138,101 @@ extern void __jmp_runtime_nosave(runtime_fn_t fn, void *stack) __noreturn;
  * Stack support
  */
 
-#define STACK_PTR_SIZE	(RUNTIME_STACK_SIZE / sizeof(uintptr_t))
-#define GUARD_PTR_SIZE	(RUNTIME_GUARD_SIZE / sizeof(uintptr_t))
-
-struct stack {
-	uintptr_t	usable[STACK_PTR_SIZE];
-	uintptr_t	guard[GUARD_PTR_SIZE]; /* unreadable and unwritable */
+/*
+ * Stacks come in size classes, each with its own tcache. A stack is a
+ * headroom region, then the usable region, then an unreadable and unwritable
+ * guard region; a struct stack pointer refers to the start of the headroom.
+ * Stacks are laid out back to back, so the guard of one stack sits right
+ * below the headroom of the next and catches overflows.
+ *
+ * Preemption signals are delivered on the running thread's stack, so the
+ * headroom keeps a signal frame that lands on a full stack from overflowing
+ * it. Its size depends on the CPU's signal frame, so it is set at init time.
+ */
+enum {
+	STACK_CLASS_16K = 0,
+	STACK_CLASS_64K,
+	STACK_CLASS_256K,
+	STACK_CLASS_NR,
 };
 
-DECLARE_PERTHREAD(struct tcache_perthread, stack_pt);
+#define STACK_MIN_SIZE		(16 * KB)
+#define STACK_CLASS_MAX		(STACK_CLASS_NR - 1)
+BUILD_ASSERT(RUNTIME_STACK_SIZE == STACK_MIN_SIZE << (2 * STACK_CLASS_MAX));
+
+extern unsigned int cfg_stack_class;
+extern size_t stack_headroom;
+extern void stack_get_stats(unsigned int cls, uint64_t *nr, uint64_t *hwm);
+
+/**
+ * stack_class_size - returns the usable size of a stack class
+ * @cls: the stack class
+ */
+static inline size_t stack_class_size(unsigned int cls)
+{
+	return STACK_MIN_SIZE << (2 * cls);
+}
+
+/**
+ * stack_class_span - returns the size of a stack class including its headroom
+ * @cls: the stack class
+ */
+static inline size_t stack_class_span(unsigned int cls)
+{
+	return stack_headroom + stack_class_size(cls);
+}
+
+/**
+ * stack_size_to_class - returns the smallest stack class that fits @size
+ * @size: the requested stack size in bytes
+ *
+ * Returns a stack class, or -EINVAL if @size is larger than any class.
+ */
+static inline int stack_size_to_class(size_t size)
+{
+	unsigned int cls;
+
+	for (cls = 0; cls < STACK_CLASS_NR; cls++) {
+		if (size <= stack_class_size(cls))
+			return cls;
+	}
+
+	return -EINVAL;
+}
+
+/**
+ * stack_top - returns the top of a stack (one past the last usable word)
+ * @s: the stack
+ * @cls: the stack's class
+ */
+static inline uintptr_t *stack_top(struct stack *s, unsigned int cls)
+{
+	return (uintptr_t *)((uintptr_t)s + stack_class_span(cls));
+}
+
+DECLARE_PERTHREAD(struct tcache_perthread[STACK_CLASS_NR], stack_pt);
 
 /**
  * stack_alloc - allocates a stack
+ * @cls: the stack class
  *
  * Stack allocation is extremely cheap, think less than taking a lock.
  *
  * Returns an unitialized stack.
  */
-static inline struct stack *stack_alloc(void)
+static inline struct stack *stack_alloc(unsigned int cls)
 {
-	return tcache_alloc(&perthread_get(stack_pt));
+	return tcache_alloc(&perthread_get(stack_pt)[cls]);
 }
 
 /**
  * stack_free - frees a stack
  * @s: the stack to free
+ * @cls: the stack class it was allocated from
  */
-static inline void stack_free(struct stack *s)
+static inline void stack_free(struct stack *s, unsigned int cls)
 {
-	tcache_free(&perthread_get(stack_pt), (void *)s);
+	tcache_free(&perthread_get(stack_pt)[cls], (void *)s);
 }
 
 #define RSP_ALIGNMENT	16
@@ -169,16 +252,19 @@ static inline void assert_rsp_aligned(uint64_t rsp)
 /**
  * stack_init_to_rsp - sets up an exit handler and returns the top of the stack
  * @s: the stack to initialize
+ * @cls: the stack class
  * @exit_fn: exit handler that is called when the top of the call stack returns
  *
  * Returns the top of the stack as a stack pointer.
  */
-static inline uint64_t stack_init_to_rsp(struct stack *s, void (*exit_fn)(void))
+static inline uint64_t stack_init_to_rsp(struct stack *s, unsigned int cls,
+					 void (*exit_fn)(void))
 {
+	uintptr_t *top = stack_top(s, cls);
 	uint64_t rsp;
 
-	s->usable[STACK_PTR_SIZE - 1] = (uintptr_t)exit_fn;
-	rsp = (uint64_t)&s->usable[STACK_PTR_SIZE - 1];
+	top[-1] = (uintptr_t)exit_fn;
+	rsp = (uint64_t)&top[-1];
 	assert_rsp_aligned(rsp);
 	return rsp;
 }
@@ -187,6 +273,7 @@ static inline uint64_t stack_init_to_rsp(struct stack *s, void (*exit_fn)(void))
  * stack_init_to_rsp_with_buf - sets up an exit handler and returns the top of
  * the stack, reserving space for a buffer above
  * @s: the stack to initialize
+ * @cls: the stack class
  * @buf: a pointer to store the buffer pointer
  * @buf_len: the length of the buffer to reserve
  * @exit_fn: exit handler that is called when the top of the call stack returns
@@ -194,19 +281,20 @@ static inline uint64_t stack_init_to_rsp(struct stack *s, void (*exit_fn)(void))
  * Returns the top of the stack as a stack pointer.
  */
 static inline uint64_t
-stack_init_to_rsp_with_buf(struct stack *s, void **buf, size_t buf_len,
-			   void (*exit_fn)(void))
+stack_init_to_rsp_with_buf(struct stack *s, unsigned int cls, void **buf,
+			   size_t buf_len, void (*exit_fn)(void))
 {
-	uint64_t rsp, pos = STACK_PTR_SIZE;
+	uintptr_t *usable = (uintptr_t *)s;
+	uint64_t rsp, pos = stack_class_span(cls) / sizeof(uintptr_t);
 
 	/* reserve the buffer */
 	pos -= div_up(buf_len, sizeof(uint64_t));
 	pos = align_down(pos, RSP_ALIGNMENT / sizeof(uint64_t));
-	*buf = (void *)&s->usable[pos];
+	*buf = (void *)&usable[pos];
 
 	/* setup for usage as stack */
-	s->usable[--pos] = (uintptr_t)exit_fn;
-	rsp = (uint64_t)&s->usable[pos];
+	usable[--pos] = (uintptr_t)exit_fn;
+	rsp = (uint64_t)&usable[pos];
 	assert_rsp_aligned(rsp);
 	return rsp;
 }
@@ -224,6 +312,10 @@ struct iokernel_control {
 	const struct iokernel_info *iok_info;
 	void *tx_buf;
 	size_t tx_len;
+	void *tso_buf;
+	size_t tso_len;
+	void *zc_buf;
+	size_t zc_len;
 };
 
 extern struct iokernel_control iok;
@@ -340,6 +432,26 @@ enum {
 	STAT_LOCAL_WAKES,
 	STAT_REMOTE_WAKES,
 	STAT_RQ_OVERFLOW,
+	STAT_RQ_GROWS,
+	STAT_STEALS_SIBLING,
+	STAT_STEALS_LLC,
+	STAT_STEALS_PACKAGE,
+	STAT_STEALS_REMOTE,
+	STAT_REMOTE_STEALS_DEFERRED,
+	STAT_LOW_PRIO_RUNS,
+	STAT_LOW_PRIO_STOLEN,
+	STAT_LOW_PRIO_DEADLINES,
+	STAT_HANDOFFS,
+	STAT_HANDOFFS_FAILED,
+	STAT_HANDOFFS_RECEIVED,
+	STAT_COOP_CEDES,
+	STAT_COOP_YIELDS,
+	STAT_CEDE_REQS,
+	STAT_CEDE_REQ_CYCLES,
+	STAT_RCU_FREES,
+	STAT_RCU_CALLBACKS,
+	STAT_RCU_GPS,
+	STAT_RCU_GP_CYCLES,
 
 	/* network stack counters */
 	STAT_RX_BYTES,
@@ -351,6 +463,8 @@ enum {
 	STAT_RX_TCP_OUT_OF_ORDER,
 	STAT_RX_TCP_TEXT_CYCLES,
 	STAT_TXQ_OVERFLOW,
+	STAT_RX_GRO_COALESCED,
+	STAT_RX_GRO_CHAINS,
 
 	/* directpath stats */
 	STAT_FLOW_STEERING_CYCLES,
@@ -360,21 +474,86 @@ enum {
 	STAT_NR,
 };
 
+/*
+ * A log-linear histogram of cycle counts: each power of two is split into
+ * 2^LAT_HIST_SUB_BITS buckets, and values beyond the last bucket are clamped.
+ */
+#define LAT_HIST_SUB_BITS	2
+#define LAT_HIST_NR		160
+
+struct lat_hist {
+	uint64_t		buckets[LAT_HIST_NR];
+};
+
+static inline unsigned int lat_hist_idx(uint64_t cycles)
+{
+	unsigned int msb, idx;
+
+	if (cycles < (1UL << LAT_HIST_SUB_BITS))
+		return cycles;
+
+	msb = 63 - __builtin_clzl(cycles);
+	idx = ((msb - LAT_HIST_SUB_BITS + 1) << LAT_HIST_SUB_BITS) +
+	      ((cycles >> (msb - LAT_HIST_SUB_BITS)) &
+	       ((1UL << LAT_HIST_SUB_BITS) - 1));
+	return MIN(idx, LAT_HIST_NR - 1);
+}
+
+/* returns the smallest value that falls in bucket @idx */
+static inline uint64_t lat_hist_bucket_start(unsigned int idx)
+{
+	unsigned int shift;
+
+	if (idx < (1U << LAT_HIST_SUB_BITS))
+		return idx;
+
+	shift = (idx >> LAT_HIST_SUB_BITS) - 1;
+	return ((1UL << LAT_HIST_SUB_BITS) +
+		(idx & ((1U << LAT_HIST_SUB_BITS) - 1))) << shift;
+}
+
+static inline void lat_hist_add(struct lat_hist *h, uint64_t cycles)
+{
+	h->buckets[lat_hist_idx(cycles)]++;
+}
+
 struct timer_idx {
 	uint64_t		deadline_us;
 	struct timer_entry	*e;
 };
 
+/*
+ * A hashed hierarchical timer wheel for coarse timers. Each level has
+ * TIMER_WHEEL_SIZE slots and each slot covers TIMER_WHEEL_SIZE times more
+ * ticks than a slot of the level below it.
+ */
+#define TIMER_WHEEL_TICK_SHIFT	10	/* ~1 ms per tick */
+#define TIMER_WHEEL_BITS	6
+#define TIMER_WHEEL_SIZE	(1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS	4
+
+struct timer_wheel {
+	uint64_t		next_us;  /* no timer in the wheel fires earlier */
+	uint64_t		now_tick; /* the next tick to process */
+	uint64_t		occupied[TIMER_WHEEL_LEVELS];
+	struct list_head	expired;
+	struct list_head	slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+};
+
 struct kthread {
 	/* 1st cache-line */
 	spinlock_t		lock;
-	uint32_t		kthread_idx;
 	uint32_t		rq_head;
-	uint32_t		rq_tail;
+	union {
+		struct {
+			uint32_t	rq_tail;
+			uint32_t	rq_tail_gen;
+		};
+		uint64_t	rq_tail_pair;
+	};
 	struct list_head	rq_overflow;
 	struct lrpc_chan_in	rxq;
-	pid_t			tid;
-	bool			parked;
+	struct rq_ring		*rq;
 
 	/* 2nd cache-line */
 	struct q_ptrs		*q_ptrs;
@@ -382,21 +561,19 @@ struct kthread {
 	struct mbufq		txcmdq_overflow;
 	unsigned int		rcu_gen;
 	unsigned int		curr_cpu;
+	pid_t			tid;
+	bool			parked;
 #ifdef GC
 	uint64_t		local_gc_gen;
-	unsigned long		pad1[1];
 #else
-	unsigned long		pad1[2];
+	unsigned long		pad1[1];
 #endif
 
 	/* 3rd cache-line */
 	struct lrpc_chan_out	txpktq;
 	struct lrpc_chan_out	txcmdq;
 
-	/* 4th-7th cache-line */
-	thread_t		*rq[RUNTIME_RQ_SIZE];
-
-	/* 8th cache-line */
+	/* 4th cache-line */
 	spinlock_t		timer_lock;
 	unsigned int		timern;
 	struct timer_idx	*timers;
@@ -408,25 +585,40 @@ struct kthread {
 	bool			directpath_busy;
 	bool			timer_busy;
 	bool			storage_busy;
-	unsigned int		pad2[3];
+	uint32_t		kthread_idx;
+	thread_t		*mailbox;
 
-	/* 9th cache-line, storage nvme queues */
+	/* 5th cache-line, storage nvme queues */
 	struct storage_q	storage_q;
 
-	/* 10th cache-line, direct path queues */
+	/* 6th cache-line, direct path queues and low priority threads */
 	struct hardware_q	*directpath_rxq;
 	struct direct_txq	*directpath_txq;
-	unsigned long		pad3[6];
-
-	/* 11th cache-line, statistics counters */
+	struct list_head	rq_low;
+	unsigned int		rq_low_cnt;
+	unsigned int		pad3;
+	struct timer_wheel	*timer_wheel;
+	struct rcu_head		*rcu_cbs;
+	unsigned long		rcu_qs_seq;
+
+	/* 7th cache-line, statistics counters */
 	uint64_t		stats[STAT_NR];
+
+	/* scheduling histograms, in cycles */
+	struct lat_hist		sched_delay_hist; /* from ready to running */
+	struct lat_hist		run_time_hist; /* from running to descheduled */
 };
 
+/* the mailbox only accepts a thread while its kthread is idle */
+#define MAILBOX_CLOSED	((thread_t *)1)
+
 /* compile-time verification of cache-line alignment */
 BUILD_ASSERT(offsetof(struct kthread, lock) % CACHE_LINE_SIZE == 0);
+BUILD_ASSERT(offsetof(struct kthread, rq_tail_pair) % sizeof(uint64_t) == 0);
+BUILD_ASSERT(offsetof(struct kthread, rq_tail_pair) ==
+	     offsetof(struct kthread, rq_tail));
 BUILD_ASSERT(offsetof(struct kthread, q_ptrs) % CACHE_LINE_SIZE == 0);
 BUILD_ASSERT(offsetof(struct kthread, txpktq) % CACHE_LINE_SIZE == 0);
-BUILD_ASSERT(offsetof(struct kthread, rq) % CACHE_LINE_SIZE == 0);
 BUILD_ASSERT(offsetof(struct kthread, timer_lock) % CACHE_LINE_SIZE == 0);
 BUILD_ASSERT(offsetof(struct kthread, storage_q) % CACHE_LINE_SIZE == 0);
 BUILD_ASSERT(offsetof(struct kthread, directpath_rxq) % CACHE_LINE_SIZE == 0);
@@ -469,6 +661,8 @@ extern struct kthread *ks[NCPU];
 extern bool cfg_prio_is_lc;
 extern uint64_t cfg_ht_punish_us;
 extern uint64_t cfg_qdelay_us;
+extern uint64_t cfg_coop_preempt_us;
+extern uint64_t cfg_quantum_us;
 
 extern void kthread_park(bool voluntary);
 extern void kthread_wait_to_attach(void);
@@ -476,7 +670,10 @@ extern void kthread_wait_to_attach(void);
 struct cpu_record {
 	struct kthread *recent_kthread;
 	unsigned long sibling_core;
-	unsigned long pad[6];
+	unsigned int llc_id;
+	unsigned int package;
+	unsigned int numa_node;
+	unsigned long pad[4];
 };
 
 BUILD_ASSERT(sizeof(struct cpu_record) == CACHE_LINE_SIZE);
@@ -493,6 +690,46 @@ extern int preferred_socket;
  */
 #define STAT(counter) (myk()->stats[STAT_ ## counter])
 
+extern ssize_t stat_write_buf(char *buf, size_t len);
+extern size_t stat_page_len(const char *buf, size_t len, size_t max);
+
+
+/*
+ * RCU support
+ */
+
+extern unsigned long rcu_gp_seq;
+extern void rcu_report_qs(struct kthread *k);
+
+/**
+ * rcu_qs_pending - returns true if a grace period is waiting on a kthread
+ * @k: the kthread
+ */
+static inline bool rcu_qs_pending(struct kthread *k)
+{
+	return ACCESS_ONCE(rcu_gp_seq) != ACCESS_ONCE(k->rcu_qs_seq);
+}
+
+/**
+ * rcu_note_qs - tells RCU that a kthread is passing through a quiescent state
+ * @k: the kthread (its RCU generation must be even)
+ *
+ * Must not be called with the kthread lock held.
+ */
+static inline void rcu_note_qs(struct kthread *k)
+{
+	if (unlikely(rcu_qs_pending(k)))
+		rcu_report_qs(k);
+}
+
+
+/*
+ * Lock statistics support
+ */
+
+DECLARE_SPINLOCK(lock_stats_lock);
+extern struct list_head lock_stats_list;
+
 
 /*
  * Softirq support
@@ -544,6 +781,17 @@ struct net_driver_ops {
 };
 
 extern struct net_driver_ops net_ops;
+extern bool cfg_tso_enabled;
+extern bool cfg_gro_enabled;
+extern size_t cfg_tcp_zc_len;
+
+/* TCP congestion control algorithms */
+enum {
+	TCP_CC_RENO = 0,
+	TCP_CC_DCTCP,
+};
+
+extern int cfg_tcp_cc;
 
 #ifdef DIRECTPATH
 
@@ -607,6 +855,9 @@ void register_cfg_init_##c (void)				\
  * Init
  */
 
+/* returns partial batches of items freed to other NUMA nodes */
+extern void smalloc_flush_remote(void);
+
 /* per-thread initialization */
 extern int kthread_init_thread(void);
 extern int ioqueues_init_thread(void);
@@ -616,6 +867,7 @@ extern int sched_init_thread(void);
 extern int stat_init_thread(void);
 extern int net_init_thread(void);
 extern int smalloc_init_thread(void);
+extern int arenas_init_thread(void);
 extern int storage_init_thread(void);
 extern int directpath_init_thread(void);
 
@@ -630,6 +882,7 @@ extern int udp_init(void);
 extern int arp_init(void);
 extern int trans_init(void);
 extern int smalloc_init(void);
+extern int arenas_init(void);
 extern int storage_init(void);
 extern int directpath_init(void);
 #ifdef GC
@@ -640,7 +893,6 @@ extern int gc_init(void);
 extern int ioqueues_register_iokernel(void);
 extern int arp_init_late(void);
 extern int stat_init_late(void);
-extern int tcp_init_late(void);
 extern int rcu_init_late(void);
 extern int directpath_init_late(void);
 
@@ -51,7 +51,7 @@ void gc_kthread_report(struct kthread *k)
 	avail = load_acquire(&k->rq_head) - k->rq_tail;
 
 	for (i = 0; i < avail; i++) {
-		th = k->rq[k->rq_tail++ % RUNTIME_RQ_SIZE];
+		th = k->rq->slots[k->rq_tail++ & k->rq->mask];
 		list_add_tail(&paused_uthreads, &th->link);
 	}
 
@@ -64,6 +64,10 @@ void gc_kthread_report(struct kthread *k)
 		list_add_tail(&paused_uthreads, &th->link);
 	}
 
+	/* low priority threads aren't counted in the exported queue */
+	list_append_list(&paused_uthreads, &k->rq_low);
+	ACCESS_ONCE(k->rq_low_cnt) = 0;
+
 	ACCESS_ONCE(k->q_ptrs->rq_tail) += avail;
 	k->local_gc_gen = gc_gen;
 	bitmap_atomic_set(gc_kthread_reports, k->kthread_idx);
@@ -165,7 +169,7 @@ void gc_discover_all_stacks(stack_bounds_cb discover_cb)
 				top = (uint64_t)&th;
 			else
 				discover_cb(sizeof(th->tf) + (uintptr_t)&th->tf, (uintptr_t)&th->tf); // scan trapframes also
-			discover_cb((uintptr_t)&th->stack->usable[STACK_PTR_SIZE], top);
+			discover_cb((uintptr_t)stack_top(th->stack, th->stack_class), top);
 		}
 		spin_unlock(&all_threads[i].lock);
 	}
@@ -36,6 +36,7 @@ static const struct init_entry global_init_handlers[] = {
 	GLOBAL_INITIALIZER(sched),
 	GLOBAL_INITIALIZER(preempt),
 	GLOBAL_INITIALIZER(smalloc),
+	GLOBAL_INITIALIZER(arenas),
 
 	/* network stack */
 	GLOBAL_INITIALIZER(net),
@@ -64,6 +65,7 @@ static const struct init_entry thread_init_handlers[] = {
 	THREAD_INITIALIZER(sched),
 	THREAD_INITIALIZER(timer),
 	THREAD_INITIALIZER(smalloc),
+	THREAD_INITIALIZER(arenas),
 
 	/* network stack */
 	THREAD_INITIALIZER(net),
@@ -80,7 +82,6 @@ static const struct init_entry late_init_handlers[] = {
 	/* network stack */
 	LATE_INITIALIZER(arp),
 	LATE_INITIALIZER(stat),
-	LATE_INITIALIZER(tcp),
 	LATE_INITIALIZER(rcu),
 	LATE_INITIALIZER(directpath),
 };
@@ -38,10 +38,20 @@ static size_t calculate_egress_pool_size(void)
 			PGSIZE_2MB);
 }
 
+/* TSO buffers hold up to 64 KB super-segments, a few per kthread */
+static size_t calculate_tso_pool_size(void)
+{
+	if (!cfg_tso_enabled)
+		return 0;
+	return align_up(NET_TSO_BUFS_PER_KTHREAD * NET_TSO_BUF_LEN * maxks,
+			PGSIZE_2MB);
+}
+
 struct iokernel_control iok;
 bool cfg_prio_is_lc;
 uint64_t cfg_ht_punish_us;
 uint64_t cfg_qdelay_us = 10;
+uint64_t cfg_coop_preempt_us;
 
 static int generate_random_mac(struct eth_addr *mac)
 {
@@ -101,6 +111,8 @@ static size_t estimate_shm_space(void)
 	BUILD_ASSERT(PGSIZE_2MB % MBUF_DEFAULT_LEN == 0);
 	ret += calculate_egress_pool_size();
 	ret = align_up(ret, PGSIZE_2MB);
+	ret += calculate_tso_pool_size();
+	ret += align_up(cfg_tcp_zc_len, PGSIZE_2MB);
 
 #ifdef DIRECTPATH
 	// mlx5 directpath
@@ -217,8 +229,17 @@ int ioqueues_init(void)
 		ts->rxq.wb = ts->q_ptrs;
 	}
 
+	/*
+	 * TSO buffers and then memory for zero-copy sends directly follow the
+	 * regular egress buffers, so directpath can register them all at once.
+	 */
 	iok.tx_len = calculate_egress_pool_size();
-	iok.tx_buf = iok_shm_alloc(iok.tx_len, PGSIZE_2MB, NULL);
+	iok.tso_len = calculate_tso_pool_size();
+	iok.zc_len = align_up(cfg_tcp_zc_len, PGSIZE_2MB);
+	iok.tx_buf = iok_shm_alloc(iok.tx_len + iok.tso_len + iok.zc_len,
+				   PGSIZE_2MB, NULL);
+	iok.tso_buf = (char *)iok.tx_buf + iok.tx_len;
+	iok.zc_buf = (char *)iok.tso_buf + iok.tso_len;
 
 	return 0;
 }
@@ -254,6 +275,7 @@ int ioqueues_register_iokernel(void)
 				  SCHED_PRIO_LC : SCHED_PRIO_BE;
 	hdr->sched_cfg.ht_punish_us = cfg_ht_punish_us;
 	hdr->sched_cfg.qdelay_us = cfg_qdelay_us;
+	hdr->sched_cfg.coop_preempt_us = cfg_coop_preempt_us;
 	hdr->sched_cfg.max_cores = maxks;
 	hdr->sched_cfg.guaranteed_cores = guaranteedks;
 	hdr->sched_cfg.preferred_socket = preferred_socket;
@@ -320,6 +342,7 @@ int ioqueues_init_thread(void)
 	myk()->q_ptrs = (struct q_ptrs *) shmptr_to_ptr(r, ts->q_ptrs,
 			sizeof(uint32_t));
 	BUG_ON(!myk()->q_ptrs);
+	preempt_cede_req = &myk()->q_ptrs->cede_req_tsc;
 
 	return 0;
 }
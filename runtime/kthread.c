@@ -54,9 +54,11 @@ static struct kthread *allock(void)
 	memset(k, 0, sizeof(*k));
 	spin_lock_init(&k->lock);
 	list_head_init(&k->rq_overflow);
+	list_head_init(&k->rq_low);
 	mbufq_init(&k->txpktq_overflow);
 	mbufq_init(&k->txcmdq_overflow);
 	spin_lock_init(&k->timer_lock);
+	k->mailbox = MAILBOX_CLOSED;
 	return k;
 }
 
@@ -82,6 +84,15 @@ int kthread_init_thread(void)
 	return 0;
 }
 
+/* records the core a kthread was just given and the NUMA node it sits on */
+static void kthread_set_curr_cpu(struct kthread *k, unsigned int cpu)
+{
+	unsigned int node = cpu_map[cpu].numa_node;
+
+	k->curr_cpu = cpu;
+	thread_numa_node = node < numa_count ? node : 0;
+}
+
 /*
  * kthread_yield_to_iokernel - block until iokernel wakes us up
  */
@@ -89,8 +100,16 @@ static __always_inline void kthread_yield_to_iokernel(void)
 {
 	struct kthread *k = myk();
 	uint64_t last_core = k->curr_cpu;
+	uint64_t req_tsc;
 	ssize_t s;
 
+	/* track how long the iokernel waited for the core */
+	req_tsc = ACCESS_ONCE(k->q_ptrs->cede_req_tsc);
+	if (req_tsc) {
+		STAT(CEDE_REQS)++;
+		STAT(CEDE_REQ_CYCLES) += rdtsc() - req_tsc;
+	}
+
 	clear_preempt_cede_needed();
 
 	/* yield to the iokernel */
@@ -101,7 +120,7 @@ static __always_inline void kthread_yield_to_iokernel(void)
 		s = ioctl(ksched_fd, KSCHED_IOC_PARK, 0);
 	}
 
-	k->curr_cpu = s;
+	kthread_set_curr_cpu(k, s);
 	if (k->curr_cpu != last_core)
 		STAT(CORE_MIGRATIONS)++;
 	store_release(&cpu_map[s].recent_kthread, k);
@@ -218,6 +237,7 @@ void kthread_park(bool voluntary)
 	}
 
 	flows_notify_parking(voluntary);
+	smalloc_flush_remote();
 
 	STAT(PARKS)++;
 
@@ -243,7 +263,7 @@ void kthread_wait_to_attach(void)
 	s = ioctl(ksched_fd, KSCHED_IOC_START, 0);
 	BUG_ON(s < 0);
 
-	k->curr_cpu = s;
+	kthread_set_curr_cpu(k, s);
 	store_release(&cpu_map[s].recent_kthread, k);
 
 	/* attach the kthread for the first time */
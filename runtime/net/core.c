@@ -28,6 +28,12 @@ struct mempool net_tx_buf_mp;
 static struct tcache *net_tx_buf_tcache;
 static DEFINE_PERTHREAD(struct tcache_perthread, net_tx_buf_pt);
 
+/* TX buffer allocation for TSO super-segments */
+bool cfg_tso_enabled;
+static struct mempool net_tx_tso_mp;
+static struct tcache *net_tx_tso_tcache;
+static DEFINE_PERTHREAD(struct tcache_perthread, net_tx_tso_pt);
+
 
 /*
  * RX Networking Functions
@@ -136,7 +142,7 @@ void net_error(struct mbuf *m, int err)
 		trans_error(m, err);
 }
 
-static void net_rx_one(struct mbuf *m)
+static void net_rx_one(struct mbuf *m, struct net_gro *gro)
 {
 	const struct eth_hdr *llhdr;
 	const struct ip_hdr *iphdr;
@@ -195,8 +201,13 @@ static void net_rx_one(struct mbuf *m)
 		net_rx_icmp(m, iphdr, len);
 		break;
 
-	case IPPROTO_UDP:
 	case IPPROTO_TCP:
+		if (gro) {
+			net_gro_receive(gro, m);
+			break;
+		}
+		/* fallthrough */
+	case IPPROTO_UDP:
 		net_rx_trans(m);
 		break;
 
@@ -217,23 +228,39 @@ drop:
  */
 void net_rx_batch(struct mbuf **ms, unsigned int nr)
 {
+	struct net_gro gro, *grop = NULL;
 	int i;
 
+	if (cfg_gro_enabled && nr > 1) {
+		net_gro_init(&gro);
+		grop = &gro;
+	}
+
 	for (i = 0; i < nr; i++) {
 		if (i + RX_PREFETCH_STRIDE < nr)
 			prefetch(ms[i + RX_PREFETCH_STRIDE]->data);
-		net_rx_one(ms[i]);
+		net_rx_one(ms[i], grop);
 	}
+
+	if (grop)
+		net_gro_flush(grop);
 }
 
 static void iokernel_softirq_poll(struct kthread *k)
 {
 	struct rx_net_hdr *hdr;
-	struct mbuf *m;
+	struct mbuf *m, *ms[RUNTIME_RX_BATCH_SIZE];
 	uint64_t cmd;
 	unsigned long payload;
+	unsigned int nr = 0;
 
 	while (true) {
+		/* hand packets over in batches so GRO can coalesce them */
+		if (nr == RUNTIME_RX_BATCH_SIZE) {
+			net_rx_batch(ms, nr);
+			nr = 0;
+		}
+
 		if (!lrpc_recv(&k->rxq, &cmd, &payload))
 			break;
 
@@ -247,7 +274,7 @@ static void iokernel_softirq_poll(struct kthread *k)
 				STAT(DROPS)++;
 				continue;
 			}
-			net_rx_one(m);
+			ms[nr++] = m;
 			break;
 
 		case RX_NET_COMPLETE:
@@ -258,6 +285,9 @@ static void iokernel_softirq_poll(struct kthread *k)
 			panic("net: invalid RXQ cmd '%ld'", cmd);
 		}
 	}
+
+	if (nr)
+		net_rx_batch(ms, nr);
 }
 
 static void iokernel_softirq(void *arg)
@@ -287,7 +317,11 @@ static void iokernel_softirq(void *arg)
 void net_tx_release_mbuf(struct mbuf *m)
 {
 	preempt_disable();
-	tcache_free(&perthread_get(net_tx_buf_pt), m);
+	if (unlikely((uintptr_t)m - (uintptr_t)net_tx_tso_mp.buf <
+		     net_tx_tso_mp.len))
+		tcache_free(&perthread_get(net_tx_tso_pt), m);
+	else
+		tcache_free(&perthread_get(net_tx_buf_pt), m);
 	preempt_enable();
 }
 
@@ -314,6 +348,42 @@ struct mbuf *net_tx_alloc_mbuf(void)
 	mbuf_init(m, buf, net_get_mtu(), MBUF_DEFAULT_HEADROOM);
 	m->csum_type = CHECKSUM_TYPE_NEEDED;
 	m->txflags = 0;
+	m->tso_mss = 0;
+	m->zc_len = 0;
+	m->release_data = 0;
+	m->release = net_tx_release_mbuf;
+	return m;
+}
+
+/**
+ * net_tx_alloc_mbuf_tso - allocates an mbuf for a TSO super-segment
+ * @mss: the size of the segments the NIC should cut the payload into
+ *
+ * The mbuf can hold up to NET_TSO_MAX_LEN bytes of payload. It should be
+ * transmitted with OLFLAG_TCP_TSO set in m->txflags.
+ *
+ * Returns an mbuf, or NULL if TSO is disabled or out of memory.
+ */
+struct mbuf *net_tx_alloc_mbuf_tso(unsigned int mss)
+{
+	struct mbuf *m;
+	unsigned char *buf;
+
+	if (!cfg_tso_enabled)
+		return NULL;
+
+	preempt_disable();
+	m = tcache_alloc(&perthread_get(net_tx_tso_pt));
+	preempt_enable();
+	if (unlikely(!m))
+		return NULL;
+
+	buf = (unsigned char *)m + MBUF_HEAD_LEN;
+	mbuf_init(m, buf, NET_TSO_MAX_LEN, MBUF_DEFAULT_HEADROOM);
+	m->csum_type = CHECKSUM_TYPE_NEEDED;
+	m->txflags = 0;
+	m->tso_mss = mss;
+	m->zc_len = 0;
 	m->release_data = 0;
 	m->release = net_tx_release_mbuf;
 	return m;
@@ -350,6 +420,13 @@ static int net_tx_iokernel(struct mbuf *m)
 	hdr->completion_data = (unsigned long)m;
 	hdr->len = len;
 	hdr->olflags = m->txflags;
+	hdr->tso_mss = m->tso_mss;
+	if (m->zc_len) {
+		hdr->olflags |= OLFLAG_ZC;
+		hdr->zc_payload = ptr_to_shmptr(&netcfg.tx_region,
+				(void *)m->zc_payload, m->zc_len);
+		hdr->zc_len = m->zc_len;
+	}
 	shmptr_t shm = ptr_to_shmptr(&netcfg.tx_region, hdr, len + sizeof(*hdr));
 
 	if (unlikely(!lrpc_send(&k->txpktq, TXPKT_NET_XMIT, shm))) {
@@ -371,7 +448,7 @@ static void net_tx_raw(struct mbuf *m)
 		net_tx_drain_overflow();
 
 	STAT(TX_PACKETS)++;
-	STAT(TX_BYTES) += len;
+	STAT(TX_BYTES) += len + m->zc_len;
 
 	if (unlikely(net_ops.tx_single(m))) {
 		mbufq_push_tail(&k->txpktq_overflow, m);
@@ -411,8 +488,10 @@ static void net_push_iphdr(struct mbuf *m, uint8_t proto, uint32_t daddr)
 	iphdr = mbuf_push_hdr(m, *iphdr);
 	iphdr->version = IPVERSION;
 	iphdr->header_len = 5;
-	iphdr->tos = IPTOS_DSCP_CS0 | IPTOS_ECN_NOTECT;
-	iphdr->len = hton16(mbuf_length(m));
+	iphdr->tos = IPTOS_DSCP_CS0 | ((m->txflags & NET_TXFLAG_ECT) ?
+				       IPTOS_ECN_ECT0 : IPTOS_ECN_NOTECT);
+	m->txflags &= ~NET_TXFLAG_ECT;
+	iphdr->len = hton16(mbuf_length(m) + m->zc_len);
 	iphdr->id = 0; /* see RFC 6864 */
 	iphdr->off = hton16(IP_DF);
 	iphdr->ttl = 64;
@@ -568,12 +647,17 @@ int net_init_thread(void)
 	struct kthread *k = myk();
 	thread_t *th;
 
-	th = thread_create(iokernel_softirq, k);
+	th = thread_create_with_stack_size(iokernel_softirq, k,
+					   RUNTIME_STACK_SIZE);
 	if (!th)
 		return -ENOMEM;
 
 	k->iokernel_softirq = th;
 	tcache_init_perthread(net_tx_buf_tcache, &perthread_get(net_tx_buf_pt));
+	if (cfg_tso_enabled) {
+		tcache_init_perthread(net_tx_tso_tcache,
+				      &perthread_get(net_tx_tso_pt));
+	}
 	return 0;
 }
 
@@ -636,6 +720,18 @@ int net_init(void)
 	if (!net_tx_buf_tcache)
 		return -ENOMEM;
 
+	if (cfg_tso_enabled) {
+		ret = mempool_create(&net_tx_tso_mp, iok.tso_buf, iok.tso_len,
+				     PGSIZE_2MB, NET_TSO_BUF_LEN);
+		if (ret)
+			return ret;
+
+		net_tx_tso_tcache = mempool_create_tcache(&net_tx_tso_mp,
+			"runtime_tx_tso_bufs", TCACHE_DEFAULT_MAG_SIZE);
+		if (!net_tx_tso_tcache)
+			return -ENOMEM;
+	}
+
 	log_info("net: started network stack");
 	net_dump_config();
 
@@ -31,9 +31,36 @@ extern void net_rx_arp(struct mbuf *m);
 extern void net_rx_icmp(struct mbuf *m, const struct ip_hdr *iphdr,
 			uint16_t len);
 extern void net_rx_trans(struct mbuf *m);
+extern void net_rx_trans_chain(struct mbuf *m);
 extern void tcp_rx_closed(struct mbuf *m);
 void net_rx_batch(struct mbuf **ms, unsigned int nr);
 
+/* the most TCP flows GRO can hold segments for at once */
+#define NET_GRO_MAX_FLOWS	8
+
+struct net_gro_flow {
+	uint32_t	saddr, daddr;	/* network byte order */
+	uint16_t	sport, dport;	/* network byte order */
+	uint32_t	ack;		/* network byte order */
+	uint32_t	seq_end;	/* the next in-order sequence number */
+	uint32_t	hdr_len;	/* the TCP header length, with options */
+	struct mbuf	*head, *tail;	/* the held segments */
+};
+
+/* per-batch state for generic receive offload (GRO) */
+struct net_gro {
+	int			nr;
+	struct net_gro_flow	flows[NET_GRO_MAX_FLOWS];
+};
+
+static inline void net_gro_init(struct net_gro *gro)
+{
+	gro->nr = 0;
+}
+
+extern void net_gro_receive(struct net_gro *gro, struct mbuf *m);
+extern void net_gro_flush(struct net_gro *gro);
+
 
 /*
  * TX Networking Functions
@@ -42,9 +69,19 @@ void net_rx_batch(struct mbuf **ms, unsigned int nr);
 /* the size of the region before a buffer to store struct mbuf */
 #define MBUF_HEAD_LEN (align_up(sizeof(struct mbuf), CACHE_LINE_SIZE))
 
+/* TSO super-segment buffers (the whole frame must fit in 16 bits) */
+#define NET_TSO_BUF_LEN		(64 * 1024)
+#define NET_TSO_BUFS_PER_KTHREAD 32
+#define NET_TSO_MAX_LEN \
+	(NET_TSO_BUF_LEN - MBUF_HEAD_LEN - MBUF_DEFAULT_HEADROOM)
+
+/* marks an egress IP packet ECN-capable, consumed before the NIC sees it */
+#define NET_TXFLAG_ECT		BIT(31)
+
 extern int arp_lookup(uint32_t daddr, struct eth_addr *dhost_out,
 		      struct mbuf *m) __must_use_return;
 extern struct mbuf *net_tx_alloc_mbuf(void);
+extern struct mbuf *net_tx_alloc_mbuf_tso(unsigned int mss);
 extern void net_tx_release_mbuf(struct mbuf *m);
 extern void net_tx_eth(struct mbuf *m, uint16_t proto,
 		       struct eth_addr dhost);
@@ -100,6 +137,8 @@ struct trans_entry;
 struct trans_ops {
 	/* receive an ingress packet */
 	void (*recv) (struct trans_entry *e, struct mbuf *m);
+	/* receive a chain of packets coalesced by GRO (optional) */
+	void (*recv_chain) (struct trans_entry *e, struct mbuf *m);
 	/* propagate a network error */
 	void (*err) (struct trans_entry *e, int err);
 };
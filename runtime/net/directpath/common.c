@@ -129,7 +129,8 @@ int directpath_init_thread(void)
 	if (!cfg_directpath_enabled)
 		return 0;
 
-	th = thread_create(directpath_softirq, k);
+	th = thread_create_with_stack_size(directpath_softirq, k,
+					   RUNTIME_STACK_SIZE);
 	if (!th)
 		return -ENOMEM;
 
@@ -39,8 +39,10 @@ struct mlx5_txq {
 
 	/* direct verbs qp */
 	struct mbuf **buffers; // pending DMA
+	uint8_t *wqe_bbs; // WQEBBs used by the WQE at each index (0 if none)
 	struct mlx5dv_qp tx_qp_dv;
 	uint32_t sq_head;
+	uint32_t sq_tail;
 	uint32_t tx_sq_log_stride;
 
 	/* direct verbs cq */
@@ -54,9 +56,20 @@ struct mlx5_txq {
 
 } __aligned(CACHE_LINE_SIZE);
 
+/* set in mlx5_txq.wqe_bbs when a slot no longer holds the regular template */
+#define MLX5_WQE_DIRTY	0x80
+
+/* the largest header a TSO WQE can inline and still fit in two WQEBBs */
+#define MLX5_TSO_MAX_HDR \
+	(2 * MLX5_SEND_WQE_BB - sizeof(struct mlx5_wqe_ctrl_seg) - \
+	 offsetof(struct mlx5_wqe_eth_seg, inline_hdr_start) - \
+	 sizeof(struct mlx5_wqe_data_seg))
+
 extern struct mlx5_rxq rxqs[NCPU];
 extern struct ibv_context *context;
+extern struct ibv_mr *mr_tx;
 
+extern void mlx5_init_tx_segment(struct mlx5_txq *v, unsigned int idx);
 extern int mlx5_transmit_one(struct mbuf *m);
 extern int mlx5_gather_rx(struct hardware_q *rxq, struct mbuf **ms, unsigned int budget);
 extern int mlx5_steer_flows(unsigned int *new_fg_assignment);
@@ -67,7 +80,7 @@ extern uint32_t mlx5_get_flow_affinity(uint8_t ipproto,
 
 static inline unsigned int nr_inflight_tx(struct mlx5_txq *v)
 {
-	return v->sq_head - v->cq_head;
+	return v->sq_head - v->sq_tail;
 }
 
 /*
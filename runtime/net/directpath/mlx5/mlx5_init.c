@@ -73,7 +73,12 @@ ibv_device_to_pci_addr(const struct ibv_device *device,
 	return 0;
 }
 
-static void mlx5_init_tx_segment(struct mlx5_txq *v, unsigned int idx)
+/*
+ * mlx5_init_tx_segment - writes the fields shared by all regular send WQEs
+ * @v: the TX queue
+ * @idx: the WQE index
+ */
+void mlx5_init_tx_segment(struct mlx5_txq *v, unsigned int idx)
 {
 	int size;
 	struct mlx5_wqe_ctrl_seg *ctrl;
@@ -295,6 +300,10 @@ static int mlx5_init_txq(int index, struct mlx5_txq *v)
 	struct mlx5dv_qp_init_attr dv_qp_attr = {
 		.comp_mask = 0,
 	};
+	if (cfg_tso_enabled) {
+		qp_init_attr.comp_mask |= IBV_QP_INIT_ATTR_MAX_TSO_HEADER;
+		qp_init_attr.max_tso_header = MLX5_TSO_MAX_HDR;
+	}
 	v->tx_qp = mlx5dv_create_qp(context, &qp_init_attr, &dv_qp_attr);
 	if (!v->tx_qp)
 		return -errno;
@@ -344,8 +353,15 @@ static int mlx5_init_txq(int index, struct mlx5_txq *v)
 	if (!v->buffers)
 		return -ENOMEM;
 
-	for (i = 0; i < v->tx_qp_dv.sq.wqe_cnt; i++)
+	v->wqe_bbs = aligned_alloc(CACHE_LINE_SIZE,
+			align_up(v->tx_qp_dv.sq.wqe_cnt, CACHE_LINE_SIZE));
+	if (!v->wqe_bbs)
+		return -ENOMEM;
+
+	for (i = 0; i < v->tx_qp_dv.sq.wqe_cnt; i++) {
 		mlx5_init_tx_segment(v, i);
+		v->wqe_bbs[i] = 1;
+	}
 
 	return 0;
 }
@@ -428,7 +444,8 @@ int mlx5_init(struct hardware_q **rxq_out, struct direct_txq **txq_out,
 	}
 
 	/* Register memory for TX buffers */
-	mr_tx = ibv_reg_mr(pd, net_tx_buf_mp.buf, net_tx_buf_mp.len, IBV_ACCESS_LOCAL_WRITE);
+	mr_tx = ibv_reg_mr(pd, iok.tx_buf, iok.tx_len + iok.tso_len + iok.zc_len,
+			   IBV_ACCESS_LOCAL_WRITE);
 	if (!mr_tx) {
 		log_err("mlx5_init: Couldn't register mr");
 		return -1;
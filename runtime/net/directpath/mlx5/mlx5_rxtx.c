@@ -1,5 +1,8 @@
 
+#include <string.h>
+
 #include <base/log.h>
+#include <net/tcp.h>
 #include <runtime/preempt.h>
 
 #ifdef DIRECTPATH
@@ -78,6 +81,7 @@ static int mlx5_gather_completions(struct mbuf **mbufs, struct mlx5_txq *v, unsi
 
 		wqe_idx = be16toh(cqe->wqe_counter) & (v->tx_qp_dv.sq.wqe_cnt - 1);
 		mbufs[compl_cnt] = load_acquire(&v->buffers[wqe_idx]);
+		v->sq_tail += v->wqe_bbs[wqe_idx] & ~MLX5_WQE_DIRTY;
 	}
 
 	cq->dbrec[0] = htobe32(v->cq_head & 0xffffff);
@@ -85,6 +89,67 @@ static int mlx5_gather_completions(struct mbuf **mbufs, struct mlx5_txq *v, unsi
 	return compl_cnt;
 }
 
+/*
+ * mlx5_post_tso - writes an LSO WQE for a TSO super-segment
+ * @v: the TX queue
+ * @m: the mbuf to send (starting at the ethernet header)
+ *
+ * The NIC needs the packet headers inlined in the WQE, which then takes two
+ * WQEBBs. The WQE is built on the stack because its second half may wrap
+ * around to the start of the send queue.
+ *
+ * Returns the index of the first WQEBB.
+ */
+static uint32_t mlx5_post_tso(struct mlx5_txq *v, struct mbuf *m)
+{
+	unsigned char wqe[2 * MLX5_SEND_WQE_BB] __aligned(16);
+	struct mlx5_wqe_ctrl_seg *ctrl = (struct mlx5_wqe_ctrl_seg *)wqe;
+	struct mlx5_wqe_eth_seg *eseg = (void *)(ctrl + 1);
+	struct mlx5_wqe_data_seg *dpseg;
+	struct tcp_hdr *tcphdr = (struct tcp_hdr *)mbuf_transport_offset(m);
+	uint32_t mask = v->tx_qp_dv.sq.wqe_cnt - 1;
+	uint32_t idx = v->sq_head & mask;
+	uint32_t hdr_len, ds;
+
+	hdr_len = mbuf_transport_offset(m) - mbuf_data(m) +
+		  tcphdr->off * sizeof(uint32_t);
+	BUG_ON(hdr_len > MLX5_TSO_MAX_HDR);
+
+	memset(wqe, 0, sizeof(wqe));
+	eseg->cs_flags = MLX5_ETH_WQE_L3_CSUM | MLX5_ETH_WQE_L4_CSUM;
+	eseg->mss = htobe16(m->tso_mss);
+	eseg->inline_hdr_sz = htobe16(hdr_len);
+	memcpy(eseg->inline_hdr_start, mbuf_data(m), hdr_len);
+
+	dpseg = (void *)(wqe + align_up(sizeof(*ctrl) +
+		offsetof(struct mlx5_wqe_eth_seg, inline_hdr_start) + hdr_len,
+		sizeof(*dpseg)));
+	dpseg->lkey = htobe32(mr_tx->lkey);
+	if (m->zc_len) {
+		dpseg->byte_count = htobe32(m->zc_len);
+		dpseg->addr = htobe64((uint64_t)m->zc_payload);
+	} else {
+		dpseg->byte_count = htobe32(mbuf_length(m) - hdr_len);
+		dpseg->addr = htobe64((uint64_t)mbuf_data(m) + hdr_len);
+	}
+
+	ds = ((unsigned char *)(dpseg + 1) - wqe) / sizeof(*dpseg);
+	ctrl->opmod_idx_opcode = htobe32(((v->sq_head & 0xffff) << 8) |
+					 MLX5_OPCODE_TSO);
+	ctrl->qpn_ds = htobe32(ds | (v->tx_qp->qp_num << 8));
+	ctrl->fm_ce_se = MLX5_WQE_CTRL_CQ_UPDATE;
+
+	memcpy(v->tx_qp_dv.sq.buf + (idx << v->tx_sq_log_stride), wqe,
+	       MLX5_SEND_WQE_BB);
+	memcpy(v->tx_qp_dv.sq.buf + (((idx + 1) & mask) << v->tx_sq_log_stride),
+	       wqe + MLX5_SEND_WQE_BB, MLX5_SEND_WQE_BB);
+
+	/* both slots must be rewritten before they hold a regular WQE again */
+	v->wqe_bbs[idx] = 2;
+	v->wqe_bbs[(idx + 1) & mask] = 0;
+	return idx;
+}
+
 /*
  * mlx5_transmit_one - send one mbuf
  * @m: mbuf to send
@@ -101,24 +166,38 @@ int mlx5_transmit_one(struct mbuf *m)
 	struct mlx5_wqe_eth_seg *eseg;
 	struct mlx5_wqe_data_seg *dpseg;
 	void *segment;
-	uint32_t idx;
+	uint32_t idx, nr_bbs;
 	int i, compl = 0;
 
 	k = getk();
 	v = container_of(k->directpath_txq, struct mlx5_txq, txq);
 	idx = v->sq_head & (v->tx_qp_dv.sq.wqe_cnt - 1);
+	nr_bbs = (m->txflags & OLFLAG_TCP_TSO) ? 2 : 1;
 
 	if (nr_inflight_tx(v) >= SQ_CLEAN_THRESH) {
 		compl = mlx5_gather_completions(mbs, v, SQ_CLEAN_MAX);
 		for (i = 0; i < compl; i++)
 			mbuf_free(mbs[i]);
-		if (unlikely(nr_inflight_tx(v) >= v->tx_qp_dv.sq.wqe_cnt)) {
+		if (unlikely(nr_inflight_tx(v) + nr_bbs >
+			     v->tx_qp_dv.sq.wqe_cnt)) {
 			putk();
 			log_warn_ratelimited("txq full");
 			return -1;
 		}
 	}
 
+	if (unlikely(nr_bbs > 1)) {
+		idx = mlx5_post_tso(v, m);
+		ctrl = v->tx_qp_dv.sq.buf + (idx << v->tx_sq_log_stride);
+		goto post;
+	}
+
+	/* restore the slot if a TSO or zero-copy WQE changed it */
+	if (unlikely(v->wqe_bbs[idx] != 1)) {
+		mlx5_init_tx_segment(v, idx);
+		v->wqe_bbs[idx] = 1;
+	}
+
 	segment = v->tx_qp_dv.sq.buf + (idx << v->tx_sq_log_stride);
 	ctrl = segment;
 	eseg = segment + sizeof(*ctrl);
@@ -131,9 +210,20 @@ int mlx5_transmit_one(struct mbuf *m)
 	dpseg->byte_count = htobe32(mbuf_length(m));
 	dpseg->addr = htobe64((uint64_t)mbuf_data(m));
 
+	/* a zero-copy payload goes in a second data segment */
+	if (unlikely(m->zc_len)) {
+		dpseg[1].byte_count = htobe32(m->zc_len);
+		dpseg[1].lkey = htobe32(mr_tx->lkey);
+		dpseg[1].addr = htobe64((uint64_t)m->zc_payload);
+		ctrl->qpn_ds = htobe32((((void *)(dpseg + 2) - segment) / 16) |
+				       (v->tx_qp->qp_num << 8));
+		v->wqe_bbs[idx] = 1 | MLX5_WQE_DIRTY;
+	}
+
+post:
 	/* record buffer */
-	store_release(&v->buffers[v->sq_head & (v->tx_qp_dv.sq.wqe_cnt - 1)], m);
-	v->sq_head++;
+	store_release(&v->buffers[idx], m);
+	v->sq_head += nr_bbs;
 
 	/* write doorbell record */
 	udma_to_device_barrier();
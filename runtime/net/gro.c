@@ -0,0 +1,135 @@
+/*
+ * gro.c - generic receive offload for ingress TCP segments
+ *
+ * Within one RX batch, back-to-back in-order data segments of the same TCP
+ * flow are linked together through mbuf->next and handed to the transport
+ * layer as a single delivery. The connection then takes its lock, updates
+ * its window and wakes its reader once per flow rather than once per segment.
+ * Payloads are never copied; each segment keeps its own mbuf.
+ */
+
+#include <base/stddef.h>
+#include <net/ip.h>
+#include <net/tcp.h>
+
+#include "defs.h"
+
+/* the only flags a segment may carry to be coalesced */
+#define GRO_FLAGS	(TCP_ACK | TCP_PUSH)
+
+bool cfg_gro_enabled = true;
+
+static void net_gro_flush_flow(struct net_gro *gro, struct net_gro_flow *f)
+{
+	struct mbuf *m = f->head;
+
+	/* keep the table dense, flow order doesn't matter across flows */
+	*f = gro->flows[--gro->nr];
+
+	if (!m->next) {
+		net_rx_trans(m);
+		return;
+	}
+
+	STAT(RX_GRO_CHAINS)++;
+	net_rx_trans_chain(m);
+}
+
+static struct net_gro_flow *net_gro_find(struct net_gro *gro,
+					 const struct ip_hdr *iphdr,
+					 const struct tcp_hdr *tcphdr)
+{
+	struct net_gro_flow *f;
+	int i;
+
+	for (i = 0; i < gro->nr; i++) {
+		f = &gro->flows[i];
+		if (f->saddr == iphdr->saddr && f->daddr == iphdr->daddr &&
+		    f->sport == tcphdr->sport && f->dport == tcphdr->dport)
+			return f;
+	}
+
+	return NULL;
+}
+
+/**
+ * net_gro_receive - passes an ingress TCP segment through GRO
+ * @gro: the GRO state for the current RX batch
+ * @m: the segment, with its data pointing at the TCP header
+ *
+ * The segment is either held so later segments of its flow can join it or
+ * delivered right away. Held segments are delivered by net_gro_flush().
+ */
+void net_gro_receive(struct net_gro *gro, struct mbuf *m)
+{
+	const struct ip_hdr *iphdr = mbuf_network_hdr(m, *iphdr);
+	const struct tcp_hdr *tcphdr;
+	struct net_gro_flow *f;
+	uint32_t hdr_len, seq, len;
+	bool candidate;
+
+	tcphdr = (const struct tcp_hdr *)mbuf_data(m);
+	if (unlikely(mbuf_length(m) < sizeof(*tcphdr))) {
+		net_rx_trans(m);
+		return;
+	}
+
+	/*
+	 * Only plain data segments with well-formed headers are coalesced. CE
+	 * marked ones are left alone so ECN feedback stays per segment.
+	 */
+	hdr_len = tcphdr->off * sizeof(uint32_t);
+	candidate = (tcphdr->flags & ~GRO_FLAGS) == 0 &&
+		    (iphdr->tos & IPTOS_ECN_MASK) != IPTOS_ECN_CE &&
+		    (tcphdr->flags & TCP_ACK) != 0 &&
+		    hdr_len >= sizeof(*tcphdr) && hdr_len < mbuf_length(m);
+	seq = ntoh32(tcphdr->seq);
+	len = mbuf_length(m) - hdr_len;
+
+	f = net_gro_find(gro, iphdr, tcphdr);
+	if (f) {
+		if (candidate && seq == f->seq_end && tcphdr->ack == f->ack &&
+		    hdr_len == f->hdr_len) {
+			STAT(RX_GRO_COALESCED)++;
+			m->next = NULL;
+			f->tail->next = m;
+			f->tail = m;
+			f->seq_end += len;
+			if (tcphdr->flags & TCP_PUSH)
+				net_gro_flush_flow(gro, f);
+			return;
+		}
+
+		/* deliver held segments first to preserve ordering */
+		net_gro_flush_flow(gro, f);
+	}
+
+	if (!candidate || (tcphdr->flags & TCP_PUSH) != 0) {
+		net_rx_trans(m);
+		return;
+	}
+
+	if (gro->nr == NET_GRO_MAX_FLOWS)
+		net_gro_flush_flow(gro, &gro->flows[0]);
+
+	f = &gro->flows[gro->nr++];
+	f->saddr = iphdr->saddr;
+	f->daddr = iphdr->daddr;
+	f->sport = tcphdr->sport;
+	f->dport = tcphdr->dport;
+	f->ack = tcphdr->ack;
+	f->hdr_len = hdr_len;
+	f->seq_end = seq + len;
+	m->next = NULL;
+	f->head = f->tail = m;
+}
+
+/**
+ * net_gro_flush - delivers all segments held by GRO
+ * @gro: the GRO state for the current RX batch
+ */
+void net_gro_flush(struct net_gro *gro)
+{
+	while (gro->nr)
+		net_gro_flush_flow(gro, &gro->flows[gro->nr - 1]);
+}
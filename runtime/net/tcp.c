@@ -14,13 +14,43 @@
 
 #include "tcp.h"
 
-/* protects @tcp_conns */
-static DEFINE_SPINLOCK(tcp_lock);
-/* a list of all TCP connections */
-static LIST_HEAD(tcp_conns);
-
 static void tcp_retransmit(void *arg);
 
+/**
+ * tcp_timer_arm - arms the connection's timer
+ * @c: the TCP connection
+ * @deadline_us: when the timer should fire
+ *
+ * The timer is only moved if @deadline_us is earlier than the deadline it is
+ * armed for. An armed timer that fires early finds nothing to do and arms
+ * itself again for the next timeout.
+ *
+ * WARNING: the caller must hold @c->lock.
+ */
+void tcp_timer_arm(tcpconn_t *c, uint64_t deadline_us)
+{
+	assert_spin_lock_held(&c->lock);
+
+	if (unlikely(c->timer_stopped) || deadline_us >= c->next_timeout)
+		return;
+
+	if (c->next_timeout != -1L)
+		timer_cancel(&c->timer);
+	c->next_timeout = deadline_us;
+	timer_start_coarse(&c->timer, deadline_us);
+
+	/* pairs with tcp_conn_destroy(), which doesn't take @c->lock */
+	mb();
+	if (unlikely(ACCESS_ONCE(c->timer_stopped)))
+		timer_cancel(&c->timer);
+}
+
+/**
+ * tcp_timer_update - arms the connection's timer for its next timeout
+ * @c: the TCP connection
+ *
+ * WARNING: the caller must hold @c->lock.
+ */
 void tcp_timer_update(tcpconn_t *c)
 {
 	uint64_t next_timeout = -1L;
@@ -41,13 +71,13 @@ void tcp_timer_update(tcpconn_t *c)
 	if (!c->tx_exclusive) {
 		m = list_top(&c->txq, struct mbuf, link);
 		if (m)
-			next_timeout = MIN(next_timeout, m->timestamp + TCP_RETRANSMIT_TIMEOUT);
+			next_timeout = MIN(next_timeout, m->timestamp + c->pcb.rto);
 	}
 
 	if (!list_empty(&c->rxq_ooo))
 		next_timeout = MIN(next_timeout, microtime() + TCP_OOQ_ACK_TIMEOUT);
 
-	store_release(&c->next_timeout, next_timeout);
+	tcp_timer_arm(c, next_timeout);
 }
 
 /* check for timeouts in a TCP connection */
@@ -56,6 +86,19 @@ static void tcp_handle_timeouts(tcpconn_t *c, uint64_t now)
 	bool do_ack = false, do_probe = false, do_retransmit = false;
 
 	spin_lock_np(&c->lock);
+	if (unlikely(c->timer_stopped)) {
+		spin_unlock_np(&c->lock);
+		return;
+	}
+
+	/*
+	 * The timer fired, but a lock holder may have armed it again for an
+	 * earlier deadline before we got the lock. Cancel it so that
+	 * tcp_timer_update() below never starts a timer that is still armed.
+	 */
+	timer_cancel(&c->timer);
+	c->next_timeout = -1L;
+
 	if (unlikely(c->pcb.state == TCP_STATE_CLOSED)) {
 		spin_unlock_np(&c->lock);
 		return;
@@ -91,7 +134,7 @@ static void tcp_handle_timeouts(tcpconn_t *c, uint64_t now)
 
 	if (!c->tx_exclusive && !list_empty(&c->txq)) {
 		struct mbuf *m = list_top(&c->txq, struct mbuf, link);
-		if (now - m->timestamp >= TCP_RETRANSMIT_TIMEOUT) {
+		if (now - m->timestamp >= c->pcb.rto) {
 			log_debug("tcp: %p retransmission timeout", c);
 			/* It is safe to take a reference, since state != closed */
 			tcp_conn_get(c);
@@ -113,30 +156,12 @@ static void tcp_handle_timeouts(tcpconn_t *c, uint64_t now)
 		thread_spawn(tcp_retransmit, c);
 }
 
-/* a periodic background thread that handles timeout events */
-static void tcp_worker(void *arg)
+/* the timer handler of a TCP connection (runs in softirq context) */
+static void tcp_conn_timer(unsigned long arg)
 {
-	tcpconn_t *c;
-	uint64_t now;
-
-	while (true) {
-		bool again = false;
-		now = microtime();
-
-		spin_lock_np(&tcp_lock);
-		list_for_each(&tcp_conns, c, global_link) {
-			if (preempt_needed()) {
-				again = true;
-				break;
-			}
-			if (load_acquire(&c->next_timeout) <= now)
-				tcp_handle_timeouts(c, now);
-		}
-		spin_unlock_np(&tcp_lock);
+	tcpconn_t *c = (tcpconn_t *)arg;
 
-		if (!again)
-			timer_sleep(10 * ONE_MS);
-	}
+	tcp_handle_timeouts(c, microtime());
 }
 
 /**
@@ -186,6 +211,7 @@ void tcp_conn_set_state(tcpconn_t *c, int new_state)
 	/* unblock any threads waiting for the connection to be established */
 	if (c->pcb.state < TCP_STATE_ESTABLISHED &&
 	    new_state >= TCP_STATE_ESTABLISHED) {
+		tcp_cc_init(c);
 		waitq_release(&c->tx_wq);
 	}
 
@@ -207,6 +233,7 @@ static void tcp_conn_err(struct trans_entry *e, int err)
 /* operations for TCP sockets */
 static const struct trans_ops tcp_conn_ops = {
 	.recv = tcp_rx_conn,
+	.recv_chain = tcp_rx_conn_chain,
 	.err = tcp_conn_err,
 };
 
@@ -263,8 +290,12 @@ tcpconn_t *tcp_conn_alloc(void)
 	c->tx_pending = NULL;
 	list_head_init(&c->txq);
 	c->do_fast_retransmit = false;
+	c->rto_recovery = false;
+	c->do_rto_resend = false;
 
 	/* timeouts */
+	timer_init(&c->timer, tcp_conn_timer, (unsigned long)c);
+	c->timer_stopped = false;
 	c->next_timeout = -1L;
 	c->ack_delayed = false;
 	c->ack_ts = 0;
@@ -278,6 +309,9 @@ tcpconn_t *tcp_conn_alloc(void)
 	c->pcb.iss = rand_crc32c(0x12345678); /* TODO: not enough */
 	c->pcb.snd_nxt = c->pcb.iss;
 	c->pcb.snd_una = c->pcb.iss;
+	c->pcb.rto = TCP_RTO_INIT;
+	c->pcb.cc = tcp_cc_default();
+	c->pcb.ecn = c->pcb.cc->ecn; /* until negotiated */
 
 	/* initialize ingress PCB */
 	c->winmax = TCP_WIN;
@@ -314,10 +348,6 @@ int tcp_conn_attach(tcpconn_t *c, struct netaddr laddr, struct netaddr raddr)
 	if (ret)
 		return ret;
 
-	spin_lock_np(&tcp_lock);
-	list_add_tail(&tcp_conns, &c->global_link);
-	spin_unlock_np(&tcp_lock);
-
 	c->attach_ts = microtime();
 
 	return 0;
@@ -327,10 +357,6 @@ static void tcp_conn_release(struct rcu_head *h)
 {
 	tcpconn_t *c = container_of(h, tcpconn_t, e.rcu);
 
-	spin_lock_np(&tcp_lock);
-	list_del_from(&tcp_conns, &c->global_link);
-	spin_unlock_np(&tcp_lock);
-
 	if (c->tx_pending)
 		mbuf_free(c->tx_pending);
 	mbuf_list_free(&c->rxq_ooo);
@@ -345,6 +371,15 @@ static void tcp_conn_release(struct rcu_head *h)
  */
 void tcp_conn_destroy(tcpconn_t *c)
 {
+	/*
+	 * The caller may hold @c->lock, so stop the timer without it. A timer
+	 * handler that is already running holds off the RCU grace period (it
+	 * runs with preemption disabled), so it can't outlive @c.
+	 */
+	ACCESS_ONCE(c->timer_stopped) = true;
+	mb();
+	timer_cancel(&c->timer);
+
 	trans_table_remove(&c->e);
 	rcu_free(&c->e.rcu, tcp_conn_release);
 }
@@ -603,9 +638,10 @@ int tcp_dial(struct netaddr laddr, struct netaddr raddr, tcpconn_t **c_out)
 	opts.mss = c->pcb.rcv_mss;
 	opts.wscale = c->pcb.rcv_wscale;
 
-	/* send a SYN to the remote host */
+	/* send a SYN to the remote host, asking for ECN if wanted */
 	spin_lock_np(&c->lock);
-	ret = tcp_tx_ctl(c, TCP_SYN, &opts);
+	ret = tcp_tx_ctl(c, TCP_SYN | (c->pcb.ecn ? TCP_ECE | TCP_CWR : 0),
+			 &opts);
 	if (unlikely(ret)) {
 		spin_unlock_np(&c->lock);
 		tcp_conn_destroy(c);
@@ -708,7 +744,18 @@ struct netaddr tcp_remote_addr(tcpconn_t *c)
 	return c->e.raddr;
 }
 
-static ssize_t tcp_read_wait(tcpconn_t *c, size_t len,
+/* returns back @len bytes of receive window, true if an update is due */
+static bool tcp_read_open_window(tcpconn_t *c, size_t len)
+{
+	assert_spin_lock_held(&c->lock);
+
+	c->pcb.rcv_wnd += len;
+	return wraps_gte(c->pcb.rcv_nxt + c->pcb.rcv_wnd,
+			 c->tx_last_ack + c->tx_last_win + c->winmax / 4);
+}
+
+/* waits for data, or arms @w and returns -EAGAIN instead if @w is set */
+static ssize_t tcp_read_wait(tcpconn_t *c, size_t len, waker_t *w,
 			     struct list_head *q, struct mbuf **mout)
 {
 	struct mbuf *m;
@@ -719,8 +766,14 @@ static ssize_t tcp_read_wait(tcpconn_t *c, size_t len,
 	spin_lock_np(&c->lock);
 
 	/* block until there is an actionable event */
-	while (!c->rx_closed && (c->rx_exclusive || list_empty(&c->rxq)))
+	while (!c->rx_closed && (c->rx_exclusive || list_empty(&c->rxq))) {
+		if (w) {
+			waitq_arm(&c->rx_wq, &c->lock, w);
+			spin_unlock_np(&c->lock);
+			return -EAGAIN;
+		}
 		waitq_wait(&c->rx_wq, &c->lock);
+	}
 
 	/* is the socket closed? */
 	if (c->rx_closed) {
@@ -752,11 +805,7 @@ static ssize_t tcp_read_wait(tcpconn_t *c, size_t len,
 		readlen += mbuf_length(m);
 	}
 
-	c->pcb.rcv_wnd += readlen;
-	if (wraps_gte(c->pcb.rcv_nxt + c->pcb.rcv_wnd,
-		      c->tx_last_ack + c->tx_last_win + c->winmax / 4)) {
-		do_ack = true;
-	}
+	do_ack = tcp_read_open_window(c, readlen);
 	spin_unlock_np(&c->lock);
 
 	if (do_ack)
@@ -789,6 +838,24 @@ static void tcp_read_finish(tcpconn_t *c, struct mbuf *m)
  * if an error occurred.
  */
 ssize_t tcp_read(tcpconn_t *c, void *buf, size_t len)
+{
+	return tcp_read_async(c, buf, len, NULL);
+}
+
+/**
+ * tcp_read_async - reads data from a TCP connection without blocking
+ * @c: the TCP connection
+ * @buf: a buffer to store the read data
+ * @len: the length of @buf
+ * @w: a waker to arm if no data is available yet (or NULL to block)
+ *
+ * If there is nothing to read, @w runs once there may be and the read should
+ * be tried again.
+ *
+ * Returns the number of bytes read, 0 if the connection is closed, -EAGAIN if
+ * @w was armed, or < 0 if an error occurred.
+ */
+ssize_t tcp_read_async(tcpconn_t *c, void *buf, size_t len, waker_t *w)
 {
 	char *pos = buf;
 	struct list_head q;
@@ -798,7 +865,7 @@ ssize_t tcp_read(tcpconn_t *c, void *buf, size_t len)
 	list_head_init(&q);
 
 	/* wait for data to become available */
-	ret = tcp_read_wait(c, len, &q, &m);
+	ret = tcp_read_wait(c, len, w, &q, &m);
 
 	/* check if connection was closed */
 	if (ret <= 0)
@@ -859,7 +926,7 @@ ssize_t tcp_readv(tcpconn_t *c, const struct iovec *iov, int iovcnt)
 	list_head_init(&q);
 
 	/* wait for data to become available */
-	len = tcp_read_wait(c, len, &q, &m);
+	len = tcp_read_wait(c, len, NULL, &q, &m);
 
 	/* check if connection was closed */
 	if (len <= 0)
@@ -916,7 +983,108 @@ ssize_t tcp_readv(tcpconn_t *c, const struct iovec *iov, int iovcnt)
 	return len;
 }
 
-static int tcp_write_wait(tcpconn_t *c, size_t *winlen)
+/**
+ * tcp_read_zc - reads data from a TCP connection without copying it
+ * @c: the TCP connection
+ * @iov: an IO vector to point at the received data
+ * @iovcnt: the number of vectors in @iov, set to the number filled on return
+ * @chain: set to the received mbufs, linked through @next
+ *
+ * Hands over whole received mbufs, at most one per vector. The data stays
+ * valid until tcp_read_zc_release() is called on @chain, and the receive
+ * window does not reopen for it until then, so hold buffers only briefly.
+ * The mbufs must not be modified.
+ *
+ * Returns the number of bytes read, 0 if the connection is closed, or < 0
+ * if an error occurred.
+ */
+ssize_t tcp_read_zc(tcpconn_t *c, struct iovec *iov, int *iovcnt,
+		    struct mbuf **chain)
+{
+	struct mbuf *m, **pprev = chain;
+	size_t readlen = 0;
+	int i = 0;
+
+	*chain = NULL;
+	if (unlikely(*iovcnt <= 0))
+		return -EINVAL;
+
+	spin_lock_np(&c->lock);
+
+	/* block until there is an actionable event */
+	while (!c->rx_closed && (c->rx_exclusive || list_empty(&c->rxq)))
+		waitq_wait(&c->rx_wq, &c->lock);
+
+	/* is the socket closed? */
+	if (c->rx_closed) {
+		spin_unlock_np(&c->lock);
+		*iovcnt = 0;
+		return -c->err;
+	}
+
+	/* pop off whole mbufs, the window opens once they are released */
+	while (i < *iovcnt) {
+		m = list_top(&c->rxq, struct mbuf, link);
+		if (!m)
+			break;
+
+		if (unlikely((m->flags & TCP_FIN) > 0)) {
+			tcp_conn_shutdown_rx(c);
+			if (mbuf_length(m) == 0)
+				break;
+		}
+
+		list_del_from(&c->rxq, &m->link);
+		iov[i].iov_base = mbuf_data(m);
+		iov[i++].iov_len = mbuf_length(m);
+		readlen += mbuf_length(m);
+		*pprev = m;
+		pprev = &m->next;
+	}
+	*pprev = NULL;
+	spin_unlock_np(&c->lock);
+
+	/* the connection must outlive the mbufs that hold its window */
+	if (*chain)
+		tcp_conn_get(c);
+
+	*iovcnt = i;
+	return readlen;
+}
+
+/**
+ * tcp_read_zc_release - releases data returned by tcp_read_zc()
+ * @c: the TCP connection
+ * @chain: the mbufs returned by tcp_read_zc()
+ *
+ * Frees the mbufs and reopens the receive window they were holding.
+ */
+void tcp_read_zc_release(tcpconn_t *c, struct mbuf *chain)
+{
+	struct mbuf *next;
+	size_t len = 0;
+	bool do_ack;
+
+	if (!chain)
+		return;
+
+	for (; chain; chain = next) {
+		next = chain->next;
+		len += mbuf_length(chain);
+		mbuf_free(chain);
+	}
+
+	spin_lock_np(&c->lock);
+	do_ack = tcp_read_open_window(c, len) && !c->rx_closed;
+	spin_unlock_np(&c->lock);
+
+	if (do_ack)
+		tcp_tx_ack(c);
+	tcp_conn_put(c);
+}
+
+/* waits for send window, or arms @w and returns -EAGAIN instead if @w is set */
+static int tcp_write_wait(tcpconn_t *c, size_t *winlen, waker_t *w)
 {
 	spin_lock_np(&c->lock);
 
@@ -930,6 +1098,11 @@ static int tcp_write_wait(tcpconn_t *c, size_t *winlen)
 			c->zero_wnd_ts = microtime();
 			tcp_timer_update(c);
 		}
+		if (w) {
+			waitq_arm(&c->tx_wq, &c->lock, w);
+			spin_unlock_np(&c->lock);
+			return -EAGAIN;
+		}
 		waitq_wait(&c->tx_wq, &c->lock);
 	}
 	c->zero_wnd = false;
@@ -943,7 +1116,7 @@ static int tcp_write_wait(tcpconn_t *c, size_t *winlen)
 	/* drop the lock to allow concurrent RX processing */
 	c->tx_exclusive = true;
 
-	*winlen = c->pcb.snd_una + c->pcb.snd_wnd - c->pcb.snd_nxt;
+	*winlen = c->pcb.snd_una + tcp_snd_wnd(c) - c->pcb.snd_nxt;
 	c->acks_delayed_cnt = 0;
 	c->ack_delayed = false;
 	spin_unlock_np(&c->lock);
@@ -974,10 +1147,16 @@ static void tcp_write_finish(tcpconn_t *c)
 			list_add_tail(&q, &c->tx_pending->link);
 			c->tx_pending = NULL;
 		}
-	} else if (c->do_fast_retransmit) {
-		c->do_fast_retransmit = false;
-		if (c->fast_retransmit_last_ack == c->pcb.snd_una)
-			retransmit = tcp_tx_fast_retransmit_start(c);
+	} else {
+		if (c->do_fast_retransmit) {
+			c->do_fast_retransmit = false;
+			if (c->fast_retransmit_last_ack == c->pcb.snd_una)
+				retransmit = tcp_tx_fast_retransmit_start(c);
+		}
+		if (c->do_rto_resend) {
+			c->do_rto_resend = false;
+			tcp_tx_retransmit_acked(c);
+		}
 	}
 
 	tcp_timer_update(c);
@@ -999,12 +1178,30 @@ static void tcp_write_finish(tcpconn_t *c)
  * if there was a failure.
  */
 ssize_t tcp_write(tcpconn_t *c, const void *buf, size_t len)
+{
+	return tcp_write_async(c, buf, len, NULL);
+}
+
+/**
+ * tcp_write_async - writes data to a TCP connection without blocking
+ * @c: the TCP connection
+ * @buf: a buffer from which to copy the data
+ * @len: the length of the data
+ * @w: a waker to arm if there is no send window yet (or NULL to block)
+ *
+ * If nothing can be sent, @w runs once something may be and the write should
+ * be tried again.
+ *
+ * Returns the number of bytes written (could be less than @len), -EAGAIN if
+ * @w was armed, or < 0 if there was a failure.
+ */
+ssize_t tcp_write_async(tcpconn_t *c, const void *buf, size_t len, waker_t *w)
 {
 	size_t winlen;
 	ssize_t ret;
 
 	/* block until the data can be sent */
-	ret = tcp_write_wait(c, &winlen);
+	ret = tcp_write_wait(c, &winlen, w);
 	if (ret)
 		return ret;
 
@@ -1033,7 +1230,7 @@ ssize_t tcp_writev(tcpconn_t *c, const struct iovec *iov, int iovcnt)
 	int i;
 
 	/* block until the data can be sent */
-	ret = tcp_write_wait(c, &winlen);
+	ret = tcp_write_wait(c, &winlen, NULL);
 	if (ret)
 		return ret;
 
@@ -1055,10 +1252,115 @@ ssize_t tcp_writev(tcpconn_t *c, const struct iovec *iov, int iovcnt)
 	return sent > 0 ? sent : ret;
 }
 
+/* memory for zero-copy sends */
+size_t cfg_tcp_zc_len;
+static DEFINE_SPINLOCK(tcp_zc_lock);
+static size_t tcp_zc_allocated;
+
+/**
+ * tcp_zc_alloc - allocates memory that can be sent with tcp_write_zc()
+ * @len: the size of the allocation
+ *
+ * The memory comes from a region shared with the IOKernel and registered
+ * with the NIC (sized by the tcp_zc_region_mb config option), so packets can
+ * point into it directly. It can never be freed, so it is best suited for
+ * long-lived buffers such as the backing store of a cache.
+ *
+ * Returns cache line aligned memory, or NULL if the region is exhausted.
+ */
+void *tcp_zc_alloc(size_t len)
+{
+	void *p = NULL;
+
+	spin_lock_np(&tcp_zc_lock);
+	if (len <= iok.zc_len - tcp_zc_allocated) {
+		p = (char *)iok.zc_buf + tcp_zc_allocated;
+		tcp_zc_allocated += align_up(len, CACHE_LINE_SIZE);
+	}
+	spin_unlock_np(&tcp_zc_lock);
+
+	return p;
+}
+
+static bool tcp_zc_contains(const void *buf, size_t len)
+{
+	uintptr_t off = (uintptr_t)buf - (uintptr_t)iok.zc_buf;
+
+	return off <= iok.zc_len && len <= iok.zc_len - off;
+}
+
+/**
+ * tcp_zc_put - drops a reference to a zero-copy write's completion
+ * @zc: the completion
+ *
+ * Notifies the writer once the last reference is gone.
+ */
+void tcp_zc_put(struct tcp_zc *zc)
+{
+	if (atomic_dec_and_test(&zc->ref)) {
+		zc->done(zc->arg);
+		sfree(zc);
+	}
+}
+
+/**
+ * tcp_write_zc - writes data to a TCP connection without copying it
+ * @c: the TCP connection
+ * @buf: the data, which must come from tcp_zc_alloc()
+ * @len: the length of the data
+ * @done: called once the data written is acknowledged and released
+ * @arg: an argument passed to @done
+ *
+ * The written part of @buf must not be modified until @done is called. @done
+ * is called exactly once if any data was written, and never otherwise. It
+ * may run in softirq context with preemption disabled, so it must not block.
+ *
+ * Returns the number of bytes written (could be less than @len), or < 0
+ * if there was a failure.
+ */
+ssize_t tcp_write_zc(tcpconn_t *c, const void *buf, size_t len,
+		     tcp_zc_done_fn done, void *arg)
+{
+	struct tcp_zc *zc;
+	size_t winlen;
+	ssize_t ret;
+
+	if (unlikely(!tcp_zc_contains(buf, len)))
+		return -EINVAL;
+
+	zc = smalloc(sizeof(*zc));
+	if (unlikely(!zc))
+		return -ENOMEM;
+	atomic_write(&zc->ref, 1);
+	zc->done = done;
+	zc->arg = arg;
+
+	/* block until the data can be sent */
+	ret = tcp_write_wait(c, &winlen, NULL);
+	if (ret) {
+		sfree(zc);
+		return ret;
+	}
+
+	/* actually send the data */
+	ret = tcp_tx_send_zc(c, buf, MIN(len, winlen), zc);
+
+	/* catch up on any pending work */
+	tcp_write_finish(c);
+
+	/* nothing references @buf if nothing was sent */
+	if (ret <= 0)
+		sfree(zc);
+	else
+		tcp_zc_put(zc);
+	return ret;
+}
+
 /* resend any pending egress packets that timed out */
 static void tcp_retransmit(void *arg)
 {
 	tcpconn_t *c = (tcpconn_t *)arg;
+	struct mbuf *m;
 
 	spin_lock_np(&c->lock);
 
@@ -1066,6 +1368,17 @@ static void tcp_retransmit(void *arg)
 		waitq_wait(&c->tx_wq, &c->lock);
 
 	if (c->pcb.state != TCP_STATE_CLOSED) {
+		/* back off if the oldest segment still timed out (RFC 6298) */
+		m = list_top(&c->txq, struct mbuf, link);
+		if (m && microtime() - m->timestamp >= c->pcb.rto) {
+			tcp_rto_backoff(c);
+			tcp_cc_loss(c, true);
+
+			/* everything in flight is presumed lost */
+			c->rto_recovery = true;
+			c->rto_recover = c->pcb.snd_nxt;
+			c->rto_resend_nxt = c->pcb.snd_una;
+		}
 		c->tx_exclusive = true;
 		spin_unlock_np(&c->lock);
 		tcp_tx_retransmit(c);
@@ -1241,13 +1554,3 @@ void tcp_close(tcpconn_t *c)
 
 	tcp_conn_put(c);
 }
-
-/**
- * tcp_init_late - starts the TCP worker thread
- *
- * Returns 0 if successful.
- */
-int tcp_init_late(void)
-{
-	return thread_spawn(tcp_worker, NULL);
-}
@@ -8,6 +8,7 @@
 #include <base/time.h>
 #include <runtime/sync.h>
 #include <runtime/tcp.h>
+#include <runtime/timer.h>
 #include <net/tcp.h>
 #include <net/mbuf.h>
 #include <net/mbufq.h>
@@ -23,10 +24,12 @@
 #define TCP_OOQ_ACK_TIMEOUT	(300 * ONE_MS)
 #define TCP_TIME_WAIT_TIMEOUT	(1 * ONE_SECOND) /* FIXME: should be 8 minutes */
 #define TCP_ZERO_WND_TIMEOUT	(300 * ONE_MS) /* FIXME: should be dynamic */
-#define TCP_RETRANSMIT_TIMEOUT	(300 * ONE_MS) /* FIXME: should be dynamic */
+#define TCP_RTO_INIT		(300 * ONE_MS) /* until the first RTT sample */
+#define TCP_RTO_MIN		(2 * TCP_ACK_TIMEOUT) /* outlast delayed ACKs */
+#define TCP_RTO_MAX		(5 * ONE_SECOND)
+#define TCP_INIT_CWND		10 /* in segments (RFC 6928) */
 #define TCP_FAST_RETRANSMIT_THRESH 3
 #define TCP_OOO_MAX_SIZE	2048
-#define TCP_RETRANSMIT_BATCH	16
 
 /**
  * tcp_calculate_mss - given an ethernet MTU, returns the TCP MSS
@@ -51,6 +54,8 @@ enum {
 	TCP_STATE_CLOSED,
 };
 
+struct tcp_cc_ops;
+
 /* TCP protocol control block (PCB) */
 struct tcp_pcb {
 	int		state;		/* the connection state */
@@ -78,13 +83,50 @@ struct tcp_pcb {
 	uint32_t	irs;		/* initial receive sequence number */
 	uint32_t	rcv_wscale;	/* the receive window scale */
 	uint32_t	rcv_mss;	/* the send max segment size */
+
+	/* round-trip time estimation (RFC 6298), in microseconds */
+	uint32_t	srtt;		/* smoothed RTT, 0 until sampled */
+	uint32_t	rttvar;		/* RTT variation */
+	uint32_t	rto;		/* retransmission timeout */
+
+	/* congestion control (RFC 5681) */
+	const struct tcp_cc_ops *cc;	/* the congestion control algorithm */
+	uint32_t	cwnd;		/* congestion window */
+	uint32_t	ssthresh;	/* slow start threshold */
+	uint32_t	cwnd_cnt;	/* bytes acked toward the next increase */
+	uint32_t	recover;	/* the window reduced last ends here */
+	union {
+		struct {
+			uint32_t alpha;	   /* marked fraction (1024 = all) */
+			uint32_t acked;	   /* bytes acked in this window */
+			uint32_t marked;   /* bytes acked with ECE */
+			uint32_t next_seq; /* this window ends here */
+		} dctcp;
+	};
+
+	/* explicit congestion notification (RFC 3168) */
+	bool		ecn;		/* negotiated with the peer */
+	bool		ecn_ce;		/* last data segment was CE marked */
+	bool		ecn_cwr;	/* set CWR on the next data segment */
+};
+
+/* a congestion control algorithm */
+struct tcp_cc_ops {
+	const char	*name;
+	bool		ecn;		/* negotiate ECN for connections */
+
+	/* the connection was established */
+	void (*init)(tcpconn_t *c);
+	/* an ACK advanced snd_una by @acked bytes, @ece if it echoed CE */
+	void (*on_ack)(tcpconn_t *c, uint32_t acked, bool ece);
+	/* a loss was detected, by a retransmission timeout if @timeout */
+	void (*on_loss)(tcpconn_t *c, bool timeout);
 };
 
 /* the TCP connection struct */
 struct tcpconn {
 	struct trans_entry	e;
 	struct tcp_pcb		pcb;
-	struct list_node	global_link;
 	struct list_node	queue_link;
 	spinlock_t		lock;
 	struct kref		ref;
@@ -109,9 +151,15 @@ struct tcpconn {
 	struct list_head	txq;
 	bool			do_fast_retransmit;
 	uint32_t		fast_retransmit_last_ack;
+	bool			rto_recovery; /* resending after a timeout */
+	bool			do_rto_resend;
+	uint32_t		rto_recover; /* snd_nxt at the timeout */
+	uint32_t		rto_resend_nxt; /* resent up to here */
 
 	/* timeouts */
-	uint64_t 		next_timeout;
+	struct timer_entry	timer;
+	bool			timer_stopped;
+	uint64_t 		next_timeout; /* the timer's deadline */
 	uint64_t		ack_ts;
 	uint64_t		zero_wnd_ts;
 	union {
@@ -132,6 +180,7 @@ extern void tcp_conn_set_state(tcpconn_t *c, int new_state);
 extern void tcp_conn_fail(tcpconn_t *c, int err);
 extern void tcp_conn_shutdown_rx(tcpconn_t *c);
 extern void tcp_conn_destroy(tcpconn_t *c);
+extern void tcp_timer_arm(tcpconn_t *c, uint64_t deadline_us);
 extern void tcp_timer_update(tcpconn_t *c);
 
 /**
@@ -157,6 +206,15 @@ static inline void tcp_conn_put(tcpconn_t *c)
 	kref_put(&c->ref, tcp_conn_release_ref);
 }
 
+/* tracks when the caller's buffer for a zero-copy write can be reused */
+struct tcp_zc {
+	atomic_t	ref;	/* one per packet, plus one for the writer */
+	tcp_zc_done_fn	done;
+	void		*arg;
+};
+
+extern void tcp_zc_put(struct tcp_zc *zc);
+
 #define TCP_OPTION_MSS		BIT(0)
 #define TCP_OPTION_WSCALE	BIT(1)
 
@@ -172,6 +230,7 @@ struct tcp_options {
  */
 
 extern void tcp_rx_conn(struct trans_entry *e, struct mbuf *m);
+extern void tcp_rx_conn_chain(struct trans_entry *e, struct mbuf *m);
 extern tcpconn_t *tcp_rx_listener(struct netaddr laddr, struct mbuf *m);
 
 
@@ -189,10 +248,29 @@ extern int tcp_tx_ctl(tcpconn_t *c, uint8_t flags,
 		      const struct tcp_options *opts);
 extern ssize_t tcp_tx_send(tcpconn_t *c, const void *buf, size_t len,
 			   bool push);
+extern ssize_t tcp_tx_send_zc(tcpconn_t *c, const void *buf, size_t len,
+			      struct tcp_zc *zc);
+extern struct mbuf *tcp_tx_copy_seg(tcpconn_t *c, struct mbuf *m,
+				    uint32_t seq);
 extern void tcp_tx_retransmit(tcpconn_t *c);
+extern void tcp_tx_retransmit_acked(tcpconn_t *c);
 extern struct mbuf *tcp_tx_fast_retransmit_start(tcpconn_t *c);
 extern void tcp_tx_fast_retransmit_finish(tcpconn_t *c, struct mbuf *m);
 
+/*
+ * congestion control
+ */
+
+extern const struct tcp_cc_ops *tcp_cc_default(void);
+extern void tcp_cc_init(tcpconn_t *c);
+extern void tcp_cc_ack(tcpconn_t *c, uint32_t acked, bool ece,
+		       struct list_head *acked_q);
+extern void tcp_cc_loss(tcpconn_t *c, bool timeout);
+extern void tcp_rtt_sample(tcpconn_t *c, uint32_t rtt);
+extern void tcp_rto_backoff(tcpconn_t *c);
+extern void tcp_reno_on_ack(tcpconn_t *c, uint32_t acked, bool ece);
+extern void tcp_reno_on_loss(tcpconn_t *c, bool timeout);
+
 /*
  * utilities
  */
@@ -211,12 +289,18 @@ static inline void mbuf_list_free(struct list_head *h)
 	}
 }
 
+/* the bytes that may be in flight, limited by the peer and by congestion */
+static inline uint32_t tcp_snd_wnd(tcpconn_t *c)
+{
+	return MIN(c->pcb.snd_wnd, c->pcb.cwnd);
+}
+
 /* is the TX window full? */
 static inline bool tcp_is_snd_full(tcpconn_t *c)
 {
 	assert_spin_lock_held(&c->lock);
 
-	return wraps_lte(c->pcb.snd_una + c->pcb.snd_wnd, c->pcb.snd_nxt);
+	return wraps_lte(c->pcb.snd_una + tcp_snd_wnd(c), c->pcb.snd_nxt);
 }
 
 
@@ -0,0 +1,270 @@
+/*
+ * tcp_cc.c - TCP congestion control and RTT estimation
+ *
+ * Each connection points at a set of congestion control hooks in its PCB.
+ * Reno (RFC 5681) reacts to loss only. DCTCP (RFC 8257) also negotiates ECN
+ * and scales its window back in proportion to the fraction of bytes the
+ * network marked, which keeps switch queues short under incast.
+ */
+
+#include <base/stddef.h>
+#include <base/log.h>
+
+#include "tcp.h"
+
+int cfg_tcp_cc = TCP_CC_RENO;
+
+/* caps the window so byte counts can't overflow */
+#define TCP_CWND_MAX	(1U << 30)
+
+/* the DCTCP estimation gain, g = 1 / 2^DCTCP_SHIFT_G */
+#define DCTCP_SHIFT_G	4
+#define DCTCP_ALPHA_MAX	1024
+
+static uint32_t tcp_cc_flight(tcpconn_t *c)
+{
+	return c->pcb.snd_nxt - c->pcb.snd_una;
+}
+
+
+/*
+ * Reno
+ */
+
+/**
+ * tcp_reno_on_ack - grows the window (slow start and congestion avoidance)
+ * @c: the TCP connection
+ * @acked: the number of newly acknowledged bytes
+ * @ece: unused, Reno doesn't negotiate ECN
+ */
+void tcp_reno_on_ack(tcpconn_t *c, uint32_t acked, bool ece)
+{
+	struct tcp_pcb *pcb = &c->pcb;
+
+	/* slow start, with at most one MSS per ACK (RFC 3465) */
+	if (pcb->cwnd < pcb->ssthresh) {
+		pcb->cwnd += MIN(acked, pcb->snd_mss);
+		pcb->cwnd = MIN(pcb->cwnd, TCP_CWND_MAX);
+		return;
+	}
+
+	/* congestion avoidance, about one MSS per round trip */
+	pcb->cwnd_cnt += acked;
+	if (pcb->cwnd_cnt >= pcb->cwnd) {
+		pcb->cwnd_cnt -= pcb->cwnd;
+		pcb->cwnd = MIN(pcb->cwnd + pcb->snd_mss, TCP_CWND_MAX);
+	}
+}
+
+/**
+ * tcp_reno_on_loss - halves the window after a loss
+ * @c: the TCP connection
+ * @timeout: restart from one segment after a retransmission timeout
+ */
+void tcp_reno_on_loss(tcpconn_t *c, bool timeout)
+{
+	struct tcp_pcb *pcb = &c->pcb;
+
+	pcb->ssthresh = MAX(tcp_cc_flight(c) / 2, 2 * pcb->snd_mss);
+	pcb->cwnd = timeout ? pcb->snd_mss : pcb->ssthresh;
+	pcb->cwnd_cnt = 0;
+}
+
+static const struct tcp_cc_ops tcp_reno_ops = {
+	.name		= "reno",
+	.ecn		= false,
+	.on_ack		= tcp_reno_on_ack,
+	.on_loss	= tcp_reno_on_loss,
+};
+
+
+/*
+ * DCTCP
+ */
+
+static void dctcp_init(tcpconn_t *c)
+{
+	/* start out assuming everything is marked, like Linux */
+	c->pcb.dctcp.alpha = DCTCP_ALPHA_MAX;
+	c->pcb.dctcp.acked = 0;
+	c->pcb.dctcp.marked = 0;
+	c->pcb.dctcp.next_seq = c->pcb.snd_nxt;
+}
+
+static void dctcp_on_ack(tcpconn_t *c, uint32_t acked, bool ece)
+{
+	struct tcp_pcb *pcb = &c->pcb;
+	uint32_t frac;
+
+	pcb->dctcp.acked += acked;
+	if (ece)
+		pcb->dctcp.marked += acked;
+
+	/* once per window of data, fold the marked fraction into alpha */
+	if (wraps_gte(pcb->snd_una, pcb->dctcp.next_seq)) {
+		frac = (uint64_t)pcb->dctcp.marked * DCTCP_ALPHA_MAX /
+		       pcb->dctcp.acked;
+		pcb->dctcp.alpha -= pcb->dctcp.alpha >> DCTCP_SHIFT_G;
+		pcb->dctcp.alpha += frac >> DCTCP_SHIFT_G;
+		pcb->dctcp.acked = 0;
+		pcb->dctcp.marked = 0;
+		pcb->dctcp.next_seq = pcb->snd_nxt;
+	}
+
+	if (!ece) {
+		tcp_reno_on_ack(c, acked, false);
+		return;
+	}
+
+	/* cut the window by alpha / 2, at most once per window of data */
+	if (wraps_lt(pcb->snd_una, pcb->recover))
+		return;
+	pcb->recover = pcb->snd_nxt;
+	pcb->ssthresh = MAX(pcb->cwnd - (uint32_t)((uint64_t)pcb->cwnd *
+			    pcb->dctcp.alpha / (2 * DCTCP_ALPHA_MAX)),
+			    2 * pcb->snd_mss);
+	pcb->cwnd = pcb->ssthresh;
+	pcb->cwnd_cnt = 0;
+	pcb->ecn_cwr = true;
+}
+
+static const struct tcp_cc_ops tcp_dctcp_ops = {
+	.name		= "dctcp",
+	.ecn		= true,
+	.init		= dctcp_init,
+	.on_ack		= dctcp_on_ack,
+	.on_loss	= tcp_reno_on_loss,
+};
+
+
+/*
+ * Common code
+ */
+
+/**
+ * tcp_cc_default - gets the congestion control algorithm for new connections
+ */
+const struct tcp_cc_ops *tcp_cc_default(void)
+{
+	switch (cfg_tcp_cc) {
+	case TCP_CC_DCTCP:
+		return &tcp_dctcp_ops;
+	default:
+		return &tcp_reno_ops;
+	}
+}
+
+/**
+ * tcp_cc_init - resets congestion control once a connection is established
+ * @c: the TCP connection
+ *
+ * WARNING: the caller must hold @c->lock.
+ */
+void tcp_cc_init(tcpconn_t *c)
+{
+	struct tcp_pcb *pcb = &c->pcb;
+
+	assert_spin_lock_held(&c->lock);
+
+	pcb->cwnd = TCP_INIT_CWND * pcb->snd_mss;
+	pcb->ssthresh = TCP_CWND_MAX;
+	pcb->cwnd_cnt = 0;
+	pcb->recover = pcb->snd_nxt;
+	if (pcb->cc->init)
+		pcb->cc->init(c);
+}
+
+/**
+ * tcp_rtt_sample - updates the RTT estimate and the retransmission timeout
+ * @c: the TCP connection
+ * @rtt: the measured round-trip time, in microseconds
+ *
+ * Follows RFC 6298. The timeout is kept between TCP_RTO_MIN and TCP_RTO_MAX,
+ * and a new sample undoes any backoff.
+ */
+void tcp_rtt_sample(tcpconn_t *c, uint32_t rtt)
+{
+	struct tcp_pcb *pcb = &c->pcb;
+	uint32_t delta;
+
+	rtt = MAX(rtt, 1);
+	if (!pcb->srtt) {
+		pcb->srtt = rtt;
+		pcb->rttvar = rtt / 2;
+	} else {
+		delta = pcb->srtt > rtt ? pcb->srtt - rtt : rtt - pcb->srtt;
+		pcb->rttvar = (3 * pcb->rttvar + delta) / 4;
+		pcb->srtt = (7 * pcb->srtt + rtt) / 8;
+	}
+
+	pcb->rto = pcb->srtt + 4 * pcb->rttvar;
+	pcb->rto = MIN(MAX(pcb->rto, TCP_RTO_MIN), TCP_RTO_MAX);
+}
+
+/**
+ * tcp_rto_backoff - doubles the retransmission timeout after it expired
+ * @c: the TCP connection
+ *
+ * WARNING: the caller must hold @c->lock.
+ */
+void tcp_rto_backoff(tcpconn_t *c)
+{
+	assert_spin_lock_held(&c->lock);
+
+	c->pcb.rto = MIN(c->pcb.rto * 2, TCP_RTO_MAX);
+}
+
+/**
+ * tcp_cc_ack - updates congestion control and RTT state for an ACK
+ * @c: the TCP connection
+ * @acked: the number of bytes the ACK advanced snd_una by
+ * @ece: whether the ACK echoed a congestion mark
+ * @acked_q: the segments the ACK removed from the TX queue
+ *
+ * The newest segment in @acked_q gives an RTT sample, unless it was resent
+ * (Karn's algorithm). @acked_q may be empty while a writer holds the queue.
+ *
+ * WARNING: the caller must hold @c->lock.
+ */
+void tcp_cc_ack(tcpconn_t *c, uint32_t acked, bool ece,
+		struct list_head *acked_q)
+{
+	struct mbuf *m;
+
+	assert_spin_lock_held(&c->lock);
+
+	m = list_tail(acked_q, struct mbuf, link);
+	if (m && !m->resent)
+		tcp_rtt_sample(c, microtime() - m->timestamp);
+
+	/* a completed handshake doesn't grow the window */
+	if (unlikely(c->pcb.state < TCP_STATE_ESTABLISHED))
+		return;
+
+	c->pcb.cc->on_ack(c, acked, ece && c->pcb.ecn);
+}
+
+/**
+ * tcp_cc_loss - reacts to a lost segment
+ * @c: the TCP connection
+ * @timeout: whether the loss was detected by a retransmission timeout
+ *
+ * Duplicate ACKs shrink the window at most once per window of data, while a
+ * timeout always does.
+ *
+ * WARNING: the caller must hold @c->lock.
+ */
+void tcp_cc_loss(tcpconn_t *c, bool timeout)
+{
+	struct tcp_pcb *pcb = &c->pcb;
+
+	assert_spin_lock_held(&c->lock);
+
+	if (unlikely(pcb->state < TCP_STATE_ESTABLISHED))
+		return;
+	if (!timeout && wraps_lt(pcb->snd_una, pcb->recover))
+		return;
+
+	pcb->recover = pcb->snd_nxt;
+	pcb->cc->on_loss(c, timeout);
+}
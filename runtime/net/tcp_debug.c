@@ -100,7 +100,7 @@ static void tcp_dump_pkt(tcpconn_t *c, const struct tcp_hdr *tcphdr,
 void tcp_debug_egress_pkt(tcpconn_t *c, struct mbuf *m)
 {
 	tcp_dump_pkt(c, (struct tcp_hdr *)mbuf_data(m),
-		     mbuf_length(m) - sizeof(struct tcp_hdr), true);
+		     mbuf_length(m) + m->zc_len - sizeof(struct tcp_hdr), true);
 }
 
 /* prints an incoming TCP packet */
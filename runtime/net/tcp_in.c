@@ -53,6 +53,29 @@ static void send_rst(tcpconn_t *c, bool acked, uint32_t seq, uint32_t ack,
 	tcp_tx_raw_rst_ack(c->e.laddr, c->e.raddr, 0, seq + len);
 }
 
+/*
+ * Tracks whether data segments arrive CE marked so ACKs can echo it. Returns
+ * true if the mark changed, in which case an ACK should go out right away so
+ * the sender learns exactly how much data was marked (DCTCP).
+ */
+static bool tcp_rx_ecn(tcpconn_t *c, struct mbuf *m)
+{
+	const struct ip_hdr *iphdr = mbuf_network_hdr(m, *iphdr);
+	bool ce;
+
+	assert_spin_lock_held(&c->lock);
+
+	if (!c->pcb.ecn)
+		return false;
+
+	ce = (iphdr->tos & IPTOS_ECN_MASK) == IPTOS_ECN_CE;
+	if (likely(ce == c->pcb.ecn_ce))
+		return false;
+
+	c->pcb.ecn_ce = ce;
+	return true;
+}
+
 static void tcp_rx_append_text(tcpconn_t *c, struct mbuf *m)
 {
 	uint64_t nxt_wnd;
@@ -171,7 +194,7 @@ void tcp_rx_conn(struct trans_entry *e, struct mbuf *m)
 	const unsigned char *optp;
 	int optlen;
 	uint64_t nxt_wnd;
-	uint32_t seq, ack, len, snd_nxt, hdr_len, win;
+	uint32_t seq, ack, len, snd_nxt, hdr_len, win, acked;
 	bool do_ack = false, slow_path;
 
 	list_head_init(&q);
@@ -218,8 +241,8 @@ void tcp_rx_conn(struct trans_entry *e, struct mbuf *m)
 	/* Is the connection in the established state? */
 	slow_path |= (c->pcb.state != TCP_STATE_ESTABLISHED);
 
-	/* Might we need to unblock waiting senders? */
-	slow_path |= tcp_is_snd_full(c);
+	/* Might we need to unblock waiting senders or resend after a timeout? */
+	slow_path |= tcp_is_snd_full(c) || c->rto_recovery;
 
 	/* Is the packet on the next in-order boundary? */
 	slow_path |= (seq != c->pcb.rcv_nxt) || !list_empty(&c->rxq_ooo);
@@ -239,9 +262,11 @@ void tcp_rx_conn(struct trans_entry *e, struct mbuf *m)
 	if (wraps_lte(c->pcb.snd_una, ack)) {
 		/* did sent segments get acked? */
 		if (c->pcb.snd_una != ack) {
+			acked = ack - c->pcb.snd_una;
 			c->rep_acks = 0;
 			c->pcb.snd_una = ack;
 			tcp_conn_ack(c, &q);
+			tcp_cc_ack(c, acked, tcphdr->flags & TCP_ECE, &q);
 		}
 
 		/* should we update the send window? */
@@ -264,14 +289,14 @@ void tcp_rx_conn(struct trans_entry *e, struct mbuf *m)
 		rx_th = waitq_signal(&c->rx_wq, &c->lock);
 
 	/* handle delayed acks */
-	if (++c->acks_delayed_cnt >= 2) {
+	if (tcp_rx_ecn(c, m) || ++c->acks_delayed_cnt >= 2) {
 		c->ack_delayed = false;
 		do_ack = true;
 		c->acks_delayed_cnt = 0;
 	} else if (!c->ack_delayed) {
 		c->ack_ts = microtime();
 		c->ack_delayed = true;
-		c->next_timeout = MIN(c->next_timeout, c->ack_ts + TCP_ACK_TIMEOUT);
+		tcp_timer_arm(c, c->ack_ts + TCP_ACK_TIMEOUT);
 	}
 
 	list_add_tail(&c->rxq, &m->link);
@@ -285,6 +310,134 @@ void tcp_rx_conn(struct trans_entry *e, struct mbuf *m)
 		tcp_tx_ack(c);
 }
 
+/**
+ * tcp_rx_conn_chain - handles a chain of in-order segments coalesced by GRO
+ * @e: the transport entry of the connection
+ * @m: the first segment, the rest are linked through @next
+ *
+ * GRO only chains contiguous data segments that carry the same ACK and no
+ * flags besides ACK and PSH. If the chain lines up with the receive window,
+ * it is appended under a single lock acquisition; otherwise each segment
+ * takes the regular path.
+ */
+void tcp_rx_conn_chain(struct trans_entry *e, struct mbuf *m)
+{
+	tcpconn_t *c = container_of(e, tcpconn_t, e);
+	struct list_head q;
+	thread_t *rx_th = NULL;
+	const struct tcp_hdr *tcphdr;
+	struct mbuf *pos, *next;
+	uint64_t nxt_wnd;
+	uint32_t seq, ack, win, len, last_seq, snd_nxt, acked, total = 0;
+	int nr = 0;
+	bool do_ack = false, push = false;
+
+	list_head_init(&q);
+	snd_nxt = load_acquire(&c->pcb.snd_nxt);
+
+	/* GRO checked the headers, but not against this connection's MSS */
+	tcphdr = (const struct tcp_hdr *)mbuf_data(m);
+	seq = ntoh32(tcphdr->seq);
+	for (pos = m; pos; pos = pos->next) {
+		tcphdr = (const struct tcp_hdr *)mbuf_data(pos);
+		len = mbuf_length(pos) - tcphdr->off * sizeof(uint32_t);
+		if (unlikely(len > c->pcb.rcv_mss))
+			goto slow_path;
+		push |= (tcphdr->flags & TCP_PUSH) > 0;
+		total += len;
+		nr++;
+	}
+
+	/* @tcphdr is now the last segment's header, which has the latest window */
+	last_seq = ntoh32(tcphdr->seq);
+	ack = ntoh32(tcphdr->ack);
+	win = (uint32_t)ntoh16(tcphdr->win) << c->pcb.snd_wscale;
+	if (unlikely(wraps_gt(ack, snd_nxt)))
+		goto slow_path;
+
+	spin_lock_np(&c->lock);
+
+	/* the whole chain must qualify for the fast path */
+	if (unlikely(c->pcb.state != TCP_STATE_ESTABLISHED ||
+		     tcp_is_snd_full(c) || c->rto_recovery ||
+		     seq != c->pcb.rcv_nxt ||
+		     !list_empty(&c->rxq_ooo) || c->pcb.rcv_wnd < total)) {
+		spin_unlock_np(&c->lock);
+		goto slow_path;
+	}
+
+	STAT(RX_TCP_IN_ORDER) += nr;
+
+	/* process acks and update send window */
+	if (wraps_lte(c->pcb.snd_una, ack)) {
+		/* did sent segments get acked? */
+		if (c->pcb.snd_una != ack) {
+			acked = ack - c->pcb.snd_una;
+			c->rep_acks = 0;
+			c->pcb.snd_una = ack;
+			tcp_conn_ack(c, &q);
+			tcp_cc_ack(c, acked, false, &q);
+		}
+
+		/* should we update the send window? */
+		if (wraps_lt(c->pcb.snd_wl1, last_seq) ||
+		    (c->pcb.snd_wl1 == last_seq &&
+		     wraps_lte(c->pcb.snd_wl2, ack))) {
+			c->pcb.snd_wnd = win;
+			c->pcb.snd_wl1 = last_seq;
+			c->pcb.snd_wl2 = ack;
+			c->rep_acks = 0;
+		}
+	}
+
+	nxt_wnd = (uint64_t)(seq + total);
+	nxt_wnd |= ((uint64_t)(c->pcb.rcv_wnd - total) << 32);
+	store_release(&c->pcb.rcv_nxt_wnd, nxt_wnd);
+
+	/* should we wake a thread */
+	if (nr > 1 || !list_empty(&c->rxq) || push)
+		rx_th = waitq_signal(&c->rx_wq, &c->lock);
+
+	/* handle delayed acks, counting every segment in the chain */
+	c->acks_delayed_cnt += nr;
+	if (tcp_rx_ecn(c, m) || c->acks_delayed_cnt >= 2) {
+		c->ack_delayed = false;
+		do_ack = true;
+		c->acks_delayed_cnt = 0;
+	} else if (!c->ack_delayed) {
+		c->ack_ts = microtime();
+		c->ack_delayed = true;
+		tcp_timer_arm(c, c->ack_ts + TCP_ACK_TIMEOUT);
+	}
+
+	/* strip the headers and enqueue the text */
+	for (pos = m; pos; pos = next) {
+		next = pos->next;
+		mbuf_mark_transport_offset(pos);
+		tcphdr = mbuf_pull_hdr(pos, *tcphdr);
+		mbuf_pull(pos, tcphdr->off * sizeof(uint32_t) - sizeof(*tcphdr));
+		pos->seg_seq = ntoh32(tcphdr->seq);
+		pos->seg_end = pos->seg_seq + mbuf_length(pos);
+		pos->flags = tcphdr->flags;
+		list_add_tail(&c->rxq, &pos->link);
+		tcp_debug_ingress_pkt(c, pos);
+	}
+	spin_unlock_np(&c->lock);
+
+	/* deferred work (delayed until after the lock was dropped) */
+	waitq_signal_finish(rx_th);
+	mbuf_list_free(&q);
+	if (do_ack)
+		tcp_tx_ack(c);
+	return;
+
+slow_path:
+	for (pos = m; pos; pos = next) {
+		next = pos->next;
+		tcp_rx_conn(e, pos);
+	}
+}
+
 static int tcp_parse_options(tcpconn_t *c, const unsigned char *ptr, int len)
 {
 	int opt_en = 0;
@@ -345,7 +498,7 @@ __tcp_rx_conn(tcpconn_t *c, struct mbuf *m, uint32_t ack, uint32_t snd_nxt,
 	struct list_head q, waiters;
 	thread_t *rx_th = NULL;
 	struct mbuf *retransmit = NULL;
-	uint32_t seq, len;
+	uint32_t seq, len, acked;
 	bool do_ack = false, do_drop = true, fin = false, snd_was_full;
 	bool ack_same = false, wnd_updated = false;
 	int ret;
@@ -393,9 +546,14 @@ __tcp_rx_conn(tcpconn_t *c, struct mbuf *m, uint32_t ack, uint32_t snd_nxt,
 			opts.mss = c->pcb.rcv_mss;
 			opts.wscale = c->pcb.rcv_wscale;
 
+			/* ECN is on if the SYN/ACK agreed to it (RFC 3168) */
+			c->pcb.ecn &= (m->flags & (TCP_ACK | TCP_ECE | TCP_CWR)) ==
+				      (TCP_ACK | TCP_ECE);
+
 			if ((m->flags & TCP_ACK) > 0) {
 				c->pcb.snd_una = ack;
 				tcp_conn_ack(c, &q);
+				tcp_cc_ack(c, 0, false, &q);
 			}
 			if (wraps_gt(c->pcb.snd_una, c->pcb.iss)) {
 				do_ack = true;
@@ -464,8 +622,11 @@ __tcp_rx_conn(tcpconn_t *c, struct mbuf *m, uint32_t ack, uint32_t snd_nxt,
 	if (wraps_lte(c->pcb.snd_una, ack) && wraps_lte(ack, snd_nxt)) {
 		/* did sent segments get acked? */
 		if (c->pcb.snd_una != ack) {
+			acked = ack - c->pcb.snd_una;
 			c->pcb.snd_una = ack;
 			tcp_conn_ack(c, &q);
+			tcp_cc_ack(c, acked, m->flags & TCP_ECE, &q);
+			tcp_tx_retransmit_acked(c);
 		} else {
 			ack_same = true;
 		}
@@ -498,6 +659,7 @@ __tcp_rx_conn(tcpconn_t *c, struct mbuf *m, uint32_t ack, uint32_t snd_nxt,
 		     len == 0 && !wnd_updated)) {
 		c->rep_acks++;
 		if (c->rep_acks >= TCP_FAST_RETRANSMIT_THRESH) {
+			tcp_cc_loss(c, false);
 			if (c->tx_exclusive) {
 				c->do_fast_retransmit = true;
 				c->fast_retransmit_last_ack = ack;
@@ -547,7 +709,7 @@ __tcp_rx_conn(tcpconn_t *c, struct mbuf *m, uint32_t ack, uint32_t snd_nxt,
 			assert(do_drop == false);
 			rx_th = waitq_signal(&c->rx_wq, &c->lock);
 		}
-		if (++c->acks_delayed_cnt >= 2) {
+		if (tcp_rx_ecn(c, m) || ++c->acks_delayed_cnt >= 2) {
 			do_ack = true;
 		} else if (!c->ack_delayed) {
 			c->ack_delayed = true;
@@ -641,6 +803,8 @@ tcpconn_t *tcp_rx_listener(struct netaddr laddr, struct mbuf *m)
 		return NULL;
 	c->pcb.irs = ntoh32(tcphdr->seq);
 	c->pcb.rcv_nxt = c->pcb.irs + 1;
+	c->pcb.ecn &= (tcphdr->flags & (TCP_ECE | TCP_CWR)) ==
+		      (TCP_ECE | TCP_CWR);
 
 	/* set up options */
 	opts.opt_en = tcp_parse_options(c, optp, optlen);
@@ -660,7 +824,8 @@ tcpconn_t *tcp_rx_listener(struct netaddr laddr, struct mbuf *m)
 
 	/* finally, send a SYN/ACK to the remote host */
 	spin_lock_np(&c->lock);
-	ret = tcp_tx_ctl(c, TCP_SYN | TCP_ACK, &opts);
+	ret = tcp_tx_ctl(c, TCP_SYN | TCP_ACK | (c->pcb.ecn ? TCP_ECE : 0),
+			 &opts);
 	if (unlikely(ret)) {
 		spin_unlock_np(&c->lock);
 		tcp_conn_destroy(c);
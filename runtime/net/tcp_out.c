@@ -4,6 +4,7 @@
 
 #include <string.h>
 
+#include <base/mem.h>
 #include <base/stddef.h>
 #include <net/ip.h>
 #include <net/tcp.h>
@@ -18,6 +19,14 @@ static void tcp_tx_release_mbuf(struct mbuf *m)
 		net_tx_release_mbuf(m);
 }
 
+static void tcp_tx_release_zc_mbuf(struct mbuf *m)
+{
+	if (atomic_dec_and_test(&m->ref)) {
+		tcp_zc_put((struct tcp_zc *)m->release_data);
+		net_tx_release_mbuf(m);
+	}
+}
+
 static uint16_t tcp_hdr_chksum(uint32_t local_ip, uint32_t remote_ip,
 			       uint16_t len)
 {
@@ -39,6 +48,10 @@ tcp_push_tcphdr(struct mbuf *m, tcpconn_t *c, uint8_t flags,
 	tcp_seq ack = c->tx_last_ack = (uint32_t)rcv_nxt_wnd;
 	uint32_t win = c->tx_last_win = rcv_nxt_wnd >> 32;
 
+	/* echo the last congestion mark we received (DCTCP style) */
+	if (c->pcb.ecn_ce && (flags & TCP_ACK))
+		flags |= TCP_ECE;
+
 	/* write the tcp header */
 	tcphdr = mbuf_push_hdr(m, *tcphdr);
 	mbuf_mark_transport_offset(m);
@@ -49,11 +62,21 @@ tcp_push_tcphdr(struct mbuf *m, tcpconn_t *c, uint8_t flags,
 	tcphdr->flags = flags;
 	tcphdr->win = hton16(win >> c->pcb.rcv_wscale);
 	tcphdr->seq = hton32(m->seg_seq);
-	tcphdr->sum = tcp_hdr_chksum(c->e.laddr.ip, c->e.raddr.ip,
-				     off * sizeof(uint32_t) + l4len);
+	/* with TSO, the NIC adds each segment's length to the checksum */
+	tcphdr->sum = tcp_hdr_chksum(c->e.laddr.ip, c->e.raddr.ip, m->tso_mss ?
+				     0 : off * sizeof(uint32_t) + l4len);
 	return tcphdr;
 }
 
+/* tells the peer we reduced the window in response to ECE (RFC 3168) */
+static inline void tcp_tx_mark_cwr(tcpconn_t *c, struct mbuf *m)
+{
+	if (unlikely(c->pcb.ecn_cwr)) {
+		c->pcb.ecn_cwr = false;
+		m->flags |= TCP_CWR;
+	}
+}
+
 /**
  * tcp_tx_raw_rst - send a RST without an established connection
  * @laddr: the local address
@@ -239,6 +262,7 @@ int tcp_tx_ctl(tcpconn_t *c, uint8_t flags, const struct tcp_options *opts)
 	m->seg_seq = c->pcb.snd_nxt;
 	m->seg_end = c->pcb.snd_nxt + 1;
 	m->flags = flags;
+	m->resent = false;
 
 	if (opts)
 		ret = tcp_push_options(m, opts);
@@ -281,6 +305,7 @@ ssize_t tcp_tx_send(tcpconn_t *c, const void *buf, size_t len, bool push)
 	ssize_t ret = 0;
 	size_t seglen;
 	uint32_t mss = c->pcb.snd_mss;
+	uint32_t tso_max = align_down(NET_TSO_MAX_LEN, mss);
 
 	assert(c->pcb.state >= TCP_STATE_ESTABLISHED);
 	assert((c->tx_exclusive == true) || spin_lock_held(&c->lock));
@@ -297,15 +322,24 @@ ssize_t tcp_tx_send(tcpconn_t *c, const void *buf, size_t len, bool push)
 			seglen = MIN(end - pos, mss - mbuf_length(m));
 			m->seg_end += seglen;
 		} else {
-			m = net_tx_alloc_mbuf();
-			if (unlikely(!m)) {
-				ret = -ENOBUFS;
-				break;
+			/* let the NIC segment writes that span several MSS */
+			m = NULL;
+			if (cfg_tso_enabled && end - pos > mss)
+				m = net_tx_alloc_mbuf_tso(mss);
+			if (m) {
+				seglen = MIN(end - pos, tso_max);
+			} else {
+				m = net_tx_alloc_mbuf();
+				if (unlikely(!m)) {
+					ret = -ENOBUFS;
+					break;
+				}
+				seglen = MIN(end - pos, mss);
 			}
-			seglen = MIN(end - pos, mss);
 			m->seg_seq = c->pcb.snd_nxt;
 			m->seg_end = c->pcb.snd_nxt + seglen;
 			m->flags = TCP_ACK;
+			m->resent = false;
 			atomic_write(&m->ref, 2);
 			m->release = tcp_tx_release_mbuf;
 		}
@@ -315,7 +349,7 @@ ssize_t tcp_tx_send(tcpconn_t *c, const void *buf, size_t len, bool push)
 		pos += seglen;
 
 		/* if not pushing, keep the last buffer for later */
-		if (!push && pos == end && mbuf_length(m) -
+		if (!push && pos == end && !m->tso_mss && mbuf_length(m) -
 		    sizeof(struct tcp_hdr) < mss) {
 			c->tx_pending = m;
 			break;
@@ -324,6 +358,7 @@ ssize_t tcp_tx_send(tcpconn_t *c, const void *buf, size_t len, bool push)
 		/* initialize TCP header */
 		if (push && pos == end)
 			m->flags |= TCP_PUSH;
+		tcp_tx_mark_cwr(c, m);
 		tcp_push_tcphdr(m, c, m->flags, 5, m->seg_end - m->seg_seq);
 
 		/* transmit the packet */
@@ -331,6 +366,10 @@ ssize_t tcp_tx_send(tcpconn_t *c, const void *buf, size_t len, bool push)
 		tcp_debug_egress_pkt(c, m);
 		m->timestamp = microtime();
 		m->txflags = OLFLAG_TCP_CHKSUM;
+		if (m->tso_mss)
+			m->txflags |= OLFLAG_TCP_TSO;
+		if (c->pcb.ecn)
+			m->txflags |= NET_TXFLAG_ECT;
 		ret = net_tx_ip(m, IPPROTO_TCP, c->e.raddr.ip);
 		if (unlikely(ret)) {
 			/* pretend the packet was sent */
@@ -344,12 +383,181 @@ ssize_t tcp_tx_send(tcpconn_t *c, const void *buf, size_t len, bool push)
 	return ret;
 }
 
+/**
+ * tcp_tx_send_zc - transmit a buffer on a TCP connection without copying it
+ * @c: the TCP connection
+ * @buf: the buffer to transmit (must be in the zero-copy region)
+ * @len: the length of the buffer to transmit
+ * @zc: the completion tracking @buf
+ *
+ * The packets point at @buf instead of carrying a copy. Each one holds a
+ * reference on @zc until it has been acknowledged and the NIC is done with
+ * it. The data is always pushed.
+ *
+ * WARNING: The caller is responsible for respecting the TCP window size limit.
+ * WARNING: The caller must have write exclusive access to the socket or hold
+ * @c->lock while write exclusion isn't taken.
+ *
+ * Returns the number of bytes transmitted, or < 0 if there was an error.
+ */
+ssize_t tcp_tx_send_zc(tcpconn_t *c, const void *buf, size_t len,
+		       struct tcp_zc *zc)
+{
+	struct mbuf *m;
+	const char *pos = buf;
+	const char *end = pos + len;
+	ssize_t ret = 0;
+	size_t seglen;
+	uint32_t mss = c->pcb.snd_mss;
+	uint32_t tso_max = align_down(NET_TSO_MAX_LEN, mss);
+
+	assert(c->pcb.state >= TCP_STATE_ESTABLISHED);
+	assert((c->tx_exclusive == true) || spin_lock_held(&c->lock));
+
+	/* data held back by an earlier write must go first */
+	if (c->tx_pending)
+		tcp_tx_send(c, buf, 0, true);
+
+	while (pos < end) {
+		m = net_tx_alloc_mbuf();
+		if (unlikely(!m)) {
+			ret = -ENOBUFS;
+			break;
+		}
+
+		/* the IOKernel needs each payload within one huge page */
+		seglen = MIN(end - pos, PGSIZE_2MB - PGOFF_2MB(pos));
+		if (cfg_tso_enabled && seglen > mss) {
+			seglen = MIN(seglen, tso_max);
+			m->tso_mss = mss;
+		} else {
+			seglen = MIN(seglen, mss);
+		}
+
+		m->zc_payload = pos;
+		m->zc_len = seglen;
+		m->seg_seq = c->pcb.snd_nxt;
+		m->seg_end = c->pcb.snd_nxt + seglen;
+		m->flags = TCP_ACK;
+		m->resent = false;
+		atomic_write(&m->ref, 2);
+		atomic_inc(&zc->ref);
+		m->release_data = (unsigned long)zc;
+		m->release = tcp_tx_release_zc_mbuf;
+		store_release(&c->pcb.snd_nxt, c->pcb.snd_nxt + seglen);
+		pos += seglen;
+
+		/* initialize TCP header */
+		if (pos == end)
+			m->flags |= TCP_PUSH;
+		tcp_tx_mark_cwr(c, m);
+		tcp_push_tcphdr(m, c, m->flags, 5, seglen);
+
+		/* transmit the packet */
+		list_add_tail(&c->txq, &m->link);
+		tcp_debug_egress_pkt(c, m);
+		m->timestamp = microtime();
+		m->txflags = OLFLAG_TCP_CHKSUM;
+		if (m->tso_mss)
+			m->txflags |= OLFLAG_TCP_TSO;
+		if (c->pcb.ecn)
+			m->txflags |= NET_TXFLAG_ECT;
+		ret = net_tx_ip(m, IPPROTO_TCP, c->e.raddr.ip);
+		if (unlikely(ret)) {
+			/* pretend the packet was sent */
+			atomic_write(&m->ref, 1);
+		}
+	}
+
+	/* if we sent anything return the length we sent instead of an error */
+	if (pos - (const char *)buf > 0)
+		ret = pos - (const char *)buf;
+	return ret;
+}
+
+/* the size of the segments the receiver got for @m */
+static uint32_t tcp_tx_seg_size(struct mbuf *m)
+{
+	return m->tso_mss ? m->tso_mss : m->seg_end - m->seg_seq;
+}
+
+/**
+ * tcp_tx_copy_seg - copies one segment of a super-segment into a new packet
+ * @c: the TCP connection
+ * @m: a TSO super-segment or zero-copy packet
+ * @seq: the sequence number of the segment to copy
+ *
+ * The original is left untouched (it may still be in flight) and the payload
+ * is copied into a regular packet, so the receiver sees exactly the segment
+ * it missed.
+ *
+ * Returns a packet ready to transmit, or NULL if out of memory.
+ */
+struct mbuf *tcp_tx_copy_seg(tcpconn_t *c, struct mbuf *m, uint32_t seq)
+{
+	struct mbuf *newm;
+	const unsigned char *payload;
+	uint32_t len = MIN(m->seg_end - seq, tcp_tx_seg_size(m));
+
+	newm = net_tx_alloc_mbuf();
+	if (unlikely(!newm))
+		return NULL;
+
+	if (m->zc_len)
+		payload = m->zc_payload;
+	else
+		payload = mbuf_transport_offset(m) + sizeof(struct tcp_hdr);
+	memcpy(mbuf_put(newm, len), payload + (seq - m->seg_seq), len);
+	newm->flags = TCP_ACK;
+	if (seq + len == m->seg_end)
+		newm->flags |= m->flags & TCP_PUSH;
+	newm->seg_seq = seq;
+	newm->seg_end = seq + len;
+	newm->txflags = OLFLAG_TCP_CHKSUM;
+	tcp_push_tcphdr(newm, c, newm->flags, 5, len);
+
+	return newm;
+}
+
+/* resends one segment of a TSO super-segment or zero-copy packet */
+static int tcp_tx_retransmit_copy(tcpconn_t *c, struct mbuf *m, uint32_t seq)
+{
+	struct mbuf *newm;
+	int ret;
+
+	newm = tcp_tx_copy_seg(c, m, seq);
+	if (unlikely(!newm))
+		return -ENOMEM;
+
+	/* transmit the packet */
+	tcp_debug_egress_pkt(c, newm);
+	ret = net_tx_ip(newm, IPPROTO_TCP, c->e.raddr.ip);
+	if (unlikely(ret))
+		mbuf_free(newm);
+	return ret;
+}
+
+/* returns the first unacknowledged sequence number in @m */
+static uint32_t tcp_tx_first_unacked(tcpconn_t *c, struct mbuf *m)
+{
+	uint32_t una = load_acquire(&c->pcb.snd_una);
+
+	return wraps_lt(m->seg_seq, una) ? una : m->seg_seq;
+}
+
 static int tcp_tx_retransmit_one(tcpconn_t *c, struct mbuf *m)
 {
 	int ret;
 	uint8_t opts_len;
 	uint16_t l4len;
 
+	/* only resend the first lost segment of a super-segment */
+	if (m->tso_mss || m->zc_len) {
+		if (wraps_lte(m->seg_end, load_acquire(&c->pcb.snd_una)))
+			return 0;
+		return tcp_tx_retransmit_copy(c, m, tcp_tx_first_unacked(c, m));
+	}
+
 	l4len = m->seg_end - m->seg_seq;
 	if (m->flags & (TCP_SYN | TCP_FIN))
 		l4len--;
@@ -417,6 +625,7 @@ struct mbuf *tcp_tx_fast_retransmit_start(tcpconn_t *c)
 	m = list_top(&c->txq, struct mbuf, link);
 	if (m) {
 		m->timestamp = microtime();
+		m->resent = true;
 		atomic_inc(&m->ref);
 	}
 
@@ -432,33 +641,93 @@ void tcp_tx_fast_retransmit_finish(tcpconn_t *c, struct mbuf *m)
 }
 
 /**
- * tcp_tx_retransmit - resend any pending egress packets that timed out
+ * tcp_tx_retransmit - resends egress packets lost to a retransmission timeout
  * @c: the TCP connection in which to send retransmissions
+ *
+ * Everything in flight when the timeout expired is presumed lost, but it is
+ * resent in order and only as far as the congestion window allows. Since a
+ * timeout restarts the window from one segment, the timer resends the first
+ * unacknowledged segment and ACKs clock out the rest (see
+ * tcp_tx_retransmit_acked()).
  */
 void tcp_tx_retransmit(tcpconn_t *c)
 {
 	struct mbuf *m;
 	uint64_t now = microtime();
+	uint32_t una, limit, seq;
+	int ret;
 
 	assert(spin_lock_held(&c->lock) || c->tx_exclusive);
 
-	int ret;
+	if (!c->rto_recovery)
+		return;
+
+	una = load_acquire(&c->pcb.snd_una);
+	if (wraps_lt(c->rto_resend_nxt, una))
+		c->rto_resend_nxt = una;
+
+	/* always allow at least one segment */
+	limit = una + MAX(ACCESS_ONCE(c->pcb.cwnd), c->pcb.snd_mss);
+	if (wraps_gt(limit, c->rto_recover))
+		limit = c->rto_recover;
 
-	int count = 0;
 	list_for_each(&c->txq, m, link) {
-		/* check if the timeout expired */
-		if (now - m->timestamp < TCP_RETRANSMIT_TIMEOUT)
+		if (!wraps_lt(c->rto_resend_nxt, limit))
 			break;
-
-		if (wraps_gte(load_acquire(&c->pcb.snd_una), m->seg_end))
+		if (wraps_lte(m->seg_end, c->rto_resend_nxt))
 			continue;
 
 		m->timestamp = now;
-		ret = tcp_tx_retransmit_one(c, m);
-		if (ret)
-			break;
+		m->resent = true;
 
-		if (++count >= TCP_RETRANSMIT_BATCH)
-			break;
+		if (!m->tso_mss && !m->zc_len) {
+			ret = tcp_tx_retransmit_one(c, m);
+			if (ret)
+				break;
+			c->rto_resend_nxt = m->seg_end;
+			continue;
+		}
+
+		/* resend the segments of a super-segment one at a time */
+		seq = wraps_lt(m->seg_seq, c->rto_resend_nxt) ?
+		      c->rto_resend_nxt : m->seg_seq;
+		for (; wraps_lt(seq, m->seg_end) && wraps_lt(seq, limit);
+		     seq = c->rto_resend_nxt) {
+			ret = tcp_tx_retransmit_copy(c, m, seq);
+			if (ret)
+				return;
+			c->rto_resend_nxt = seq + MIN(m->seg_end - seq,
+						      tcp_tx_seg_size(m));
+		}
 	}
 }
+
+/**
+ * tcp_tx_retransmit_acked - resends more after an ACK during timeout recovery
+ * @c: the TCP connection
+ *
+ * Called whenever an ACK advances snd_una. Recovery ends once everything that
+ * was in flight at the timeout is acknowledged.
+ *
+ * WARNING: the caller must hold @c->lock.
+ */
+void tcp_tx_retransmit_acked(tcpconn_t *c)
+{
+	assert_spin_lock_held(&c->lock);
+
+	if (likely(!c->rto_recovery))
+		return;
+
+	if (wraps_gte(c->pcb.snd_una, c->rto_recover)) {
+		c->rto_recovery = false;
+		return;
+	}
+
+	/* a writer holds the TX queue, it resends once it is done */
+	if (c->tx_exclusive) {
+		c->do_rto_resend = true;
+		return;
+	}
+
+	tcp_tx_retransmit(c);
+}
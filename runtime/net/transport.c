@@ -229,6 +229,31 @@ void net_rx_trans(struct mbuf *m)
 	rcu_read_unlock();
 }
 
+/**
+ * net_rx_trans_chain - receive a chain of L4 packets from the same flow
+ * m: the first mbuf, the rest are linked through @next
+ */
+void net_rx_trans_chain(struct mbuf *m)
+{
+	struct trans_entry *e;
+	struct mbuf *next;
+
+	rcu_read_lock();
+	e = trans_lookup(m);
+	if (likely(e && e->ops->recv_chain)) {
+		e->ops->recv_chain(e, m);
+		rcu_read_unlock();
+		return;
+	}
+	rcu_read_unlock();
+
+	/* fall back to delivering the packets one at a time */
+	for (; m; m = next) {
+		next = m->next;
+		net_rx_trans(m);
+	}
+}
+
 /**
  * trans_error - reports a network error to the L4 layer
  * @m: the mbuf that triggered the error
@@ -11,8 +11,18 @@
 
 typedef struct waitq {
 	struct list_head	waiters;
+	struct list_head	wakers;
 } waitq_t;
 
+/* runs every armed waker, they check their condition again when they run */
+static inline void waitq_wake_all(waitq_t *q)
+{
+	waker_t *w;
+
+	while ((w = list_pop(&q->wakers, waker_t, link)))
+		w->fn(w);
+}
+
 /**
  * waitq_wait - waits for the next signal
  * @q: the wake queue
@@ -26,14 +36,29 @@ static inline void waitq_wait(waitq_t *q, spinlock_t *l)
 	spin_lock_np(l);
 }
 
+/**
+ * waitq_arm - arms a waker to run on the next signal instead of waiting
+ * @q: the wake queue
+ * @l: a held spinlock protecting the wake queue and the condition
+ * @w: the waker
+ */
+static inline void waitq_arm(waitq_t *q, spinlock_t *l, waker_t *w)
+{
+	assert_spin_lock_held(l);
+	list_add_tail(&q->wakers, &w->link);
+}
+
 /**
  * waitq_signal - wakes up to one waiter on the wake queue
  * @q: the wake queue
  * @l: a held spinlock protecting the wake queue and the condition
+ *
+ * Armed wakers can't tell whether they were the one woken, so they all run.
  */
 static inline thread_t *waitq_signal(waitq_t *q, spinlock_t *l)
 {
 	assert_spin_lock_held(l);
+	waitq_wake_all(q);
 	return list_pop(&q->waiters, thread_t, link);
 }
 
@@ -71,6 +96,7 @@ static inline void waitq_signal_locked(waitq_t *q, spinlock_t *l)
  */
 static inline void waitq_release(waitq_t *q)
 {
+	waitq_wake_all(q);
 	while (true) {
 		thread_t *th = list_pop(&q->waiters, thread_t, link);
 		if (!th)
@@ -81,6 +107,7 @@ static inline void waitq_release(waitq_t *q)
 
 static inline void waitq_release_start(waitq_t *q, struct list_head *waiters)
 {
+	waitq_wake_all(q);
 	list_append_list(waiters, &q->waiters);
 }
 
@@ -101,7 +128,7 @@ static inline void waitq_release_finish(struct list_head *waiters)
  */
 static inline bool waitq_empty(waitq_t *q)
 {
-	return list_empty(&q->waiters);
+	return list_empty(&q->waiters) && list_empty(&q->wakers);
 }
 
 /**
@@ -111,4 +138,5 @@ static inline bool waitq_empty(waitq_t *q)
 static inline void waitq_init(waitq_t *q)
 {
 	list_head_init(&q->waiters);
+	list_head_init(&q->wakers);
 }
@@ -67,6 +67,8 @@ unsigned long poll_wait(poll_waiter_t *w)
 		spin_lock_np(&w->lock);
 		t = list_pop(&w->triggered, poll_trigger_t, link);
 		if (t) {
+			/* it's off the list, so poll_disarm() mustn't unlink it */
+			t->triggered = false;
 			spin_unlock_np(&w->lock);
 			return t->data;
 		}
@@ -14,6 +14,11 @@
 /* the current preemption count */
 volatile __thread unsigned int preempt_cnt = PREEMPT_NOT_PENDING;
 volatile __thread bool preempt_cede;
+/* points to the iokernel's cooperative cede request (a timestamp) */
+static uint64_t preempt_no_cede_req;
+volatile __thread uint64_t *preempt_cede_req = &preempt_no_cede_req;
+/* the end of the running thread's time slice */
+__thread uint64_t preempt_slice_end_tsc = UINT64_MAX;
 
 /* set a flag to indicate a preemption request is pending */
 static void set_preempt_needed(void)
@@ -71,7 +76,49 @@ void preempt(void)
 		thread_yield();
 }
 
+/**
+ * preempt_point_slow - yields at a cooperative preemption point
+ */
+void preempt_point_slow(void)
+{
+	/* a preemption point will be reached again soon */
+	if (!preempt_enabled())
+		return;
 
+	if (preempt_needed()) {
+		preempt();
+		return;
+	}
+
+	preempt_disable();
+	if (*preempt_cede_req != 0) {
+		STAT(COOP_CEDES)++;
+		preempt_enable_nocheck();
+		thread_cede();
+		return;
+	}
+
+	STAT(COOP_YIELDS)++;
+	preempt_enable_nocheck();
+	thread_yield();
+}
+
+/**
+ * preempt_get_cede_stats - gets how quickly cores were given back
+ * @nr: set to the number of times the iokernel asked for a core
+ * @cycles: set to the total cycles until the cores were given back
+ */
+void preempt_get_cede_stats(uint64_t *nr, uint64_t *cycles)
+{
+	int i;
+
+	*nr = 0;
+	*cycles = 0;
+	for (i = 0; i < nrks; i++) {
+		*nr += ACCESS_ONCE(ks[i]->stats[STAT_CEDE_REQS]);
+		*cycles += ACCESS_ONCE(ks[i]->stats[STAT_CEDE_REQ_CYCLES]);
+	}
+}
 
 /**
  * preempt_init - global initializer for preemption support
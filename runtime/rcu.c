@@ -5,14 +5,16 @@
  * strategy here is to maintain a per-kthread counter. Whenever the scheduler is
  * entered or exited, the counter is incremented. When the count is even, we
  * know that either the scheduler loop is still running or the kthread is
- * parked. When the count is odd, we know a uthread is currently running. We can
- * safely free objects by reading each kthread's counter and then waiting until
- * each kthread count is either even & >= the previous value (to detect parking)
- * or odd & > the previous value (to detect rescheduling).
+ * parked. When the count is odd, we know a uthread is currently running.
  *
- * FIXME: Freeing objects is expensive with this minimal implementation. This
- * should be fine as long as RCU updates are rare. The Linux Kernel uses several
- * more optimized strategies that we may want to consider in the future.
+ * rcu_free() pushes callbacks onto a per-kthread list, so queueing never
+ * touches shared state. A single worker thread collects the lists into
+ * batches. For each batch it starts a grace period by bumping @rcu_gp_seq;
+ * kthreads that are already in the scheduler or parked (even counter) are
+ * quiescent right away, and the rest report a quiescent state the next time
+ * they pass through the scheduler (see rcu_note_qs()). The last kthread to
+ * report wakes the worker, which then runs the batch's callbacks. There is no
+ * polling, so reclamation takes about as long as the longest running uthread.
  */
 
 #include <base/stddef.h>
@@ -20,71 +22,183 @@
 #include <runtime/rcu.h>
 #include <runtime/sync.h>
 #include <runtime/thread.h>
-#include <runtime/timer.h>
 
 #include "defs.h"
 
-/* the time RCU waits before checking if it can free objects */
-#define RCU_SLEEP_PERIOD (10 * ONE_MS)
+/* the number of the latest grace period, kthreads report against it */
+unsigned long rcu_gp_seq;
+/* the number of kthreads that the latest grace period is waiting on */
+static atomic_t rcu_gp_remaining;
 
-/* Protects @rcu_head. */
+/* Protects the worker and batch state below. */
 static DEFINE_SPINLOCK(rcu_lock);
-/* The head of the list of objects waiting to be freed */
-static struct rcu_head *rcu_head;
+static thread_t *rcu_worker_th;
+/* the worker is parked until callbacks are queued */
+static bool rcu_worker_idle;
+/* the worker is parked until the grace period ends */
+static bool rcu_worker_gp_wait;
+/* the number of batches started and finished */
+static unsigned long rcu_batch_seq, rcu_batch_done;
+/* threads waiting for a batch to finish */
+static LIST_HEAD(rcu_waiters);
+
+struct rcu_waiter {
+	struct list_node	link;
+	thread_t		*th;
+	unsigned long		batch;
+};
 
 #ifdef DEBUG
 __thread int rcu_read_count;
 #endif /* DEBUG */
 
-static void rcu_worker(void *arg)
+/**
+ * rcu_report_qs - reports that a kthread passed through a quiescent state
+ * @k: the kthread
+ *
+ * Can be called by @k itself or on its behalf, only the first report for a
+ * grace period counts.
+ */
+void rcu_report_qs(struct kthread *k)
+{
+	unsigned long seq = load_acquire(&rcu_gp_seq);
+	unsigned long old = ACCESS_ONCE(k->rcu_qs_seq);
+
+	if (old == seq ||
+	    !__sync_bool_compare_and_swap(&k->rcu_qs_seq, old, seq))
+		return;
+	if (!atomic_dec_and_test(&rcu_gp_remaining))
+		return;
+
+	spin_lock_np(&rcu_lock);
+	if (rcu_worker_gp_wait) {
+		rcu_worker_gp_wait = false;
+		thread_ready(rcu_worker_th);
+	}
+	spin_unlock_np(&rcu_lock);
+}
+
+static bool rcu_cbs_pending(void)
 {
-	struct rcu_head *head, *next;
-	unsigned int last_rcu_gen[NCPU];
-	unsigned int gen;
 	int i;
 
-	while (true) {
-		/* check if any RCU objects are waiting to be freed */
-		spin_lock_np(&rcu_lock);
-		if (!rcu_head) {
-			spin_unlock_np(&rcu_lock);
-			timer_sleep(RCU_SLEEP_PERIOD);
+	for (i = 0; i < nrks; i++) {
+		if (ACCESS_ONCE(ks[i]->rcu_cbs))
+			return true;
+	}
+
+	return false;
+}
+
+static void rcu_gp_run(void)
+{
+	uint64_t start_tsc = rdtsc();
+	int i;
+
+	atomic_write(&rcu_gp_remaining, nrks);
+	store_release(&rcu_gp_seq, rcu_gp_seq + 1);
+
+	/* pairs with the barrier before parking in schedule() */
+	mb();
+
+	/* kthreads in the scheduler or parked are already quiescent */
+	for (i = 0; i < nrks; i++) {
+		if ((load_acquire(&ks[i]->rcu_gen) & 0x1) == 0x0)
+			rcu_report_qs(ks[i]);
+	}
+
+	spin_lock_np(&rcu_lock);
+	if (atomic_read(&rcu_gp_remaining) > 0) {
+		rcu_worker_gp_wait = true;
+		thread_park_and_unlock_np(&rcu_lock);
+	} else {
+		spin_unlock_np(&rcu_lock);
+	}
+
+	preempt_disable();
+	STAT(RCU_GPS)++;
+	STAT(RCU_GP_CYCLES) += rdtsc() - start_tsc;
+	preempt_enable();
+}
+
+static void rcu_batch_finish(unsigned long batch)
+{
+	struct rcu_waiter *w, *next;
+
+	spin_lock_np(&rcu_lock);
+	rcu_batch_done = batch;
+	list_for_each_safe(&rcu_waiters, w, next, link) {
+		if (w->batch > batch)
 			continue;
-		}
-		head = rcu_head;
-		rcu_head = NULL;
+		list_del_from(&rcu_waiters, &w->link);
+		thread_ready(w->th);
+	}
+	spin_unlock_np(&rcu_lock);
+}
+
+static void rcu_worker_wait(void)
+{
+	spin_lock_np(&rcu_lock);
+	if (!list_empty(&rcu_waiters)) {
 		spin_unlock_np(&rcu_lock);
+		return;
+	}
 
-		/* read the RCU generation counters */
-		for (i = 0; i < nrks; i++)
-			last_rcu_gen[i] = load_acquire(&ks[i]->rcu_gen);
+	/* pairs with the push in rcu_free() */
+	rcu_worker_idle = true;
+	mb();
+	if (rcu_cbs_pending()) {
+		rcu_worker_idle = false;
+		spin_unlock_np(&rcu_lock);
+		return;
+	}
 
-		while (true) {
-			/* wait for RCU generation counters to increase */
-			timer_sleep(RCU_SLEEP_PERIOD);
+	thread_park_and_unlock_np(&rcu_lock);
+}
 
-			/* read the RCU generation counters again */
-			for (i = 0; i < nrks; i++) {
-				gen = load_acquire(&ks[i]->rcu_gen);
-				if ((gen & 0x1) == 0x1 &&
-				    gen == last_rcu_gen[i]) {
-					break;
-				}
-			}
+static void rcu_worker(void *arg)
+{
+	struct rcu_head *batch[NCPU], *head, *next;
+	unsigned long seq, nr;
+	int i;
 
-			/* did any of the RCU generation checks fail? */
-			if (i != maxks)
+	while (true) {
+		rcu_worker_wait();
+
+		spin_lock_np(&rcu_lock);
+		seq = ++rcu_batch_seq;
+		spin_unlock_np(&rcu_lock);
+
+		/* take every kthread's callbacks, the batch waits for one GP */
+		nr = 0;
+		for (i = 0; i < nrks; i++) {
+			batch[i] = NULL;
+			if (!ACCESS_ONCE(ks[i]->rcu_cbs))
 				continue;
+			batch[i] = __atomic_exchange_n(&ks[i]->rcu_cbs, NULL,
+						       __ATOMIC_ACQ_REL);
+			nr++;
+		}
+
+		if (nr) {
+			rcu_gp_run();
 
 			/* actually free the RCU objects */
-			while (head) {
-				next = head->next;
-				head->func(head);
-				head = next;
+			nr = 0;
+			for (i = 0; i < nrks; i++) {
+				for (head = batch[i]; head; head = next) {
+					next = head->next;
+					head->func(head);
+					nr++;
+				}
 			}
 
-			break;
+			preempt_disable();
+			STAT(RCU_CALLBACKS) += nr;
+			preempt_enable();
 		}
+
+		rcu_batch_finish(seq);
 	}
 }
 
@@ -95,23 +209,49 @@ static void rcu_worker(void *arg)
  */
 void rcu_free(struct rcu_head *head, rcu_callback_t func)
 {
+	struct kthread *k;
+	struct rcu_head *old;
+
 	head->func = func;
 
-	spin_lock_np(&rcu_lock);
-	head->next = rcu_head;
-	rcu_head = head;
-	spin_unlock_np(&rcu_lock);
+	k = getk();
+	do {
+		old = ACCESS_ONCE(k->rcu_cbs);
+		head->next = old;
+	} while (!__sync_bool_compare_and_swap(&k->rcu_cbs, old, head));
+	STAT(RCU_FREES)++;
+	putk();
+
+	/* the compare-and-swap orders the push before this check */
+	if (unlikely(ACCESS_ONCE(rcu_worker_idle))) {
+		spin_lock_np(&rcu_lock);
+		if (rcu_worker_idle) {
+			rcu_worker_idle = false;
+			thread_ready(rcu_worker_th);
+		}
+		spin_unlock_np(&rcu_lock);
+	}
 }
 
-struct sync_arg {
-	struct rcu_head rcu;
-	thread_t *th;
-};
+/* waits until a batch that started after this call has finished */
+static void rcu_wait_batch(void)
+{
+	struct rcu_waiter w;
+
+	w.th = thread_self();
+
+	spin_lock_np(&rcu_lock);
+	w.batch = rcu_batch_seq + 1;
+	list_add_tail(&rcu_waiters, &w.link);
+	if (rcu_worker_idle) {
+		rcu_worker_idle = false;
+		thread_ready(rcu_worker_th);
+	}
+	thread_park_and_unlock_np(&rcu_lock);
+}
 
 static void synchronize_rcu_finish(struct rcu_head *head)
 {
-	struct sync_arg *tmp = container_of(head, struct sync_arg, rcu);
-	thread_ready(tmp->th);
 }
 
 /**
@@ -121,15 +261,47 @@ static void synchronize_rcu_finish(struct rcu_head *head)
  */
 void synchronize_rcu(void)
 {
-	struct sync_arg tmp;
+	struct rcu_head head;
 
-	tmp.rcu.func = synchronize_rcu_finish;
-	tmp.th = thread_self();
+	/* makes sure the next batch waits for a grace period */
+	rcu_free(&head, synchronize_rcu_finish);
+	rcu_wait_batch();
+}
 
-	spin_lock_np(&rcu_lock);
-	tmp.rcu.next = rcu_head;
-	rcu_head = &tmp.rcu;
-	thread_park_and_unlock_np(&rcu_lock);
+/**
+ * rcu_barrier - blocks until all pending RCU callbacks have finished
+ *
+ * Waits for every callback passed to rcu_free() (on any kthread) before this
+ * call. Use it before tearing down state that the callbacks depend on.
+ *
+ * WARNING: Can only be called from thread context.
+ */
+void rcu_barrier(void)
+{
+	rcu_wait_batch();
+}
+
+/**
+ * rcu_get_stats - gets RCU reclamation statistics
+ * @outstanding: set to the number of callbacks that haven't run yet
+ * @gps: set to the number of grace periods so far
+ * @gp_cycles: set to the total length of those grace periods in cycles
+ */
+void rcu_get_stats(uint64_t *outstanding, uint64_t *gps, uint64_t *gp_cycles)
+{
+	uint64_t frees = 0, callbacks = 0;
+	int i;
+
+	*gps = 0;
+	*gp_cycles = 0;
+	for (i = 0; i < nrks; i++) {
+		frees += ACCESS_ONCE(ks[i]->stats[STAT_RCU_FREES]);
+		callbacks += ACCESS_ONCE(ks[i]->stats[STAT_RCU_CALLBACKS]);
+		*gps += ACCESS_ONCE(ks[i]->stats[STAT_RCU_GPS]);
+		*gp_cycles += ACCESS_ONCE(ks[i]->stats[STAT_RCU_GP_CYCLES]);
+	}
+
+	*outstanding = frees - callbacks;
 }
 
 /**
@@ -139,5 +311,10 @@ void synchronize_rcu(void)
  */
 int rcu_init_late(void)
 {
-	return thread_spawn(rcu_worker, NULL);
+	rcu_worker_th = thread_create(rcu_worker, NULL);
+	if (!rcu_worker_th)
+		return -ENOMEM;
+
+	thread_ready(rcu_worker_th);
+	return 0;
 }
@@ -3,6 +3,7 @@
  */
 
 #include <sched.h>
+#include <stdlib.h>
 
 #include <base/stddef.h>
 #include <base/lock.h>
@@ -40,6 +41,11 @@ static __thread uint64_t last_tsc;
 /* used to force timer and network processing after a timeout */
 static __thread uint64_t last_watchdog_tsc;
 
+/* how long work must wait before it can be stolen across sockets */
+uint64_t cfg_remote_steal_us = RUNTIME_REMOTE_STEAL_US;
+/* the time slice enforced by preempt_point() (0 is unlimited) */
+uint64_t cfg_quantum_us;
+
 /**
  * In inc/runtime/thread.h, this function is declared inline (rather than static
  * inline) so that it is accessible to the Rust bindings. As a result, it must
@@ -70,6 +76,31 @@ static inline bool cores_have_affinity(unsigned int cpua, unsigned int cpub)
 	       cpu_map[cpua].sibling_core == cpub;
 }
 
+/* how close two cores are, in the order that work is stolen */
+enum {
+	LOCALITY_SIBLING = 0,	/* same core or hyperthread sibling */
+	LOCALITY_LLC,		/* shares the last-level cache */
+	LOCALITY_PACKAGE,	/* same socket, but a different cache */
+	LOCALITY_REMOTE,	/* a different socket */
+	LOCALITY_NR,
+};
+
+/**
+ * cores_locality - returns the locality class of two cores
+ * @cpua: the first core
+ * @cpub: the second core
+ */
+static inline int cores_locality(unsigned int cpua, unsigned int cpub)
+{
+	if (cores_have_affinity(cpua, cpub))
+		return LOCALITY_SIBLING;
+	if (cpu_map[cpua].llc_id == cpu_map[cpub].llc_id)
+		return LOCALITY_LLC;
+	if (cpu_map[cpua].package == cpu_map[cpub].package)
+		return LOCALITY_PACKAGE;
+	return LOCALITY_REMOTE;
+}
+
 /**
  * jmp_thread - runs a thread, popping its trap frame
  * @th: the thread to run
@@ -147,6 +178,299 @@ static __noreturn void jmp_runtime_nosave(runtime_fn_t fn)
 	__jmp_runtime_nosave(fn, runtime_stack);
 }
 
+/*
+ * Runqueue support
+ *
+ * Threads are always added at rq_head by the kthread that owns the runqueue,
+ * so it is the only writer of rq_head. Threads are removed at rq_tail, either
+ * by the owner or by other kthreads stealing work. By default, rq_tail is
+ * protected by the kthread lock. With LOCKFREE_RQ, rq_tail is instead updated
+ * with a compare-and-swap, so thieves never need the victim's lock to steal
+ * from its runqueue. The owner can also move rq_tail backwards to let a
+ * thread cut the line, so rq_tail is paired with a generation number that is
+ * bumped on every update to rule out ABA races.
+ *
+ * The ring starts with cfg_rq_size slots and the owner doubles it when it
+ * fills up (under the kthread lock), up to RUNTIME_RQ_MAX_SIZE. Threads keep
+ * their index when the ring grows, so a thief holding a pointer to the old
+ * ring still reads the correct threads. With LOCKFREE_RQ, thieves mark
+ * themselves as RCU readers while they steal, and the old ring is freed after
+ * a grace period. The overflow list is only used once the ring can't grow any
+ * further.
+ */
+
+/* the initial number of slots in each kthread's runqueue */
+unsigned int cfg_rq_size = RUNTIME_RQ_SIZE;
+
+static struct rq_ring *rq_ring_alloc(uint32_t size)
+{
+	struct rq_ring *rq;
+
+	assert(is_power_of_two(size));
+	rq = aligned_alloc(CACHE_LINE_SIZE,
+			   align_up(sizeof(*rq) + size * sizeof(thread_t *),
+				    CACHE_LINE_SIZE));
+	if (!rq)
+		return NULL;
+
+	rq->mask = size - 1;
+	return rq;
+}
+
+#ifdef LOCKFREE_RQ
+static void rq_ring_release(struct rcu_head *head)
+{
+	free(container_of(head, struct rq_ring, rcu));
+}
+#endif
+
+/**
+ * rq_grow - doubles the capacity of the local runqueue
+ * @k: the local kthread
+ *
+ * The kthread lock must be held.
+ *
+ * Returns true if the runqueue has more room.
+ */
+static bool rq_grow(struct kthread *k)
+{
+	struct rq_ring *old = k->rq, *new;
+	uint32_t i;
+
+	assert_spin_lock_held(&k->lock);
+
+	if (old->mask + 1 >= RUNTIME_RQ_MAX_SIZE)
+		return false;
+	new = rq_ring_alloc((old->mask + 1) * 2);
+	if (unlikely(!new))
+		return false;
+
+	for (i = load_acquire(&k->rq_tail); i != k->rq_head; i++)
+		new->slots[i & new->mask] = old->slots[i & old->mask];
+	store_release(&k->rq, new);
+
+#ifdef LOCKFREE_RQ
+	/* thieves might still be reading the old ring, see steal_work() */
+	rcu_free(&old->rcu, rq_ring_release);
+#else
+	free(old);
+#endif
+
+	STAT(RQ_GROWS)++;
+	return true;
+}
+
+/* returns true if the local runqueue has no free slots */
+static inline bool rq_full(struct kthread *k, uint32_t rq_tail)
+{
+	return k->rq_head - rq_tail > k->rq->mask;
+}
+
+/* accounts for threads leaving the runqueue in the iokernel's counters */
+static inline void rq_export_tail(struct kthread *k, uint32_t n)
+{
+#ifdef LOCKFREE_RQ
+	/* thieves update this without holding the kthread lock */
+	__sync_fetch_and_add(&k->q_ptrs->rq_tail, n);
+#else
+	ACCESS_ONCE(k->q_ptrs->rq_tail) += n;
+#endif
+}
+
+#ifdef LOCKFREE_RQ
+
+static inline bool rq_tail_cas(struct kthread *k, uint64_t old,
+			       uint32_t rq_tail)
+{
+	uint64_t new = (old & ~0xffffffffUL) + (1UL << 32) + rq_tail;
+
+	return __sync_bool_compare_and_swap(&k->rq_tail_pair, old, new);
+}
+
+/**
+ * rq_pop - removes the oldest thread from the local runqueue
+ * @k: the local kthread
+ *
+ * Returns a thread, or NULL if the runqueue is empty.
+ */
+static thread_t *rq_pop(struct kthread *k)
+{
+	uint64_t pair;
+	uint32_t rq_tail;
+	thread_t *th;
+
+	do {
+		pair = load_acquire(&k->rq_tail_pair);
+		rq_tail = (uint32_t)pair;
+		if (k->rq_head == rq_tail)
+			return NULL;
+		th = k->rq->slots[rq_tail & k->rq->mask];
+	} while (!rq_tail_cas(k, pair, rq_tail + 1));
+
+	rq_export_tail(k, 1);
+	return th;
+}
+
+/**
+ * rq_push_head_locked - inserts a thread at the front of the local runqueue
+ * @k: the local kthread
+ * @th: the thread to insert
+ *
+ * If the runqueue is full and can't grow, @th is placed at the front of the
+ * overflow queue instead, because the newest thread can't be displaced
+ * safely while thieves are active.
+ */
+static void rq_push_head_locked(struct kthread *k, thread_t *th)
+{
+	uint64_t pair;
+	uint32_t rq_tail;
+
+	assert_spin_lock_held(&k->lock);
+
+	while (true) {
+		pair = load_acquire(&k->rq_tail_pair);
+		rq_tail = (uint32_t)pair;
+		if (unlikely(rq_full(k, rq_tail))) {
+			if (rq_grow(k))
+				continue;
+			list_add(&k->rq_overflow, &th->link);
+			STAT(RQ_OVERFLOW)++;
+			return;
+		}
+
+		k->rq->slots[(rq_tail - 1) & k->rq->mask] = th;
+		if (rq_tail_cas(k, pair, rq_tail - 1))
+			return;
+	}
+}
+
+/**
+ * rq_steal - moves half of a remote runqueue to the local runqueue
+ * @l: the local kthread (its runqueue must be empty)
+ * @r: the remote kthread
+ *
+ * Does not require the remote kthread's lock.
+ *
+ * Returns the number of threads stolen.
+ */
+static uint32_t rq_steal(struct kthread *l, struct kthread *r)
+{
+	struct rq_ring *rq;
+	uint64_t pair;
+	uint32_t i, avail, rq_tail;
+
+	while (true) {
+		/* the ring must be loaded last, see rq_grow() */
+		pair = load_acquire(&r->rq_tail_pair);
+		rq_tail = (uint32_t)pair;
+		avail = load_acquire(&r->rq_head) - rq_tail;
+		if (!avail)
+			return 0;
+		rq = load_acquire(&r->rq);
+
+		/* a stale snapshot, the CAS below would fail anyways */
+		if (unlikely(avail > rq->mask + 1))
+			continue;
+
+		/* steal half the tasks */
+		avail = MIN(div_up(avail, 2), l->rq->mask + 1);
+		for (i = 0; i < avail; i++) {
+			l->rq->slots[(l->rq_head + i) & l->rq->mask] =
+				rq->slots[(rq_tail + i) & rq->mask];
+		}
+		if (rq_tail_cas(r, pair, rq_tail + avail))
+			break;
+	}
+
+	rq_export_tail(r, avail);
+	store_release(&l->rq_head, l->rq_head + avail);
+	return avail;
+}
+
+#else /* LOCKFREE_RQ */
+
+/**
+ * rq_pop - removes the oldest thread from the local runqueue
+ * @k: the local kthread
+ *
+ * Returns a thread, or NULL if the runqueue is empty.
+ */
+static thread_t *rq_pop(struct kthread *k)
+{
+	thread_t *th;
+
+	assert_spin_lock_held(&k->lock);
+
+	if (k->rq_head == k->rq_tail)
+		return NULL;
+	th = k->rq->slots[k->rq_tail++ & k->rq->mask];
+	rq_export_tail(k, 1);
+	return th;
+}
+
+/**
+ * rq_push_head_locked - inserts a thread at the front of the local runqueue
+ * @k: the local kthread
+ * @th: the thread to insert
+ *
+ * If the runqueue is full and can't grow, the newest thread is displaced into
+ * the front of the overflow queue.
+ */
+static void rq_push_head_locked(struct kthread *k, thread_t *th)
+{
+	struct rq_ring *rq;
+	thread_t *newestth;
+
+	assert_spin_lock_held(&k->lock);
+
+	if (unlikely(rq_full(k, k->rq_tail)))
+		rq_grow(k);
+
+	rq = k->rq;
+	newestth = rq->slots[--k->rq_tail & rq->mask];
+	rq->slots[k->rq_tail & rq->mask] = th;
+	if (unlikely(k->rq_head - k->rq_tail > rq->mask + 1)) {
+		list_add(&k->rq_overflow, &newestth->link);
+		k->rq_head--;
+		STAT(RQ_OVERFLOW)++;
+	}
+}
+
+/**
+ * rq_steal - moves half of a remote runqueue to the local runqueue
+ * @l: the local kthread (its runqueue must be empty)
+ * @r: the remote kthread
+ *
+ * The remote kthread's lock must be held.
+ *
+ * Returns the number of threads stolen.
+ */
+static uint32_t rq_steal(struct kthread *l, struct kthread *r)
+{
+	struct rq_ring *rq = r->rq;
+	uint32_t i, avail, rq_tail;
+
+	assert_spin_lock_held(&r->lock);
+
+	avail = load_acquire(&r->rq_head) - r->rq_tail;
+	if (!avail)
+		return 0;
+
+	/* steal half the tasks */
+	avail = MIN(div_up(avail, 2), l->rq->mask + 1);
+	rq_tail = r->rq_tail;
+	for (i = 0; i < avail; i++) {
+		l->rq->slots[(l->rq_head + i) & l->rq->mask] =
+			rq->slots[rq_tail++ & rq->mask];
+	}
+	store_release(&r->rq_tail, rq_tail);
+	rq_export_tail(r, avail);
+	store_release(&l->rq_head, l->rq_head + avail);
+	return avail;
+}
+
+#endif /* LOCKFREE_RQ */
+
 static void drain_overflow(struct kthread *l)
 {
 	thread_t *th;
@@ -154,11 +478,12 @@ static void drain_overflow(struct kthread *l)
 	assert_spin_lock_held(&l->lock);
 	assert(myk() == l || l->parked);
 
-	while (l->rq_head - l->rq_tail < RUNTIME_RQ_SIZE) {
+	while (!rq_full(l, load_acquire(&l->rq_tail))) {
 		th = list_pop(&l->rq_overflow, thread_t, link);
 		if (!th)
 			break;
-		l->rq[l->rq_head++ % RUNTIME_RQ_SIZE] = th;
+		l->rq->slots[l->rq_head & l->rq->mask] = th;
+		store_release(&l->rq_head, l->rq_head + 1);
 	}
 }
 
@@ -177,13 +502,22 @@ static bool work_available(struct kthread *k)
 
 static void update_oldest_tsc(struct kthread *k)
 {
+	struct rq_ring *rq;
 	thread_t *th;
+	uint32_t rq_tail;
 
+#ifndef LOCKFREE_RQ
 	assert_spin_lock_held(&k->lock);
+#endif
 
-	/* find the oldest thread in the runqueue */
-	if (load_acquire(&k->rq_head) != k->rq_tail) {
-		th = k->rq[k->rq_tail % RUNTIME_RQ_SIZE];
+	/*
+	 * find the oldest thread in the runqueue (deliberately racy with
+	 * thieves if the runqueue is lock-free)
+	 */
+	rq_tail = load_acquire(&k->rq_tail);
+	if (load_acquire(&k->rq_head) != rq_tail) {
+		rq = load_acquire(&k->rq);
+		th = rq->slots[rq_tail & rq->mask];
 		ACCESS_ONCE(k->q_ptrs->oldest_tsc) = th->ready_tsc;
 	}
 }
@@ -191,13 +525,37 @@ static void update_oldest_tsc(struct kthread *k)
 static bool steal_work(struct kthread *l, struct kthread *r)
 {
 	thread_t *th;
-	uint32_t i, avail, rq_tail, overflow = 0;
+	uint32_t avail;
 
 	assert_spin_lock_held(&l->lock);
-	assert(l->rq_head == 0 && l->rq_tail == 0);
+	assert(l->rq_head == l->rq_tail);
 
 	if (!work_available(r))
 		return false;
+
+#ifdef LOCKFREE_RQ
+	/*
+	 * Try to steal directly from the runqueue without taking the lock.
+	 * The scheduler normally counts as an RCU quiescent state, so mark
+	 * this kthread as running a thread (odd generation) while it may hold
+	 * a pointer to @r's ring. The barrier orders the mark before the ring
+	 * is loaded: either the RCU worker sees the odd generation and waits,
+	 * or the ring is loaded after rq_grow() replaced it.
+	 */
+	store_release(&l->rcu_gen, l->rcu_gen + 1);
+	mb();
+	avail = rq_steal(l, r);
+	if (avail)
+		update_oldest_tsc(r);
+	store_release(&l->rcu_gen, l->rcu_gen + 1);
+	if (avail) {
+		update_oldest_tsc(l);
+		ACCESS_ONCE(l->q_ptrs->rq_head) += avail;
+		STAT(THREADS_STOLEN) += avail;
+		return true;
+	}
+#endif
+
 	if (!spin_try_lock(&r->lock))
 		return false;
 
@@ -211,15 +569,11 @@ static bool steal_work(struct kthread *l, struct kthread *r)
 		drain_overflow(r);
 	}
 #endif
+#ifndef LOCKFREE_RQ
 	/* try to steal directly from the runqueue */
-	avail = load_acquire(&r->rq_head) - r->rq_tail;
+	avail = rq_steal(l, r);
 	if (avail) {
-		/* steal half the tasks */
-		avail = div_up(avail, 2);
-		rq_tail = r->rq_tail;
-		for (i = 0; i < avail; i++)
-			l->rq[i] = r->rq[rq_tail++ % RUNTIME_RQ_SIZE];
-		store_release(&r->rq_tail, rq_tail);
+		uint32_t overflow = 0;
 
 		/*
 		 * Drain the remote overflow queue, so newly readied tasks
@@ -234,24 +588,25 @@ static bool steal_work(struct kthread *l, struct kthread *r)
 			overflow++;
 		}
 
-		ACCESS_ONCE(r->q_ptrs->rq_tail) += avail + overflow;
+		rq_export_tail(r, overflow);
 		update_oldest_tsc(r);
 		spin_unlock(&r->lock);
 
-		l->rq_head = avail;
 		update_oldest_tsc(l);
 		ACCESS_ONCE(l->q_ptrs->rq_head) += avail + overflow;
 		STAT(THREADS_STOLEN) += avail + overflow;
 		return true;
 	}
+#endif
 
 	/* check for overflow tasks */
 	th = list_pop(&r->rq_overflow, thread_t, link);
 	if (th) {
-		ACCESS_ONCE(r->q_ptrs->rq_tail)++;
+		rq_export_tail(r, 1);
 		update_oldest_tsc(r);
 		spin_unlock(&r->lock);
-		l->rq[l->rq_head++ % RUNTIME_RQ_SIZE] = th;
+		l->rq->slots[l->rq_head & l->rq->mask] = th;
+		store_release(&l->rq_head, l->rq_head + 1);
 		ACCESS_ONCE(l->q_ptrs->oldest_tsc) = th->ready_tsc;
 		ACCESS_ONCE(l->q_ptrs->rq_head)++;
 		STAT(THREADS_STOLEN)++;
@@ -269,6 +624,266 @@ static bool steal_work(struct kthread *l, struct kthread *r)
 	return false;
 }
 
+/* only steal across sockets once the remote work has waited long enough */
+static bool remote_steal_allowed(struct kthread *r)
+{
+	uint64_t oldest_tsc = ACCESS_ONCE(r->q_ptrs->oldest_tsc);
+	uint64_t now = rdtsc();
+
+	return now > oldest_tsc &&
+	       now - oldest_tsc >= cycles_per_us * cfg_remote_steal_us;
+}
+
+/**
+ * steal_work_nearest - tries to steal work from the closest kthreads first
+ * @l: the local kthread
+ *
+ * Candidates with work are grouped by locality in a single pass over all
+ * kthreads (starting at a random index), and then tried from the closest
+ * group outward, so that cache-warm work stays within a core, an LLC, or a
+ * socket whenever possible.
+ *
+ * Returns true if work was found.
+ */
+static bool steal_work_nearest(struct kthread *l)
+{
+	uint16_t cand[LOCALITY_NR][NCPU];
+	unsigned int ncand[LOCALITY_NR] = {0};
+	unsigned int start_idx, loc;
+	struct kthread *r;
+	int i, idx;
+
+	start_idx = rand_crc32c((uintptr_t)l);
+	for (i = 0; i < nrks; i++) {
+		idx = (start_idx + i) % nrks;
+		r = ks[idx];
+		if (r == l || !work_available(r))
+			continue;
+		loc = cores_locality(l->curr_cpu, ACCESS_ONCE(r->curr_cpu));
+		cand[loc][ncand[loc]++] = idx;
+	}
+
+	for (loc = 0; loc < LOCALITY_NR; loc++) {
+		for (i = 0; i < ncand[loc]; i++) {
+			r = ks[cand[loc][i]];
+			if (loc == LOCALITY_REMOTE && !remote_steal_allowed(r)) {
+				STAT(REMOTE_STEALS_DEFERRED)++;
+				continue;
+			}
+			if (steal_work(l, r)) {
+				l->stats[STAT_STEALS_SIBLING + loc]++;
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Low priority support
+ *
+ * Low priority threads wait in a separate per-kthread list, protected by the
+ * kthread lock. They only run when there is no normal priority work to run or
+ * steal, or once they have waited longer than RUNTIME_LOW_PRIO_DEADLINE_US.
+ * They are not exported to the iokernel while they wait, so background work
+ * alone never causes cores to be granted.
+ */
+
+static void rq_low_add_locked(struct kthread *k, thread_t *th, bool head)
+{
+	assert_spin_lock_held(&k->lock);
+
+	if (head)
+		list_add(&k->rq_low, &th->link);
+	else
+		list_add_tail(&k->rq_low, &th->link);
+	ACCESS_ONCE(k->rq_low_cnt) = k->rq_low_cnt + 1;
+}
+
+static thread_t *rq_low_pop_locked(struct kthread *k)
+{
+	thread_t *th;
+
+	assert_spin_lock_held(&k->lock);
+
+	th = list_pop(&k->rq_low, thread_t, link);
+	if (th)
+		ACCESS_ONCE(k->rq_low_cnt) = k->rq_low_cnt - 1;
+	return th;
+}
+
+/* moves a low priority thread to the front of the local runqueue */
+static void rq_low_run_next(struct kthread *l, thread_t *th)
+{
+	assert_spin_lock_held(&l->lock);
+
+	/* time spent waiting as background work isn't queueing delay */
+	if (l->rq_head != l->rq_tail)
+		th->ready_tsc = l->rq->slots[l->rq_tail & l->rq->mask]->ready_tsc;
+	else
+		th->ready_tsc = rdtsc();
+	rq_push_head_locked(l, th);
+	ACCESS_ONCE(l->q_ptrs->oldest_tsc) = th->ready_tsc;
+	ACCESS_ONCE(l->q_ptrs->rq_head)++;
+	STAT(LOW_PRIO_RUNS)++;
+}
+
+/* returns true if the oldest local low priority thread is past its deadline */
+static bool rq_low_expired(struct kthread *l)
+{
+	thread_t *th = list_top(&l->rq_low, thread_t, link);
+
+	return th && rdtsc() - th->ready_tsc >=
+		     cycles_per_us * RUNTIME_LOW_PRIO_DEADLINE_US;
+}
+
+/* exposes waiting low priority threads to the iokernel before parking */
+static void rq_low_flush_locked(struct kthread *k)
+{
+	assert_spin_lock_held(&k->lock);
+
+	if (likely(!k->rq_low_cnt))
+		return;
+
+	ACCESS_ONCE(k->q_ptrs->rq_head) += k->rq_low_cnt;
+	list_append_list(&k->rq_overflow, &k->rq_low);
+	ACCESS_ONCE(k->rq_low_cnt) = 0;
+}
+
+/* tries to steal one low priority thread from any other kthread */
+static bool steal_low_prio(struct kthread *l)
+{
+	unsigned int start_idx;
+	struct kthread *r;
+	thread_t *th;
+	int i;
+
+	start_idx = rand_crc32c((uintptr_t)l);
+	for (i = 0; i < nrks; i++) {
+		r = ks[(start_idx + i) % nrks];
+		if (r == l || !ACCESS_ONCE(r->rq_low_cnt))
+			continue;
+		if (!spin_try_lock(&r->lock))
+			continue;
+		th = rq_low_pop_locked(r);
+		spin_unlock(&r->lock);
+		if (th) {
+			rq_low_run_next(l, th);
+			STAT(LOW_PRIO_STOLEN)++;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Idle kthread handoff
+ *
+ * While a kthread polls for work, it opens its mailbox and advertises itself
+ * in the idle mask of its NUMA node. If thread_ready() finds the local
+ * runqueue already has work queued, it hands the thread directly to an idle
+ * kthread on the same node. The idle kthread doesn't have to find the thread
+ * by stealing. The mailbox is closed before the kthread stops polling, so a
+ * handed off thread is never stranded on a parked kthread.
+ *
+ * Each node's mask has its own cache line, so kthreads going idle and busy
+ * only touch a line shared with their node, and thread_ready() only reads
+ * it. A kthread only changes node while parked, so it always opens and
+ * closes its mailbox in the same mask.
+ */
+
+struct idle_mask {
+	DEFINE_BITMAP(kthreads, NCPU);
+} __aligned(CACHE_LINE_SIZE);
+
+static struct idle_mask idle_masks[NNUMA];
+
+/* is any kthread on this kthread's node idle? */
+static inline bool idle_kthreads_nearby(void)
+{
+	unsigned long *mask = idle_masks[thread_numa_node].kthreads;
+	int i;
+
+	for (i = 0; i < BITMAP_LONG_SIZE(nrks); i++) {
+		if (ACCESS_ONCE(mask[i]))
+			return true;
+	}
+
+	return false;
+}
+
+/* adds a runnable thread at the tail of the local runqueue */
+static void rq_enqueue_locked(struct kthread *k, thread_t *th)
+{
+	assert_spin_lock_held(&k->lock);
+
+	if (unlikely(th->prio != THREAD_PRIO_NORMAL)) {
+		rq_low_add_locked(k, th, false);
+		return;
+	}
+	if (unlikely(rq_full(k, k->rq_tail)) && !rq_grow(k)) {
+		list_add_tail(&k->rq_overflow, &th->link);
+		ACCESS_ONCE(k->q_ptrs->rq_head)++;
+		STAT(RQ_OVERFLOW)++;
+		return;
+	}
+
+	k->rq->slots[k->rq_head & k->rq->mask] = th;
+	store_release(&k->rq_head, k->rq_head + 1);
+	if (k->rq_head - load_acquire(&k->rq_tail) == 1)
+		ACCESS_ONCE(k->q_ptrs->oldest_tsc) = th->ready_tsc;
+	ACCESS_ONCE(k->q_ptrs->rq_head)++;
+}
+
+static void mailbox_open(struct kthread *l)
+{
+	store_release(&l->mailbox, NULL);
+	bitmap_atomic_set(idle_masks[thread_numa_node].kthreads,
+			  l->kthread_idx);
+}
+
+static void mailbox_close(struct kthread *l)
+{
+	thread_t *th;
+
+	bitmap_atomic_clear(idle_masks[thread_numa_node].kthreads,
+			    l->kthread_idx);
+
+	/* take any thread that was handed off before the mailbox closed */
+	th = __atomic_exchange_n(&l->mailbox, MAILBOX_CLOSED, __ATOMIC_ACQ_REL);
+	if (th) {
+		rq_enqueue_locked(l, th);
+		STAT(HANDOFFS_RECEIVED)++;
+	}
+}
+
+/* tries to hand a runnable thread to an idle kthread on the same node */
+static bool thread_handoff(struct kthread *k, thread_t *th)
+{
+	unsigned long *mask = idle_masks[thread_numa_node].kthreads;
+	struct kthread *r;
+	int i, idx;
+
+	if (unlikely(is_world_stopped()))
+		return false;
+
+	for (i = 1; i < nrks; i++) {
+		idx = (k->kthread_idx + i) % nrks;
+		if (!bitmap_test(mask, idx))
+			continue;
+		r = ks[idx];
+		if (__sync_bool_compare_and_swap(&r->mailbox, NULL, th)) {
+			STAT(HANDOFFS)++;
+			return true;
+		}
+	}
+
+	STAT(HANDOFFS_FAILED)++;
+	return false;
+}
+
 static __noinline bool do_watchdog(struct kthread *l)
 {
 	bool work;
@@ -281,21 +896,38 @@ static __noinline bool do_watchdog(struct kthread *l)
 	return work;
 }
 
+/* starts the time slice of a uthread that is being switched in */
+static inline void preempt_slice_start(uint64_t now)
+{
+	if (cfg_quantum_us)
+		preempt_slice_end_tsc = now + cycles_per_us * cfg_quantum_us;
+}
+
+/* accounts for the time a uthread ran since it was last switched in */
+static inline void thread_account_run(struct kthread *k, thread_t *th,
+				      uint64_t now)
+{
+	th->run_cycles += now - last_tsc;
+	lat_hist_add(&k->run_time_hist, now - last_tsc);
+}
+
 /* the main scheduler routine, decides what to run next */
 static __noreturn __noinline void schedule(void)
 {
 	struct kthread *r = NULL, *l = myk();
 	uint64_t start_tsc, end_tsc;
 	thread_t *th = NULL;
-	unsigned int start_idx;
 	unsigned int iters = 0;
-	int i, sibling;
+	bool idle = false;
+	int sibling;
 
 	assert_spin_lock_held(&l->lock);
 	assert(l->parked == false);
 
 	/* unmark busy for the stack of the last uthread */
+	start_tsc = rdtsc();
 	if (likely(__self != NULL)) {
+		thread_account_run(l, __self, start_tsc);
 		store_release(&__self->thread_running, false);
 		__self = NULL;
 	}
@@ -308,7 +940,6 @@ static __noreturn __noinline void schedule(void)
 
 	/* update entry stat counters */
 	STAT(RESCHEDULES)++;
-	start_tsc = rdtsc();
 	STAT(PROGRAM_CYCLES) += start_tsc - last_tsc;
 
 	/* increment the RCU generation number (even is in scheduler) */
@@ -334,14 +965,30 @@ static __noreturn __noinline void schedule(void)
 	if (unlikely(!list_empty(&l->rq_overflow)))
 		drain_overflow(l);
 
+	/* run a low priority thread if it has waited too long */
+	if (unlikely(l->rq_low_cnt) && rq_low_expired(l)) {
+		rq_low_run_next(l, rq_low_pop_locked(l));
+		STAT(LOW_PRIO_DEADLINES)++;
+		goto done;
+	}
+
 	/* first try the local runqueue */
 	if (l->rq_head != l->rq_tail)
 		goto done;
 
+#ifndef LOCKFREE_RQ
 	/* reset the local runqueue since it's empty */
 	l->rq_head = l->rq_tail = 0;
+#endif
+
+	/* don't strand items freed to other nodes while idle */
+	smalloc_flush_remote();
 
 again:
+	/* take a thread that another kthread handed off */
+	if (idle && unlikely(ACCESS_ONCE(l->mailbox) != NULL))
+		goto done;
+
 	/* then check for local softirqs */
 	if (softirq_sched(l)) {
 		STAT(SOFTIRQS_LOCAL)++;
@@ -351,15 +998,27 @@ again:
 	/* then try to steal from a sibling kthread */
 	sibling = cpu_map[l->curr_cpu].sibling_core;
 	r = cpu_map[sibling].recent_kthread;
-	if (r && r != l && steal_work(l, r))
+	if (r && r != l && steal_work(l, r)) {
+		STAT(STEALS_SIBLING)++;
 		goto done;
+	}
 
-	/* try to steal from every kthread */
-	start_idx = rand_crc32c((uintptr_t)l);
-	for (i = 0; i < nrks; i++) {
-		int idx = (start_idx + i) % nrks;
-		if (ks[idx] != l && steal_work(l, ks[idx]))
-			goto done;
+	/* then try every other kthread, nearest first */
+	if (steal_work_nearest(l))
+		goto done;
+
+	/* then fall back to low priority threads, local ones first */
+	if (unlikely(l->rq_low_cnt)) {
+		rq_low_run_next(l, rq_low_pop_locked(l));
+		goto done;
+	}
+	if (steal_low_prio(l))
+		goto done;
+
+	/* let other kthreads hand threads to this one while it polls */
+	if (!idle && !is_world_stopped()) {
+		mailbox_open(l);
+		idle = true;
 	}
 
 	/* recheck for local softirqs one last time */
@@ -369,8 +1028,13 @@ again:
 	}
 
 #ifdef GC
-	if (unlikely(get_gc_gen() != l->local_gc_gen))
+	if (unlikely(get_gc_gen() != l->local_gc_gen)) {
+		if (idle) {
+			mailbox_close(l);
+			idle = false;
+		}
 		gc_kthread_report(l);
+	}
 #endif
 
 	/* keep trying to find work until the polling timeout expires */
@@ -381,6 +1045,22 @@ again:
 		goto again;
 	}
 
+	if (idle) {
+		mailbox_close(l);
+		idle = false;
+		if (l->rq_head != l->rq_tail)
+			goto done;
+	}
+
+	/* don't hold up a grace period while parked (pairs with rcu_gp_run()) */
+	mb();
+	if (unlikely(rcu_qs_pending(l))) {
+		spin_unlock(&l->lock);
+		rcu_report_qs(l);
+		spin_lock(&l->lock);
+		goto again;
+	}
+
 	l->parked = true;
 	spin_unlock(&l->lock);
 
@@ -396,10 +1076,17 @@ again:
 	goto again;
 
 done:
+	if (idle) {
+		mailbox_close(l);
+		idle = false;
+	}
+
 	/* pop off a thread and run it */
-	assert(l->rq_head != l->rq_tail);
-	th = l->rq[l->rq_tail++ % RUNTIME_RQ_SIZE];
-	ACCESS_ONCE(l->q_ptrs->rq_tail)++;
+	th = rq_pop(l);
+	if (unlikely(!th)) {
+		/* thieves got to the runqueue first */
+		goto again;
+	}
 
 	/* move overflow tasks into the runqueue */
 	if (unlikely(!list_empty(&l->rq_overflow)))
@@ -408,10 +1095,15 @@ done:
 	update_oldest_tsc(l);
 	spin_unlock(&l->lock);
 
+	/* the scheduler is a quiescent state */
+	rcu_note_qs(l);
+
 	/* update exit stat counters */
 	end_tsc = rdtsc();
 	STAT(SCHED_CYCLES) += end_tsc - start_tsc;
 	last_tsc = end_tsc;
+	preempt_slice_start(end_tsc);
+	lat_hist_add(&l->sched_delay_hist, end_tsc - th->ready_tsc);
 	if (cores_have_affinity(th->last_cpu, l->curr_cpu))
 		STAT(LOCAL_RUNS)++;
 	else
@@ -445,25 +1137,28 @@ static __always_inline void enter_schedule(thread_t *curth)
 	spin_lock(&k->lock);
 	now = rdtsc();
 
-	/* slow path: switch from the uthread stack to the runtime stack */
-	if (k->rq_head == k->rq_tail ||
+	/*
+	 * slow path: switch from the uthread stack to the runtime stack,
+	 * otherwise pop the next runnable thread from the queue
+	 */
+	if (
 #ifdef GC
 	    get_gc_gen() != k->local_gc_gen ||
 #endif
 	    (!disable_watchdog &&
 	     unlikely(now - last_watchdog_tsc >
-		      cycles_per_us * RUNTIME_WATCHDOG_US))) {
+		      cycles_per_us * RUNTIME_WATCHDOG_US)) ||
+	    !(th = rq_pop(k))) {
 		jmp_runtime(schedule);
 		return;
 	}
 
 	/* fast path: switch directly to the next uthread */
 	STAT(PROGRAM_CYCLES) += now - last_tsc;
+	thread_account_run(k, curth, now);
 	last_tsc = now;
-
-	/* pop the next runnable thread from the queue */
-	th = k->rq[k->rq_tail++ % RUNTIME_RQ_SIZE];
-	ACCESS_ONCE(k->q_ptrs->rq_tail)++;
+	preempt_slice_start(now);
+	lat_hist_add(&k->sched_delay_hist, now - th->ready_tsc);
 
 	/* move overflow tasks into the runqueue */
 	if (unlikely(!list_empty(&k->rq_overflow)))
@@ -480,6 +1175,7 @@ static __always_inline void enter_schedule(thread_t *curth)
 	store_release(&k->rcu_gen, k->rcu_gen + 2);
 	ACCESS_ONCE(k->q_ptrs->rcu_gen) += 2;
 	assert((k->rcu_gen & 0x1) == 0x1);
+	rcu_note_qs(k);
 
 	/* check for misuse of preemption disabling */
 	BUG_ON((preempt_cnt & ~PREEMPT_NOT_PENDING) != 1);
@@ -575,18 +1271,7 @@ void thread_ready_locked(thread_t *th)
 	assert_spin_lock_held(&k->lock);
 
 	thread_ready_prepare(k, th);
-	if (unlikely(k->rq_head - k->rq_tail >= RUNTIME_RQ_SIZE)) {
-		assert(k->rq_head - k->rq_tail == RUNTIME_RQ_SIZE);
-		list_add_tail(&k->rq_overflow, &th->link);
-		ACCESS_ONCE(k->q_ptrs->rq_head)++;
-		STAT(RQ_OVERFLOW)++;
-		return;
-	}
-
-	k->rq[k->rq_head++ % RUNTIME_RQ_SIZE] = th;
-	if (k->rq_head - k->rq_tail == 1)
-		ACCESS_ONCE(k->q_ptrs->oldest_tsc) = th->ready_tsc;
-	ACCESS_ONCE(k->q_ptrs->rq_head)++;
+	rq_enqueue_locked(k, th);
 }
 
 /**
@@ -600,22 +1285,19 @@ void thread_ready_locked(thread_t *th)
 void thread_ready_head_locked(thread_t *th)
 {
 	struct kthread *k = myk();
-	thread_t *oldestth;
 
 	assert_preempt_disabled();
 	assert_spin_lock_held(&k->lock);
 
 	thread_ready_prepare(k, th);
+	if (unlikely(th->prio != THREAD_PRIO_NORMAL)) {
+		rq_low_add_locked(k, th, true);
+		return;
+	}
 
 	if (k->rq_head != k->rq_tail)
-		th->ready_tsc = k->rq[k->rq_tail % RUNTIME_RQ_SIZE]->ready_tsc;
-	oldestth = k->rq[--k->rq_tail % RUNTIME_RQ_SIZE];
-	k->rq[k->rq_tail % RUNTIME_RQ_SIZE] = th;
-	if (unlikely(k->rq_head - k->rq_tail > RUNTIME_RQ_SIZE)) {
-		list_add(&k->rq_overflow, &oldestth->link);
-		k->rq_head--;
-		STAT(RQ_OVERFLOW)++;
-	}
+		th->ready_tsc = k->rq->slots[k->rq_tail & k->rq->mask]->ready_tsc;
+	rq_push_head_locked(k, th);
 	ACCESS_ONCE(k->q_ptrs->oldest_tsc) = th->ready_tsc;
 	ACCESS_ONCE(k->q_ptrs->rq_head)++;
 }
@@ -633,19 +1315,37 @@ void thread_ready(thread_t *th)
 
 	k = getk();
 	thread_ready_prepare(k, th);
-	rq_tail = load_acquire(&k->rq_tail);
-	if (unlikely(k->rq_head - rq_tail >= RUNTIME_RQ_SIZE)) {
-		assert(k->rq_head - rq_tail == RUNTIME_RQ_SIZE);
+	if (unlikely(th->prio != THREAD_PRIO_NORMAL)) {
 		spin_lock(&k->lock);
-		list_add_tail(&k->rq_overflow, &th->link);
+		rq_low_add_locked(k, th, false);
 		spin_unlock(&k->lock);
-		ACCESS_ONCE(k->q_ptrs->rq_head)++;
 		putk();
-		STAT(RQ_OVERFLOW)++;
 		return;
 	}
 
-	k->rq[k->rq_head % RUNTIME_RQ_SIZE] = th;
+	rq_tail = load_acquire(&k->rq_tail);
+
+	/* hand the thread to an idle kthread rather than wait behind others */
+	if (k->rq_head != rq_tail && unlikely(idle_kthreads_nearby()) &&
+	    thread_handoff(k, th)) {
+		putk();
+		return;
+	}
+
+	if (unlikely(rq_full(k, rq_tail))) {
+		spin_lock(&k->lock);
+		if (!rq_grow(k)) {
+			list_add_tail(&k->rq_overflow, &th->link);
+			spin_unlock(&k->lock);
+			ACCESS_ONCE(k->q_ptrs->rq_head)++;
+			putk();
+			STAT(RQ_OVERFLOW)++;
+			return;
+		}
+		spin_unlock(&k->lock);
+	}
+
+	k->rq->slots[k->rq_head & k->rq->mask] = th;
 	store_release(&k->rq_head, k->rq_head + 1);
 	if (k->rq_head - load_acquire(&k->rq_tail) == 1)
 		ACCESS_ONCE(k->q_ptrs->oldest_tsc) = th->ready_tsc;
@@ -662,31 +1362,122 @@ void thread_ready(thread_t *th)
 void thread_ready_head(thread_t *th)
 {
 	struct kthread *k;
-	thread_t *oldestth;
 
 	k = getk();
 	thread_ready_prepare(k, th);
 	spin_lock(&k->lock);
-	if (k->rq_head != k->rq_tail)
-		th->ready_tsc = k->rq[k->rq_tail % RUNTIME_RQ_SIZE]->ready_tsc;
-	oldestth = k->rq[--k->rq_tail % RUNTIME_RQ_SIZE];
-	k->rq[k->rq_tail % RUNTIME_RQ_SIZE] = th;
-	if (unlikely(k->rq_head - k->rq_tail > RUNTIME_RQ_SIZE)) {
-		list_add(&k->rq_overflow, &oldestth->link);
-		k->rq_head--;
-		STAT(RQ_OVERFLOW)++;
+	if (unlikely(th->prio != THREAD_PRIO_NORMAL)) {
+		rq_low_add_locked(k, th, true);
+		spin_unlock(&k->lock);
+		putk();
+		return;
 	}
+	if (k->rq_head != k->rq_tail)
+		th->ready_tsc = k->rq->slots[k->rq_tail & k->rq->mask]->ready_tsc;
+	rq_push_head_locked(k, th);
 	spin_unlock(&k->lock);
 	ACCESS_ONCE(k->q_ptrs->oldest_tsc) = th->ready_tsc;
 	ACCESS_ONCE(k->q_ptrs->rq_head)++;
 	putk();
 }
 
+/* publishes threads at the tail of the local runqueue, growing it to fit */
+static void rq_enqueue_many_locked(struct kthread *k, thread_t **ths,
+				   uint32_t nr)
+{
+	uint32_t rq_tail, room, i;
+	bool was_empty;
+
+	assert_spin_lock_held(&k->lock);
+
+	/* make room for as much of the batch as possible */
+	rq_tail = load_acquire(&k->rq_tail);
+	was_empty = k->rq_head == rq_tail;
+	while (k->rq_head - rq_tail + nr > k->rq->mask + 1 && rq_grow(k))
+		rq_tail = load_acquire(&k->rq_tail);
+	room = k->rq->mask + 1 - (k->rq_head - rq_tail);
+
+	for (i = 0; i < MIN(nr, room); i++)
+		k->rq->slots[(k->rq_head + i) & k->rq->mask] = ths[i];
+	store_release(&k->rq_head, k->rq_head + i);
+	for (; i < nr; i++) {
+		list_add_tail(&k->rq_overflow, &ths[i]->link);
+		STAT(RQ_OVERFLOW)++;
+	}
+
+	if (was_empty)
+		ACCESS_ONCE(k->q_ptrs->oldest_tsc) = ths[0]->ready_tsc;
+	ACCESS_ONCE(k->q_ptrs->rq_head) += nr;
+}
+
+#define READY_MANY_BATCH	32
+
+/**
+ * thread_ready_many - makes a batch of uthreads runnable (at the tail of the
+ * queue)
+ * @ths: the threads to mark runnable
+ * @n: the number of threads
+ *
+ * Cheaper than calling thread_ready() @n times: the batch is published with
+ * one kthread lock acquisition and one update of the exported queue for
+ * every READY_MANY_BATCH threads. The runqueue grows to hold the whole batch
+ * when it can, so idle kthreads can steal half of it at a time instead of
+ * taking threads one by one from the overflow queue. Like thread_ready(),
+ * threads that would wait behind others are handed to idle kthreads first.
+ *
+ * This function can only be called when the threads are parked. @ths is not
+ * modified.
+ */
+void thread_ready_many(thread_t **ths, int n)
+{
+	thread_t *batch[READY_MANY_BATCH], *th;
+	struct kthread *k;
+	bool handoff = true;
+	uint32_t nr;
+	int i = 0;
+
+	k = getk();
+	while (i < n) {
+		for (nr = 0; i < n && nr < READY_MANY_BATCH; i++) {
+			th = ths[i];
+			thread_ready_prepare(k, th);
+
+			/* low priority threads wait on their own list */
+			if (unlikely(th->prio != THREAD_PRIO_NORMAL)) {
+				spin_lock(&k->lock);
+				rq_low_add_locked(k, th, false);
+				spin_unlock(&k->lock);
+				continue;
+			}
+
+			/* stop handing off once no idle kthread takes one */
+			if (handoff &&
+			    (nr || k->rq_head != load_acquire(&k->rq_tail)) &&
+			    unlikely(idle_kthreads_nearby())) {
+				if (thread_handoff(k, th))
+					continue;
+				handoff = false;
+			}
+
+			batch[nr++] = th;
+		}
+
+		if (!nr)
+			continue;
+		spin_lock(&k->lock);
+		rq_enqueue_many_locked(k, batch, nr);
+		spin_unlock(&k->lock);
+	}
+	putk();
+}
+
 static void thread_finish_cede(void)
 {
 	struct kthread *k = myk();
-	thread_t *th, *myth = thread_self();
+	thread_t *myth = thread_self();
+	uint64_t now = rdtsc();
 
+	thread_account_run(k, myth, now);
 	myth->thread_running = false;
 	myth->thread_ready = true;
 	myth->last_cpu = k->curr_cpu;
@@ -695,7 +1486,7 @@ static void thread_finish_cede(void)
 	/* clear thread run start time */
 	ACCESS_ONCE(k->q_ptrs->run_start_tsc) = UINT64_MAX;
 
-	STAT(PROGRAM_CYCLES) += rdtsc() - last_tsc;
+	STAT(PROGRAM_CYCLES) += now - last_tsc;
 
 	/* ensure preempted thread cuts the line,
 	 * possibly displacing the newest element in a full runqueue
@@ -704,19 +1495,16 @@ static void thread_finish_cede(void)
 	spin_lock(&k->lock);
 	ACCESS_ONCE(k->q_ptrs->oldest_tsc) = myth->ready_tsc;
 	ACCESS_ONCE(k->q_ptrs->rq_head)++;
-	th = k->rq[--k->rq_tail % RUNTIME_RQ_SIZE];
-	k->rq[k->rq_tail % RUNTIME_RQ_SIZE] = myth;
-	if (unlikely(k->rq_head - k->rq_tail > RUNTIME_RQ_SIZE)) {
-		list_add(&k->rq_overflow, &th->link);
-		k->rq_head--;
-		STAT(RQ_OVERFLOW)++;
-	}
+	rq_push_head_locked(k, myth);
+	rq_low_flush_locked(k);
 	spin_unlock(&k->lock);
 
 	/* increment the RCU generation number (even - pretend in sched) */
 	store_release(&k->rcu_gen, k->rcu_gen + 1);
 	ACCESS_ONCE(k->q_ptrs->rcu_gen) += 1;
 	assert((k->rcu_gen & 0x1) == 0x0);
+	mb();
+	rcu_note_qs(k);
 
 	/* cede this kthread to the iokernel */
 	ACCESS_ONCE(k->parked) = true; /* deliberately racy */
@@ -744,7 +1532,7 @@ void thread_cede(void)
 	jmp_runtime(thread_finish_cede);
 }
 
-static __always_inline thread_t *__thread_create(void)
+static __always_inline thread_t *__thread_create(unsigned int stack_class)
 {
 	struct thread *th;
 	struct stack *s;
@@ -756,7 +1544,7 @@ static __always_inline thread_t *__thread_create(void)
 		return NULL;
 	}
 
-	s = stack_alloc();
+	s = stack_alloc(stack_class);
 	if (unlikely(!s)) {
 		tcache_free(&perthread_get(thread_pt), th);
 		preempt_enable();
@@ -766,10 +1554,13 @@ static __always_inline thread_t *__thread_create(void)
 	preempt_enable();
 
 	th->stack = s;
+	th->stack_class = stack_class;
 	th->main_thread = false;
+	th->prio = THREAD_PRIO_NORMAL;
 	th->thread_ready = false;
 	th->thread_running = false;
 	th->run_start_tsc = UINT64_MAX;
+	th->run_cycles = 0;
 
 	return th;
 }
@@ -783,11 +1574,11 @@ static __always_inline thread_t *__thread_create(void)
  */
 thread_t *thread_create(thread_fn_t fn, void *arg)
 {
-	thread_t *th = __thread_create();
+	thread_t *th = __thread_create(cfg_stack_class);
 	if (unlikely(!th))
 		return NULL;
 
-	th->tf.rsp = stack_init_to_rsp(th->stack, thread_exit);
+	th->tf.rsp = stack_init_to_rsp(th->stack, th->stack_class, thread_exit);
 	th->tf.rdi = (uint64_t)arg;
 	th->tf.rbp = (uint64_t)0; /* just in case base pointers are enabled */
 	th->tf.rip = (uint64_t)fn;
@@ -807,12 +1598,12 @@ thread_t *thread_create(thread_fn_t fn, void *arg)
 thread_t *thread_create_with_buf(thread_fn_t fn, void **buf, size_t buf_len)
 {
 	void *ptr;
-	thread_t *th = __thread_create();
+	thread_t *th = __thread_create(cfg_stack_class);
 	if (unlikely(!th))
 		return NULL;
 
-	th->tf.rsp = stack_init_to_rsp_with_buf(th->stack, &ptr, buf_len,
-						thread_exit);
+	th->tf.rsp = stack_init_to_rsp_with_buf(th->stack, th->stack_class,
+						&ptr, buf_len, thread_exit);
 	th->tf.rdi = (uint64_t)ptr;
 	th->tf.rbp = (uint64_t)0; /* just in case base pointers are enabled */
 	th->tf.rip = (uint64_t)fn;
@@ -821,6 +1612,87 @@ thread_t *thread_create_with_buf(thread_fn_t fn, void **buf, size_t buf_len)
 	return th;
 }
 
+/**
+ * thread_get_run_cycles - returns the CPU time a thread has used, in cycles
+ * @th: the thread (may be the calling thread)
+ */
+uint64_t thread_get_run_cycles(thread_t *th)
+{
+	uint64_t cycles;
+
+	if (th != thread_self())
+		return ACCESS_ONCE(th->run_cycles);
+
+	preempt_disable();
+	cycles = th->run_cycles + rdtsc() - last_tsc;
+	preempt_enable();
+	return cycles;
+}
+
+/**
+ * thread_create_with_stack_size - creates a new thread with a minimum stack size
+ * @fn: a function pointer to the starting method of the thread
+ * @arg: an argument passed to @fn
+ * @stack_size: the minimum usable stack size in bytes
+ *
+ * The stack is taken from the smallest size class that fits @stack_size.
+ *
+ * Returns a thread, or NULL if out of memory or @stack_size is too large.
+ */
+thread_t *thread_create_with_stack_size(thread_fn_t fn, void *arg,
+					size_t stack_size)
+{
+	int cls = stack_size_to_class(stack_size);
+	thread_t *th;
+
+	if (unlikely(cls < 0))
+		return NULL;
+
+	th = __thread_create(cls);
+	if (unlikely(!th))
+		return NULL;
+
+	th->tf.rsp = stack_init_to_rsp(th->stack, cls, thread_exit);
+	th->tf.rdi = (uint64_t)arg;
+	th->tf.rbp = (uint64_t)0; /* just in case base pointers are enabled */
+	th->tf.rip = (uint64_t)fn;
+	gc_register_thread(th);
+	return th;
+}
+
+/**
+ * thread_create_with_prio - creates a new thread with a priority class
+ * @fn: a function pointer to the starting method of the thread
+ * @arg: an argument passed to @fn
+ * @prio: the priority class (THREAD_PRIO_*)
+ *
+ * Returns a thread, or NULL if out of memory.
+ */
+thread_t *thread_create_with_prio(thread_fn_t fn, void *arg, int prio)
+{
+	thread_t *th = thread_create(fn, arg);
+	if (unlikely(!th))
+		return NULL;
+
+	thread_set_prio(th, prio);
+	return th;
+}
+
+/**
+ * thread_set_prio - sets the priority class of a thread
+ * @th: the thread
+ * @prio: the priority class (THREAD_PRIO_*)
+ *
+ * The thread must not be runnable; the new class applies the next time it is
+ * made runnable.
+ */
+void thread_set_prio(thread_t *th, int prio)
+{
+	BUG_ON(prio < 0 || prio >= THREAD_PRIO_NR);
+	BUG_ON(th->thread_ready);
+	th->prio = prio;
+}
+
 /**
  * thread_spawn - creates and launches a new thread
  * @fn: a function pointer to the starting method of the thread
@@ -837,6 +1709,39 @@ int thread_spawn(thread_fn_t fn, void *arg)
 	return 0;
 }
 
+/**
+ * thread_spawn_many - creates and launches a batch of threads
+ * @fn: a function pointer to the starting method of each thread
+ * @args: an array of @n arguments, one passed to each thread
+ * @n: the number of threads
+ *
+ * Threads are made runnable in batches with thread_ready_many().
+ *
+ * Returns the number of threads launched, which is less than @n only if out
+ * of memory.
+ */
+int thread_spawn_many(thread_fn_t fn, void **args, int n)
+{
+	thread_t *ths[RUNTIME_SPAWN_BATCH];
+	int i, nr, done = 0;
+
+	while (done < n) {
+		nr = MIN(n - done, RUNTIME_SPAWN_BATCH);
+		for (i = 0; i < nr; i++) {
+			ths[i] = thread_create(fn, args[done + i]);
+			if (unlikely(!ths[i]))
+				break;
+		}
+
+		thread_ready_many(ths, i);
+		done += i;
+		if (unlikely(i < nr))
+			break;
+	}
+
+	return done;
+}
+
 /**
  * thread_spawn_main - creates and launches the main thread
  * @fn: a function pointer to the starting method of the thread
@@ -870,8 +1775,9 @@ static void thread_finish_exit(void)
 	if (unlikely(th->main_thread))
 		init_shutdown(EXIT_SUCCESS);
 
+	thread_account_run(myk(), th, rdtsc());
 	gc_remove_thread(th);
-	stack_free(th->stack);
+	stack_free(th->stack, th->stack_class);
 	tcache_free(&perthread_get(thread_pt), th);
 	__self = NULL;
 
@@ -940,12 +1846,17 @@ int sched_init_thread(void)
 
 	tcache_init_perthread(thread_tcache, &perthread_get(thread_pt));
 
-	s = stack_alloc();
+	myk()->rq = rq_ring_alloc(cfg_rq_size);
+	if (!myk()->rq)
+		return -ENOMEM;
+
+	s = stack_alloc(STACK_CLASS_MAX);
 	if (!s)
 		return -ENOMEM;
 
 	runtime_stack_base = (void *)s;
-	runtime_stack = (void *)stack_init_to_rsp(s, runtime_top_of_stack); 
+	runtime_stack = (void *)stack_init_to_rsp(s, STACK_CLASS_MAX,
+						  runtime_top_of_stack);
 
 	return 0;
 }
@@ -975,6 +1886,13 @@ int sched_init(void)
 	}
 
 	for (i = 0; i < cpu_count; i++) {
+		/* a core without a hyperthread sibling is its own sibling */
+		cpu_map[i].sibling_core = i;
+		cpu_map[i].llc_id = bitmap_find_next_set(
+			cpu_info_tbl[i].llc_siblings_mask, cpu_count, 0);
+		cpu_map[i].package = cpu_info_tbl[i].package;
+		cpu_map[i].numa_node = cpu_info_tbl[i].numa_node;
+
 		siblings = 0;
 		bitmap_for_each_set(cpu_info_tbl[i].thread_siblings_mask,
 				    cpu_count, j) {
@@ -1,6 +1,14 @@
 /*
  * smalloc.c - a simple malloc implementation built on top of the base
  * libary slab and thread-local cache allocator
+ *
+ * Each NUMA node has its own thread-local caches, and a kthread allocates
+ * from the node of the core it is currently running on. Items freed on a
+ * different node are batched and handed back to their home node rather than
+ * recycled locally, so hot buffers don't bounce between sockets.
+ *
+ * Allocations larger than the biggest size class are backed directly by runs
+ * of contiguous 2MB pages, so their size is rounded up to a multiple of 2MB.
  */
 
 #include <base/page.h>
@@ -15,11 +23,27 @@
 #define SMALLOC_BITS            15
 #define SMALLOC_MIN_SIZE	SLAB_MIN_SIZE
 #define SMALLOC_MAX_SIZE        (SMALLOC_MIN_SIZE << (SMALLOC_BITS - 1))
+#define SMALLOC_REMOTE_BATCH	16
 BUILD_ASSERT(SMALLOC_MIN_SIZE >= SLAB_MIN_SIZE);
 
+/* a batch of items waiting to be returned to another node */
+struct smalloc_remote {
+	void			*head;
+	void			*tail;
+	unsigned int		nr;
+};
+
 static struct slab smalloc_slabs[SMALLOC_BITS];
-static struct tcache *smalloc_tcaches[SMALLOC_BITS];
-static DEFINE_PERTHREAD(struct tcache_perthread, smalloc_pts[SMALLOC_BITS]);
+static struct tcache *smalloc_tcaches[NNUMA][SMALLOC_BITS];
+static DEFINE_PERTHREAD(struct tcache_perthread,
+			smalloc_pts[NNUMA][SMALLOC_BITS]);
+static DEFINE_PERTHREAD(struct smalloc_remote,
+			smalloc_remotes[NNUMA][SMALLOC_BITS]);
+
+/* set once this kthread can allocate from smalloc */
+__thread bool smalloc_thread_ready;
+/* the number of items this kthread has batched for other nodes */
+static __thread unsigned int smalloc_remote_pending;
 
 /**
  * smalloc_size_to_idx - converts a size to a cache index
@@ -51,6 +75,32 @@ static const char *slab_names[SMALLOC_BITS] = {
 	"smalloc (256 KB)",
 };
 
+/* is the item backed by a run of large pages rather than a slab? */
+static inline bool smalloc_is_large(void *item)
+{
+	return !(addr_to_page(item)->flags & PAGE_FLAG_SLAB);
+}
+
+static void *smalloc_large(size_t size)
+{
+	void *item;
+
+	/* zero-sized allocations still return a unique pointer */
+	if (size == 0)
+		return smalloc(1);
+
+	/* no node has more address space than this (also avoids overflow) */
+	if (unlikely(size > LGPAGE_NODE_ADDR_LEN))
+		return NULL;
+
+	preempt_disable();
+	item = page_alloc_run_on_node(div_up(size, PGSIZE_2MB),
+				      thread_numa_node);
+	preempt_enable();
+
+	return item;
+}
+
 /**
  * smalloc - allocates memory (non-inlined path)
  * @size: the size of the item
@@ -62,11 +112,13 @@ void *smalloc(size_t size)
 	struct tcache_perthread *pt;
 	void *item;
 
-	if (unlikely(size > SMALLOC_MAX_SIZE))
-		return NULL;
+	/* also catches zero, which has no size class */
+	if (unlikely(size - 1 >= SMALLOC_MAX_SIZE))
+		return smalloc_large(size);
 
 	preempt_disable();
-	pt = &perthread_get(smalloc_pts[smalloc_size_to_idx(size)]);
+	pt = &perthread_get(smalloc_pts[thread_numa_node]
+					[smalloc_size_to_idx(size)]);
 	item = tcache_alloc(pt);
 	preempt_enable();
 
@@ -89,21 +141,161 @@ void *__szalloc(size_t size)
 	return item;
 }
 
+/* hands a batch back to its home node */
+static void sfree_remote_flush(int idx, struct smalloc_remote *r)
+{
+	slab_free_remote(&smalloc_slabs[idx], r->head, r->tail, r->nr);
+	smalloc_remote_pending -= r->nr;
+	r->head = r->tail = NULL;
+	r->nr = 0;
+}
+
+/* queues an item for its home node, flushing once the batch is full */
+static void sfree_remote(int idx, int node, void *item)
+{
+	struct smalloc_remote *r;
+
+	/* threads outside the runtime have no perthread state to batch in */
+	if (unlikely(!smalloc_thread_ready)) {
+		slab_free_remote(&smalloc_slabs[idx], item, item, 1);
+		return;
+	}
+
+	r = &perthread_get(smalloc_remotes[node][idx]);
+
+	*(void **)item = r->head;
+	r->head = item;
+	if (r->nr++ == 0)
+		r->tail = item;
+	smalloc_remote_pending++;
+	if (r->nr >= SMALLOC_REMOTE_BATCH)
+		sfree_remote_flush(idx, r);
+}
+
+/**
+ * smalloc_flush_remote - hands partial remote batches back to their nodes
+ *
+ * Called when the kthread runs out of work, so that items freed on behalf of
+ * other nodes aren't stranded while it is idle or parked.
+ */
+void smalloc_flush_remote(void)
+{
+	struct smalloc_remote *r;
+	int node, idx;
+
+	assert_preempt_disabled();
+
+	if (likely(!smalloc_remote_pending))
+		return;
+
+	for (node = 0; node < numa_count; node++) {
+		for (idx = 0; idx < SMALLOC_BITS; idx++) {
+			r = &perthread_get(smalloc_remotes[node][idx]);
+			if (r->nr)
+				sfree_remote_flush(idx, r);
+		}
+	}
+}
+
 /*
  * sfree - frees memory back to the generic allocator
  * @item: the item to free
  */
 void sfree(void *item)
 {
-	struct slab_node *n = addr_to_page(item)->snode;
+	struct slab_node *n;
 	struct tcache_perthread *pt;
+	int idx;
+
+	if (unlikely(smalloc_is_large(item))) {
+		preempt_disable();
+		page_free_run(item);
+		preempt_enable();
+		return;
+	}
 
+	n = addr_to_page(item)->snode;
+	idx = smalloc_size_to_idx(n->size);
 	preempt_disable();
-	pt = &perthread_get(smalloc_pts[smalloc_size_to_idx(n->size)]);
+	if (unlikely(n->numa_node != thread_numa_node ||
+		     !smalloc_thread_ready)) {
+		sfree_remote(idx, n->numa_node, item);
+		preempt_enable();
+		return;
+	}
+
+	pt = &perthread_get(smalloc_pts[thread_numa_node][idx]);
 	tcache_free(pt, item);
 	preempt_enable();
 }
 
+/**
+ * smalloc_usable_size - gets the number of bytes usable in an item
+ * @item: the item
+ *
+ * Returns the size, which may be larger than what was requested.
+ */
+size_t smalloc_usable_size(void *item)
+{
+	if (unlikely(smalloc_is_large(item)))
+		return page_run_len(item) * PGSIZE_2MB;
+
+	return addr_to_page(item)->snode->size;
+}
+
+/**
+ * srealloc - changes the size of an item
+ * @item: the item (or NULL to allocate a new one)
+ * @size: the new size (or zero to free the item)
+ *
+ * The item is kept in place if it already has room for @size and wouldn't
+ * waste more than half of its memory.
+ *
+ * Returns the resized item, or NULL if out of memory (@item is left intact).
+ */
+void *srealloc(void *item, size_t size)
+{
+	size_t old_size;
+	void *new_item;
+
+	if (!item)
+		return smalloc(size);
+	if (size == 0) {
+		sfree(item);
+		return NULL;
+	}
+
+	old_size = smalloc_usable_size(item);
+	if (size <= old_size && size > old_size / 2)
+		return item;
+
+	new_item = smalloc(size);
+	if (unlikely(!new_item))
+		return NULL;
+
+	memcpy(new_item, item, MIN(size, old_size));
+	sfree(item);
+	return new_item;
+}
+
+/**
+ * saligned_alloc - allocates memory with a given alignment
+ * @alignment: the alignment, a power of two no larger than 2MB
+ * @size: the size of the item
+ *
+ * Returns an item or NULL if out of memory or the alignment isn't supported.
+ */
+void *saligned_alloc(size_t alignment, size_t size)
+{
+	if (unlikely(!is_power_of_two(alignment) || alignment > PGSIZE_2MB))
+		return NULL;
+
+	/* size classes are naturally aligned to their size */
+	if (alignment > SMALLOC_MIN_SIZE && size < alignment)
+		size = alignment;
+	return smalloc(size);
+}
+
 /**
  * smalloc_init - initializes slab malloc
  *
@@ -111,7 +303,7 @@ void sfree(void *item)
  */
 int smalloc_init(void)
 {
-	int i, ret;
+	int i, j, ret;
 
 	for (i = 0; i < SMALLOC_BITS; i++) {
 		ret = slab_create(&smalloc_slabs[i], slab_names[i],
@@ -120,10 +312,12 @@ int smalloc_init(void)
 		if (ret)
 			return ret;
 
-		smalloc_tcaches[i] = slab_create_tcache(&smalloc_slabs[i],
-							SMALLOC_MAG_SIZE);
-		if (!smalloc_tcaches[i])
-			return -ENOMEM;
+		for (j = 0; j < numa_count; j++) {
+			smalloc_tcaches[j][i] = slab_create_tcache_on_node(
+				&smalloc_slabs[i], j, SMALLOC_MAG_SIZE);
+			if (!smalloc_tcaches[j][i])
+				return -ENOMEM;
+		}
 	}
 
 	return 0;
@@ -134,11 +328,14 @@ int smalloc_init(void)
  */
 int smalloc_init_thread(void)
 {
-	int i;
+	int i, j;
 
-	for (i = 0; i < SMALLOC_BITS; i++)
-		tcache_init_perthread(smalloc_tcaches[i],
-				      &perthread_get(smalloc_pts[i]));
+	for (j = 0; j < numa_count; j++) {
+		for (i = 0; i < SMALLOC_BITS; i++)
+			tcache_init_perthread(smalloc_tcaches[j][i],
+					      &perthread_get(smalloc_pts[j][i]));
+	}
 
+	smalloc_thread_ready = true;
 	return 0;
 }
@@ -21,8 +21,11 @@ static bool softirq_directpath_pending(struct kthread *k)
 
 static bool softirq_timer_pending(struct kthread *k)
 {
-	return ACCESS_ONCE(k->timern) > 0 &&
-	       ACCESS_ONCE(k->timers[0].deadline_us) <= microtime();
+	uint64_t next_us = ACCESS_ONCE(k->timer_wheel->next_us);
+
+	if (ACCESS_ONCE(k->timern) > 0)
+		next_us = MIN(next_us, ACCESS_ONCE(k->timers[0].deadline_us));
+	return next_us != UINT64_MAX && next_us <= microtime();
 }
 
 static bool softirq_storage_pending(struct kthread *k)
@@ -2,6 +2,8 @@
  * stack.c - allocates and manages per-thread stacks
  */
 
+#include <signal.h>
+#include <sys/auxv.h>
 #include <sys/mman.h>
 
 #include <base/stddef.h>
@@ -15,74 +17,138 @@
 
 #define STACK_BASE_ADDR	0x200000000000UL
 
-static struct tcache *stack_tcache;
-DEFINE_PERTHREAD(struct tcache_perthread, stack_pt);
+#ifndef AT_MINSIGSTKSZ
+#define AT_MINSIGSTKSZ	51
+#endif
+
+/* the free stacks and usage statistics of one stack class */
+struct stack_pool {
+	struct tcache	*tc;
+	spinlock_t	lock;
+	int		free_count;
+	atomic64_t	nr;	/* the number of stacks created */
+	atomic64_t	hwm;	/* the deepest usage seen, in bytes */
+	struct stack	*free[RUNTIME_MAX_THREADS + TCACHE_DEFAULT_MAG_SIZE];
+};
+
+static struct stack_pool stack_pools[STACK_CLASS_NR];
+static atomic64_t stack_pos = ATOMIC_INIT(STACK_BASE_ADDR);
+DEFINE_PERTHREAD(struct tcache_perthread[STACK_CLASS_NR], stack_pt);
 
-static struct stack *stack_create(void *base)
+/* the stack class used by default for new threads */
+unsigned int cfg_stack_class = STACK_CLASS_256K;
+/* the space reserved below each stack for a signal frame */
+size_t stack_headroom;
+
+static const char *stack_tcache_names[] = {
+	"runtime_stacks_16k",
+	"runtime_stacks_64k",
+	"runtime_stacks_256k",
+};
+BUILD_ASSERT(ARRAY_SIZE(stack_tcache_names) == STACK_CLASS_NR);
+
+static struct stack *stack_create(void *base, unsigned int cls)
 {
+	size_t size = stack_class_span(cls);
 	void *stack_addr;
-	struct stack *s;
+	int ret;
 
-	stack_addr = mmap(base, sizeof(struct stack), PROT_READ | PROT_WRITE,
+	stack_addr = mmap(base, size * 2, PROT_READ | PROT_WRITE,
 			  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 	if (stack_addr == MAP_FAILED)
 		return NULL;
 
-	s = (struct stack *)stack_addr;
-	if (mprotect(s->guard, RUNTIME_GUARD_SIZE, PROT_NONE) == - 1) {
-		munmap(stack_addr, sizeof(struct stack));
+	if (mprotect(stack_addr + size, size, PROT_NONE) == - 1) {
+		munmap(stack_addr, size * 2);
 		return NULL;
 	}
 
-	return s;
+	/* a huge page would defeat the purpose of a small stack */
+	if (cls < STACK_CLASS_MAX) {
+		ret = madvise(stack_addr, size, MADV_NOHUGEPAGE);
+		WARN_ON_ONCE(ret);
+	}
+
+	atomic64_inc(&stack_pools[cls].nr);
+	return (struct stack *)stack_addr;
+}
+
+/*
+ * Records how deep a stack has been used, at page granularity, based on
+ * which of its pages are resident. Only small stacks are tracked; the
+ * largest class may be backed by a huge page, which is resident as a whole.
+ */
+static void stack_update_hwm(struct stack *s, unsigned int cls)
+{
+	struct stack_pool *p = &stack_pools[cls];
+	unsigned char vec[stack_class_size(STACK_CLASS_MAX - 1) / PGSIZE_4KB];
+	size_t size = stack_class_size(cls);
+	long used, hwm;
+	int i;
+
+	if (cls >= STACK_CLASS_MAX)
+		return;
+
+	/* the headroom is not counted, it is only used by signal frames */
+	if (mincore((char *)s + stack_headroom, size, vec))
+		return;
+
+	for (i = 0; i < size / PGSIZE_4KB; i++) {
+		if (vec[i] & 0x1)
+			break;
+	}
+	used = size - i * PGSIZE_4KB;
+
+	hwm = atomic64_read(&p->hwm);
+	while (used > hwm && !atomic64_cmpxchg(&p->hwm, hwm, used))
+		hwm = atomic64_read(&p->hwm);
 }
 
 /* WARNING: the contents of the stack may be lost after reclaiming. */
-static void stack_reclaim(struct stack *s)
+static void stack_reclaim(struct stack *s, unsigned int cls)
 {
 	int ret;
-	ret = madvise(s->usable, RUNTIME_STACK_SIZE, MADV_DONTNEED);
+
+	stack_update_hwm(s, cls);
+	ret = madvise(s, stack_class_span(cls), MADV_DONTNEED);
 	WARN_ON_ONCE(ret);
 }
 
-static DEFINE_SPINLOCK(stack_lock);
-static int free_stack_count;
-static struct stack *free_stacks[RUNTIME_MAX_THREADS];
-static atomic64_t stack_pos = ATOMIC_INIT(STACK_BASE_ADDR);
-
 static void stack_tcache_free(struct tcache *tc, int nr, void **items)
 {
+	struct stack_pool *p = &stack_pools[tc->data];
 	int i;
 
 	/* try to release the backing memory first */
 	for (i = 0; i < nr; i++)
-		stack_reclaim((struct stack *)items[i]);
+		stack_reclaim((struct stack *)items[i], tc->data);
 
 	/* then make the stacks available for reallocation */
-	spin_lock(&stack_lock);
+	spin_lock(&p->lock);
 	for (i = 0; i < nr; i++)
-		free_stacks[free_stack_count++] = items[i];
-	BUG_ON(free_stack_count >=
+		p->free[p->free_count++] = items[i];
+	BUG_ON(p->free_count >=
 	       RUNTIME_MAX_THREADS + TCACHE_DEFAULT_MAG_SIZE);
-	spin_unlock(&stack_lock);
+	spin_unlock(&p->lock);
 }
 
 static int stack_tcache_alloc(struct tcache *tc, int nr, void **items)
 {
+	struct stack_pool *p = &stack_pools[tc->data];
+	size_t size = stack_class_span(tc->data);
 	void *base;
 	int i = 0;
 
-	spin_lock(&stack_lock);
-	while (free_stack_count && i < nr) {
-		items[i++] = free_stacks[--free_stack_count];
+	spin_lock(&p->lock);
+	while (p->free_count && i < nr) {
+		items[i++] = p->free[--p->free_count];
 	}
-	spin_unlock(&stack_lock);
+	spin_unlock(&p->lock);
 
 
 	for (; i < nr; i++) {
-		base = (void *)atomic64_fetch_and_and(&stack_pos,
-						      sizeof(struct stack));
-		items[i] = stack_create(base);
+		base = (void *)atomic64_fetch_and_add(&stack_pos, size * 2);
+		items[i] = stack_create(base, tc->data);
 		if (unlikely(!items[i]))
 			goto fail;
 	}
@@ -100,13 +166,35 @@ static const struct tcache_ops stack_tcache_ops = {
 	.free	= stack_tcache_free,
 };
 
+/**
+ * stack_get_stats - gets the usage statistics of a stack class
+ * @cls: the stack class
+ * @nr: set to the number of stacks created
+ * @hwm: set to the deepest usage seen so far, in bytes
+ *
+ * Usage is sampled when stacks are reclaimed, so stacks that are still held
+ * by threads are not yet accounted for. It is not tracked for the largest
+ * class, so @hwm is always zero for it.
+ */
+void stack_get_stats(unsigned int cls, uint64_t *nr, uint64_t *hwm)
+{
+	*nr = atomic64_read(&stack_pools[cls].nr);
+	*hwm = atomic64_read(&stack_pools[cls].hwm);
+}
+
 /**
  * stack_init_thread - intializes per-thread state
  * Returns 0 (always successful).
  */
 int stack_init_thread(void)
 {
-	tcache_init_perthread(stack_tcache, &perthread_get(stack_pt));
+	unsigned int cls;
+
+	for (cls = 0; cls < STACK_CLASS_NR; cls++) {
+		tcache_init_perthread(stack_pools[cls].tc,
+				      &perthread_get(stack_pt)[cls]);
+	}
+
 	return 0;
 }
 
@@ -116,10 +204,24 @@ int stack_init_thread(void)
  */
 int stack_init(void)
 {
-	stack_tcache = tcache_create("runtime_stacks", &stack_tcache_ops,
-				     TCACHE_DEFAULT_MAG_SIZE,
-				     RUNTIME_STACK_SIZE);
-	if (!stack_tcache)
-		return -ENOMEM;
+	struct stack_pool *p;
+	unsigned int cls;
+
+	/* leave a page for the signal handler's own frames */
+	stack_headroom = MAX(getauxval(AT_MINSIGSTKSZ), (unsigned long)MINSIGSTKSZ);
+	stack_headroom = align_up(stack_headroom + PGSIZE_4KB, PGSIZE_4KB);
+
+	for (cls = 0; cls < STACK_CLASS_NR; cls++) {
+		p = &stack_pools[cls];
+		spin_lock_init(&p->lock);
+		p->tc = tcache_create(stack_tcache_names[cls],
+				      &stack_tcache_ops,
+				      TCACHE_DEFAULT_MAG_SIZE,
+				      stack_class_size(cls));
+		if (!p->tc)
+			return -ENOMEM;
+		p->tc->data = cls;
+	}
+
 	return 0;
 }
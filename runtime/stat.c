@@ -2,6 +2,7 @@
  * stat.c - support for statistics and counters
  */
 
+#include <ctype.h>
 #include <string.h>
 #include <stdio.h>
 
@@ -11,6 +12,7 @@
 #include <base/tcache.h>
 #include <base/thread.h>
 #include <runtime/thread.h>
+#include <runtime/sync.h>
 #include <runtime/udp.h>
 #include <runtime/tcp.h>
 
@@ -35,6 +37,26 @@ static const char *stat_names[] = {
 	"local_wakes",
 	"remote_wakes",
 	"rq_overflow",
+	"rq_grows",
+	"steals_sibling",
+	"steals_llc",
+	"steals_package",
+	"steals_remote",
+	"remote_steals_deferred",
+	"low_prio_runs",
+	"low_prio_stolen",
+	"low_prio_deadlines",
+	"handoffs",
+	"handoffs_failed",
+	"handoffs_received",
+	"coop_cedes",
+	"coop_yields",
+	"cede_reqs",
+	"cede_req_cycles",
+	"rcu_frees",
+	"rcu_callbacks",
+	"rcu_gps",
+	"rcu_gp_cycles",
 
 	/* network stack counters */
 	"rx_bytes",
@@ -46,6 +68,8 @@ static const char *stat_names[] = {
 	"rx_tcp_out_of_order",
 	"rx_tcp_text_cycles",
 	"txq_overflow",
+	"rx_gro_coalesced",
+	"rx_gro_chains",
 
 	/* directpath counters */
 	"flow_steering_cycles",
@@ -53,6 +77,12 @@ static const char *stat_names[] = {
 
 };
 
+static const char *stack_stat_names[][2] = {
+	{ "stacks_16k", "stack_hwm_16k" },
+	{ "stacks_64k", "stack_hwm_64k" },
+	{ "stacks_256k", NULL },	/* no high-water mark, may use THP */
+};
+
 static const char *tc_stat_names[] = {
 	"mag_free",
 	"mag_alloc",
@@ -63,6 +93,7 @@ static const char *tc_stat_names[] = {
 
 /* must correspond exactly to STAT_* enum definitions in defs.h */
 BUILD_ASSERT(ARRAY_SIZE(stat_names) == STAT_NR);
+BUILD_ASSERT(ARRAY_SIZE(stack_stat_names) == STACK_CLASS_NR);
 
 static int append_stat(char **pos, char *end, const char *name, uint64_t val)
 {
@@ -75,9 +106,162 @@ static int append_stat(char **pos, char *end, const char *name, uint64_t val)
 	return 0;
 }
 
-static ssize_t stat_write_buf(char *buf, size_t len)
+/* the scheduling histograms, see struct kthread */
+static const struct {
+	const char	*name;
+	size_t		offset;
+} hist_stats[] = {
+	{ "sched_delay", offsetof(struct kthread, sched_delay_hist) },
+	{ "run_time", offsetof(struct kthread, run_time_hist) },
+};
+
+/* the percentiles reported for each histogram, in parts per thousand */
+static const struct {
+	const char	*suffix;
+	unsigned int	permille;
+} hist_pcts[] = {
+	{ "p50_ns", 500 },
+	{ "p90_ns", 900 },
+	{ "p99_ns", 990 },
+	{ "p999_ns", 999 },
+};
+
+static int append_hist(char **pos, char *end, const char *name, size_t offset)
+{
+	uint64_t buckets[LAT_HIST_NR], total = 0, sum, target, cycles;
+	struct lat_hist *h;
+	char stat_name[64];
+	int i, j, ret;
+
+	/* merge the histograms from each kthread */
+	memset(buckets, 0, sizeof(buckets));
+	for (i = 0; i < nrks; i++) {
+		h = (struct lat_hist *)((char *)ks[i] + offset);
+		for (j = 0; j < LAT_HIST_NR; j++)
+			buckets[j] += ACCESS_ONCE(h->buckets[j]);
+	}
+	for (j = 0; j < LAT_HIST_NR; j++)
+		total += buckets[j];
+
+	snprintf(stat_name, sizeof(stat_name), "%s_count", name);
+	ret = append_stat(pos, end, stat_name, total);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < ARRAY_SIZE(hist_pcts); i++) {
+		target = div_up(total * hist_pcts[i].permille, 1000);
+		sum = 0;
+		for (j = 0; j < LAT_HIST_NR - 1; j++) {
+			sum += buckets[j];
+			if (sum >= target)
+				break;
+		}
+
+		/* report the upper bound of the bucket */
+		cycles = lat_hist_bucket_start(MIN(j + 1, LAT_HIST_NR - 1));
+		snprintf(stat_name, sizeof(stat_name), "%s_%s", name,
+			 hist_pcts[i].suffix);
+		ret = append_stat(pos, end, stat_name,
+				  total ? cycles * 1000 / cycles_per_us : 0);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int append_lock_stats(char **pos, char *end)
+{
+	struct lock_stats *s;
+	char stat_name[64];
+	int ret = 0;
+
+	spin_lock_np(&lock_stats_lock);
+	list_for_each(&lock_stats_list, s, link) {
+		snprintf(stat_name, sizeof(stat_name), "lock_%s_acquires",
+			 s->name);
+		ret = append_stat(pos, end, stat_name, ACCESS_ONCE(s->acquires));
+		if (ret)
+			break;
+		snprintf(stat_name, sizeof(stat_name), "lock_%s_contended",
+			 s->name);
+		ret = append_stat(pos, end, stat_name,
+				  ACCESS_ONCE(s->contended));
+		if (ret)
+			break;
+		snprintf(stat_name, sizeof(stat_name), "lock_%s_wait_cycles",
+			 s->name);
+		ret = append_stat(pos, end, stat_name,
+				  ACCESS_ONCE(s->wait_cycles));
+		if (ret)
+			break;
+	}
+	spin_unlock_np(&lock_stats_lock);
+
+	return ret;
+}
+
+struct tcache_stat_buf {
+	char		**pos;
+	char		*end;
+};
+
+static int append_tcache_stat(const char *name, struct tcache_stats *stats,
+			      void *arg)
+{
+	struct tcache_stat_buf *b = (struct tcache_stat_buf *)arg;
+	const struct {
+		const char	*suffix;
+		uint64_t	val;
+	} vals[] = {
+		{ "mag_size", stats->mag_size },
+		{ "depot_trips", stats->depot_trips },
+		{ "depot_misses", stats->depot_misses },
+	};
+	char stat_name[64], *c;
+	int i, ret;
+
+	for (i = 0; i < ARRAY_SIZE(vals); i++) {
+		snprintf(stat_name, sizeof(stat_name), "tcache_%s_%s", name,
+			 vals[i].suffix);
+
+		/* cache names are human readable, keep the keys parseable */
+		for (c = stat_name; *c; c++) {
+			if (!isalnum(*c))
+				*c = '_';
+		}
+
+		ret = append_stat(b->pos, b->end, stat_name, vals[i].val);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int append_tcache_stats(char **pos, char *end)
 {
-	uint64_t stats[STAT_NR], tc_stats[4];
+	struct tcache_stat_buf b = { pos, end };
+	int ret;
+
+	preempt_disable();
+	ret = tcache_for_each(append_tcache_stat, &b);
+	preempt_enable();
+
+	return ret;
+}
+
+/**
+ * stat_write_buf - writes every stat to a buffer as "name:value" pairs
+ * @buf: the buffer
+ * @len: the size of the buffer
+ *
+ * Returns the number of bytes written, including the terminating '\0', or
+ * -E2BIG if @buf is too small.
+ */
+ssize_t stat_write_buf(char *buf, size_t len)
+{
+	uint64_t stats[STAT_NR], tc_stats[4], nr, hwm;
 	char *pos = buf, *end = buf + len;
 	int i, j, ret;
 
@@ -110,6 +294,33 @@ static ssize_t stat_write_buf(char *buf, size_t len)
 			return ret;
 	}
 
+	for (j = 0; j < ARRAY_SIZE(hist_stats); j++) {
+		ret = append_hist(&pos, end, hist_stats[j].name,
+				  hist_stats[j].offset);
+		if (ret)
+			return ret;
+	}
+
+	for (j = 0; j < STACK_CLASS_NR; j++) {
+		stack_get_stats(j, &nr, &hwm);
+		ret = append_stat(&pos, end, stack_stat_names[j][0], nr);
+		if (ret)
+			return ret;
+		if (!stack_stat_names[j][1])
+			continue;
+		ret = append_stat(&pos, end, stack_stat_names[j][1], hwm);
+		if (ret)
+			return ret;
+	}
+
+	ret = append_lock_stats(&pos, end);
+	if (ret)
+		return ret;
+
+	ret = append_tcache_stats(&pos, end);
+	if (ret)
+		return ret;
+
 	/* report the clock rate */
 	ret = append_stat(&pos, end, "cycles_per_us", cycles_per_us);
 	if (ret)
@@ -167,6 +378,7 @@ static void stat_tcp_server(void *arg)
 	struct netaddr laddr;
 	tcpconn_t *c;
 	tcpqueue_t *q;
+	thread_t *th;
 	int ret;
 
 	laddr.ip = 0;
@@ -178,19 +390,56 @@ static void stat_tcp_server(void *arg)
 	while (true) {
 		ret = tcp_accept(q, &c);
 		BUG_ON(ret);
-		ret = thread_spawn(stat_tcp_worker, c);
-		WARN_ON(ret);
+		/* the worker keeps a 64 KB response buffer on its stack */
+		th = thread_create_with_stack_size(stat_tcp_worker, c,
+						   RUNTIME_STACK_SIZE);
+		if (WARN_ON(!th)) {
+			tcp_close(c);
+			continue;
+		}
+		thread_ready(th);
+	}
+}
+
+/**
+ * stat_page_len - finds how much of a stat buffer fits in one page
+ * @buf: the remaining stats, as written by stat_write_buf()
+ * @len: the length of @buf
+ * @max: the size of a page
+ *
+ * Pages always end between two stats, the separating ',' is dropped.
+ *
+ * Returns the length of the page, or 0 if a single stat doesn't fit.
+ */
+size_t stat_page_len(const char *buf, size_t len, size_t max)
+{
+	size_t i;
+
+	if (len <= max)
+		return len;
+
+	for (i = max; i > 0; i--) {
+		if (buf[i] == ',')
+			return i;
 	}
+
+	return 0;
 }
 
+/*
+ * The stats don't fit in a single datagram, so a UDP reply is split into as
+ * many as needed. Each one holds whole stats, and the last one ends with
+ * "tsc".
+ */
 static void stat_worker_udp(void *arg)
 {
 	const size_t cmd_len = strlen("stat");
 	size_t payload_size = udp_get_payload_size();
-	char buf[payload_size];
+	static char buf[65535];
 	struct netaddr laddr, raddr;
 	udpconn_t *c;
 	ssize_t ret, len;
+	size_t pos, page_len;
 
 	laddr.ip = 0;
 	laddr.port = STAT_PORT;
@@ -208,15 +457,21 @@ static void stat_worker_udp(void *arg)
 		if (strncmp(buf, "stat", cmd_len) != 0)
 			continue;
 
-		len = stat_write_buf(buf, payload_size);
+		len = stat_write_buf(buf, sizeof(buf));
 		if (len < 0) {
 			log_err("stat: couldn't generate stat buffer");
 			continue;
 		}
-		assert(len <= payload_size);
 
-		ret = udp_write_to(c, buf, len, &raddr);
-		WARN_ON(ret != len);
+		for (pos = 0; pos < len; pos += page_len + 1) {
+			page_len = stat_page_len(buf + pos, len - pos,
+						 payload_size);
+			if (WARN_ON(!page_len))
+				break;
+
+			ret = udp_write_to(c, buf + pos, page_len, &raddr);
+			WARN_ON(ret != page_len);
+		}
 	}
 }
 
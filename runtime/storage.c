@@ -226,6 +226,119 @@ done_np:
 	return rc;
 }
 
+/* allocates a DMA buffer for a request (preemption must be disabled) */
+static void *storage_buf_alloc(size_t len)
+{
+	if (likely(len <= REQUEST_BUF_SZ))
+		return tcache_alloc(&perthread_get(storage_buf_pt));
+	return spdk_zmalloc(len, 0, NULL, SPDK_ENV_SOCKET_ID_ANY,
+			    SPDK_MALLOC_DMA);
+}
+
+/* frees a DMA buffer for a request (preemption must be disabled) */
+static void storage_buf_free(void *buf, size_t len)
+{
+	if (likely(len <= REQUEST_BUF_SZ))
+		tcache_free(&perthread_get(storage_buf_pt), buf);
+	else
+		spdk_free(buf);
+}
+
+/* completes an asynchronous request (runs in softirq context) */
+static void async_complete(void *arg, const struct spdk_nvme_cpl *completion)
+{
+	struct storage_op *op = arg;
+
+	op->ret = spdk_nvme_cpl_is_error(completion) ? -EIO : 0;
+	if (op->dest)
+		memcpy(op->dest, op->payload, op->len);
+	storage_buf_free(op->payload, op->len);
+	op->waker->fn(op->waker);
+}
+
+static int storage_submit_async(struct storage_op *op, const void *src,
+				uint64_t lba, uint32_t lba_count)
+{
+	struct kthread *k;
+	struct storage_q *q;
+	int rc;
+
+	if (!cfg_storage_enabled)
+		return -ENODEV;
+
+	op->len = lba_count * block_size;
+	k = getk();
+	q = &k->storage_q;
+
+	op->payload = storage_buf_alloc(op->len);
+	if (unlikely(!op->payload)) {
+		putk();
+		return -ENOMEM;
+	}
+	if (src)
+		memcpy(op->payload, src, op->len);
+
+	spin_lock(&q->lock);
+	if (src) {
+		rc = spdk_nvme_ns_cmd_write(spdk_namespace, q->spdk_qp_handle,
+					    op->payload, lba, lba_count,
+					    async_complete, op, 0);
+	} else {
+		rc = spdk_nvme_ns_cmd_read(spdk_namespace, q->spdk_qp_handle,
+					   op->payload, lba, lba_count,
+					   async_complete, op, 0);
+	}
+	if (unlikely(rc != 0)) {
+		spin_unlock(&q->lock);
+		storage_buf_free(op->payload, op->len);
+		putk();
+		return -EIO;
+	}
+
+	q->outstanding_reqs++;
+	spin_unlock(&q->lock);
+	putk();
+	return 0;
+}
+
+/**
+ * storage_write_async - starts writing a payload to the nvme device
+ * @op: the request state, must stay valid until @w runs
+ * @payload: the data, lba_count * storage_block_size() bytes (copied)
+ * @lba: the first block to write
+ * @lba_count: the number of blocks to write
+ * @w: the waker to run once the write completes
+ *
+ * Returns 0 if the write was started (@op->ret then holds its result once @w
+ * runs), -ENOMEM if no memory is available, or -EIO if it couldn't be issued.
+ */
+int storage_write_async(struct storage_op *op, const void *payload,
+			uint64_t lba, uint32_t lba_count, waker_t *w)
+{
+	op->waker = w;
+	op->dest = NULL;
+	return storage_submit_async(op, payload, lba, lba_count);
+}
+
+/**
+ * storage_read_async - starts reading a payload from the nvme device
+ * @op: the request state, must stay valid until @w runs
+ * @dest: the buffer, lba_count * storage_block_size() bytes
+ * @lba: the first block to read
+ * @lba_count: the number of blocks to read
+ * @w: the waker to run once the read completes
+ *
+ * Returns 0 if the read was started (@op->ret then holds its result once @w
+ * runs), -ENOMEM if no memory is available, or -EIO if it couldn't be issued.
+ */
+int storage_read_async(struct storage_op *op, void *dest, uint64_t lba,
+		       uint32_t lba_count, waker_t *w)
+{
+	op->waker = w;
+	op->dest = dest;
+	return storage_submit_async(op, NULL, lba, lba_count);
+}
+
 static int storage_softirq_one(struct storage_q *q)
 {
 	int ret;
@@ -278,7 +391,8 @@ int storage_init_thread(void)
 	if (!cfg_storage_enabled)
 		return 0;
 
-	th = thread_create(storage_softirq, k);
+	th = thread_create_with_stack_size(storage_softirq, k,
+					   RUNTIME_STACK_SIZE);
 	if (!th)
 		return -ENOMEM;
 
@@ -419,6 +533,18 @@ int storage_read(void *dest, uint64_t lba, uint32_t lba_count)
 	return -ENODEV;
 }
 
+int storage_write_async(struct storage_op *op, const void *payload,
+			uint64_t lba, uint32_t lba_count, waker_t *w)
+{
+	return -ENODEV;
+}
+
+int storage_read_async(struct storage_op *op, void *dest, uint64_t lba,
+		       uint32_t lba_count, waker_t *w)
+{
+	return -ENODEV;
+}
+
 int storage_init(void)
 {
 	return 0;
@@ -2,6 +2,9 @@
  * sync.c - support for synchronization
  */
 
+#include <stdlib.h>
+#include <string.h>
+
 #include <base/lock.h>
 #include <base/log.h>
 #include <runtime/thread.h>
@@ -10,15 +13,98 @@
 #include "defs.h"
 
 
+/*
+ * Lock contention statistics
+ */
+
+/* protects @lock_stats_list */
+DEFINE_SPINLOCK(lock_stats_lock);
+/* every lock with statistics enabled, reported by stat.c */
+LIST_HEAD(lock_stats_list);
+
+static struct lock_stats *lock_stats_alloc(const char *name)
+{
+	struct lock_stats *s;
+
+	s = malloc(sizeof(*s));
+	if (!s)
+		return NULL;
+
+	memset(s, 0, sizeof(*s));
+	s->name = name;
+	spin_lock_np(&lock_stats_lock);
+	list_add_tail(&lock_stats_list, &s->link);
+	spin_unlock_np(&lock_stats_lock);
+	return s;
+}
+
+static inline void lock_stats_contended(struct lock_stats *s,
+					uint64_t start_tsc)
+{
+	s->contended++;
+	s->wait_cycles += rdtsc() - start_tsc;
+}
+
+/* is @th running on a kthread right now? */
+static inline bool sync_owner_running(thread_t *th)
+{
+	return th && load_acquire(&th->thread_running);
+}
+
+/* should a waiter stop spinning and park? */
+static inline bool sync_spin_expired(uint64_t start_tsc)
+{
+	return rdtsc() - start_tsc >= cycles_per_us * RUNTIME_SYNC_SPIN_US ||
+	       preempt_cede_needed();
+}
+
+
 /*
  * Mutex support
  */
 
 #define WAITER_FLAG (1 << 31)
 
+/*
+ * Spins while the mutex is held by a thread that is running on another
+ * kthread, since it will likely release the mutex sooner than a park and
+ * wakeup would take. Returns true if the mutex was acquired.
+ */
+static bool mutex_spin(mutex_t *m, uint64_t start_tsc)
+{
+	thread_t *owner;
+	int held;
+
+	while (true) {
+		held = atomic_read(&m->held);
+		if (held == 0) {
+			if (atomic_cmpxchg(&m->held, 0, 1))
+				return true;
+			continue;
+		}
+
+		/* the mutex is handed off to parked waiters in order */
+		if (held & WAITER_FLAG)
+			return false;
+
+		/* the owner field is briefly NULL while the mutex changes hands */
+		owner = ACCESS_ONCE(m->owner);
+		if (owner && !sync_owner_running(owner))
+			return false;
+		if (sync_spin_expired(start_tsc))
+			return false;
+
+		cpu_relax();
+	}
+}
+
 void __mutex_lock(mutex_t *m)
 {
-	thread_t *myth;
+	uint64_t start_tsc = rdtsc();
+	thread_t *myth = thread_self();
+
+	if (mutex_spin(m, start_tsc))
+		goto acquired;
 
 	spin_lock_np(&m->waiter_lock);
 
@@ -26,12 +112,25 @@ void __mutex_lock(mutex_t *m)
 	if (atomic_fetch_and_or(&m->held, WAITER_FLAG) == 0) {
 		atomic_write(&m->held, 1);
 		spin_unlock_np(&m->waiter_lock);
-		return;
+		goto acquired;
 	}
 
-	myth = thread_self();
 	list_add_tail(&m->waiters, &myth->link);
 	thread_park_and_unlock_np(&m->waiter_lock);
+
+	/* __mutex_unlock() handed the mutex to this thread */
+	if (unlikely(m->stats)) {
+		m->stats->acquires++;
+		lock_stats_contended(m->stats, start_tsc);
+	}
+	return;
+
+acquired:
+	m->owner = myth;
+	if (unlikely(m->stats)) {
+		m->stats->acquires++;
+		lock_stats_contended(m->stats, start_tsc);
+	}
 }
 
 
@@ -47,6 +146,7 @@ void __mutex_unlock(mutex_t *m)
 		spin_unlock_np(&m->waiter_lock);
 		return;
 	}
+	m->owner = waketh;
 	spin_unlock_np(&m->waiter_lock);
 	thread_ready(waketh);
 }
@@ -60,6 +160,24 @@ void mutex_init(mutex_t *m)
 	atomic_write(&m->held, 0);
 	spin_lock_init(&m->waiter_lock);
 	list_head_init(&m->waiters);
+	m->owner = NULL;
+	m->stats = NULL;
+}
+
+/**
+ * mutex_enable_stats - starts counting contention on a mutex
+ * @m: the mutex (must not be held)
+ * @name: the name reported in the runtime stats, must outlive the runtime
+ *
+ * The counters are never freed, so this is meant for long-lived mutexes.
+ *
+ * Returns 0 if successful, otherwise -ENOMEM.
+ */
+int mutex_enable_stats(mutex_t *m, const char *name)
+{
+	assert(!mutex_held(m));
+	m->stats = lock_stats_alloc(name);
+	return m->stats ? 0 : -ENOMEM;
 }
 
 /*
@@ -76,7 +194,34 @@ void rwmutex_init(rwmutex_t *m)
 	list_head_init(&m->read_waiters);
 	list_head_init(&m->write_waiters);
 	m->count = 0;
-	m->read_waiter_count = 0;
+	m->writer = NULL;
+	m->stats = NULL;
+}
+
+/**
+ * rwmutex_enable_stats - starts counting contention on a rwmutex
+ * @m: the rwmutex (must not be held)
+ * @name: the name reported in the runtime stats, must outlive the runtime
+ *
+ * The counters are never freed, so this is meant for long-lived rwmutexes.
+ *
+ * Returns 0 if successful, otherwise -ENOMEM.
+ */
+int rwmutex_enable_stats(rwmutex_t *m, const char *name)
+{
+	assert(m->count == 0);
+	m->stats = lock_stats_alloc(name);
+	return m->stats ? 0 : -ENOMEM;
+}
+
+/* spins while a writer that is running on another kthread holds @m */
+static void rwmutex_spin(rwmutex_t *m, uint64_t start_tsc)
+{
+	while (ACCESS_ONCE(m->count) < 0 &&
+	       sync_owner_running(ACCESS_ONCE(m->writer)) &&
+	       !sync_spin_expired(start_tsc)) {
+		cpu_relax();
+	}
 }
 
 /**
@@ -85,18 +230,38 @@ void rwmutex_init(rwmutex_t *m)
  */
 void rwmutex_rdlock(rwmutex_t *m)
 {
+	uint64_t start_tsc = 0;
 	thread_t *myth;
 
+	if (unlikely(ACCESS_ONCE(m->count) < 0)) {
+		start_tsc = rdtsc();
+		rwmutex_spin(m, start_tsc);
+	}
+
 	spin_lock_np(&m->waiter_lock);
 	myth = thread_self();
 	if (m->count >= 0) {
 		m->count++;
+		if (unlikely(m->stats)) {
+			m->stats->acquires++;
+			if (start_tsc)
+				lock_stats_contended(m->stats, start_tsc);
+		}
 		spin_unlock_np(&m->waiter_lock);
 		return;
 	}
-	m->read_waiter_count++;
+	if (!start_tsc)
+		start_tsc = rdtsc();
 	list_add_tail(&m->read_waiters, &myth->link);
 	thread_park_and_unlock_np(&m->waiter_lock);
+
+	/* rwmutex_unlock() granted the read lock to this thread */
+	if (unlikely(m->stats)) {
+		spin_lock_np(&m->waiter_lock);
+		m->stats->acquires++;
+		lock_stats_contended(m->stats, start_tsc);
+		spin_unlock_np(&m->waiter_lock);
+	}
 }
 
 /**
@@ -110,6 +275,8 @@ bool rwmutex_try_rdlock(rwmutex_t *m)
 	spin_lock_np(&m->waiter_lock);
 	if (m->count >= 0) {
 		m->count++;
+		if (unlikely(m->stats))
+			m->stats->acquires++;
 		spin_unlock_np(&m->waiter_lock);
 		return true;
 	}
@@ -123,17 +290,36 @@ bool rwmutex_try_rdlock(rwmutex_t *m)
  */
 void rwmutex_wrlock(rwmutex_t *m)
 {
-	thread_t *myth;
+	uint64_t start_tsc = 0;
+	thread_t *myth = thread_self();
+
+	if (unlikely(ACCESS_ONCE(m->count) != 0)) {
+		start_tsc = rdtsc();
+		rwmutex_spin(m, start_tsc);
+	}
 
 	spin_lock_np(&m->waiter_lock);
-	myth = thread_self();
 	if (m->count == 0) {
 		m->count = -1;
+		m->writer = myth;
+		if (unlikely(m->stats)) {
+			m->stats->acquires++;
+			if (start_tsc)
+				lock_stats_contended(m->stats, start_tsc);
+		}
 		spin_unlock_np(&m->waiter_lock);
 		return;
 	}
+	if (!start_tsc)
+		start_tsc = rdtsc();
 	list_add_tail(&m->write_waiters, &myth->link);
 	thread_park_and_unlock_np(&m->waiter_lock);
+
+	/* rwmutex_unlock() granted the write lock to this thread */
+	if (unlikely(m->stats)) {
+		m->stats->acquires++;
+		lock_stats_contended(m->stats, start_tsc);
+	}
 }
 
 /**
@@ -147,6 +333,9 @@ bool rwmutex_try_wrlock(rwmutex_t *m)
 	spin_lock_np(&m->waiter_lock);
 	if (m->count == 0) {
 		m->count = -1;
+		m->writer = thread_self();
+		if (unlikely(m->stats))
+			m->stats->acquires++;
 		spin_unlock_np(&m->waiter_lock);
 		return true;
 	}
@@ -166,14 +355,16 @@ void rwmutex_unlock(rwmutex_t *m)
 
 	spin_lock_np(&m->waiter_lock);
 	assert(m->count != 0);
-	if (m->count < 0)
+	if (m->count < 0) {
 		m->count = 0;
-	else
+		m->writer = NULL;
+	} else {
 		m->count--;
+	}
 
-	if (m->count == 0 && m->read_waiter_count > 0) {
-		m->count = m->read_waiter_count;
-		m->read_waiter_count = 0;
+	if (m->count == 0 && !list_empty(&m->read_waiters)) {
+		list_for_each(&m->read_waiters, th, link)
+			m->count++;
 		list_append_list(&tmp, &m->read_waiters);
 		spin_unlock_np(&m->waiter_lock);
 		while (true) {
@@ -192,6 +383,7 @@ void rwmutex_unlock(rwmutex_t *m)
 			return;
 		}
 		m->count = -1;
+		m->writer = th;
 		spin_unlock_np(&m->waiter_lock);
 		thread_ready(th);
 		return;
@@ -289,15 +481,19 @@ void condvar_init(condvar_t *cv)
 void waitgroup_add(waitgroup_t *wg, int cnt)
 {
 	thread_t *waketh;
-	struct list_head tmp;
+	waker_t *w;
+	struct list_head tmp, wakers;
 
 	list_head_init(&tmp);
+	list_head_init(&wakers);
 
 	spin_lock_np(&wg->lock);
 	wg->cnt += cnt;
 	BUG_ON(wg->cnt < 0);
-	if (wg->cnt == 0)
+	if (wg->cnt == 0) {
 		list_append_list(&tmp, &wg->waiters);
+		list_append_list(&wakers, &wg->wakers);
+	}
 	spin_unlock_np(&wg->lock);
 
 	while (true) {
@@ -306,6 +502,9 @@ void waitgroup_add(waitgroup_t *wg, int cnt)
 			break;
 		thread_ready(waketh);
 	}
+
+	while ((w = list_pop(&wakers, waker_t, link)))
+		w->fn(w);
 }
 
 /**
@@ -326,6 +525,27 @@ void waitgroup_wait(waitgroup_t *wg)
 	thread_park_and_unlock_np(&wg->lock);
 }
 
+/**
+ * waitgroup_wait_async - waits for the wait group count to become zero without
+ * blocking
+ * @wg: the wait group to wait on
+ * @w: the waker to run once the count reaches zero
+ *
+ * Returns true if @w was armed, or false if the count is already zero (@w
+ * will not run).
+ */
+bool waitgroup_wait_async(waitgroup_t *wg, waker_t *w)
+{
+	spin_lock_np(&wg->lock);
+	if (wg->cnt == 0) {
+		spin_unlock_np(&wg->lock);
+		return false;
+	}
+	list_add_tail(&wg->wakers, &w->link);
+	spin_unlock_np(&wg->lock);
+	return true;
+}
+
 /**
  * waitgroup_init - initializes a wait group
  * @wg: the wait group to initialize
@@ -334,6 +554,7 @@ void waitgroup_init(waitgroup_t *wg)
 {
 	spin_lock_init(&wg->lock);
 	list_head_init(&wg->waiters);
+	list_head_init(&wg->wakers);
 	wg->cnt = 0;
 }
 
@@ -388,3 +609,92 @@ bool barrier_wait(barrier_t *b)
 	thread_park_and_unlock_np(&b->lock);
 	return false;
 }
+
+
+/*
+ * Big-reader mutex support
+ */
+
+/* how much longer than a revocation took to keep readers off the fast path */
+#define BRMUTEX_INHIBIT_MULT	9
+
+/**
+ * brmutex_init - initializes a brmutex
+ * @m: the brmutex to initialize
+ *
+ * Returns 0 if successful, otherwise -ENOMEM.
+ */
+int brmutex_init(brmutex_t *m)
+{
+	m->readers = aligned_alloc(CACHE_LINE_SIZE,
+				   sizeof(struct brmutex_reader) * maxks);
+	if (!m->readers)
+		return -ENOMEM;
+
+	memset(m->readers, 0, sizeof(struct brmutex_reader) * maxks);
+	m->rbias = true;
+	m->inhibit_until_tsc = 0;
+	rwmutex_init(&m->rw);
+	return 0;
+}
+
+/**
+ * brmutex_destroy - frees the resources used by a brmutex
+ * @m: the brmutex, must not be held
+ */
+void brmutex_destroy(brmutex_t *m)
+{
+	free(m->readers);
+	m->readers = NULL;
+}
+
+unsigned int __brmutex_rdlock(brmutex_t *m)
+{
+	rwmutex_rdlock(&m->rw);
+
+	/* writers are excluded, so it's safe to restore the bias */
+	if (!ACCESS_ONCE(m->rbias) && rdtsc() >= m->inhibit_until_tsc)
+		ACCESS_ONCE(m->rbias) = true;
+
+	return BRMUTEX_SLOW_READER;
+}
+
+/**
+ * brmutex_wrlock - acquires a write lock on a brmutex
+ * @m: the brmutex to acquire
+ *
+ * Expensive if readers are on the fast path, since they have to drain first.
+ */
+void brmutex_wrlock(brmutex_t *m)
+{
+	uint64_t start_tsc, now;
+	int i;
+
+	rwmutex_wrlock(&m->rw);
+	if (!m->rbias)
+		return;
+
+	/* revoke the bias, pairs with the atomic in brmutex_rdlock() */
+	start_tsc = rdtsc();
+	ACCESS_ONCE(m->rbias) = false;
+	mb();
+
+	/* fast path readers may be parked, so let them run */
+	for (i = 0; i < maxks; i++) {
+		while (atomic_read(&m->readers[i].cnt) > 0)
+			thread_yield();
+	}
+
+	/* back off so frequent writers don't keep paying for revocation */
+	now = rdtsc();
+	m->inhibit_until_tsc = now + (now - start_tsc) * BRMUTEX_INHIBIT_MULT;
+}
+
+/**
+ * brmutex_wrunlock - releases a write lock on a brmutex
+ * @m: the brmutex to release
+ */
+void brmutex_wrunlock(brmutex_t *m)
+{
+	rwmutex_unlock(&m->rw);
+}
@@ -1,12 +1,16 @@
 /*
  * timer.c - support for timers
  *
- * So far we use a D-ary heap just like the Go runtime. We may want to consider
- * adding a lower-resolution shared timer wheel as well.
+ * Fine-grained timers use a D-ary heap just like the Go runtime. Coarse timers
+ * (see timer_start_coarse()) use a per-kthread hashed hierarchical timer wheel
+ * instead, so that arming and cancelling them is O(1) and there's no limit on
+ * how many can be armed. Timers in the wheel may fire up to one tick late.
+ * Fine-grained timers also spill into the wheel if the heap is full.
  */
 
 #include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <base/time.h>
 #include <runtime/sync.h>
@@ -94,18 +98,160 @@ static void sift_down(struct timer_idx *heap, int i, int n)
 	}
 }
 
+#define TIMER_WHEEL_MASK	(TIMER_WHEEL_SIZE - 1)
+#define TIMER_WHEEL_SPAN	(1UL << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS))
+/* the index of wheel timers that are waiting for the softirq to run them */
+#define TIMER_WHEEL_EXPIRED	UINT_MAX
+
+/* the occupancy of each level is tracked in a 64-bit mask */
+BUILD_ASSERT(TIMER_WHEEL_SIZE == 64);
+
+static void timer_wheel_add(struct timer_wheel *w, struct timer_entry *e)
+{
+	unsigned int level, slot;
+	uint64_t tick, delta;
+
+	/* round up so that the timer never fires early */
+	tick = div_up(e->deadline_us, 1UL << TIMER_WHEEL_TICK_SHIFT);
+	tick = MAX(tick, w->now_tick);
+	delta = tick - w->now_tick;
+
+	for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+		if (delta < 1UL << ((level + 1) * TIMER_WHEEL_BITS))
+			break;
+	}
+
+	/* timers beyond the last level are placed again when they cascade */
+	if (delta >= TIMER_WHEEL_SPAN)
+		tick = w->now_tick + TIMER_WHEEL_SPAN - 1;
+
+	slot = (tick >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK;
+	list_add_tail(&w->slots[level][slot], &e->link);
+	w->occupied[level] |= 1UL << slot;
+	e->idx = level * TIMER_WHEEL_SIZE + slot;
+}
+
+/* returns true if the timer's slot (or the expired list) is now empty */
+static bool timer_wheel_del(struct timer_wheel *w, struct timer_entry *e)
+{
+	unsigned int level, slot;
+
+	list_del(&e->link);
+	if (e->idx == TIMER_WHEEL_EXPIRED)
+		return list_empty(&w->expired);
+
+	level = e->idx / TIMER_WHEEL_SIZE;
+	slot = e->idx % TIMER_WHEEL_SIZE;
+	if (!list_empty(&w->slots[level][slot]))
+		return false;
+
+	w->occupied[level] &= ~(1UL << slot);
+	return true;
+}
+
+/* returns the first tick at which a non-empty slot will be processed */
+static uint64_t timer_wheel_next_tick(struct timer_wheel *w)
+{
+	uint64_t next = UINT64_MAX, occ, c;
+	unsigned int level, shift, idx;
+
+	for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		occ = w->occupied[level];
+		if (!occ)
+			continue;
+
+		/* find the first slot boundary at or after now_tick */
+		shift = level * TIMER_WHEEL_BITS;
+		c = (w->now_tick + (1UL << shift) - 1) >> shift;
+		idx = c & TIMER_WHEEL_MASK;
+		occ = (occ >> idx) | (occ << ((TIMER_WHEEL_SIZE - idx) &
+					       TIMER_WHEEL_MASK));
+		next = MIN(next, (c + __builtin_ctzll(occ)) << shift);
+	}
+
+	return next;
+}
+
+static void timer_wheel_update_next(struct timer_wheel *w)
+{
+	uint64_t tick;
+
+	if (!list_empty(&w->expired)) {
+		w->next_us = 0;
+		return;
+	}
+
+	tick = timer_wheel_next_tick(w);
+	if (tick == UINT64_MAX)
+		w->next_us = UINT64_MAX;
+	else
+		w->next_us = tick << TIMER_WHEEL_TICK_SHIFT;
+}
+
+/* moves the timers of the current slot of @level into lower levels */
+static void timer_wheel_cascade(struct timer_wheel *w, unsigned int level)
+{
+	unsigned int slot;
+	struct timer_entry *e;
+	LIST_HEAD(tmp);
+
+	slot = (w->now_tick >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK;
+	list_append_list(&tmp, &w->slots[level][slot]);
+	w->occupied[level] &= ~(1UL << slot);
+
+	while ((e = list_pop(&tmp, struct timer_entry, link)))
+		timer_wheel_add(w, e);
+}
+
+/* moves timers that are due by @now_us to the expired list */
+static void timer_wheel_advance(struct timer_wheel *w, uint64_t now_us)
+{
+	uint64_t now_tick = now_us >> TIMER_WHEEL_TICK_SHIFT, next;
+	struct timer_entry *e;
+	unsigned int level, slot;
+
+	while (w->now_tick <= now_tick) {
+		/* skip ticks that have nothing to process */
+		next = timer_wheel_next_tick(w);
+		if (next > now_tick) {
+			w->now_tick = now_tick + 1;
+			break;
+		}
+		w->now_tick = next;
+
+		for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+			if (w->now_tick & ((1UL << (level * TIMER_WHEEL_BITS)) - 1))
+				break;
+			timer_wheel_cascade(w, level);
+		}
+
+		slot = w->now_tick & TIMER_WHEEL_MASK;
+		list_for_each(&w->slots[0][slot], e, link)
+			e->idx = TIMER_WHEEL_EXPIRED;
+		list_append_list(&w->expired, &w->slots[0][slot]);
+		w->occupied[0] &= ~(1UL << slot);
+		w->now_tick++;
+	}
+
+	timer_wheel_update_next(w);
+}
+
 static void update_q_ptrs(struct kthread *k)
 {
-	uint64_t next_tsc = 0;
+	uint64_t next_us = k->timer_wheel->next_us, next_tsc = 0;
 
 	if (k->timern)
-		next_tsc = k->timers[0].deadline_us * cycles_per_us + start_tsc;
+		next_us = MIN(next_us, k->timers[0].deadline_us);
+	if (next_us != UINT64_MAX)
+		next_tsc = next_us * cycles_per_us + start_tsc;
 	ACCESS_ONCE(k->q_ptrs->next_timer_tsc) = next_tsc;
 }
 
 /**
  * timer_earliest_deadline - return the first deadline for this kthread or 0 if
  * there are no active timers.
+ *
+ * The deadline of a timer in the timer wheel is rounded to its tick.
  */
 uint64_t timer_earliest_deadline(void)
 {
@@ -113,17 +259,18 @@ uint64_t timer_earliest_deadline(void)
 	uint64_t deadline_us;
 
 	/* deliberate race condition */
-	if (k->timern == 0)
-		deadline_us = 0;
-	else
-		deadline_us = k->timers[0].deadline_us;
+	deadline_us = ACCESS_ONCE(k->timer_wheel->next_us);
+	if (k->timern != 0)
+		deadline_us = MIN(deadline_us, k->timers[0].deadline_us);
 
-	return deadline_us;
+	return deadline_us == UINT64_MAX ? 0 : deadline_us;
 }
 
-static void timer_start_locked(struct timer_entry *e, uint64_t deadline_us)
+static void timer_start_locked(struct timer_entry *e, uint64_t deadline_us,
+			       bool coarse)
 {
 	struct kthread *k = myk();
+	struct timer_wheel *w = k->timer_wheel;
 	int i;
 
 	assert_spin_lock_held(&k->timer_lock);
@@ -131,18 +278,37 @@ static void timer_start_locked(struct timer_entry *e, uint64_t deadline_us)
 	/* can't insert a timer twice! */
 	BUG_ON(e->armed);
 
-	i = k->timern++;
-	if (k->timern >= RUNTIME_MAX_TIMERS) {
-		/* TODO: support unlimited timers */
-		BUG();
+	e->deadline_us = deadline_us;
+	e->localk = k;
+	e->armed = true;
+
+	/* coarse timers go in the timer wheel, and so do the rest once the
+	 * heap is full */
+	e->in_wheel = coarse || k->timern >= RUNTIME_MAX_TIMERS;
+	if (e->in_wheel) {
+		timer_wheel_add(w, e);
+		w->next_us = MIN(w->next_us, timer_wheel_next_tick(w) <<
+					     TIMER_WHEEL_TICK_SHIFT);
+		return;
 	}
 
+	i = k->timern++;
 	k->timers[i].deadline_us = deadline_us;
 	k->timers[i].e = e;
 	e->idx = i;
-	e->localk = k;
 	sift_up(k->timers, i);
-	e->armed = true;
+}
+
+static void __timer_start(struct timer_entry *e, uint64_t deadline_us,
+			  bool coarse)
+{
+	struct kthread *k = getk();
+
+	spin_lock(&k->timer_lock);
+	timer_start_locked(e, deadline_us, coarse);
+	update_q_ptrs(k);
+	spin_unlock(&k->timer_lock);
+	putk();
 }
 
 /**
@@ -154,13 +320,23 @@ static void timer_start_locked(struct timer_entry *e, uint64_t deadline_us)
  */
 void timer_start(struct timer_entry *e, uint64_t deadline_us)
 {
-	struct kthread *k = getk();
+	__timer_start(e, deadline_us, false);
+}
 
-	spin_lock(&k->timer_lock);
-	timer_start_locked(e, deadline_us);
-	update_q_ptrs(k);
-	spin_unlock(&k->timer_lock);
-	putk();
+/**
+ * timer_start_coarse - arms a timer that can fire up to a tick late
+ * @e: the timer entry to start
+ * @deadline_us: the deadline in microseconds
+ *
+ * Meant for timeouts that are usually cancelled or re-armed before they fire
+ * (e.g. TCP's), where ~1 ms of slack is fine. Arming and cancelling are O(1)
+ * and any number of coarse timers can be armed.
+ *
+ * @e must have been initialized with timer_init().
+ */
+void timer_start_coarse(struct timer_entry *e, uint64_t deadline_us)
+{
+	__timer_start(e, deadline_us, true);
 }
 
 /**
@@ -177,6 +353,8 @@ bool timer_cancel(struct timer_entry *e)
 
 try_again:
 	k = load_acquire(&e->localk);
+	if (!k)
+		return false;
 	spin_lock_np(&k->timer_lock);
 
 	if (e->localk != k) {
@@ -191,6 +369,16 @@ try_again:
 	}
 	e->armed = false;
 
+	if (e->in_wheel) {
+		/* the timer may have been the only one at the next deadline */
+		if (timer_wheel_del(k->timer_wheel, e)) {
+			timer_wheel_update_next(k->timer_wheel);
+			update_q_ptrs(k);
+		}
+		spin_unlock_np(&k->timer_lock);
+		return true;
+	}
+
 	last = --k->timern;
 	if (e->idx == last) {
 		update_q_ptrs(k);
@@ -224,7 +412,7 @@ static void __timer_sleep(uint64_t deadline_us)
 	k = getk();
 	spin_lock_np(&k->timer_lock);
 	putk();
-	timer_start_locked(&e, deadline_us);
+	timer_start_locked(&e, deadline_us, false);
 	update_q_ptrs(k);
 	thread_park_and_unlock_np(&k->timer_lock);
 }
@@ -252,6 +440,7 @@ void timer_sleep(uint64_t duration_us)
 
 static void timer_softirq_one(struct kthread *k)
 {
+	struct timer_wheel *w = k->timer_wheel;
 	struct timer_entry *e;
 	uint64_t now_us;
 	int i;
@@ -260,25 +449,35 @@ static void timer_softirq_one(struct kthread *k)
 	assert_timer_heap_is_valid(k);
 
 	now_us = microtime();
-	while (!preempt_needed() && k->timern > 0 &&
-	       k->timers[0].deadline_us <= now_us) {
-		i = --k->timern;
-		e = k->timers[0].e;
-		if (i > 0) {
-			k->timers[0] = k->timers[i];
-			k->timers[0].e->idx = 0;
-			sift_down(k->timers, 0, i);
+	while (!preempt_needed()) {
+		if (w->next_us <= now_us)
+			timer_wheel_advance(w, now_us);
+
+		if (k->timern > 0 && k->timers[0].deadline_us <= now_us) {
+			i = --k->timern;
+			e = k->timers[0].e;
+			if (i > 0) {
+				k->timers[0] = k->timers[i];
+				k->timers[0].e->idx = 0;
+				sift_down(k->timers, 0, i);
+			}
+		} else if (!list_empty(&w->expired)) {
+			e = list_pop(&w->expired, struct timer_entry, link);
+			timer_wheel_update_next(w);
+		} else {
+			break;
 		}
+		e->armed = false;
 		update_q_ptrs(k);
 		spin_unlock(&k->timer_lock);
 
 		/* execute the timer handler */
-		e->armed = false;
 		e->fn(e->arg);
 		spin_lock(&k->timer_lock);
 		now_us = microtime();
 	}
 
+	update_q_ptrs(k);
 	spin_unlock(&k->timer_lock);
 }
 
@@ -303,7 +502,9 @@ int timer_init_thread(void)
 {
 	struct kthread *k = myk();
 	struct timer_spec *ts = &iok.threads[k->kthread_idx].timer_heap;
+	struct timer_wheel *w;
 	thread_t *th;
+	int i, j;
 
 	k->timers = aligned_alloc(CACHE_LINE_SIZE,
 			align_up(sizeof(struct timer_idx) * RUNTIME_MAX_TIMERS,
@@ -311,7 +512,22 @@ int timer_init_thread(void)
 	if (!k->timers)
 		return -ENOMEM;
 
-	th = thread_create(timer_softirq, k);
+	w = aligned_alloc(CACHE_LINE_SIZE,
+			  align_up(sizeof(*w), CACHE_LINE_SIZE));
+	if (!w)
+		return -ENOMEM;
+	memset(w, 0, sizeof(*w));
+	w->next_us = UINT64_MAX;
+	w->now_tick = microtime() >> TIMER_WHEEL_TICK_SHIFT;
+	list_head_init(&w->expired);
+	for (i = 0; i < TIMER_WHEEL_LEVELS; i++) {
+		for (j = 0; j < TIMER_WHEEL_SIZE; j++)
+			list_head_init(&w->slots[i][j]);
+	}
+	k->timer_wheel = w;
+
+	th = thread_create_with_stack_size(timer_softirq, k,
+					   RUNTIME_STACK_SIZE);
 	if (!th)
 		return -ENOMEM;
 
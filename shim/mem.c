@@ -1,84 +1,133 @@
-
 #include <dlfcn.h>
+#include <errno.h>
+#include <malloc.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include <base/page.h>
 #include <runtime/preempt.h>
+#include <runtime/smalloc.h>
 
-#define HOOK3(fnname, retType, argType1, argType2, argType3)                   \
-	retType fnname(argType1 __a1, argType2 __a2, argType3 __a3)            \
-	{                                                                      \
-		static retType (*real_##fnname)(argType1, argType2, argType3); \
-		if (unlikely(!real_##fnname)) {                                \
-			real_##fnname = dlsym(RTLD_NEXT, #fnname);             \
-		}                                                              \
-		preempt_disable();                                             \
-		retType __t = real_##fnname(__a1, __a2, __a3);                 \
-		preempt_enable();                                              \
-		return __t;                                                    \
-	}
+/*
+ * Allocations from runtime threads are served by smalloc, so unmodified
+ * binaries get NUMA-local, huge-page backed memory. Anything else (threads the
+ * runtime doesn't manage, or allocations made before it started) goes to libc.
+ * Frees are routed by address since memory can cross between the two.
+ */
 
-#define HOOK2(fnname, retType, argType1, argType2)                             \
-	retType fnname(argType1 __a1, argType2 __a2)                           \
-	{                                                                      \
-		static retType (*real_##fnname)(argType1, argType2);           \
-		if (unlikely(!real_##fnname)) {                                \
-			real_##fnname = dlsym(RTLD_NEXT, #fnname);             \
-		}                                                              \
-		preempt_disable();                                             \
-		retType __t = real_##fnname(__a1, __a2);                       \
-		preempt_enable();                                              \
-		return __t;                                                    \
-	}
+#define REAL(fnname, fntype)                                                   \
+	({                                                                     \
+		static fntype __fn;                                            \
+		if (unlikely(!__fn))                                           \
+			__fn = (fntype)dlsym(RTLD_NEXT, #fnname);              \
+		__fn;                                                          \
+	})
 
-#define HOOK1(fnname, retType, argType1)                                       \
-	retType fnname(argType1 __a1)                                          \
-	{                                                                      \
-		static retType (*real_##fnname)(argType1);                     \
-		if (unlikely(!real_##fnname)) {                                \
-			real_##fnname = dlsym(RTLD_NEXT, #fnname);             \
-		}                                                              \
-		preempt_disable();                                             \
-		retType __t = real_##fnname(__a1);                             \
-		preempt_enable();                                              \
-		return __t;                                                    \
-	}
+typedef void *(*malloc_fn_t)(size_t);
+typedef void (*free_fn_t)(void *);
+typedef void *(*realloc_fn_t)(void *, size_t);
+typedef void *(*calloc_fn_t)(size_t, size_t);
+typedef void *(*memalign_fn_t)(size_t, size_t);
+typedef size_t (*usable_size_fn_t)(void *);
+
+static inline bool use_smalloc(void)
+{
+	return smalloc_thread_ready;
+}
+
+static inline bool is_smalloc_addr(void *ptr)
+{
+	return is_page_addr(ptr);
+}
+
+static void *libc_malloc(size_t size)
+{
+	void *ptr;
+
+	preempt_disable();
+	ptr = REAL(malloc, malloc_fn_t)(size);
+	preempt_enable();
+	return ptr;
+}
+
+static void libc_free(void *ptr)
+{
+	preempt_disable();
+	REAL(free, free_fn_t)(ptr);
+	preempt_enable();
+}
+
+static void *libc_memalign(size_t alignment, size_t size)
+{
+	void *ptr;
+
+	preempt_disable();
+	ptr = REAL(memalign, memalign_fn_t)(alignment, size);
+	preempt_enable();
+	return ptr;
+}
+
+void *malloc(size_t size)
+{
+	if (use_smalloc())
+		return smalloc(size);
+	return libc_malloc(size);
+}
+
+void free(void *ptr)
+{
+	if (!ptr)
+		return;
+	if (is_smalloc_addr(ptr))
+		sfree(ptr);
+	else
+		libc_free(ptr);
+}
+
+void cfree(void *ptr)
+{
+	free(ptr);
+}
 
-#define HOOK1_NORET(fnname, argType1)                                          \
-	void fnname(argType1 __a1)                                             \
-	{                                                                      \
-		static void (*real_##fnname)(argType1);                        \
-		if (unlikely(!real_##fnname)) {                                \
-			real_##fnname = dlsym(RTLD_NEXT, #fnname);             \
-		}                                                              \
-		preempt_disable();                                             \
-		real_##fnname(__a1);                                           \
-		preempt_enable();                                              \
+void *realloc(void *ptr, size_t size)
+{
+	void *new_ptr;
+
+	if (!ptr)
+		return malloc(size);
+	if (is_smalloc_addr(ptr)) {
+		if (use_smalloc())
+			return srealloc(ptr, size);
+
+		/* move it to libc memory */
+		new_ptr = libc_malloc(size);
+		if (new_ptr) {
+			memcpy(new_ptr, ptr, MIN(size, smalloc_usable_size(ptr)));
+			sfree(ptr);
+		}
+		return new_ptr;
 	}
 
-HOOK1(malloc, void *, size_t);
-HOOK1_NORET(free, void *);
-HOOK2(realloc, void *, void *, size_t);
-HOOK1_NORET(cfree, void *);
-HOOK2(memalign, void *, size_t, size_t);
-HOOK2(aligned_alloc, void *, size_t, size_t);
-HOOK1(valloc, void *, size_t);
-HOOK1(pvalloc, void *, size_t);
-HOOK3(posix_memalign, int, void **, size_t, size_t);
-
-HOOK1_NORET(__libc_free, void *);
-HOOK2(__libc_realloc, void *, void *, size_t);
-HOOK2(__libc_calloc, void *, size_t, size_t);
-HOOK1_NORET(__libc_cfree, void *);
-HOOK2(__libc_memalign, void *, size_t, size_t);
-HOOK1(__libc_valloc, void *, size_t);
-HOOK1(__libc_pvalloc, void *, size_t);
-HOOK3(__posix_memalign, int, void **, size_t, size_t);
+	preempt_disable();
+	new_ptr = REAL(realloc, realloc_fn_t)(ptr, size);
+	preempt_enable();
+	return new_ptr;
+}
 
 static void *dummy_calloc(size_t a, size_t b) { return NULL; }
 
 void *calloc(size_t a, size_t b)
 {
-	static void *(*real_calloc)(size_t, size_t);
+	static calloc_fn_t real_calloc;
+	size_t size;
+	void *ptr;
+
+	if (use_smalloc()) {
+		if (unlikely(__builtin_mul_overflow(a, b, &size)))
+			return NULL;
+		return __szalloc(size);
+	}
+
 	if (unlikely(!real_calloc)) {
 		// Ensure that dlsym's call to calloc doesn't loop infinitely
 		real_calloc = dummy_calloc;
@@ -86,7 +135,106 @@ void *calloc(size_t a, size_t b)
 		real_calloc = dlsym(RTLD_NEXT, "calloc");
 	}
 	preempt_disable();
-	void *ptr = real_calloc(a, b);
+	ptr = real_calloc(a, b);
 	preempt_enable();
 	return ptr;
 }
+
+void *memalign(size_t alignment, size_t size)
+{
+	if (use_smalloc() && alignment <= PGSIZE_2MB)
+		return saligned_alloc(alignment, size);
+	return libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	return memalign(alignment, size);
+}
+
+void *valloc(size_t size)
+{
+	return memalign(PGSIZE_4KB, size);
+}
+
+void *pvalloc(size_t size)
+{
+	return memalign(PGSIZE_4KB, align_up(size, PGSIZE_4KB));
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	void *ptr;
+
+	if (!is_power_of_two(alignment) || alignment % sizeof(void *) != 0)
+		return EINVAL;
+
+	ptr = memalign(alignment, size);
+	if (!ptr)
+		return ENOMEM;
+
+	*memptr = ptr;
+	return 0;
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+	size_t size;
+
+	if (!ptr)
+		return 0;
+	if (is_smalloc_addr(ptr))
+		return smalloc_usable_size(ptr);
+
+	preempt_disable();
+	size = REAL(malloc_usable_size, usable_size_fn_t)(ptr);
+	preempt_enable();
+	return size;
+}
+
+/* glibc's internal entry points */
+
+void *__libc_malloc(size_t size)
+{
+	return malloc(size);
+}
+
+void __libc_free(void *ptr)
+{
+	free(ptr);
+}
+
+void __libc_cfree(void *ptr)
+{
+	free(ptr);
+}
+
+void *__libc_realloc(void *ptr, size_t size)
+{
+	return realloc(ptr, size);
+}
+
+void *__libc_calloc(size_t a, size_t b)
+{
+	return calloc(a, b);
+}
+
+void *__libc_memalign(size_t alignment, size_t size)
+{
+	return memalign(alignment, size);
+}
+
+void *__libc_valloc(size_t size)
+{
+	return valloc(size);
+}
+
+void *__libc_pvalloc(size_t size)
+{
+	return pvalloc(size);
+}
+
+int __posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	return posix_memalign(memptr, alignment, size);
+}
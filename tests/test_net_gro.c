@@ -0,0 +1,285 @@
+/*
+ * test_net_gro.c - tests coalescing of ingress TCP segments into chains
+ *
+ * Segments are built by hand and fed through the RX path of a connection that
+ * is attached to the transport layer but has no real peer, so the ACKs it
+ * sends are never answered.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <net/ethernet.h>
+#include <net/ip.h>
+#include <net/tcp.h>
+#include <runtime/runtime.h>
+#include <runtime/tcp.h>
+
+#include "../runtime/defs.h"
+#include "../runtime/net/tcp.h"
+
+#define SEG_LEN		1000
+#define NR_SEGS		8
+#define STREAM_LEN	(SEG_LEN * NR_SEGS)
+/* starts close to a sequence number wrap */
+#define IRS		0xffffe000
+#define LPORT		9000
+#define RPORT		9001
+#define SND_INFLIGHT	3000
+
+static unsigned char stream[STREAM_LEN];
+
+static uint64_t sum_stat(int stat)
+{
+	uint64_t sum = 0;
+	int i;
+
+	for (i = 0; i < nrks; i++)
+		sum += ks[i]->stats[stat];
+	return sum;
+}
+
+static struct mbuf *build_seg(tcpconn_t *c, uint32_t off, uint32_t ack,
+			      uint16_t win, uint8_t flags, uint8_t tos)
+{
+	struct eth_hdr *eth;
+	struct ip_hdr *iphdr;
+	struct tcp_hdr *tcphdr;
+	struct mbuf *m;
+
+	m = net_tx_alloc_mbuf();
+	BUG_ON(!m);
+
+	eth = mbuf_put_hdr(m, *eth);
+	eth->dhost = netcfg.mac;
+	eth->shost = netcfg.mac;
+	eth->type = hton16(ETHTYPE_IP);
+
+	iphdr = mbuf_put_hdr(m, *iphdr);
+	memset(iphdr, 0, sizeof(*iphdr));
+	iphdr->version = IPVERSION;
+	iphdr->header_len = sizeof(*iphdr) / sizeof(uint32_t);
+	iphdr->tos = tos;
+	iphdr->len = hton16(sizeof(*iphdr) + sizeof(*tcphdr) + SEG_LEN);
+	iphdr->ttl = 64;
+	iphdr->proto = IPPROTO_TCP;
+	iphdr->saddr = hton32(c->e.raddr.ip);
+	iphdr->daddr = hton32(c->e.laddr.ip);
+
+	tcphdr = mbuf_put_hdr(m, *tcphdr);
+	memset(tcphdr, 0, sizeof(*tcphdr));
+	tcphdr->sport = hton16(c->e.raddr.port);
+	tcphdr->dport = hton16(c->e.laddr.port);
+	tcphdr->seq = hton32(IRS + off);
+	tcphdr->ack = hton32(ack);
+	tcphdr->off = sizeof(*tcphdr) / sizeof(uint32_t);
+	tcphdr->flags = flags;
+	tcphdr->win = hton16(win);
+
+	memcpy(mbuf_put(m, SEG_LEN), &stream[off], SEG_LEN);
+	m->csum_type = CHECKSUM_TYPE_UNNECESSARY;
+	return m;
+}
+
+static tcpconn_t *conn_create(void)
+{
+	struct netaddr laddr = {0, LPORT}, raddr = {0, RPORT};
+	tcpconn_t *c;
+
+	c = tcp_conn_alloc();
+	BUG_ON(!c);
+	raddr.ip = netcfg.addr ^ 1;
+	BUG_ON(tcp_conn_attach(c, laddr, raddr));
+
+	spin_lock_np(&c->lock);
+	c->pcb.state = TCP_STATE_ESTABLISHED;
+	c->pcb.irs = IRS;
+	c->pcb.rcv_nxt = IRS;
+	c->pcb.snd_mss = tcp_calculate_mss(net_get_mtu());
+	c->pcb.snd_wnd = TCP_WIN;
+	c->pcb.snd_wl1 = IRS - 1;
+	c->pcb.snd_wl2 = c->pcb.snd_una;
+	tcp_cc_init(c);
+
+	/* pretend some data was sent, so ACKs can cover it */
+	c->pcb.snd_nxt = c->pcb.snd_una + SND_INFLIGHT;
+	spin_unlock_np(&c->lock);
+
+	return c;
+}
+
+/* reads the stream back and compares it byte for byte */
+static void read_check(tcpconn_t *c)
+{
+	unsigned char buf[STREAM_LEN];
+	ssize_t ret;
+	size_t pos;
+
+	BUG_ON(ACCESS_ONCE(c->pcb.rcv_nxt) != IRS + STREAM_LEN);
+	for (pos = 0; pos < STREAM_LEN; pos += ret) {
+		ret = tcp_read(c, buf + pos, STREAM_LEN - pos);
+		BUG_ON(ret <= 0);
+	}
+	BUG_ON(memcmp(buf, stream, STREAM_LEN) != 0);
+}
+
+static void rx_batch(struct mbuf **ms, unsigned int nr)
+{
+	BUG_ON(!cfg_gro_enabled);
+	net_rx_batch(ms, nr);
+}
+
+/* a batch of in-order segments becomes one chain */
+static void test_chain(void)
+{
+	struct mbuf *ms[NR_SEGS];
+	uint64_t chains, coalesced, ooo;
+	uint32_t ack;
+	tcpconn_t *c;
+	int i;
+
+	log_info("testing a chain of in-order segments");
+
+	c = conn_create();
+	ack = c->pcb.snd_nxt;
+	for (i = 0; i < NR_SEGS; i++)
+		ms[i] = build_seg(c, i * SEG_LEN, ack, 20000 + i, TCP_ACK, 0);
+
+	chains = sum_stat(STAT_RX_GRO_CHAINS);
+	coalesced = sum_stat(STAT_RX_GRO_COALESCED);
+	ooo = sum_stat(STAT_RX_TCP_OUT_OF_ORDER);
+	rx_batch(ms, NR_SEGS);
+	BUG_ON(sum_stat(STAT_RX_GRO_CHAINS) - chains != 1);
+	BUG_ON(sum_stat(STAT_RX_GRO_COALESCED) - coalesced != NR_SEGS - 1);
+	BUG_ON(sum_stat(STAT_RX_TCP_OUT_OF_ORDER) != ooo);
+
+	spin_lock_np(&c->lock);
+
+	/* the receive window shrinks by the whole chain */
+	BUG_ON(c->pcb.rcv_nxt != IRS + STREAM_LEN);
+	BUG_ON(c->pcb.rcv_wnd != TCP_WIN - STREAM_LEN);
+
+	/* the ACK is taken, along with the last segment's window */
+	BUG_ON(c->pcb.snd_una != ack);
+	BUG_ON(c->pcb.snd_wnd != 20000 + NR_SEGS - 1);
+	BUG_ON(c->pcb.snd_wl1 != IRS + (NR_SEGS - 1) * SEG_LEN);
+	BUG_ON(c->pcb.snd_wl2 != ack);
+
+	/* every segment counts toward the delayed ACK, so one was sent */
+	BUG_ON(c->ack_delayed);
+	BUG_ON(c->acks_delayed_cnt != 0);
+	spin_unlock_np(&c->lock);
+
+	read_check(c);
+	tcp_conn_destroy(c);
+}
+
+/* a chain that doesn't start at rcv_nxt falls back to per-segment handling */
+static void test_chain_fallback(void)
+{
+	struct mbuf *ms[NR_SEGS];
+	uint64_t chains, ooo;
+	uint32_t ack;
+	tcpconn_t *c;
+	int i;
+
+	log_info("testing the fallback for an out-of-order chain");
+
+	c = conn_create();
+	ack = c->pcb.snd_una;
+
+	/* everything but the first segment */
+	for (i = 1; i < NR_SEGS; i++)
+		ms[i - 1] = build_seg(c, i * SEG_LEN, ack, 20000, TCP_ACK, 0);
+
+	chains = sum_stat(STAT_RX_GRO_CHAINS);
+	ooo = sum_stat(STAT_RX_TCP_OUT_OF_ORDER);
+	rx_batch(ms, NR_SEGS - 1);
+	BUG_ON(sum_stat(STAT_RX_GRO_CHAINS) - chains != 1);
+	BUG_ON(sum_stat(STAT_RX_TCP_OUT_OF_ORDER) - ooo != NR_SEGS - 1);
+
+	spin_lock_np(&c->lock);
+	BUG_ON(c->pcb.rcv_nxt != IRS);
+	BUG_ON(c->rxq_ooo_len != NR_SEGS - 1);
+	spin_unlock_np(&c->lock);
+
+	/* the missing segment drains the out-of-order queue */
+	ms[0] = build_seg(c, 0, ack, 20000, TCP_ACK | TCP_PUSH, 0);
+	rx_batch(ms, 1);
+
+	spin_lock_np(&c->lock);
+	BUG_ON(!list_empty(&c->rxq_ooo));
+	spin_unlock_np(&c->lock);
+
+	read_check(c);
+	tcp_conn_destroy(c);
+}
+
+/*
+ * A segment that can't be coalesced flushes its flow first, so it is still
+ * delivered after the segments held before it.
+ */
+static void test_flush_order(void)
+{
+	struct mbuf *ms[NR_SEGS];
+	uint64_t chains, ooo;
+	uint32_t ack;
+	tcpconn_t *c;
+	int i;
+
+	log_info("testing ordering around a segment that isn't coalesced");
+
+	c = conn_create();
+	ack = c->pcb.snd_una;
+	for (i = 0; i < NR_SEGS; i++) {
+		/* CE marked segments are never coalesced */
+		ms[i] = build_seg(c, i * SEG_LEN, ack, 20000, TCP_ACK,
+				  i == NR_SEGS / 2 ? IPTOS_ECN_CE : 0);
+	}
+
+	chains = sum_stat(STAT_RX_GRO_CHAINS);
+	ooo = sum_stat(STAT_RX_TCP_OUT_OF_ORDER);
+	rx_batch(ms, NR_SEGS);
+
+	/* one chain before the marked segment, one after it */
+	BUG_ON(sum_stat(STAT_RX_GRO_CHAINS) - chains != 2);
+	BUG_ON(sum_stat(STAT_RX_TCP_OUT_OF_ORDER) != ooo);
+
+	read_check(c);
+	tcp_conn_destroy(c);
+}
+
+static void main_handler(void *arg)
+{
+	int i;
+
+	log_info("started main_handler() thread");
+
+	for (i = 0; i < STREAM_LEN; i++)
+		stream[i] = i * 13 + (i >> 8);
+
+	test_chain();
+	test_chain_fallback();
+	test_flush_order();
+	log_info("gro tests passed");
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	if (argc < 2) {
+		printf("arg must be config file\n");
+		return -EINVAL;
+	}
+
+	ret = runtime_init(argv[1], main_handler, NULL);
+	if (ret) {
+		printf("failed to start runtime\n");
+		return ret;
+	}
+
+	return 0;
+}
@@ -0,0 +1,348 @@
+/*
+ * test_net_tcp_cc.c - tests TCP RTT estimation and congestion control
+ *
+ * Most connections are never attached to the transport layer; those tests
+ * drive the congestion control hooks directly. The retransmission timeout test
+ * attaches a connection whose peer never answers and feeds it ACKs by hand.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <net/ethernet.h>
+#include <net/ip.h>
+#include <net/tcp.h>
+#include <runtime/runtime.h>
+#include <runtime/smalloc.h>
+#include <runtime/tcp.h>
+#include <runtime/timer.h>
+
+#include "../runtime/defs.h"
+#include "../runtime/net/tcp.h"
+
+#define MSS	1000
+#define IRS	0x1000
+#define LPORT	9000
+#define RPORT	9001
+
+static tcpconn_t *conn_create(int cc, uint32_t flight)
+{
+	int old_cc = cfg_tcp_cc;
+	tcpconn_t *c;
+
+	cfg_tcp_cc = cc;
+	c = tcp_conn_alloc();
+	cfg_tcp_cc = old_cc;
+	BUG_ON(!c);
+
+	c->timer_stopped = true;
+	c->pcb.state = TCP_STATE_ESTABLISHED;
+	c->pcb.snd_mss = MSS;
+	c->pcb.snd_nxt = c->pcb.snd_una + flight;
+
+	spin_lock_np(&c->lock);
+	tcp_cc_init(c);
+	spin_unlock_np(&c->lock);
+	return c;
+}
+
+/* advances snd_una and reports the ACK, the way the RX path does */
+static void ack(tcpconn_t *c, uint32_t acked, bool ece)
+{
+	struct list_head q;
+
+	list_head_init(&q);
+	spin_lock_np(&c->lock);
+	c->pcb.snd_una += acked;
+	tcp_cc_ack(c, acked, ece, &q);
+	spin_unlock_np(&c->lock);
+}
+
+static void test_rtt(void)
+{
+	tcpconn_t *c;
+	int i;
+
+	log_info("testing RTT estimation and timeout backoff");
+
+	c = conn_create(TCP_CC_RENO, 0);
+	spin_lock_np(&c->lock);
+
+	/* the first sample seeds the estimate */
+	tcp_rtt_sample(c, 10000);
+	BUG_ON(c->pcb.srtt != 10000 || c->pcb.rttvar != 5000);
+	BUG_ON(c->pcb.rto != 30000);
+
+	/* later ones are smoothed (RFC 6298) */
+	tcp_rtt_sample(c, 2000);
+	BUG_ON(c->pcb.srtt != 9000 || c->pcb.rttvar != 5750);
+	BUG_ON(c->pcb.rto != 32000);
+
+	/* backoff doubles the timeout up to the cap */
+	tcp_rto_backoff(c);
+	BUG_ON(c->pcb.rto != 64000);
+	for (i = 0; i < 10; i++)
+		tcp_rto_backoff(c);
+	BUG_ON(c->pcb.rto != TCP_RTO_MAX);
+
+	/* and a new sample undoes it */
+	tcp_rtt_sample(c, 9000);
+	BUG_ON(c->pcb.srtt != 9000 || c->pcb.rttvar != 4312);
+	BUG_ON(c->pcb.rto != 26248);
+
+	spin_unlock_np(&c->lock);
+	sfree(c);
+
+	/* a zero sample counts as 1 us and the timeout has a floor */
+	c = conn_create(TCP_CC_RENO, 0);
+	spin_lock_np(&c->lock);
+	tcp_rtt_sample(c, 0);
+	BUG_ON(c->pcb.srtt != 1 || c->pcb.rttvar != 0);
+	BUG_ON(c->pcb.rto != TCP_RTO_MIN);
+	spin_unlock_np(&c->lock);
+	sfree(c);
+
+	/* and a ceiling */
+	c = conn_create(TCP_CC_RENO, 0);
+	spin_lock_np(&c->lock);
+	tcp_rtt_sample(c, 100 * ONE_SECOND);
+	BUG_ON(c->pcb.rto != TCP_RTO_MAX);
+	spin_unlock_np(&c->lock);
+	sfree(c);
+}
+
+static void test_reno_loss(void)
+{
+	tcpconn_t *c;
+
+	log_info("testing reno's reaction to loss");
+
+	/* duplicate ACKs halve the window */
+	c = conn_create(TCP_CC_RENO, 20 * MSS);
+	c->pcb.cwnd_cnt = MSS / 2;
+	tcp_reno_on_loss(c, false);
+	BUG_ON(c->pcb.ssthresh != 10 * MSS || c->pcb.cwnd != 10 * MSS);
+	BUG_ON(c->pcb.cwnd_cnt != 0);
+
+	/* a timeout restarts from one segment */
+	tcp_reno_on_loss(c, true);
+	BUG_ON(c->pcb.ssthresh != 10 * MSS || c->pcb.cwnd != MSS);
+
+	/* the threshold never drops below two segments */
+	c->pcb.snd_nxt = c->pcb.snd_una + MSS;
+	tcp_reno_on_loss(c, false);
+	BUG_ON(c->pcb.ssthresh != 2 * MSS || c->pcb.cwnd != 2 * MSS);
+	sfree(c);
+
+	/* duplicate ACKs shrink the window once per window of data */
+	c = conn_create(TCP_CC_RENO, 0);
+	c->pcb.snd_nxt = c->pcb.snd_una + 20 * MSS;
+	spin_lock_np(&c->lock);
+	tcp_cc_loss(c, false);
+	BUG_ON(c->pcb.cwnd != 10 * MSS);
+	BUG_ON(c->pcb.recover != c->pcb.snd_nxt);
+	tcp_cc_loss(c, false);
+	BUG_ON(c->pcb.cwnd != 10 * MSS);
+
+	/* but a timeout always does */
+	tcp_cc_loss(c, true);
+	BUG_ON(c->pcb.cwnd != MSS);
+	spin_unlock_np(&c->lock);
+	sfree(c);
+}
+
+static void test_dctcp(void)
+{
+	tcpconn_t *c;
+
+	log_info("testing dctcp's alpha and window cuts");
+
+	c = conn_create(TCP_CC_DCTCP, 10 * MSS);
+	BUG_ON(!c->pcb.ecn);
+	BUG_ON(c->pcb.dctcp.alpha != 1024);
+	BUG_ON(c->pcb.cwnd != TCP_INIT_CWND * MSS);
+
+	/* alpha only changes once a window of data is acked */
+	ack(c, 5 * MSS, false);
+	BUG_ON(c->pcb.dctcp.alpha != 1024);
+	BUG_ON(c->pcb.cwnd != 11 * MSS);
+
+	/* an unmarked window decays alpha by g = 1/16 */
+	c->pcb.snd_nxt += 10 * MSS;
+	ack(c, 5 * MSS, false);
+	BUG_ON(c->pcb.dctcp.alpha != 960);
+	BUG_ON(c->pcb.cwnd != 12 * MSS);
+	BUG_ON(c->pcb.ecn_cwr);
+
+	/* a mark cuts the window by alpha / 2 */
+	ack(c, 5 * MSS, true);
+	BUG_ON(c->pcb.dctcp.alpha != 960);
+	BUG_ON(c->pcb.ssthresh != 12000 - 12000 * 960 / 2048);
+	BUG_ON(c->pcb.cwnd != 6375);
+	BUG_ON(!c->pcb.ecn_cwr);
+	c->pcb.ecn_cwr = false;
+
+	/* but only once per window of data */
+	ack(c, 2 * MSS, true);
+	BUG_ON(c->pcb.cwnd != 6375);
+	BUG_ON(c->pcb.ecn_cwr);
+
+	/* a fully marked window moves alpha up by g */
+	c->pcb.snd_nxt += 10 * MSS;
+	ack(c, 3 * MSS, true);
+	BUG_ON(c->pcb.dctcp.alpha != 960 - 960 / 16 + 1024 / 16);
+	BUG_ON(c->pcb.cwnd != 6375 - 6375 * 964 / 2048);
+	BUG_ON(!c->pcb.ecn_cwr);
+
+	/* losses are handled like reno */
+	BUG_ON(c->pcb.cc->on_loss != tcp_reno_on_loss);
+	sfree(c);
+}
+
+/* delivers a pure ACK from the peer */
+static void rx_ack(tcpconn_t *c, uint32_t ack)
+{
+	struct eth_hdr *eth;
+	struct ip_hdr *iphdr;
+	struct tcp_hdr *tcphdr;
+	struct mbuf *m;
+
+	m = net_tx_alloc_mbuf();
+	BUG_ON(!m);
+
+	eth = mbuf_put_hdr(m, *eth);
+	eth->dhost = netcfg.mac;
+	eth->shost = netcfg.mac;
+	eth->type = hton16(ETHTYPE_IP);
+
+	iphdr = mbuf_put_hdr(m, *iphdr);
+	memset(iphdr, 0, sizeof(*iphdr));
+	iphdr->version = IPVERSION;
+	iphdr->header_len = sizeof(*iphdr) / sizeof(uint32_t);
+	iphdr->len = hton16(sizeof(*iphdr) + sizeof(*tcphdr));
+	iphdr->ttl = 64;
+	iphdr->proto = IPPROTO_TCP;
+	iphdr->saddr = hton32(c->e.raddr.ip);
+	iphdr->daddr = hton32(c->e.laddr.ip);
+
+	tcphdr = mbuf_put_hdr(m, *tcphdr);
+	memset(tcphdr, 0, sizeof(*tcphdr));
+	tcphdr->sport = hton16(c->e.raddr.port);
+	tcphdr->dport = hton16(c->e.laddr.port);
+	tcphdr->seq = hton32(IRS);
+	tcphdr->ack = hton32(ack);
+	tcphdr->off = sizeof(*tcphdr) / sizeof(uint32_t);
+	tcphdr->flags = TCP_ACK;
+	tcphdr->win = hton16(UINT16_MAX);
+
+	m->csum_type = CHECKSUM_TYPE_UNNECESSARY;
+	net_rx_batch(&m, 1);
+}
+
+/* counts the queued segments that were resent */
+static int nr_resent(tcpconn_t *c)
+{
+	struct mbuf *m;
+	int nr = 0;
+
+	list_for_each(&c->txq, m, link)
+		nr += m->resent;
+	return nr;
+}
+
+static void test_rto_resend(void)
+{
+	struct netaddr laddr = {0, LPORT}, raddr = {0, RPORT};
+	static char buf[TCP_INIT_CWND * MSS];
+	uint32_t una;
+	tcpconn_t *c;
+
+	log_info("testing that timeout resends follow the congestion window");
+
+	c = tcp_conn_alloc();
+	BUG_ON(!c);
+	raddr.ip = netcfg.addr ^ 1;
+	BUG_ON(tcp_conn_attach(c, laddr, raddr));
+
+	spin_lock_np(&c->lock);
+	c->pcb.state = TCP_STATE_ESTABLISHED;
+	c->pcb.irs = IRS;
+	c->pcb.rcv_nxt = IRS;
+	c->pcb.snd_mss = MSS;
+	c->pcb.snd_wnd = UINT16_MAX;
+	c->pcb.snd_wl1 = IRS - 1;
+	c->pcb.snd_wl2 = c->pcb.snd_una;
+	tcp_cc_init(c);
+	una = c->pcb.snd_una;
+	spin_unlock_np(&c->lock);
+
+	/* a full initial window that is never acknowledged */
+	BUG_ON(tcp_write(c, buf, sizeof(buf)) != sizeof(buf));
+	timer_sleep(TCP_RTO_INIT + 50 * ONE_MS);
+
+	/* the timeout only resends the first segment */
+	spin_lock_np(&c->lock);
+	BUG_ON(c->pcb.cwnd != MSS);
+	BUG_ON(c->pcb.rto != 2 * TCP_RTO_INIT);
+	BUG_ON(!c->rto_recovery);
+	BUG_ON(c->rto_recover != una + sizeof(buf));
+	BUG_ON(c->rto_resend_nxt != una + MSS);
+	BUG_ON(nr_resent(c) != 1);
+	BUG_ON(!list_top(&c->txq, struct mbuf, link)->resent);
+	spin_unlock_np(&c->lock);
+
+	/* its ACK grows the window by a segment, so two more go out */
+	rx_ack(c, una + MSS);
+	spin_lock_np(&c->lock);
+	BUG_ON(c->pcb.cwnd != 2 * MSS);
+	BUG_ON(c->rto_resend_nxt != una + 3 * MSS);
+	BUG_ON(nr_resent(c) != 2);
+	spin_unlock_np(&c->lock);
+
+	/* a partial ACK only makes room for what it acknowledged */
+	rx_ack(c, una + 2 * MSS);
+	spin_lock_np(&c->lock);
+	BUG_ON(c->pcb.cwnd != 3 * MSS);
+	BUG_ON(c->rto_resend_nxt != una + 5 * MSS);
+	BUG_ON(nr_resent(c) != 3);
+	spin_unlock_np(&c->lock);
+
+	/* recovery ends once everything lost is acknowledged */
+	rx_ack(c, una + sizeof(buf));
+	spin_lock_np(&c->lock);
+	BUG_ON(c->rto_recovery);
+	BUG_ON(!list_empty(&c->txq));
+	spin_unlock_np(&c->lock);
+
+	tcp_conn_destroy(c);
+}
+
+static void main_handler(void *arg)
+{
+	log_info("started main_handler() thread");
+	test_rtt();
+	test_reno_loss();
+	test_dctcp();
+	test_rto_resend();
+	log_info("tcp congestion control tests passed");
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	if (argc < 2) {
+		printf("arg must be config file\n");
+		return -EINVAL;
+	}
+
+	ret = runtime_init(argv[1], main_handler, NULL);
+	if (ret) {
+		printf("failed to start runtime\n");
+		return ret;
+	}
+
+	return 0;
+}
@@ -0,0 +1,103 @@
+/*
+ * test_net_tcp_timer.c - tests moving a TCP connection's timer earlier while
+ * its handler is waiting for the connection lock
+ *
+ * Needs at least two kthreads, so that another kthread fires the timer while
+ * this one holds the lock.
+ */
+
+#include <stdio.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <base/time.h>
+#include <runtime/runtime.h>
+#include <runtime/rcu.h>
+#include <runtime/smalloc.h>
+#include <runtime/timer.h>
+
+#include "../runtime/net/tcp.h"
+
+#define ROUNDS		1000
+#define FIRE_US		50
+#define WAIT_US		(5 * ONE_MS)
+
+static void test_rearm_while_firing(void)
+{
+	uint64_t start_us;
+	tcpconn_t *c;
+	int i, raced = 0;
+
+	log_info("testing timer re-arm while the handler waits for the lock");
+
+	c = tcp_conn_alloc();
+	BUG_ON(!c);
+	c->pcb.state = TCP_STATE_ESTABLISHED;
+
+	for (i = 0; i < ROUNDS; i++) {
+		spin_lock_np(&c->lock);
+
+		/* give the handler a timeout to re-arm for, but not act on */
+		c->ack_delayed = true;
+		c->ack_ts = microtime();
+		tcp_timer_arm(c, c->ack_ts + FIRE_US);
+
+		/* hold the lock until another kthread fires the timer */
+		start_us = microtime();
+		while (ACCESS_ONCE(c->timer.armed) &&
+		       microtime() - start_us < WAIT_US)
+			cpu_relax();
+
+		if (!ACCESS_ONCE(c->timer.armed)) {
+			/* move the deadline earlier, as a new RTT sample can */
+			tcp_timer_arm(c, c->next_timeout - 1);
+			raced++;
+		}
+
+		c->ack_ts = microtime();
+		spin_unlock_np(&c->lock);
+
+		/* let the handlers run */
+		timer_sleep(2 * FIRE_US);
+	}
+
+	/* stop the timer the way tcp_conn_destroy() does */
+	spin_lock_np(&c->lock);
+	c->ack_delayed = false;
+	spin_unlock_np(&c->lock);
+	ACCESS_ONCE(c->timer_stopped) = true;
+	mb();
+	timer_cancel(&c->timer);
+	synchronize_rcu();
+	sfree(c);
+
+	if (!raced)
+		log_warn("the timer never fired under the lock, add kthreads");
+	log_info("re-armed %d of %d timers while their handler waited", raced,
+		 ROUNDS);
+}
+
+static void main_handler(void *arg)
+{
+	log_info("started main_handler() thread");
+	test_rearm_while_firing();
+	log_info("tcp timer tests passed");
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	if (argc < 2) {
+		printf("arg must be config file\n");
+		return -EINVAL;
+	}
+
+	ret = runtime_init(argv[1], main_handler, NULL);
+	if (ret) {
+		printf("failed to start runtime\n");
+		return ret;
+	}
+
+	return 0;
+}
@@ -0,0 +1,136 @@
+/*
+ * test_net_tcp_tso.c - tests that TSO super-segments are resent as regular
+ * MSS-sized segments
+ *
+ * Needs enable_tso in the config. The connection is not attached to a peer,
+ * so the packets are sent to an address that may never answer.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <runtime/runtime.h>
+#include <runtime/smalloc.h>
+#include <runtime/tcp.h>
+
+#include "../runtime/net/tcp.h"
+
+/* more than a super-segment can hold, with a partial last segment */
+#define TSO_LEN		(NET_TSO_MAX_LEN + 10 * 1000 + 123)
+
+static unsigned char buf[2 * NET_TSO_BUF_LEN];
+
+/* rebuilds each segment as a retransmit would and checks it */
+static int check_copies(tcpconn_t *c, uint32_t iss)
+{
+	struct mbuf *m, *newm;
+	const unsigned char *payload;
+	uint32_t seq, len;
+	int nr_tso = 0;
+
+	list_for_each(&c->txq, m, link) {
+		nr_tso += m->tso_mss != 0;
+		if (m->tso_mss)
+			BUG_ON(m->tso_mss != c->pcb.snd_mss);
+
+		for (seq = m->seg_seq; wraps_lt(seq, m->seg_end); seq += len) {
+			newm = tcp_tx_copy_seg(c, m, seq);
+			BUG_ON(!newm);
+			BUG_ON(newm->tso_mss);
+			BUG_ON(newm->seg_seq != seq);
+
+			len = newm->seg_end - newm->seg_seq;
+			BUG_ON(len == 0 || len > c->pcb.snd_mss);
+			BUG_ON(wraps_gt(newm->seg_end, m->seg_end));
+
+			payload = mbuf_transport_offset(newm) +
+				  sizeof(struct tcp_hdr);
+			BUG_ON(memcmp(payload, buf + (seq - iss), len) != 0);
+
+			/* only the last segment of the write is pushed */
+			BUG_ON(!!(newm->flags & TCP_PUSH) !=
+			       (newm->seg_end == iss + TSO_LEN));
+			mbuf_free(newm);
+		}
+	}
+
+	return nr_tso;
+}
+
+static void test_tso_copies(void)
+{
+	struct list_head freeq;
+	tcpconn_t *c;
+	uint32_t iss;
+	ssize_t ret;
+	int i, nr_tso;
+
+	log_info("testing resends of TSO super-segments");
+
+	if (!cfg_tso_enabled) {
+		log_warn("TSO is disabled, set enable_tso");
+		return;
+	}
+
+	for (i = 0; i < TSO_LEN; i++)
+		buf[i] = i * 7 + (i >> 8);
+
+	c = tcp_conn_alloc();
+	BUG_ON(!c);
+	c->pcb.state = TCP_STATE_ESTABLISHED;
+	c->pcb.snd_mss = tcp_calculate_mss(net_get_mtu());
+	c->e.laddr.ip = netcfg.addr;
+	c->e.raddr.ip = netcfg.addr ^ 1;
+
+	/* retransmissions are driven by the test, not by the timer */
+	c->timer_stopped = true;
+
+	spin_lock_np(&c->lock);
+	iss = c->pcb.snd_nxt;
+	ret = tcp_tx_send(c, buf, TSO_LEN, true);
+	BUG_ON(ret != TSO_LEN);
+	BUG_ON(c->pcb.snd_nxt != iss + TSO_LEN);
+
+	nr_tso = check_copies(c, iss);
+	BUG_ON(nr_tso < 2);
+
+	/* acknowledge everything */
+	list_head_init(&freeq);
+	c->pcb.snd_una = c->pcb.snd_nxt;
+	tcp_conn_ack(c, &freeq);
+	BUG_ON(!list_empty(&c->txq));
+	spin_unlock_np(&c->lock);
+	mbuf_list_free(&freeq);
+
+	sfree(c);
+
+	log_info("%d super-segments were resent as MSS-sized segments",
+		 nr_tso);
+}
+
+static void main_handler(void *arg)
+{
+	log_info("started main_handler() thread");
+	test_tso_copies();
+	log_info("tcp segmentation offload tests passed");
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	if (argc < 2) {
+		printf("arg must be config file\n");
+		return -EINVAL;
+	}
+
+	ret = runtime_init(argv[1], main_handler, NULL);
+	if (ret) {
+		printf("failed to start runtime\n");
+		return ret;
+	}
+
+	return 0;
+}
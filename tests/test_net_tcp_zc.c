@@ -0,0 +1,312 @@
+/*
+ * test_net_tcp_zc.c - tests zero-copy TCP sends, their retransmission and
+ * their completion callback, and zero-copy reads
+ *
+ * The send test needs tcp_zc_region_mb in the config. The connections are not
+ * attached to a real peer, so packets are sent to an address that may never
+ * answer; the tests only depend on them being released, not delivered. The
+ * read test feeds segments to its connection by hand.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <base/time.h>
+#include <net/ethernet.h>
+#include <net/ip.h>
+#include <net/tcp.h>
+#include <runtime/runtime.h>
+#include <runtime/smalloc.h>
+#include <runtime/tcp.h>
+#include <runtime/timer.h>
+
+#include "../runtime/net/tcp.h"
+
+#define ZC_LEN		(256 * 1024 + 123)
+#define RELEASE_WAIT_US	(10 * ONE_SECOND)
+
+/* enough to hold back more than a quarter of the window */
+#define RX_SEG_LEN	1000
+#define RX_SEGS		40
+#define RX_LEN		(RX_SEG_LEN * RX_SEGS)
+#define RX_IRS		0x1000
+#define RX_LPORT	9000
+#define RX_RPORT	9001
+
+static atomic_t zc_done;
+
+static void zc_done_fn(void *arg)
+{
+	BUG_ON(arg != &zc_done);
+	atomic_inc(&zc_done);
+}
+
+/* rebuilds each segment as a retransmit would and checks its payload */
+static void check_retransmit_copies(tcpconn_t *c, const unsigned char *buf,
+				    uint32_t iss)
+{
+	struct mbuf *m, *newm;
+	const unsigned char *payload;
+	uint32_t seq, len;
+
+	list_for_each(&c->txq, m, link) {
+		BUG_ON(!m->zc_len);
+		for (seq = m->seg_seq; wraps_lt(seq, m->seg_end); seq += len) {
+			newm = tcp_tx_copy_seg(c, m, seq);
+			BUG_ON(!newm);
+			BUG_ON(newm->zc_len);
+			BUG_ON(newm->seg_seq != seq);
+
+			len = newm->seg_end - newm->seg_seq;
+			BUG_ON(len == 0 || len > c->pcb.snd_mss);
+			BUG_ON(wraps_gt(newm->seg_end, m->seg_end));
+
+			payload = mbuf_transport_offset(newm) +
+				  sizeof(struct tcp_hdr);
+			BUG_ON(memcmp(payload, buf + (seq - iss), len) != 0);
+
+			/* only the last segment of the write is pushed */
+			BUG_ON(!!(newm->flags & TCP_PUSH) !=
+			       (newm->seg_end == iss + ZC_LEN));
+			mbuf_free(newm);
+		}
+	}
+}
+
+static void test_zc_send(void)
+{
+	struct tcp_zc *zc;
+	struct list_head freeq;
+	unsigned char *buf;
+	uint64_t start_us;
+	tcpconn_t *c;
+	uint32_t iss;
+	ssize_t ret;
+	int i;
+
+	log_info("testing a zero-copy send, its retransmit and completion");
+
+	buf = tcp_zc_alloc(ZC_LEN);
+	if (!buf) {
+		log_warn("no zero-copy region, set tcp_zc_region_mb");
+		return;
+	}
+	for (i = 0; i < ZC_LEN; i++)
+		buf[i] = i * 7 + (i >> 8);
+
+	c = tcp_conn_alloc();
+	BUG_ON(!c);
+	c->pcb.state = TCP_STATE_ESTABLISHED;
+	c->pcb.snd_mss = tcp_calculate_mss(net_get_mtu());
+	c->e.laddr.ip = netcfg.addr;
+	c->e.raddr.ip = netcfg.addr ^ 1;
+
+	/* retransmissions are driven by the test, not by the timer */
+	c->timer_stopped = true;
+
+	zc = smalloc(sizeof(*zc));
+	BUG_ON(!zc);
+	atomic_write(&zc->ref, 1);
+	zc->done = zc_done_fn;
+	zc->arg = &zc_done;
+
+	spin_lock_np(&c->lock);
+	iss = c->pcb.snd_nxt;
+	ret = tcp_tx_send_zc(c, buf, ZC_LEN, zc);
+	BUG_ON(ret != ZC_LEN);
+	BUG_ON(c->pcb.snd_nxt != iss + ZC_LEN);
+
+	check_retransmit_copies(c, buf, iss);
+
+	/* resend everything, as a timeout with a large enough window would */
+	c->pcb.cwnd = ZC_LEN;
+	c->rto_recovery = true;
+	c->rto_recover = c->pcb.snd_nxt;
+	c->rto_resend_nxt = c->pcb.snd_una;
+	tcp_tx_retransmit(c);
+	BUG_ON(c->rto_resend_nxt != c->pcb.snd_nxt);
+	spin_unlock_np(&c->lock);
+
+	/* the packets still hold @buf until they are acknowledged */
+	tcp_zc_put(zc);
+	timer_sleep(ONE_MS);
+	BUG_ON(atomic_read(&zc_done) != 0);
+
+	/* acknowledge everything */
+	list_head_init(&freeq);
+	spin_lock_np(&c->lock);
+	c->pcb.snd_una = c->pcb.snd_nxt;
+	tcp_conn_ack(c, &freeq);
+	BUG_ON(!list_empty(&c->txq));
+	spin_unlock_np(&c->lock);
+	mbuf_list_free(&freeq);
+
+	/* the callback runs once the NIC (or ARP) releases the packets */
+	start_us = microtime();
+	while (!atomic_read(&zc_done) &&
+	       microtime() - start_us < RELEASE_WAIT_US)
+		timer_sleep(ONE_MS);
+	BUG_ON(atomic_read(&zc_done) != 1);
+
+	/* it must run only once */
+	timer_sleep(ONE_MS);
+	BUG_ON(atomic_read(&zc_done) != 1);
+
+	sfree(c);
+
+	log_info("zero-copy completion ran after %ld us",
+		 microtime() - start_us);
+}
+
+static unsigned char rx_stream[2 * RX_LEN];
+
+/* delivers one data segment from the peer, starting at @off in the stream */
+static void rx_seg(tcpconn_t *c, uint32_t off)
+{
+	struct eth_hdr *eth;
+	struct ip_hdr *iphdr;
+	struct tcp_hdr *tcphdr;
+	struct mbuf *m;
+
+	m = net_tx_alloc_mbuf();
+	BUG_ON(!m);
+
+	eth = mbuf_put_hdr(m, *eth);
+	eth->dhost = netcfg.mac;
+	eth->shost = netcfg.mac;
+	eth->type = hton16(ETHTYPE_IP);
+
+	iphdr = mbuf_put_hdr(m, *iphdr);
+	memset(iphdr, 0, sizeof(*iphdr));
+	iphdr->version = IPVERSION;
+	iphdr->header_len = sizeof(*iphdr) / sizeof(uint32_t);
+	iphdr->len = hton16(sizeof(*iphdr) + sizeof(*tcphdr) + RX_SEG_LEN);
+	iphdr->ttl = 64;
+	iphdr->proto = IPPROTO_TCP;
+	iphdr->saddr = hton32(c->e.raddr.ip);
+	iphdr->daddr = hton32(c->e.laddr.ip);
+
+	tcphdr = mbuf_put_hdr(m, *tcphdr);
+	memset(tcphdr, 0, sizeof(*tcphdr));
+	tcphdr->sport = hton16(c->e.raddr.port);
+	tcphdr->dport = hton16(c->e.laddr.port);
+	tcphdr->seq = hton32(RX_IRS + off);
+	tcphdr->ack = hton32(c->pcb.snd_una);
+	tcphdr->off = sizeof(*tcphdr) / sizeof(uint32_t);
+	tcphdr->flags = TCP_ACK | TCP_PUSH;
+	tcphdr->win = hton16(UINT16_MAX);
+
+	memcpy(mbuf_put(m, RX_SEG_LEN), &rx_stream[off], RX_SEG_LEN);
+	m->csum_type = CHECKSUM_TYPE_UNNECESSARY;
+	net_rx_batch(&m, 1);
+}
+
+/* receives RX_LEN bytes at @off and reads them back without copying */
+static struct mbuf *rx_read_zc(tcpconn_t *c, uint32_t off)
+{
+	struct iovec iov[RX_SEGS];
+	struct mbuf *chain;
+	int i, iovcnt = RX_SEGS;
+	size_t pos = off;
+	ssize_t ret;
+
+	for (i = 0; i < RX_SEGS; i++)
+		rx_seg(c, off + i * RX_SEG_LEN);
+
+	ret = tcp_read_zc(c, iov, &iovcnt, &chain);
+	BUG_ON(ret != RX_LEN || iovcnt != RX_SEGS || !chain);
+	for (i = 0; i < iovcnt; i++) {
+		BUG_ON(memcmp(iov[i].iov_base, &rx_stream[pos],
+			      iov[i].iov_len) != 0);
+		pos += iov[i].iov_len;
+	}
+
+	return chain;
+}
+
+static void test_zc_read(void)
+{
+	struct netaddr laddr = {0, RX_LPORT}, raddr = {0, RX_RPORT};
+	struct mbuf *chain;
+	tcpconn_t *c;
+	int i, refs;
+
+	log_info("testing zero-copy reads and the window they hold");
+
+	for (i = 0; i < ARRAY_SIZE(rx_stream); i++)
+		rx_stream[i] = i * 13 + (i >> 8);
+
+	c = tcp_conn_alloc();
+	BUG_ON(!c);
+	raddr.ip = netcfg.addr ^ 1;
+	BUG_ON(tcp_conn_attach(c, laddr, raddr));
+
+	spin_lock_np(&c->lock);
+	c->pcb.state = TCP_STATE_ESTABLISHED;
+	c->pcb.irs = RX_IRS;
+	c->pcb.rcv_nxt = RX_IRS;
+	c->pcb.snd_mss = tcp_calculate_mss(net_get_mtu());
+	c->pcb.snd_wnd = UINT16_MAX;
+	c->pcb.snd_wl1 = RX_IRS - 1;
+	c->pcb.snd_wl2 = c->pcb.snd_una;
+	spin_unlock_np(&c->lock);
+	refs = atomic_read(&c->ref.cnt);
+
+	/* the window stays closed while the chain is held */
+	chain = rx_read_zc(c, 0);
+	BUG_ON(atomic_read(&c->ref.cnt) != refs + 1);
+	timer_sleep(TCP_ACK_TIMEOUT * 2);
+	spin_lock_np(&c->lock);
+	BUG_ON(c->pcb.rcv_nxt != RX_IRS + RX_LEN);
+	BUG_ON(c->pcb.rcv_wnd != TCP_WIN - RX_LEN);
+	BUG_ON(c->tx_last_ack + c->tx_last_win != RX_IRS + TCP_WIN);
+	spin_unlock_np(&c->lock);
+
+	/* releasing it reopens the window and advertises it right away */
+	tcp_read_zc_release(c, chain);
+	BUG_ON(atomic_read(&c->ref.cnt) != refs);
+	spin_lock_np(&c->lock);
+	BUG_ON(c->pcb.rcv_wnd != TCP_WIN);
+	BUG_ON(c->tx_last_ack != RX_IRS + RX_LEN);
+	BUG_ON(c->tx_last_win != TCP_WIN);
+	spin_unlock_np(&c->lock);
+
+	/* a chain keeps the connection alive after it is closed */
+	chain = rx_read_zc(c, RX_LEN);
+	refs = atomic_read(&c->ref.cnt);
+	tcp_close(c);
+	BUG_ON(atomic_read(&c->ref.cnt) != refs - 1);
+	BUG_ON(!c->rx_closed);
+	timer_sleep(10 * ONE_MS);
+	tcp_read_zc_release(c, chain);
+
+	log_info("zero-copy reads held and returned the window");
+}
+
+static void main_handler(void *arg)
+{
+	log_info("started main_handler() thread");
+	test_zc_send();
+	test_zc_read();
+	log_info("tcp zero-copy tests passed");
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	if (argc < 2) {
+		printf("arg must be config file\n");
+		return -EINVAL;
+	}
+
+	ret = runtime_init(argv[1], main_handler, NULL);
+	if (ret) {
+		printf("failed to start runtime\n");
+		return ret;
+	}
+
+	return 0;
+}
@@ -0,0 +1,89 @@
+/*
+ * test_runtime_arena.c - tests arenas
+ */
+
+#include <stdio.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <base/time.h>
+#include <runtime/runtime.h>
+#include <runtime/arena.h>
+
+#define N	1000000
+
+static void test_alloc(void)
+{
+	arena_t a;
+	char *p, *last = NULL;
+	size_t size, align;
+	int i;
+
+	log_info("testing arena allocations");
+	arena_init(&a);
+
+	for (i = 0; i < 10000; i++) {
+		size = 1 + i % 4000;
+		align = 1UL << (i % 8);
+		p = arena_alloc_aligned(&a, size, align);
+		BUG_ON(!p || (uintptr_t)p % align != 0);
+		memset(p, i, size);
+		if (last)
+			BUG_ON(last[0] != (char)(i - 1));
+		last = p;
+	}
+
+	/* large allocations bypass the chunks */
+	p = arena_alloc_aligned(&a, 1024 * 1024, 4096);
+	BUG_ON(!p || (uintptr_t)p % 4096 != 0);
+	memset(p, 0, 1024 * 1024);
+
+	p = arena_zalloc(&a, 100);
+	BUG_ON(!p || p[0] != 0 || p[99] != 0);
+
+	arena_destroy(&a);
+}
+
+static void test_bench(void)
+{
+	uint64_t start_us;
+	arena_t a;
+	int i, j;
+
+	log_info("testing arena per-request cost");
+	start_us = microtime();
+	for (i = 0; i < N; i++) {
+		arena_init(&a);
+		for (j = 0; j < 16; j++)
+			BUG_ON(!arena_alloc(&a, 64 << (j % 5)));
+		arena_destroy(&a);
+	}
+	log_info("%f ns / request (16 allocations)",
+		 (double)(microtime() - start_us) * 1000 / N);
+}
+
+static void main_handler(void *arg)
+{
+	log_info("started main_handler() thread");
+	test_alloc();
+	test_bench();
+	log_info("arena tests passed");
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	if (argc < 2) {
+		printf("arg must be config file\n");
+		return -EINVAL;
+	}
+
+	ret = runtime_init(argv[1], main_handler, NULL);
+	if (ret) {
+		printf("failed to start runtime\n");
+		return ret;
+	}
+
+	return 0;
+}
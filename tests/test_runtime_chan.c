@@ -0,0 +1,159 @@
+/*
+ * test_runtime_chan.c - tests channels
+ */
+
+#include <stdio.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <base/time.h>
+#include <runtime/runtime.h>
+#include <runtime/sync.h>
+#include <runtime/chan.h>
+
+#define NSENDERS	8
+#define NRECEIVERS	8
+#define N		1000000
+#define BATCH		16
+#define CAPACITY	64
+
+static chan_t chan, chans[2];
+static atomic64_t recv_sum;
+
+static void send_handler(void *arg)
+{
+	unsigned long vals[BATCH], i, j;
+	ssize_t ret;
+
+	for (i = 0; i < N / NSENDERS; i += BATCH) {
+		for (j = 0; j < BATCH; j++)
+			vals[j] = i + j + 1;
+		for (j = 0; j < BATCH; j += ret) {
+			ret = chan_send_batch(&chan, &vals[j], BATCH - j);
+			BUG_ON(ret <= 0);
+		}
+	}
+
+	waitgroup_t *wg_parent = (waitgroup_t *)arg;
+	waitgroup_done(wg_parent);
+}
+
+static void recv_handler(void *arg)
+{
+	unsigned long vals[BATCH], sum = 0;
+	ssize_t ret, i;
+
+	while (true) {
+		ret = chan_recv_batch(&chan, vals, BATCH);
+		if (ret == -EPIPE)
+			break;
+		BUG_ON(ret <= 0);
+		for (i = 0; i < ret; i++)
+			sum += vals[i];
+	}
+	atomic64_fetch_and_add(&recv_sum, sum);
+
+	waitgroup_t *wg_parent = (waitgroup_t *)arg;
+	waitgroup_done(wg_parent);
+}
+
+static void test_mpmc(void)
+{
+	unsigned long expected = 0, i;
+	waitgroup_t send_wg, recv_wg;
+	uint64_t start_us;
+	int ret;
+
+	log_info("testing %d senders and %d receivers", NSENDERS, NRECEIVERS);
+	ret = chan_init(&chan, sizeof(unsigned long), CAPACITY);
+	BUG_ON(ret);
+
+	waitgroup_init(&send_wg);
+	waitgroup_init(&recv_wg);
+	waitgroup_add(&send_wg, NSENDERS);
+	waitgroup_add(&recv_wg, NRECEIVERS);
+	start_us = microtime();
+	for (i = 0; i < NRECEIVERS; i++) {
+		ret = thread_spawn(recv_handler, &recv_wg);
+		BUG_ON(ret);
+	}
+	for (i = 0; i < NSENDERS; i++) {
+		ret = thread_spawn(send_handler, &send_wg);
+		BUG_ON(ret);
+	}
+
+	waitgroup_wait(&send_wg);
+	chan_close(&chan);
+	waitgroup_wait(&recv_wg);
+
+	for (i = 0; i < N / NSENDERS; i++)
+		expected += (i + 1) * NSENDERS;
+	BUG_ON(atomic64_read(&recv_sum) != expected);
+	log_info("%f values / second",
+		 (double)N / ((microtime() - start_us) * 0.000001));
+	chan_destroy(&chan);
+}
+
+static void select_send_handler(void *arg)
+{
+	unsigned long i, idx = (unsigned long)arg;
+	int ret;
+
+	for (i = 0; i < N / 10; i++) {
+		ret = chan_send(&chans[idx], &i);
+		BUG_ON(ret);
+	}
+	chan_close(&chans[idx]);
+}
+
+static void test_select(void)
+{
+	chan_t *cs[2] = {&chans[0], &chans[1]};
+	unsigned long val, cnt[2] = {0, 0};
+	int i, ret;
+
+	log_info("testing chan_select()");
+	for (i = 0; i < 2; i++) {
+		ret = chan_init(&chans[i], sizeof(unsigned long), CAPACITY);
+		BUG_ON(ret);
+		ret = thread_spawn(select_send_handler, (void *)(unsigned long)i);
+		BUG_ON(ret);
+	}
+
+	while ((ret = chan_select(cs, 2, &val)) >= 0) {
+		/* values from each channel arrive in order */
+		BUG_ON(val != cnt[ret]);
+		cnt[ret]++;
+	}
+	BUG_ON(ret != -EPIPE);
+	BUG_ON(cnt[0] != N / 10 || cnt[1] != N / 10);
+
+	for (i = 0; i < 2; i++)
+		chan_destroy(&chans[i]);
+}
+
+static void main_handler(void *arg)
+{
+	log_info("started main_handler() thread");
+	test_mpmc();
+	test_select();
+	log_info("channel tests passed");
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	if (argc < 2) {
+		printf("arg must be config file\n");
+		return -EINVAL;
+	}
+
+	ret = runtime_init(argv[1], main_handler, NULL);
+	if (ret) {
+		printf("failed to start runtime\n");
+		return ret;
+	}
+
+	return 0;
+}
@@ -0,0 +1,189 @@
+/*
+ * test_runtime_handoff.c - checks that threads handed to idle kthreads run
+ * exactly once, and measures wakeup to run latency when the waking kthread
+ * is busy and other kthreads are idle
+ *
+ * Run once with runtime_spinning_kthreads set to the number of cores and once
+ * without it to compare handoffs to polling and parked kthreads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <base/time.h>
+#include <runtime/runtime.h>
+#include <runtime/sync.h>
+#include <runtime/timer.h>
+
+#include "../runtime/defs.h"
+
+#define N		100000
+#define FILLER_US	50
+#define WAKERS		8
+#define WAKES		20000
+
+static uint64_t wake_tsc[N];
+static uint64_t run_cycles[N];
+static waitgroup_t wg;
+
+static void filler_handler(void *arg)
+{
+	delay_us(FILLER_US);
+	waitgroup_done(&wg);
+}
+
+static void wake_handler(void *arg)
+{
+	unsigned long i = (unsigned long)arg;
+
+	run_cycles[i] = rdtsc() - wake_tsc[i];
+	waitgroup_done(&wg);
+}
+
+static atomic_t runs[WAKERS][WAKES];
+static waitgroup_t check_wg;
+
+static void check_handler(void *arg)
+{
+	atomic_inc((atomic_t *)arg);
+	waitgroup_done(&check_wg);
+}
+
+/* wakes threads from a busy kthread, so most of them are handed off */
+static void waker_handler(void *arg)
+{
+	atomic_t *r = (atomic_t *)arg;
+	int i, ret;
+
+	for (i = 0; i < WAKES; i++) {
+		preempt_disable();
+		ret = thread_spawn(check_handler, &r[i]);
+		BUG_ON(ret);
+		ret = thread_spawn(check_handler, &r[++i]);
+		BUG_ON(ret);
+		preempt_enable();
+		if (i % 64 == 1)
+			timer_sleep(1);
+	}
+
+	waitgroup_done(&check_wg);
+}
+
+static uint64_t sum_stat(int stat)
+{
+	uint64_t sum = 0;
+	int i;
+
+	for (i = 0; i < nrks; i++)
+		sum += ks[i]->stats[stat];
+	return sum;
+}
+
+static void test_handoff_runs_once(void)
+{
+	uint64_t handoffs, start_us;
+	thread_t *th;
+	int i, j;
+
+	log_info("checking that handed off threads run exactly once");
+
+	handoffs = sum_stat(STAT_HANDOFFS);
+	waitgroup_init(&check_wg);
+	waitgroup_add(&check_wg, WAKERS * (WAKES + 1));
+	for (i = 0; i < WAKERS; i++)
+		BUG_ON(thread_spawn(waker_handler, runs[i]));
+	waitgroup_wait(&check_wg);
+
+	for (i = 0; i < WAKERS; i++) {
+		for (j = 0; j < WAKES; j++) {
+			if (atomic_read(&runs[i][j]) != 1) {
+				log_err("thread %d/%d ran %d times", i, j,
+					atomic_read(&runs[i][j]));
+				BUG();
+			}
+		}
+	}
+
+	/* a thread left in a mailbox must be picked up, not stranded */
+	start_us = microtime();
+	for (i = 0; i < nrks; i++) {
+		while (true) {
+			th = ACCESS_ONCE(ks[i]->mailbox);
+			if (th == NULL || th == MAILBOX_CLOSED)
+				break;
+			BUG_ON(microtime() - start_us > 10 * ONE_MS);
+			timer_sleep(1);
+		}
+	}
+
+	handoffs = sum_stat(STAT_HANDOFFS) - handoffs;
+	if (!handoffs)
+		log_warn("no threads were handed off, add spinning kthreads");
+	log_info("%ld threads were handed off", handoffs);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void main_handler(void *arg)
+{
+	uint64_t start_us, elapsed_us;
+	unsigned long i;
+	int ret;
+
+	log_info("started main_handler() thread");
+	test_handoff_runs_once();
+
+	log_info("waking %d threads behind a %d us filler thread", N,
+		 FILLER_US);
+
+	waitgroup_init(&wg);
+	waitgroup_add(&wg, N * 2);
+	start_us = microtime();
+	for (i = 0; i < N; i++) {
+		/* keep the local runqueue busy so the wakeup goes elsewhere */
+		preempt_disable();
+		ret = thread_spawn(filler_handler, NULL);
+		BUG_ON(ret);
+		wake_tsc[i] = rdtsc();
+		ret = thread_spawn(wake_handler, (void *)i);
+		BUG_ON(ret);
+		preempt_enable();
+		timer_sleep(FILLER_US * 2);
+	}
+	waitgroup_wait(&wg);
+	elapsed_us = microtime() - start_us;
+
+	qsort(run_cycles, N, sizeof(uint64_t), cmp_u64);
+	log_info("finished in %ld us", elapsed_us);
+	log_info("wakeup to run latency (us) p50 %.2f p90 %.2f p99 %.2f "
+		 "p999 %.2f",
+		 (double)run_cycles[N / 2] / cycles_per_us,
+		 (double)run_cycles[N * 9 / 10] / cycles_per_us,
+		 (double)run_cycles[N * 99 / 100] / cycles_per_us,
+		 (double)run_cycles[N * 999 / 1000] / cycles_per_us);
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	if (argc < 2) {
+		printf("arg must be config file\n");
+		return -EINVAL;
+	}
+
+	ret = runtime_init(argv[1], main_handler, NULL);
+	if (ret) {
+		printf("failed to start runtime\n");
+		return ret;
+	}
+
+	return 0;
+}
@@ -5,10 +5,15 @@
 #include <base/time.h>
 #include <runtime/runtime.h>
 #include <runtime/sync.h>
+#include <runtime/timer.h>
 
 #define N	20000
 #define ITERS   500000
 #define NCORES	4
+#define CONTEND_THREADS	16
+#define CONTEND_ITERS	100000
+#define READ_ITERS	1000000
+#define WRITE_PERIOD_US	1000
 
 struct bucket {
 	mutex_t lock;
@@ -28,6 +33,147 @@ static mutex_t start_lock;
 static condvar_t start_cv;
 static bool start;
 
+static mutex_t contend_lock;
+static unsigned long contend_count;
+
+static void contend_handler(void *arg)
+{
+	int i, j;
+
+	for (i = 0; i < CONTEND_ITERS; i++) {
+		mutex_lock(&contend_lock);
+		contend_count++;
+		for (j = 0; j < 50; j++)
+			cpu_relax();
+		mutex_unlock(&contend_lock);
+	}
+
+	waitgroup_t *wg_parent = (waitgroup_t *)arg;
+	waitgroup_done(wg_parent);
+}
+
+/* short critical sections should mostly spin rather than park */
+static void test_contention(void)
+{
+	waitgroup_t wg;
+	uint64_t start_us;
+	int i, ret;
+
+	mutex_init(&contend_lock);
+	ret = mutex_enable_stats(&contend_lock, "contend");
+	BUG_ON(ret);
+
+	waitgroup_init(&wg);
+	waitgroup_add(&wg, CONTEND_THREADS);
+	start_us = microtime();
+	for (i = 0; i < CONTEND_THREADS; i++) {
+		ret = thread_spawn(contend_handler, &wg);
+		BUG_ON(ret);
+	}
+	waitgroup_wait(&wg);
+
+	BUG_ON(contend_count != CONTEND_THREADS * CONTEND_ITERS);
+	log_info("contended mutex: %f acquires / second, %ld of %ld contended, "
+		 "%.2f us avg wait",
+		 (double)contend_count / ((microtime() - start_us) * 0.000001),
+		 contend_lock.stats->contended, contend_lock.stats->acquires,
+		 contend_lock.stats->contended ?
+		 (double)contend_lock.stats->wait_cycles /
+		 contend_lock.stats->contended / cycles_per_us : 0.0);
+}
+
+static rwmutex_t rw_lock;
+static brmutex_t br_lock;
+static unsigned long shared_a, shared_b;
+static bool use_br, writer_stop;
+
+static void reader_handler(void *arg)
+{
+	unsigned int token;
+	int i;
+
+	for (i = 0; i < READ_ITERS; i++) {
+		if (use_br) {
+			token = brmutex_rdlock(&br_lock);
+			BUG_ON(shared_a != shared_b);
+			brmutex_rdunlock(&br_lock, token);
+		} else {
+			rwmutex_rdlock(&rw_lock);
+			BUG_ON(shared_a != shared_b);
+			rwmutex_unlock(&rw_lock);
+		}
+	}
+
+	waitgroup_t *wg_parent = (waitgroup_t *)arg;
+	waitgroup_done(wg_parent);
+}
+
+static void writer_handler(void *arg)
+{
+	while (!ACCESS_ONCE(writer_stop)) {
+		timer_sleep(WRITE_PERIOD_US);
+		if (use_br)
+			brmutex_wrlock(&br_lock);
+		else
+			rwmutex_wrlock(&rw_lock);
+		shared_a++;
+		shared_b++;
+		if (use_br)
+			brmutex_wrunlock(&br_lock);
+		else
+			rwmutex_unlock(&rw_lock);
+	}
+
+	waitgroup_t *wg_parent = (waitgroup_t *)arg;
+	waitgroup_done(wg_parent);
+}
+
+/* returns millions of read locks per second */
+static double bench_readers(int readers, bool br)
+{
+	waitgroup_t wg, writer_wg;
+	uint64_t start_us;
+	int i, ret;
+
+	use_br = br;
+	writer_stop = false;
+	waitgroup_init(&writer_wg);
+	waitgroup_add(&writer_wg, 1);
+	ret = thread_spawn(writer_handler, &writer_wg);
+	BUG_ON(ret);
+
+	waitgroup_init(&wg);
+	waitgroup_add(&wg, readers);
+	start_us = microtime();
+	for (i = 0; i < readers; i++) {
+		ret = thread_spawn(reader_handler, &wg);
+		BUG_ON(ret);
+	}
+	waitgroup_wait(&wg);
+	start_us = microtime() - start_us;
+
+	ACCESS_ONCE(writer_stop) = true;
+	waitgroup_wait(&writer_wg);
+	return (double)readers * READ_ITERS / start_us;
+}
+
+/* read-mostly scaling of rwmutex vs brmutex, from one reader to all cores */
+static void test_rw_scaling(void)
+{
+	int i, ret;
+
+	rwmutex_init(&rw_lock);
+	ret = brmutex_init(&br_lock);
+	BUG_ON(ret);
+
+	for (i = 1; i <= runtime_max_cores(); i++) {
+		log_info("%d readers: rwmutex %.2f M/s, brmutex %.2f M/s", i,
+			 bench_readers(i, false), bench_readers(i, true));
+	}
+
+	brmutex_destroy(&br_lock);
+}
+
 static void work_handler(void *arg)
 {
 	int bucket;
@@ -134,6 +280,9 @@ static void main_handler(void *arg)
 
 	waitgroup_wait(&wg);
 	log_info("%f messages / second", messages_per_second);
+
+	test_contention();
+	test_rw_scaling();
 }
 
 int main(int argc, char *argv[])
@@ -0,0 +1,114 @@
+/*
+ * test_runtime_prio.c - measures the latency of normal priority threads while
+ * low priority background threads keep every kthread busy
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <base/time.h>
+#include <runtime/runtime.h>
+#include <runtime/sync.h>
+#include <runtime/timer.h>
+
+#define N		100000
+#define BG_WORK_US	20
+#define BG_PER_CORE	4
+
+static uint64_t spawn_tsc[N];
+static uint64_t run_cycles[N];
+static atomic64_t bg_iters;
+static bool bg_stop;
+static waitgroup_t bg_wg, wg;
+
+static void bg_handler(void *arg)
+{
+	while (!ACCESS_ONCE(bg_stop)) {
+		delay_us(BG_WORK_US);
+		atomic64_inc(&bg_iters);
+		thread_yield();
+	}
+
+	waitgroup_done(&bg_wg);
+}
+
+static void fg_handler(void *arg)
+{
+	unsigned long i = (unsigned long)arg;
+
+	run_cycles[i] = rdtsc() - spawn_tsc[i];
+	waitgroup_done(&wg);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void main_handler(void *arg)
+{
+	unsigned long i, nbg;
+	uint64_t start_us, elapsed_us;
+	thread_t *th;
+	int ret;
+
+	log_info("started main_handler() thread");
+
+	nbg = runtime_max_cores() * BG_PER_CORE;
+	log_info("spawning %ld low priority background threads", nbg);
+	waitgroup_init(&bg_wg);
+	waitgroup_add(&bg_wg, nbg);
+	for (i = 0; i < nbg; i++) {
+		th = thread_create_with_prio(bg_handler, NULL, THREAD_PRIO_LOW);
+		BUG_ON(!th);
+		thread_ready(th);
+	}
+
+	log_info("spawning %d normal priority threads", N);
+	waitgroup_init(&wg);
+	waitgroup_add(&wg, N);
+	start_us = microtime();
+	for (i = 0; i < N; i++) {
+		spawn_tsc[i] = rdtsc();
+		ret = thread_spawn(fg_handler, (void *)i);
+		BUG_ON(ret);
+		timer_sleep(1);
+	}
+	waitgroup_wait(&wg);
+	elapsed_us = microtime() - start_us;
+
+	ACCESS_ONCE(bg_stop) = true;
+	waitgroup_wait(&bg_wg);
+
+	qsort(run_cycles, N, sizeof(uint64_t), cmp_u64);
+	log_info("background ran %ld iterations in %ld us",
+		 atomic64_read(&bg_iters), elapsed_us);
+	log_info("spawn to run latency (us) p50 %.2f p90 %.2f p99 %.2f "
+		 "p999 %.2f",
+		 (double)run_cycles[N / 2] / cycles_per_us,
+		 (double)run_cycles[N * 9 / 10] / cycles_per_us,
+		 (double)run_cycles[N * 99 / 100] / cycles_per_us,
+		 (double)run_cycles[N * 999 / 1000] / cycles_per_us);
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	if (argc < 2) {
+		printf("arg must be config file\n");
+		return -EINVAL;
+	}
+
+	ret = runtime_init(argv[1], main_handler, NULL);
+	if (ret) {
+		printf("failed to start runtime\n");
+		return ret;
+	}
+
+	return 0;
+}
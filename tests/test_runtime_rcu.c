@@ -16,6 +16,7 @@
 #define NTHREADS	100
 #define FIRST_VAL	0x1000000
 #define SECOND_VAL	0x2000000
+#define CHURN_FREES	100000
 
 static waitgroup_t release_wg;
 
@@ -52,6 +53,56 @@ static void read_handler(void *arg)
 	waitgroup_done(wg_parent);
 }
 
+static atomic_t churn_released;
+
+static void churn_release(struct rcu_head *head)
+{
+	struct test_obj *o = container_of(head, struct test_obj, rcu);
+	free(o);
+	atomic_inc(&churn_released);
+}
+
+static void churn_handler(void *arg)
+{
+	struct test_obj *o;
+	int i;
+
+	for (i = 0; i < CHURN_FREES / NTHREADS; i++) {
+		o = malloc(sizeof(*o));
+		BUG_ON(!o);
+		rcu_free(&o->rcu, churn_release);
+		if (i % 16 == 0)
+			thread_yield();
+	}
+	waitgroup_t *wg_parent = (waitgroup_t *)arg;
+	waitgroup_done(wg_parent);
+}
+
+static void test_churn(void)
+{
+	uint64_t outstanding, gps, gp_cycles, start_us;
+	waitgroup_t wg;
+	int ret, i;
+
+	log_info("testing rcu_barrier() with %d frees...", CHURN_FREES);
+	waitgroup_init(&wg);
+	waitgroup_add(&wg, NTHREADS);
+	start_us = microtime();
+	for (i = 0; i < NTHREADS; i++) {
+		ret = thread_spawn(churn_handler, &wg);
+		BUG_ON(ret);
+	}
+	waitgroup_wait(&wg);
+	rcu_barrier();
+	BUG_ON(atomic_read(&churn_released) != CHURN_FREES);
+
+	rcu_get_stats(&outstanding, &gps, &gp_cycles);
+	log_info("churn finished in %ld us, %ld outstanding, %ld grace "
+		 "periods, %.2f us avg grace period", microtime() - start_us,
+		 outstanding, gps,
+		 gps ? (double)gp_cycles / gps / cycles_per_us : 0.0);
+}
+
 static void spawn_rcu_readers(waitgroup_t *wg, int readers)
 {
 	int ret, i;
@@ -111,6 +162,8 @@ static void main_handler(void *arg)
 	free(o);
 	waitgroup_wait(&wg);
 	log_info("readers finished.");
+
+	test_churn();
 }
 
 int main(int argc, char *argv[])
@@ -4,13 +4,18 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <base/log.h>
 #include <base/assert.h>
+#include <base/cpu.h>
+#include <base/page.h>
 #include <base/slab.h>
 #include <base/tcache.h>
 #include <runtime/runtime.h>
 #include <runtime/smalloc.h>
+#include <runtime/sync.h>
+#include <runtime/timer.h>
 #include <asm/ops.h>
 
 #define SAMPLES	200000
@@ -50,6 +55,168 @@ static void smalloc_bench(int samples, int n)
 	}
 }
 
+#define FREE_CHUNK	60	/* not a multiple of the remote batch size */
+
+static waitgroup_t free_wg;
+static struct slab_node *free_snodes[NNUMA];
+static long free_remote_base[NNUMA];
+
+static void free_handler(void *arg)
+{
+	int start = (long)arg, end = MIN(start + FREE_CHUNK, N);
+	unsigned int node;
+	int i;
+
+	/*
+	 * Pretend to run on a node that has no memory, so every free takes the
+	 * remote path even on a single-node machine.
+	 */
+	preempt_disable();
+	node = thread_numa_node;
+	if (numa_count < NNUMA)
+		thread_numa_node = numa_count;
+	for (i = start; i < end; i++)
+		sfree(ptrs[i]);
+	thread_numa_node = node;
+	preempt_enable();
+
+	waitgroup_done(&free_wg);
+}
+
+static long free_remote_count(void)
+{
+	long cnt = 0;
+	int i;
+
+	for (i = 0; i < NNUMA; i++) {
+		if (free_snodes[i]) {
+			cnt += atomic64_read(&free_snodes[i]->nr_remote_frees) -
+			       free_remote_base[i];
+		}
+	}
+
+	return cnt;
+}
+
+/* frees items from threads that may run on other cores (and nodes) */
+static void smalloc_cross_free_test(void)
+{
+	struct slab_node *n;
+	int i, j;
+
+	log_info("testing frees from other threads");
+
+	for (j = 0; j < 100; j++) {
+		for (i = 0; i < N; i++) {
+			ptrs[i] = smalloc(SIZE);
+			BUG_ON(!ptrs[i]);
+
+			n = addr_to_page(ptrs[i])->snode;
+			if (!free_snodes[n->numa_node]) {
+				free_snodes[n->numa_node] = n;
+				free_remote_base[n->numa_node] =
+					atomic64_read(&n->nr_remote_frees);
+			}
+		}
+
+		waitgroup_init(&free_wg);
+		waitgroup_add(&free_wg, div_up(N, FREE_CHUNK));
+		for (i = 0; i < N; i += FREE_CHUNK)
+			BUG_ON(thread_spawn(free_handler, (void *)(long)i));
+		waitgroup_wait(&free_wg);
+	}
+
+	if (numa_count == NNUMA)
+		return;
+
+	/* partial batches are handed back once the kthreads go idle */
+	timer_sleep(10 * ONE_MS);
+	BUG_ON(free_remote_count() != 100 * N);
+}
+
+#define MAX_TCACHES	256
+static const char *tcache_names[MAX_TCACHES];
+static int nr_tcache_names;
+
+static int collect_tcache_name(const char *name, struct tcache_stats *stats,
+			       void *arg)
+{
+	int i;
+
+	/* every cache, including each node's, must be told apart in stats */
+	for (i = 0; i < nr_tcache_names; i++)
+		BUG_ON(strcmp(tcache_names[i], name) == 0);
+
+	BUG_ON(nr_tcache_names >= MAX_TCACHES);
+	tcache_names[nr_tcache_names++] = name;
+	return 0;
+}
+
+static void smalloc_tcache_name_test(void)
+{
+	log_info("testing that tcache names are unique");
+
+	preempt_disable();
+	tcache_for_each(collect_tcache_name, NULL);
+	preempt_enable();
+	BUG_ON(nr_tcache_names < numa_count);
+}
+
+/* large objects, realloc and aligned allocations */
+static void smalloc_api_test(void)
+{
+	size_t align, size;
+	char *p, *last;
+	int i, reused;
+
+	log_info("testing large, realloc and aligned allocations");
+
+	p = smalloc(5 * 1024 * 1024);
+	BUG_ON(!p || !is_page_addr(p));
+	BUG_ON(smalloc_usable_size(p) < 5 * 1024 * 1024);
+	memset(p, 0xAB, 5 * 1024 * 1024);
+	sfree(p);
+
+	/* freed runs stay mapped, so the next allocation should reuse them */
+	last = NULL;
+	for (i = 0, reused = 0; i < 100; i++) {
+		p = smalloc(3 * 1024 * 1024);
+		BUG_ON(!p);
+		reused += p == last;
+		last = p;
+		p[0] = 1;
+		sfree(p);
+	}
+	BUG_ON(reused == 0);
+
+	p = NULL;
+	for (size = 1; size <= 8 * 1024 * 1024; size *= 3) {
+		p = srealloc(p, size);
+		BUG_ON(!p || smalloc_usable_size(p) < size);
+		p[0] = 1;
+		p[size - 1] = 2;
+	}
+	for (; size > 1; size /= 3) {
+		p = srealloc(p, size);
+		BUG_ON(!p || p[0] != 1);
+	}
+	BUG_ON(srealloc(p, 0) != NULL);
+
+	for (align = 16; align <= PGSIZE_2MB; align *= 2) {
+		for (i = 1; i < 4; i++) {
+			p = saligned_alloc(align, align / i + 1);
+			BUG_ON(!p || (uintptr_t)p % align != 0);
+			sfree(p);
+		}
+	}
+	BUG_ON(saligned_alloc(3, 16) != NULL);
+
+	/* sizes that can't be backed must fail rather than wrap around */
+	BUG_ON(smalloc(SIZE_MAX) != NULL);
+	BUG_ON(smalloc(SIZE_MAX - PGSIZE_2MB + 2) != NULL);
+	BUG_ON(smalloc(LGPAGE_NODE_ADDR_LEN + 1) != NULL);
+	BUG_ON(srealloc(NULL, SIZE_MAX) != NULL);
+}
 
 static void main_handler(void *arg)
 {
@@ -109,6 +276,9 @@ static void main_handler(void *arg)
 			 i, tsc_elapsed / (SAMPLES * i));
 	}
 
+	smalloc_cross_free_test();
+	smalloc_tcache_name_test();
+	smalloc_api_test();
 
 #ifdef DEBUG
 	slab_print_usage();
@@ -0,0 +1,217 @@
+/*
+ * test_runtime_stack.c - tests stack size classes, their pools and signal
+ * delivery on nearly full small stacks
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <base/tcache.h>
+#include <runtime/runtime.h>
+#include <runtime/sync.h>
+
+#include "../runtime/defs.h"
+
+#define REUSE_ROUNDS	1000
+#define DEEP_THREADS	32
+#define DEEP_SIGNALS	100
+/* leaves room for the thread's own frames above the buffer */
+#define DEEP_USE	(STACK_MIN_SIZE - 2 * KB)
+
+static waitgroup_t wg;
+
+struct class_case {
+	size_t		size;
+	int		cls;
+};
+
+static const struct class_case class_cases[] = {
+	{ 1,				STACK_CLASS_16K },
+	{ 16 * KB,			STACK_CLASS_16K },
+	{ 16 * KB + 1,			STACK_CLASS_64K },
+	{ 64 * KB,			STACK_CLASS_64K },
+	{ 64 * KB + 1,			STACK_CLASS_256K },
+	{ RUNTIME_STACK_SIZE,		STACK_CLASS_256K },
+	{ RUNTIME_STACK_SIZE + 1,	-EINVAL },
+};
+
+/* checks that @p lies in the usable part of the running thread's stack */
+static void check_on_stack(const void *p)
+{
+	thread_t *th = thread_self();
+	uintptr_t bottom = (uintptr_t)th->stack + stack_headroom;
+
+	BUG_ON((uintptr_t)p < bottom);
+	BUG_ON((uintptr_t)p >= (uintptr_t)stack_top(th->stack,
+						    th->stack_class));
+}
+
+static void __noinline touch_stack(size_t len)
+{
+	char buf[len];
+
+	memset(buf, 0xab, len);
+	check_on_stack(buf);
+	barrier();
+}
+
+static void class_handler(void *arg)
+{
+	const struct class_case *c = arg;
+
+	BUG_ON(thread_self()->stack_class != c->cls);
+
+	/* the requested size must be usable */
+	touch_stack(c->size > KB ? c->size - KB : c->size);
+	waitgroup_done(&wg);
+}
+
+static void test_stack_classes(void)
+{
+	const struct class_case *c;
+	uint64_t nr[STACK_CLASS_NR], after, hwm;
+	thread_t *th;
+	int i;
+
+	log_info("testing stack size classes, headroom %ld bytes",
+		 stack_headroom);
+
+	for (i = 0; i < STACK_CLASS_NR; i++)
+		stack_get_stats(i, &nr[i], &hwm);
+
+	waitgroup_init(&wg);
+	for (i = 0; i < ARRAY_SIZE(class_cases); i++) {
+		c = &class_cases[i];
+		BUG_ON(stack_size_to_class(c->size) != c->cls);
+
+		th = thread_create_with_stack_size(class_handler, (void *)c,
+						   c->size);
+		if (c->cls < 0) {
+			BUG_ON(th);
+			continue;
+		}
+
+		BUG_ON(!th);
+		BUG_ON(th->stack_class != c->cls);
+		waitgroup_add(&wg, 1);
+		thread_ready(th);
+	}
+	waitgroup_wait(&wg);
+
+	/* the stack stats count stacks per class */
+	for (i = 0; i < STACK_CLASS_NR; i++) {
+		stack_get_stats(i, &after, &hwm);
+		BUG_ON(after < nr[i]);
+		if (i == STACK_CLASS_MAX)
+			BUG_ON(hwm != 0);
+	}
+}
+
+static void reuse_handler(void *arg)
+{
+	touch_stack(KB);
+	waitgroup_done(&wg);
+}
+
+static void test_stack_reuse(void)
+{
+	uint64_t before, after, hwm;
+	thread_t *th;
+	int i;
+
+	log_info("testing that freed small stacks are reused");
+
+	stack_get_stats(STACK_CLASS_16K, &before, &hwm);
+
+	/* only one thread is alive at a time */
+	for (i = 0; i < REUSE_ROUNDS; i++) {
+		waitgroup_init(&wg);
+		waitgroup_add(&wg, 1);
+		th = thread_create_with_stack_size(reuse_handler, NULL, 4 * KB);
+		BUG_ON(!th);
+		thread_ready(th);
+		waitgroup_wait(&wg);
+	}
+
+	/* at most two magazines can be held by each kthread */
+	stack_get_stats(STACK_CLASS_16K, &after, &hwm);
+	BUG_ON(after - before > (maxks * 2 + 1) * TCACHE_DEFAULT_MAG_SIZE);
+	BUG_ON(hwm > stack_class_size(STACK_CLASS_16K));
+
+	log_info("created %ld 16k stacks for %d threads, hwm %ld bytes",
+		 after - before, REUSE_ROUNDS, hwm);
+}
+
+static void deep_handler(void *arg)
+{
+	char buf[DEEP_USE];
+	int i, j;
+
+	check_on_stack(buf);
+	memset(buf, (long)arg, sizeof(buf));
+
+	/*
+	 * Preempt the thread with its stack nearly full. The signal frame and
+	 * the yield it triggers land below the usable region, in the headroom.
+	 */
+	for (i = 0; i < DEEP_SIGNALS; i++) {
+		BUG_ON(pthread_kill(pthread_self(), SIGUSR2));
+		for (j = 0; j < sizeof(buf); j += 512)
+			BUG_ON(ACCESS_ONCE(buf[j]) != (char)(long)arg);
+	}
+
+	waitgroup_done(&wg);
+}
+
+static void test_preempt_small_stacks(void)
+{
+	thread_t *th;
+	long i;
+
+	log_info("testing preemption on nearly full 16k stacks");
+
+	waitgroup_init(&wg);
+	waitgroup_add(&wg, DEEP_THREADS);
+	for (i = 0; i < DEEP_THREADS; i++) {
+		th = thread_create_with_stack_size(deep_handler, (void *)i,
+						   DEEP_USE);
+		BUG_ON(!th);
+		BUG_ON(th->stack_class != STACK_CLASS_16K);
+		thread_ready(th);
+	}
+	waitgroup_wait(&wg);
+
+	log_info("%d threads survived %d preemptions each", DEEP_THREADS,
+		 DEEP_SIGNALS);
+}
+
+static void main_handler(void *arg)
+{
+	log_info("started main_handler() thread");
+	test_stack_classes();
+	test_stack_reuse();
+	test_preempt_small_stacks();
+	log_info("stack tests passed");
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	if (argc < 2) {
+		printf("arg must be config file\n");
+		return -EINVAL;
+	}
+
+	ret = runtime_init(argv[1], main_handler, NULL);
+	if (ret) {
+		printf("failed to start runtime\n");
+		return ret;
+	}
+
+	return 0;
+}
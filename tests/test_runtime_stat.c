@@ -0,0 +1,88 @@
+/*
+ * test_runtime_stat.c - tests that the stat responder's replies fit in UDP
+ * datagrams
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <runtime/runtime.h>
+#include <runtime/udp.h>
+
+#include "../runtime/defs.h"
+
+static char buf[65535];
+static char joined[65535];
+
+static void test_udp_pages(void)
+{
+	size_t payload_size = udp_get_payload_size();
+	size_t pos, page_len, joined_len = 0;
+	int nr_pages = 0;
+	ssize_t len;
+
+	log_info("testing stat replies split into datagrams");
+
+	len = stat_write_buf(buf, sizeof(buf));
+	BUG_ON(len <= 0);
+	BUG_ON(buf[len - 1] != '\0');
+
+	/* the per-tcache stats are part of the reply */
+	BUG_ON(!strstr(buf, "tcache_"));
+	log_info("%ld bytes of stats, %ld byte datagrams", len, payload_size);
+
+	for (pos = 0; pos < len; pos += page_len + 1) {
+		page_len = stat_page_len(buf + pos, len - pos, payload_size);
+		BUG_ON(page_len == 0 || page_len > payload_size);
+		nr_pages++;
+
+		/* pages hold whole stats */
+		BUG_ON(buf[pos] == ',' || !strchr(buf + pos, ':'));
+		if (pos + page_len < len)
+			BUG_ON(buf[pos + page_len] != ',');
+
+		if (joined_len)
+			joined[joined_len++] = ',';
+		memcpy(joined + joined_len, buf + pos, page_len);
+		joined_len += page_len;
+	}
+
+	/* nothing was lost between the pages, and tsc comes last */
+	BUG_ON(joined_len != len || memcmp(joined, buf, len) != 0);
+	BUG_ON(!strstr(buf + pos - page_len - 1, "tsc:"));
+	BUG_ON(nr_pages < div_up(len, payload_size));
+
+	/* a stat that can't fit in any page */
+	BUG_ON(stat_page_len("a_long_stat_name:1,b:2", 22, 8) != 0);
+	BUG_ON(stat_page_len("a:1,b:2", 7, 5) != 3);
+	BUG_ON(stat_page_len("a:1,b:2", 7, 7) != 7);
+
+	log_info("stats fit in %d datagrams", nr_pages);
+}
+
+static void main_handler(void *arg)
+{
+	log_info("started main_handler() thread");
+	test_udp_pages();
+	log_info("stat tests passed");
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	if (argc < 2) {
+		printf("arg must be config file\n");
+		return -EINVAL;
+	}
+
+	ret = runtime_init(argv[1], main_handler, NULL);
+	if (ret) {
+		printf("failed to start runtime\n");
+		return ret;
+	}
+
+	return 0;
+}
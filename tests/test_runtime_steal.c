@@ -0,0 +1,110 @@
+/*
+ * test_runtime_steal.c - measures work stealing latency and throughput
+ *
+ * Build once with CONFIG_LOCKFREE_RQ=n and once with CONFIG_LOCKFREE_RQ=y
+ * to compare the spinlocked and lock-free runqueues.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <base/time.h>
+#include <runtime/runtime.h>
+#include <runtime/sync.h>
+
+#define N		1000000
+#define BURST		64
+#define WORK_US		2
+
+static uint64_t spawn_tsc[N];
+static uint64_t steal_cycles[N];
+static unsigned int spawn_kthread;
+static waitgroup_t wg;
+
+static void leaf_handler(void *arg)
+{
+	unsigned long i = (unsigned long)arg;
+	uint64_t now = rdtsc();
+
+	/* only count threads that started on a different kthread */
+	if (get_current_affinity() != ACCESS_ONCE(spawn_kthread))
+		steal_cycles[i] = now - spawn_tsc[i];
+
+	delay_us(WORK_US);
+	waitgroup_done(&wg);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void main_handler(void *arg)
+{
+	unsigned long i, j, nstolen = 0;
+	uint64_t start_us, elapsed_us;
+	int ret;
+
+	log_info("started main_handler() thread");
+	log_info("spawning %d threads in bursts of %d", N, BURST);
+
+	waitgroup_init(&wg);
+	waitgroup_add(&wg, N);
+	start_us = microtime();
+	for (i = 0; i < N; i += BURST) {
+		preempt_disable();
+		ACCESS_ONCE(spawn_kthread) = get_current_affinity();
+		for (j = i; j < MIN(i + BURST, N); j++) {
+			spawn_tsc[j] = rdtsc();
+			ret = thread_spawn(leaf_handler, (void *)j);
+			BUG_ON(ret);
+		}
+		preempt_enable();
+		delay_us(WORK_US * BURST / runtime_max_cores());
+	}
+
+	waitgroup_wait(&wg);
+	elapsed_us = microtime() - start_us;
+
+	/* compact the latencies of the threads that were stolen */
+	for (i = 0; i < N; i++) {
+		if (steal_cycles[i])
+			steal_cycles[nstolen++] = steal_cycles[i];
+	}
+
+	log_info("ran %f threads / second", (double)N / elapsed_us * 1000000);
+	if (!nstolen) {
+		log_info("no threads were stolen");
+		return;
+	}
+
+	qsort(steal_cycles, nstolen, sizeof(uint64_t), cmp_u64);
+	log_info("stolen %ld / %d, steal latency (us) p50 %.2f p90 %.2f "
+		 "p99 %.2f p999 %.2f", nstolen, N,
+		 (double)steal_cycles[nstolen / 2] / cycles_per_us,
+		 (double)steal_cycles[nstolen * 9 / 10] / cycles_per_us,
+		 (double)steal_cycles[nstolen * 99 / 100] / cycles_per_us,
+		 (double)steal_cycles[nstolen * 999 / 1000] / cycles_per_us);
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	if (argc < 2) {
+		printf("arg must be config file\n");
+		return -EINVAL;
+	}
+
+	ret = runtime_init(argv[1], main_handler, NULL);
+	if (ret) {
+		printf("failed to start runtime\n");
+		return ret;
+	}
+
+	return 0;
+}
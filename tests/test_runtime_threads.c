@@ -3,6 +3,7 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 
 #include <base/stddef.h>
 #include <base/log.h>
@@ -12,6 +13,8 @@
 
 #define N		1000000
 #define NCORES		4
+#define BATCH		1000
+#define BATCH_ROUNDS	100
 
 static void leaf_handler(void *arg)
 {
@@ -38,6 +41,46 @@ static void work_handler(void *arg)
 	waitgroup_done(wg_parent);
 }
 
+static atomic_t batch_runs[BATCH];
+static waitgroup_t batch_wg;
+
+static void batch_handler(void *arg)
+{
+	atomic_inc(&batch_runs[(long)arg]);
+	waitgroup_done(&batch_wg);
+}
+
+/* readies threads in one batch, some of them low priority */
+static void test_ready_many(void)
+{
+	thread_t *ths[BATCH], *copy[BATCH];
+	int i, j;
+
+	log_info("testing thread_ready_many()");
+
+	for (j = 0; j < BATCH_ROUNDS; j++) {
+		for (i = 0; i < BATCH; i++) {
+			atomic_write(&batch_runs[i], 0);
+			ths[i] = thread_create_with_prio(batch_handler,
+				(void *)(long)i,
+				i % 7 ? THREAD_PRIO_NORMAL : THREAD_PRIO_LOW);
+			BUG_ON(!ths[i]);
+			copy[i] = ths[i];
+		}
+
+		waitgroup_init(&batch_wg);
+		waitgroup_add(&batch_wg, BATCH);
+		thread_ready_many(ths, BATCH);
+
+		/* the caller's array is left alone */
+		BUG_ON(memcmp(ths, copy, sizeof(ths)) != 0);
+
+		waitgroup_wait(&batch_wg);
+		for (i = 0; i < BATCH; i++)
+			BUG_ON(atomic_read(&batch_runs[i]) != 1);
+	}
+}
+
 static void main_handler(void *arg)
 {
 	waitgroup_t wg;
@@ -61,6 +104,8 @@ static void main_handler(void *arg)
 			     ((microtime() - start_us) * 0.000001);
 	log_info("spawned %f threads / second, efficiency %f",
 		 threads_per_second, threads_per_second / 1000000);
+
+	test_ready_many();
 }
 
 int main(int argc, char *argv[])
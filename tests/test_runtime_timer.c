@@ -3,6 +3,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <base/stddef.h>
 #include <base/log.h>
@@ -11,8 +12,21 @@
 #include <runtime/sync.h>
 #include <runtime/timer.h>
 
+#include "../runtime/defs.h"
+
 #define WORKERS		1000
 #define N		100000
+#define COARSE_TIMERS	100000
+#define COARSE_MAX_US	200000
+
+struct coarse_timer {
+	struct timer_entry	e;
+	uint64_t		deadline_us;
+};
+
+static struct coarse_timer *coarse;
+static waitgroup_t coarse_wg;
+static atomic_t coarse_early;
 
 static void work_handler(void *arg)
 {
@@ -25,6 +39,147 @@ static void work_handler(void *arg)
 	waitgroup_done(wg_parent);
 }
 
+static void coarse_handler(unsigned long arg)
+{
+	struct coarse_timer *t = (struct coarse_timer *)arg;
+
+	if (microtime() < t->deadline_us)
+		atomic_inc(&coarse_early);
+	waitgroup_done(&coarse_wg);
+}
+
+/* arms more coarse timers than the heap could hold and cancels half */
+static void test_coarse_timers(void)
+{
+	uint64_t start_us, now_us;
+	int i, cancelled = 0;
+
+	coarse = calloc(COARSE_TIMERS, sizeof(*coarse));
+	BUG_ON(!coarse);
+
+	waitgroup_init(&coarse_wg);
+	waitgroup_add(&coarse_wg, COARSE_TIMERS);
+	start_us = microtime();
+	for (i = 0; i < COARSE_TIMERS; i++) {
+		now_us = microtime();
+		coarse[i].deadline_us = now_us + 1000 + rand() % COARSE_MAX_US;
+		timer_init(&coarse[i].e, coarse_handler,
+			   (unsigned long)&coarse[i]);
+		timer_start_coarse(&coarse[i].e, coarse[i].deadline_us);
+	}
+	log_info("armed %d coarse timers in %ld us", COARSE_TIMERS,
+		 microtime() - start_us);
+
+	start_us = microtime();
+	for (i = 0; i < COARSE_TIMERS; i += 2) {
+		if (timer_cancel(&coarse[i].e)) {
+			waitgroup_done(&coarse_wg);
+			cancelled++;
+		}
+	}
+	log_info("cancelled %d coarse timers in %ld us", cancelled,
+		 microtime() - start_us);
+
+	waitgroup_wait(&coarse_wg);
+	BUG_ON(atomic_read(&coarse_early) != 0);
+	log_info("all coarse timers fired on time");
+	free(coarse);
+}
+
+static void noop_handler(unsigned long arg)
+{
+}
+
+/* cancelling the earliest coarse timer moves the wheel's deadline later */
+static void test_cancel_earliest(void)
+{
+	struct timer_entry late, early;
+	struct timer_wheel *w;
+	uint64_t now_us, before_us, early_us;
+
+	timer_init(&late, noop_handler, 0);
+	timer_init(&early, noop_handler, 0);
+
+	/* stay on this kthread so both timers land in its wheel */
+	preempt_disable();
+	w = myk()->timer_wheel;
+	now_us = microtime();
+	timer_start_coarse(&late, now_us + 20 * ONE_MS);
+	before_us = ACCESS_ONCE(w->next_us);
+	timer_start_coarse(&early, now_us + 5 * ONE_MS);
+	early_us = ACCESS_ONCE(w->next_us);
+	BUG_ON(early_us > now_us + 6 * ONE_MS);
+
+	BUG_ON(!timer_cancel(&early));
+	if (early_us < before_us)
+		BUG_ON(ACCESS_ONCE(w->next_us) == early_us);
+	BUG_ON(!timer_cancel(&late));
+	preempt_enable();
+
+	log_info("cancelling the earliest coarse timer updated the deadline");
+}
+
+/* only coarse timers go in the wheel, however far out they are */
+static void test_placement(void)
+{
+	struct timer_entry fine, coarse;
+	uint64_t now_us = microtime();
+
+	timer_init(&fine, noop_handler, 0);
+	timer_init(&coarse, noop_handler, 0);
+
+	timer_start(&fine, now_us + 10 * ONE_MS);
+	BUG_ON(fine.in_wheel);
+	timer_start_coarse(&coarse, now_us + 10);
+	BUG_ON(!coarse.in_wheel);
+
+	BUG_ON(!timer_cancel(&fine));
+	BUG_ON(!timer_cancel(&coarse));
+
+	log_info("timers were placed by precision, not by distance");
+}
+
+static void overflow_handler(unsigned long arg)
+{
+	uint64_t deadline_us = *(uint64_t *)arg;
+
+	if (microtime() < deadline_us)
+		atomic_inc(&coarse_early);
+	waitgroup_done(&coarse_wg);
+}
+
+/* fills one kthread's heap, the rest of the timers spill into its wheel */
+static void test_heap_overflow(void)
+{
+	const int nr = RUNTIME_MAX_TIMERS + 100;
+	struct timer_entry *e;
+	uint64_t deadline_us;
+	int i, spilled = 0;
+
+	e = calloc(nr, sizeof(*e));
+	BUG_ON(!e);
+
+	waitgroup_init(&coarse_wg);
+	waitgroup_add(&coarse_wg, nr);
+	deadline_us = microtime() + 50 * ONE_MS;
+
+	preempt_disable();
+	for (i = 0; i < nr; i++) {
+		timer_init(&e[i], overflow_handler, (unsigned long)&deadline_us);
+		timer_start(&e[i], deadline_us);
+		spilled += e[i].in_wheel;
+	}
+	preempt_enable();
+	BUG_ON(spilled < nr - RUNTIME_MAX_TIMERS);
+
+	waitgroup_wait(&coarse_wg);
+	BUG_ON(atomic_read(&coarse_early) != 0);
+	free(e);
+
+	log_info("%d of %d timers spilled into the wheel and fired on time",
+		 spilled, nr);
+}
+
 static void main_handler(void *arg)
 {
 	waitgroup_t wg;
@@ -46,6 +201,11 @@ static void main_handler(void *arg)
 	timeouts_per_second = (double)(WORKERS * N) /
 		((microtime() - start_us) * 0.000001);
 	log_info("handled %f timeouts / second", timeouts_per_second);
+
+	test_coarse_timers();
+	test_cancel_earliest();
+	test_placement();
+	test_heap_overflow();
 }
 
 int main(int argc, char *argv[])